@@ -0,0 +1,623 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <netinet/tcp.h>
+
+#include "../http/http.hpp"
+
+using namespace std;
+
+// 压测工具：基于本项目eventloop/tcp_sock的多线程epoll负载生成器
+// 用法：bench <场景|all> [选项]
+//   场景：echo-short echo-keepalive echo-pipeline http-short http-keepalive http-pipeline http-large http-idle
+//   -c 活跃连接数(64) -t 压测线程数(2) -s 内置服务器线程数(2) -d 持续秒数(5) -w 预热秒数(1)
+//   -p 流水线深度(16) -b 消息/请求体大小(echo 64, http-large 65536) -i 空闲连接数(1000) -P 端口(18080)
+//   -H ip:port 压测已在运行的外部服务器（不启动内置服务器，也不统计服务器CPU）
+// 每个场景一行JSON输出到标准输出，便于保存下来和历史结果比对；可读的摘要输出到标准错误
+// 内置服务器在子进程中运行（echo用TcpServer，http用HttpServer），服务器CPU取自/proc/<pid>/stat
+
+struct bench_options
+{
+    string _scenario;
+    int _conns = 64;
+    int _threads = 2;
+    int _server_threads = 2;
+    int _duration = 5;
+    int _warmup = 1;
+    int _pipeline = 16;
+    int _body_size = -1; // -1表示按场景取默认值
+    int _idle_conns = 1000;
+    uint16_t _port = 18080;
+    string _ip = "127.0.0.1";
+    bool _external = false;
+};
+
+// 场景描述
+struct bench_scenario
+{
+    const char *_name;
+    bool _http;      // http还是echo
+    bool _short;     // 每个请求一个连接
+    bool _pipeline;  // 流水线
+    bool _large;     // 大请求体/响应体
+    bool _idle;      // 额外保持大量空闲连接
+};
+
+static const bench_scenario g_scenarios[] = {
+    {"echo-short", false, true, false, false, false},
+    {"echo-keepalive", false, false, false, false, false},
+    {"echo-pipeline", false, false, true, false, false},
+    {"http-short", true, true, false, false, false},
+    {"http-keepalive", true, false, false, false, false},
+    {"http-pipeline", true, false, true, false, false},
+    {"http-large", true, false, false, true, false},
+    {"http-idle", true, false, false, false, true},
+};
+
+static std::atomic<bool> g_recording(false); // 预热结束后才开始统计
+
+/////////////////////////////////////////////////////////////////   内置服务器
+
+static void echo_message(const conn_ptr &conn, buf_ptr buf)
+{
+    conn->send_peer(buf->read_addr(), buf->valid_data_size());
+    buf->move_read_pos_back(buf->valid_data_size());
+}
+
+// bench --serve <场景> <线程数> <端口> <超时>
+static void run_server(const bench_scenario &sc, const int &threads, const uint16_t &port, const int &timeout)
+{
+    if (!sc._http)
+    {
+        TcpServer svr(port);
+        svr.set_handle_message_callback(echo_message);
+        svr.set_thread_num(threads);
+        svr.start();
+    }
+    else
+    {
+        HttpServer svr(port, timeout);
+        svr.Get("/hello", [](const HttpRequest &, HttpResponse *rsp)
+                { rsp->SetContent("hello world", "text/plain"); });
+        svr.Post("/echo", [](const HttpRequest &req, HttpResponse *rsp)
+                 { rsp->SetContent(req._body, "application/octet-stream"); });
+        svr.SetThreadCount(threads);
+        svr.Start();
+    }
+}
+
+// 进程累计的CPU时间（秒）
+static double process_cpu(const pid_t &pid)
+{
+    if (pid == 0)
+    {
+        struct rusage ru;
+        getrusage(RUSAGE_SELF, &ru);
+        return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+    }
+
+    std::ifstream in("/proc/" + to_string(pid) + "/stat");
+    string stat;
+    getline(in, stat);
+    size_t pos = stat.rfind(')'); // 进程名里可能有空格
+    if (pos == string::npos)
+        return 0;
+    std::istringstream ss(stat.substr(pos + 2));
+    string field;
+    unsigned long utime = 0, stime = 0;
+    for (int i = 3; i <= 15 && ss >> field; ++i)
+    {
+        if (i == 14)
+            utime = stoul(field);
+        else if (i == 15)
+            stime = stoul(field);
+    }
+    return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+// 等待服务器开始监听
+static bool wait_server(const bench_options &opt)
+{
+    for (int i = 0; i < 200; ++i)
+    {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sin_family = AF_INET;
+        sa.sin_port = htons(opt._port);
+        sa.sin_addr.s_addr = inet_addr(opt._ip.c_str());
+        int ret = connect(fd, (const struct sockaddr *)&sa, sizeof(sa));
+        close(fd);
+        if (ret == 0)
+            return true;
+        usleep(10000);
+    }
+    return false;
+}
+
+/////////////////////////////////////////////////////////////////   负载生成
+
+class bench_worker;
+
+// 一个压测连接，所有操作都在所属worker的eventloop线程中执行
+class bench_client
+{
+private:
+    bench_worker *_worker;
+    loop_ptr _loop;
+    const bench_scenario &_sc;
+    const bench_options &_opt;
+    const string &_request; // 每次发送的请求
+    bool _idle;             // 空闲连接只建立不发请求
+    bool _stopped;
+
+    int _fd;
+    std::unique_ptr<channel> _chan;
+    buffer_t _in;
+    string _out;
+    size_t _out_pos;
+    std::deque<uint64_t> _inflight; // 已发出请求的发送时间
+
+public:
+    bench_client(bench_worker *worker, loop_ptr loop, const bench_scenario &sc, const bench_options &opt, const string &request, const bool &idle)
+        : _worker(worker), _loop(loop), _sc(sc), _opt(opt), _request(request), _idle(idle), _stopped(false), _fd(-1), _out_pos(0) {}
+
+    void start() { _loop->run_in_loop(std::bind(&bench_client::connect_in_loop, this)); }
+
+    void stop() { _loop->run_in_loop(std::bind(&bench_client::stop_in_loop, this)); }
+
+private:
+    // 停止压测，关闭连接
+    void stop_in_loop()
+    {
+        _stopped = true;
+        _loop->cancel_task((uint64_t)(uintptr_t)this); // 等待重连的定时任务
+        close_conn();
+    }
+
+    void connect_in_loop()
+    {
+        if (_stopped)
+            return;
+
+        uint64_t begin = metrics_clock::now_ns();
+        tcp_sock sock;
+        sock.socket_();
+        sockaddr_in sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sin_family = AF_INET;
+        sa.sin_port = htons(_opt._port);
+        sa.sin_addr.s_addr = inet_addr(_opt._ip.c_str());
+        if (-1 == connect(sock.get_fd(), (const struct sockaddr *)&sa, sizeof(sa)))
+        {
+            // 连接失败计入错误，1秒后重试（tcp_sock::connect_失败会直接退出进程，这里不用它）
+            count_error();
+            _loop->add_delayed_task((uint64_t)(uintptr_t)this, 1, std::bind(&bench_client::connect_in_loop, this));
+            return;
+        }
+        _fd = sock.release_();
+        tcp_sock::set_nonblock(_fd);
+        int one = 1;
+        setsockopt(_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        _chan.reset(new channel(_fd, _loop));
+        _chan->set_read_event_callbcak(std::bind(&bench_client::handle_read, this));
+        _chan->set_write_event_callbcak(std::bind(&bench_client::handle_write, this));
+        _chan->set_trace_tag("bench");
+        _chan->monitor_read_event();
+
+        if (_idle)
+            return;
+        // 短连接的延迟从建立连接开始计算
+        send_requests(_sc._short ? begin : metrics_clock::now_ns());
+    }
+
+    // 补足在途请求：流水线模式补到深度，否则一次一个
+    void send_requests(const uint64_t &now)
+    {
+        size_t depth = _sc._pipeline ? _opt._pipeline : 1;
+        while (_inflight.size() < depth)
+        {
+            _out.append(_request);
+            _inflight.push_back(now);
+        }
+        handle_write();
+    }
+
+    void handle_write()
+    {
+        if (_fd == -1) // 同一轮事件中连接已经在读回调里关闭
+            return;
+        while (_out_pos < _out.size())
+        {
+            ssize_t n = send(_fd, _out.data() + _out_pos, _out.size() - _out_pos, MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (n < 0)
+            {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    break;
+                if (errno == EINTR)
+                    continue;
+                return fail();
+            }
+            _out_pos += n;
+        }
+
+        if (_out_pos == _out.size())
+        {
+            _out.clear();
+            _out_pos = 0;
+            if (_chan->is_write_monitored())
+                _chan->cancel_monitor_write_event();
+        }
+        else if (!_chan->is_write_monitored())
+            _chan->monitor_write_event();
+    }
+
+    void handle_read()
+    {
+        char buf[65536];
+        bool peer_closed = false;
+        while (true)
+        {
+            ssize_t n = recv(_fd, buf, sizeof(buf), MSG_DONTWAIT);
+            if (n > 0)
+            {
+                _in.write(buf, n);
+                continue;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                break;
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0)
+                return fail();
+            peer_closed = true; // 响应和FIN可能一起到达，先处理完已收到的数据
+            break;
+        }
+
+        size_t len = 0;
+        while (!_inflight.empty() && (len = response_len()) > 0)
+        {
+            // 服务器主动结束长连接（比如达到每个连接的请求数上限）也是正常的响应，之后重新连接
+            bool closing = _sc._http && memmem(_in.read_addr(), len, "Connection: close\r\n", 19) != nullptr;
+            _in.move_read_pos_back(len);
+            complete(len);
+            if (_sc._short || closing)
+                return reconnect();
+        }
+        if (peer_closed)
+            return fail();
+        if (!_idle && !_sc._short)
+            send_requests(metrics_clock::now_ns());
+    }
+
+    // 接收缓冲区中第一个完整响应的长度，不完整返回0
+    size_t response_len()
+    {
+        size_t avail = _in.valid_data_size();
+        if (!_sc._http)
+            return avail >= _request.size() ? _request.size() : 0;
+
+        const char *data = _in.read_addr();
+        const char *end = (const char *)memmem(data, avail, "\r\n\r\n", 4);
+        if (end == nullptr)
+            return 0;
+        size_t head_len = end - data + 4;
+        size_t body_len = 0;
+        const char *cl = (const char *)memmem(data, head_len, "Content-Length: ", 16);
+        if (cl != nullptr)
+            body_len = strtoul(cl + 16, nullptr, 10);
+        return avail >= head_len + body_len ? head_len + body_len : 0;
+    }
+
+    void complete(const size_t &len);
+
+    // 关闭连接：RST关闭，避免大量TIME_WAIT耗尽本地端口
+    void close_conn()
+    {
+        if (_fd == -1)
+            return;
+        _chan->cancel_monitor_all_event();
+        struct linger lg = {1, 0};
+        setsockopt(_fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+        close(_fd);
+        _fd = -1;
+        _in.clear();
+        _out.clear();
+        _out_pos = 0;
+        _inflight.clear();
+    }
+
+    // 当前正处于channel的事件回调中，channel要到任务阶段才能替换
+    void reconnect()
+    {
+        close_conn();
+        _loop->push_in_loop(std::bind(&bench_client::connect_in_loop, this));
+    }
+
+    void fail();
+    void count_error();
+};
+
+// 压测线程，持有一个eventloop，统计数据只由该线程写
+class bench_worker
+{
+private:
+    loop_thread *_thread;
+    loop_ptr _loop;
+
+public:
+    latency_histogram _latency;
+    std::atomic<uint64_t> _requests;
+    std::atomic<uint64_t> _errors;
+    std::atomic<uint64_t> _bytes;
+
+    bench_worker() : _thread(new loop_thread), _loop(_thread->get_loop()), _requests(0), _errors(0), _bytes(0) {}
+
+    loop_ptr get_loop() { return _loop; }
+
+    static void bump(std::atomic<uint64_t> &counter, const uint64_t &delta) { counter.store(counter.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed); }
+};
+
+void bench_client::complete(const size_t &len)
+{
+    uint64_t now = metrics_clock::now_ns();
+    uint64_t sent = _inflight.front();
+    _inflight.pop_front();
+    if (!g_recording.load(std::memory_order_relaxed))
+        return;
+    _worker->_latency.record(now - sent);
+    bench_worker::bump(_worker->_requests, 1);
+    bench_worker::bump(_worker->_bytes, len);
+}
+
+void bench_client::count_error()
+{
+    if (g_recording.load(std::memory_order_relaxed) && !_stopped)
+        bench_worker::bump(_worker->_errors, 1);
+}
+
+void bench_client::fail()
+{
+    count_error();
+    reconnect();
+}
+
+/////////////////////////////////////////////////////////////////   场景执行
+
+static string make_request(const bench_scenario &sc, const bench_options &opt)
+{
+    if (!sc._http)
+        return string(opt._body_size > 0 ? opt._body_size : 64, 'x');
+
+    string conn = sc._short ? "close" : "keep-alive";
+    if (!sc._large)
+        return "GET /hello HTTP/1.1\r\nHost: bench\r\nConnection: " + conn + "\r\n\r\n";
+
+    size_t size = opt._body_size > 0 ? opt._body_size : 65536;
+    return "POST /echo HTTP/1.1\r\nHost: bench\r\nConnection: " + conn + "\r\nContent-Length: " + to_string(size) + "\r\n\r\n" + string(size, 'x');
+}
+
+// 在每个worker的任务池里放一个任务并等它执行，之前压入的任务都已经执行完
+static void barrier(vector<bench_worker *> &workers)
+{
+    std::mutex mtx;
+    std::condition_variable cond;
+    size_t done = 0;
+    for (auto w : workers)
+    {
+        w->get_loop()->push_in_loop([&]()
+                                    {
+                                        std::unique_lock<std::mutex> lock(mtx);
+                                        ++done;
+                                        cond.notify_all(); });
+    }
+    std::unique_lock<std::mutex> lock(mtx);
+    cond.wait(lock, [&]()
+              { return done == workers.size(); });
+}
+
+static void run_scenario(const bench_scenario &sc, const bench_options &opt, vector<bench_worker *> &workers)
+{
+    // 压测进程里已经有worker线程和日志线程，子进程直接exec自身以服务器模式运行，不继承这些线程的状态
+    pid_t server = 0;
+    if (!opt._external)
+    {
+        server = fork();
+        if (server == 0)
+        {
+            dup2(STDERR_FILENO, STDOUT_FILENO); // 标准输出只留给结果
+            string threads = to_string(opt._server_threads), port = to_string(opt._port), timeout = to_string(opt._duration + opt._warmup + 30);
+            execl("/proc/self/exe", "bench", "--serve", sc._name, threads.c_str(), port.c_str(), timeout.c_str(), (char *)nullptr);
+            _exit(127);
+        }
+    }
+    if (!wait_server(opt))
+    {
+        cerr << sc._name << ": server is not reachable on " << opt._ip << ":" << opt._port << "\n";
+        if (server > 0)
+            kill(server, SIGKILL), waitpid(server, nullptr, 0);
+        return;
+    }
+
+    // 建立连接，活跃连接和空闲连接都平均分到各个worker上
+    string request = make_request(sc, opt);
+    vector<bench_client *> clients;
+    int idle = sc._idle ? opt._idle_conns : 0;
+    for (int i = 0; i < opt._conns + idle; ++i)
+    {
+        bench_worker *w = workers[i % workers.size()];
+        clients.push_back(new bench_client(w, w->get_loop(), sc, opt, request, i >= opt._conns));
+    }
+    for (int i = opt._conns; i < (int)clients.size(); ++i) // 空闲连接先建立好
+        clients[i]->start();
+    barrier(workers);
+    for (int i = 0; i < opt._conns; ++i)
+        clients[i]->start();
+
+    sleep(opt._warmup);
+    uint64_t base_requests = 0, base_errors = 0, base_bytes = 0;
+    vector<histogram_snapshot> base_latency;
+    for (auto w : workers)
+    {
+        base_requests += w->_requests.load();
+        base_errors += w->_errors.load();
+        base_bytes += w->_bytes.load();
+        base_latency.push_back(w->_latency.snapshot());
+    }
+    double server_cpu = server > 0 ? process_cpu(server) : 0;
+    double client_cpu = process_cpu(0);
+    uint64_t begin = metrics_clock::now_ns();
+    g_recording = true;
+
+    sleep(opt._duration);
+
+    g_recording = false;
+    double seconds = (metrics_clock::now_ns() - begin) / 1e9;
+    server_cpu = server > 0 ? process_cpu(server) - server_cpu : -1;
+    client_cpu = process_cpu(0) - client_cpu;
+
+    // 各worker的统计是累计值，减去场景开始前的部分
+    uint64_t requests = 0, errors = 0, bytes = 0;
+    histogram_snapshot latency;
+    for (size_t i = 0; i < workers.size(); ++i)
+    {
+        requests += workers[i]->_requests.load();
+        errors += workers[i]->_errors.load();
+        bytes += workers[i]->_bytes.load();
+        histogram_snapshot hs = workers[i]->_latency.snapshot();
+        for (size_t b = 0; b < hs._counts.size(); ++b)
+            hs._counts[b] -= base_latency[i]._counts[b];
+        hs._count -= base_latency[i]._count;
+        hs._sum -= base_latency[i]._sum;
+        hs._max = 0; // 最大值无法相减，取统计区间内最高的非空桶
+        for (size_t b = 0; b < hs._counts.size(); ++b)
+            if (hs._counts[b] > 0)
+                hs._max = latency_histogram::bucket_upper(b);
+        latency += hs;
+    }
+    requests -= base_requests;
+    errors -= base_errors;
+    bytes -= base_bytes;
+
+    for (auto c : clients)
+        c->stop();
+    barrier(workers);
+    for (auto c : clients)
+        delete c;
+    if (server > 0)
+    {
+        kill(server, SIGKILL);
+        waitpid(server, nullptr, 0);
+    }
+
+    double rps = requests / seconds;
+    char line[1024];
+    snprintf(line, sizeof(line),
+             "{\"scenario\":\"%s\",\"conns\":%d,\"idle_conns\":%d,\"pipeline\":%d,\"request_bytes\":%zu,\"client_threads\":%d,\"server_threads\":%d,"
+             "\"seconds\":%.3f,\"requests\":%llu,\"errors\":%llu,\"rps\":%.1f,\"mb_per_sec\":%.3f,"
+             "\"latency_us\":{\"mean\":%.1f,\"p50\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f},"
+             "\"server_cpu_us_per_req\":%.3f,\"client_cpu_us_per_req\":%.3f}",
+             sc._name, opt._conns, idle, sc._pipeline ? opt._pipeline : 1, request.size(), opt._threads, opt._external ? -1 : opt._server_threads,
+             seconds, (unsigned long long)requests, (unsigned long long)errors, rps, bytes / seconds / 1e6,
+             latency.mean() / 1e3, latency.percentile(0.5) / 1e3, latency.percentile(0.99) / 1e3, latency.percentile(0.999) / 1e3, latency._max / 1e3,
+             requests > 0 && server_cpu >= 0 ? server_cpu * 1e6 / requests : -1.0, requests > 0 ? client_cpu * 1e6 / requests : -1.0);
+    cout << line << endl;
+
+    fprintf(stderr, "%-15s %10.0f req/s  p50 %8.1fus  p99 %8.1fus  p999 %8.1fus  errors %llu\n", sc._name, rps,
+            latency.percentile(0.5) / 1e3, latency.percentile(0.99) / 1e3, latency.percentile(0.999) / 1e3, (unsigned long long)errors);
+}
+
+static void usage(const char *prog)
+{
+    cerr << "usage: " << prog << " <scenario|all> [-c conns] [-t threads] [-s server_threads] [-d seconds] [-w warmup]"
+         << " [-p pipeline] [-b bytes] [-i idle_conns] [-P port] [-H ip:port]\n"
+         << "scenarios:";
+    for (auto &sc : g_scenarios)
+        cerr << " " << sc._name;
+    cerr << "\n";
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (string(argv[1]) == "--serve" && argc == 6)
+    {
+        logger::set_level(FATAL); // RST关闭连接等压测中的正常情况不打日志，也不让日志影响结果
+        for (auto &sc : g_scenarios)
+            if (string(argv[2]) == sc._name)
+                run_server(sc, atoi(argv[3]), atoi(argv[4]), atoi(argv[5]));
+        return 1;
+    }
+
+    bench_options opt;
+    opt._scenario = argv[1];
+    for (int i = 2; i + 1 < argc; i += 2)
+    {
+        string flag = argv[i];
+        string val = argv[i + 1];
+        if (flag == "-c")
+            opt._conns = stoi(val);
+        else if (flag == "-t")
+            opt._threads = stoi(val);
+        else if (flag == "-s")
+            opt._server_threads = stoi(val);
+        else if (flag == "-d")
+            opt._duration = stoi(val);
+        else if (flag == "-w")
+            opt._warmup = stoi(val);
+        else if (flag == "-p")
+            opt._pipeline = stoi(val);
+        else if (flag == "-b")
+            opt._body_size = stoi(val);
+        else if (flag == "-i")
+            opt._idle_conns = stoi(val);
+        else if (flag == "-P")
+            opt._port = stoi(val);
+        else if (flag == "-H")
+        {
+            size_t colon = val.find(':');
+            opt._ip = val.substr(0, colon);
+            if (colon != string::npos)
+                opt._port = stoi(val.substr(colon + 1));
+            opt._external = true;
+        }
+        else
+        {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    vector<const bench_scenario *> todo;
+    for (auto &sc : g_scenarios)
+        if (opt._scenario == "all" || opt._scenario == sc._name)
+            todo.push_back(&sc);
+    if (todo.empty())
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    vector<bench_worker *> workers;
+    for (int i = 0; i < opt._threads; ++i)
+        workers.push_back(new bench_worker);
+
+    for (auto sc : todo)
+        run_scenario(*sc, opt, workers);
+
+    // worker线程一直阻塞在epoll中，直接退出进程
+    logger::instance().flush();
+    fflush(stdout);
+    _exit(0);
+}
@@ -0,0 +1,593 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <memory>
+
+#include "../http/http.hpp"
+
+using namespace std;
+
+// 核心数据结构的微基准：buffer_t、timewheel、eventloop跨线程任务池、HttpContext::RecvHttpRequest、HttpWriter::Write、一个请求的完整处理
+// 用法：micro [名称过滤]，只运行名称中包含过滤串的项目
+// 每项一行JSON输出到标准输出（ns/op、allocs/op、bytes/op），可读的表格输出到标准错误
+// 分配次数通过在可执行文件中替换malloc系列函数统计（glibc允许），包含operator new以及buffer_pool的malloc
+
+/////////////////////////////////////////////////////////////////   分配计数
+
+extern "C" void *__libc_malloc(size_t);
+extern "C" void *__libc_calloc(size_t, size_t);
+extern "C" void *__libc_realloc(void *, size_t);
+extern "C" void __libc_free(void *);
+
+static std::atomic<uint64_t> g_allocs(0);
+static std::atomic<uint64_t> g_alloc_bytes(0);
+
+extern "C" void *malloc(size_t size)
+{
+    g_allocs.fetch_add(1, std::memory_order_relaxed);
+    g_alloc_bytes.fetch_add(size, std::memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t n, size_t size)
+{
+    g_allocs.fetch_add(1, std::memory_order_relaxed);
+    g_alloc_bytes.fetch_add(n * size, std::memory_order_relaxed);
+    return __libc_calloc(n, size);
+}
+
+extern "C" void *realloc(void *p, size_t size)
+{
+    g_allocs.fetch_add(1, std::memory_order_relaxed);
+    g_alloc_bytes.fetch_add(size, std::memory_order_relaxed);
+    return __libc_realloc(p, size);
+}
+
+extern "C" void free(void *p) { __libc_free(p); }
+
+/////////////////////////////////////////////////////////////////   计时框架
+
+static string g_filter;
+
+// 防止编译器把结果优化掉
+template <class T>
+static void keep(const T &v) { asm volatile("" : : "g"(&v) : "memory"); }
+
+// 运行一项：body(ops)执行ops次操作；先预热一轮，再取三轮中最快的一轮
+// setup(ops)在每轮计时之前执行，不计入耗时和分配次数
+static void run(const string &name, const uint64_t &ops, const std::function<void(uint64_t)> &body,
+                const std::function<void(uint64_t)> &setup = std::function<void(uint64_t)>())
+{
+    if (!g_filter.empty() && name.find(g_filter) == string::npos)
+        return;
+
+    if (setup)
+        setup(ops / 10 + 1);
+    body(ops / 10 + 1);
+
+    double best = 1e30;
+    uint64_t allocs = 0, bytes = 0;
+    for (int round = 0; round < 3; ++round)
+    {
+        if (setup)
+            setup(ops);
+        uint64_t a0 = g_allocs.load(), b0 = g_alloc_bytes.load();
+        uint64_t t0 = metrics_clock::now_ns();
+        body(ops);
+        uint64_t t1 = metrics_clock::now_ns();
+        uint64_t a1 = g_allocs.load(), b1 = g_alloc_bytes.load();
+        double ns = (double)(t1 - t0) / ops;
+        if (ns < best)
+        {
+            best = ns;
+            allocs = a1 - a0;
+            bytes = b1 - b0;
+        }
+    }
+
+    double allocs_per_op = (double)allocs / ops;
+    double bytes_per_op = (double)bytes / ops;
+    printf("{\"name\":\"%s\",\"ops\":%llu,\"ns_per_op\":%.2f,\"allocs_per_op\":%.3f,\"bytes_per_op\":%.1f}\n",
+           name.c_str(), (unsigned long long)ops, best, allocs_per_op, bytes_per_op);
+    fflush(stdout);
+    fprintf(stderr, "%-40s %12.2f ns/op %10.3f allocs/op %12.1f B/op\n", name.c_str(), best, allocs_per_op, bytes_per_op);
+}
+
+/////////////////////////////////////////////////////////////////   buffer_t
+
+static void bench_buffer()
+{
+    string small(64, 'x');
+    string large(16384, 'x');
+    char out[16384];
+
+    // 写入读出同样大小的数据，读写位置回到开头，不会扩容
+    run("buffer/write_read_64", 2000000, [&](uint64_t ops)
+        {
+            buffer_t buf;
+            for (uint64_t i = 0; i < ops; ++i)
+            {
+                buf.write(small);
+                buf.read(out, small.size());
+            }
+            keep(out); });
+
+    run("buffer/write_read_16k", 200000, [&](uint64_t ops)
+        {
+            buffer_t buf;
+            for (uint64_t i = 0; i < ops; ++i)
+            {
+                buf.write(large);
+                buf.read(out, large.size());
+            }
+            keep(out); });
+
+    // 从空缓冲区开始追加64B直到64KB，包含逐级扩容
+    run("buffer/expand_to_64k", 20000, [&](uint64_t ops)
+        {
+            for (uint64_t i = 0; i < ops; ++i)
+            {
+                buffer_t buf;
+                for (int j = 0; j < 1024; ++j)
+                    buf.write(small);
+                keep(buf);
+            } });
+
+    // 有池的情况：扩容和释放都走eventloop的buffer_pool
+    buffer_pool pool;
+    run("buffer/expand_to_64k_pooled", 20000, [&](uint64_t ops)
+        {
+            for (uint64_t i = 0; i < ops; ++i)
+            {
+                buffer_t buf;
+                buf.set_pool(&pool);
+                for (int j = 0; j < 1024; ++j)
+                    buf.write(small);
+                keep(buf);
+            } });
+
+    // 在一个典型请求头里查找行尾/空行
+    string header = "GET /index.html HTTP/1.1\r\nHost: example.com\r\nUser-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36\r\n"
+                    "Accept: text/html,application/xhtml+xml\r\nAccept-Encoding: gzip, deflate\r\nConnection: keep-alive\r\n\r\n";
+    run("buffer/findCRLF", 2000000, [&](uint64_t ops)
+        {
+            buffer_t buf;
+            buf.write(header);
+            for (uint64_t i = 0; i < ops; ++i)
+                keep(buf.findCRLF()); });
+
+    run("buffer/find_blank_line", 1000000, [&](uint64_t ops)
+        {
+            buffer_t buf;
+            buf.write(header);
+            for (uint64_t i = 0; i < ops; ++i)
+                keep(buf.find("\r\n\r\n")); });
+
+    // 逐行取出整个请求头
+    run("buffer/getline_header", 500000, [&](uint64_t ops)
+        {
+            buffer_t buf;
+            for (uint64_t i = 0; i < ops; ++i)
+            {
+                buf.write(header);
+                while (buf.valid_data_size() > 0)
+                {
+                    string line = buf.getline();
+                    if (line.empty())
+                        break;
+                    keep(line);
+                }
+                buf.clear();
+            } });
+}
+
+/////////////////////////////////////////////////////////////////   timewheel
+
+static void bench_timewheel(eventloop &loop)
+{
+    static const uint64_t counts[] = {100000, 1000000};
+    for (uint64_t n : counts)
+    {
+        string suffix = "_" + to_string(n);
+        std::unique_ptr<timewheel> wheel;
+        uint64_t fired = 0;
+
+        // 换一个新的时间轮并放入ops个任务（延时分散在整个时间轮上）
+        // 旧时间轮先拨一圈让任务全部到期，任务析构时要访问时间轮的_ttmap，不能带着任务析构
+        auto reset_wheel = [&](uint64_t ops)
+        {
+            if (wheel)
+                wheel->advance(SECWHEELCAP);
+            wheel.reset(new timewheel(&loop));
+            for (uint64_t i = 0; i < ops; ++i)
+                wheel->add_task(i, 1 + i % (SECWHEELCAP - 1), [&fired]()
+                                { ++fired; });
+        };
+
+        run("timewheel/add" + suffix, n, [&](uint64_t ops)
+            {
+                for (uint64_t i = 0; i < ops; ++i)
+                    wheel->add_task(i, 1 + i % (SECWHEELCAP - 1), [&fired]()
+                                    { ++fired; }); },
+            [&](uint64_t)
+            { reset_wheel(0); });
+
+        // 刷新已有任务，每次刷新往时间轮里多放一个shared_ptr
+        run("timewheel/refresh" + suffix, n, [&](uint64_t ops)
+            {
+                for (uint64_t i = 0; i < ops; ++i)
+                    wheel->refresh_task_delaytime(i); },
+            reset_wheel);
+
+        run("timewheel/cancel" + suffix, n, [&](uint64_t ops)
+            {
+                for (uint64_t i = 0; i < ops; ++i)
+                    wheel->cancel_task(i); },
+            reset_wheel);
+
+        // 拨动时间轮让全部任务到期执行，按任务数计算
+        run("timewheel/tick_expire" + suffix, n, [&](uint64_t)
+            { wheel->advance(SECWHEELCAP); },
+            reset_wheel);
+
+        reset_wheel(0);
+        keep(fired);
+    }
+}
+
+/////////////////////////////////////////////////////////////////   eventloop跨线程任务池
+
+static void bench_task_queue()
+{
+    loop_thread *lt = new loop_thread; // 进程退出前一直阻塞在epoll中，不回收
+    loop_ptr loop = lt->get_loop();
+
+    static const int producer_nums[] = {1, 4};
+    for (int producers : producer_nums)
+    {
+        // producers个线程一共压入ops个任务，计时到最后一个任务执行完
+        run("eventloop/cross_thread_task_p" + to_string(producers), 400000, [&](uint64_t ops)
+            {
+                std::atomic<uint64_t> done(0);
+                std::vector<std::thread> threads;
+                for (int p = 0; p < producers; ++p)
+                    threads.emplace_back([&, p]()
+                                         {
+                                             uint64_t mine = ops / producers + (p < (int)(ops % producers) ? 1 : 0);
+                                             for (uint64_t i = 0; i < mine; ++i)
+                                                 loop->run_in_loop([&done]()
+                                                                   { done.fetch_add(1, std::memory_order_relaxed); }); });
+                for (auto &t : threads)
+                    t.join();
+                while (done.load(std::memory_order_relaxed) < ops)
+                    std::this_thread::yield(); });
+    }
+}
+
+/////////////////////////////////////////////////////////////////   HttpContext::RecvHttpRequest
+
+static void bench_http_parser()
+{
+    struct corpus_t
+    {
+        const char *_name;
+        string _data;
+    };
+    string body(1024, 'a');
+    vector<corpus_t> corpora = {
+        {"curl_get", "GET /hello HTTP/1.1\r\nHost: 127.0.0.1:8080\r\nUser-Agent: curl/7.88.1\r\nAccept: */*\r\n\r\n"},
+        {"browser_get", "GET /static/js/app.3f9a1c.js?v=20240101 HTTP/1.1\r\n"
+                        "Host: www.example.com\r\n"
+                        "Connection: keep-alive\r\n"
+                        "sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\", \"Not-A.Brand\";v=\"99\"\r\n"
+                        "sec-ch-ua-mobile: ?0\r\n"
+                        "User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/124.0.0.0 Safari/537.36\r\n"
+                        "sec-ch-ua-platform: \"Windows\"\r\n"
+                        "Accept: */*\r\n"
+                        "Sec-Fetch-Site: same-origin\r\n"
+                        "Sec-Fetch-Mode: no-cors\r\n"
+                        "Sec-Fetch-Dest: script\r\n"
+                        "Referer: https://www.example.com/index.html\r\n"
+                        "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+                        "Accept-Language: zh-CN,zh;q=0.9,en;q=0.8\r\n"
+                        "Cookie: session=7f3b2a9c4d5e6f708192a3b4c5d6e7f8; theme=dark; _ga=GA1.1.123456789.1700000000\r\n\r\n"},
+        {"form_post", "POST /login HTTP/1.1\r\nHost: www.example.com\r\nConnection: keep-alive\r\nContent-Type: application/x-www-form-urlencoded\r\n"
+                      "Content-Length: 41\r\n\r\nusername=admin&password=123456&remember=1"},
+        {"post_1k", "POST /upload HTTP/1.1\r\nHost: www.example.com\r\nConnection: keep-alive\r\nContent-Type: application/octet-stream\r\n"
+                    "Content-Length: 1024\r\n\r\n" +
+                        body},
+    };
+
+    for (auto &c : corpora)
+    {
+        run(string("http/parse_") + c._name, 20000, [&](uint64_t ops)
+            {
+                buffer_t buf;
+                HttpContext ctx;
+                for (uint64_t i = 0; i < ops; ++i)
+                {
+                    buf.write(c._data);
+                    ctx.RecvHttpRequest(&buf);
+                    keep(ctx.Request());
+                    ctx.Reset();
+                } });
+    }
+
+    // 流水线：一次读到16个请求
+    string pipelined;
+    for (int i = 0; i < 16; ++i)
+        pipelined += corpora[0]._data;
+    run("http/parse_pipelined_x16", 32000, [&](uint64_t ops)
+        {
+            buffer_t buf;
+            HttpContext ctx;
+            for (uint64_t i = 0; i < ops; i += 16)
+            {
+                buf.write(pipelined);
+                while (buf.valid_data_size() > 0)
+                {
+                    ctx.RecvHttpRequest(&buf);
+                    keep(ctx.Request());
+                    ctx.Reset();
+                }
+            } });
+}
+
+/////////////////////////////////////////////////////////////////   HttpWriter::Write
+
+static void bench_http_writer()
+{
+    HttpRequest req;
+    req._method = "GET";
+    req._path = "/hello";
+    req.SetHeader("Connection", "keep-alive");
+
+    HttpResponse small;
+    small.SetContent("hello world", "text/plain");
+    run("http/write_small", 1000000, [&](uint64_t ops)
+        {
+            buffer_t buf;
+            for (uint64_t i = 0; i < ops; ++i)
+            {
+                HttpWriter::Write(req, small, &buf);
+                keep(buf);
+                buf.clear();
+            } });
+
+    // 动态响应即时压缩的CPU开销（4KB的JSON）
+    string json;
+    for (int i = 0; json.size() < 4096; ++i)
+        json += "{\"id\":" + to_string(i) + ",\"name\":\"user" + to_string(i * 7) + "\",\"active\":true},";
+    for (int level : {1, 6})
+        run("http/gzip_4k_level" + to_string(level), 20000, [&](uint64_t ops)
+            {
+                string out;
+                for (uint64_t i = 0; i < ops; ++i)
+                {
+                    Gzip::Compress(json.data(), json.size(), level, &out);
+                    keep(out);
+                } });
+
+    HttpResponse notfound(404);
+    run("http/write_404", 1000000, [&](uint64_t ops)
+        {
+            buffer_t buf;
+            for (uint64_t i = 0; i < ops; ++i)
+            {
+                HttpWriter::Write(req, notfound, &buf);
+                keep(buf);
+                buf.clear();
+            } });
+}
+
+/////////////////////////////////////////////////////////////////   WebSocket帧
+
+static void bench_websocket()
+{
+    // 客户端帧的去掩码（按8字节一组）和服务端帧的序列化
+    string payload(4096, 'x');
+    const unsigned char mask[4] = {0x12, 0x34, 0x56, 0x78};
+    run("ws/unmask_4k", 1000000, [&](uint64_t ops)
+        {
+            for (uint64_t i = 0; i < ops; ++i)
+            {
+                WsCodec::Unmask(&payload[0], payload.size(), mask);
+                keep(payload);
+            } });
+
+    string msg = "{\"type\":\"tick\",\"price\":101.25}";
+    run("ws/write_small", 2000000, [&](uint64_t ops)
+        {
+            buffer_t buf;
+            for (uint64_t i = 0; i < ops; ++i)
+            {
+                WsCodec::Write(&buf, WS_TEXT, msg.data(), msg.size());
+                keep(buf);
+                buf.clear();
+            } });
+
+    run("ws/parse_header", 4000000, [&](uint64_t ops)
+        {
+            string frame = WsCodec::Frame(WS_TEXT, msg.data(), msg.size());
+            frame[1] |= 0x80; // 带掩码的客户端帧
+            frame.insert(2, 4, 'm');
+            WsFrame f;
+            for (uint64_t i = 0; i < ops; ++i)
+            {
+                WsCodec::ParseHeader(frame.data(), frame.size(), &f);
+                keep(f);
+            } });
+}
+
+static void bench_hpack()
+{
+    // 典型的浏览器请求头部块：编码一次，之后反复解码（新的解码器，不命中动态表）
+    HeaderList req = {{":method", "GET"}, {":scheme", "http"}, {":path", "/static/app.js?v=20240101"}, {":authority", "example.com"},
+                      {"user-agent", "Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0 Safari/537.36"},
+                      {"accept", "*/*"}, {"accept-encoding", "gzip, deflate, br"}, {"accept-language", "zh-CN,zh;q=0.9,en;q=0.8"},
+                      {"cookie", "session=6f1c2e9ab3d54e7f; theme=dark"}};
+    string block;
+    HpackEncoder encoder;
+    for (auto &field : req)
+        encoder.Encode(field.first, field.second, &block);
+    run("hpack/decode_request", 500000, [&](uint64_t ops)
+        {
+            HeaderList headers;
+            bool too_large = false;
+            for (uint64_t i = 0; i < ops; ++i)
+            {
+                HpackDecoder decoder;
+                headers.clear();
+                decoder.Decode((const uint8_t *)block.data(), block.size(), &headers, &too_large);
+                keep(headers);
+            } });
+
+    // 同一个连接上连续的响应头部：大部分字段命中动态表
+    HeaderList rsp = {{":status", "200"}, {"content-type", "text/html"}, {"content-length", "324"}, {"accept-ranges", "bytes"},
+                      {"etag", "\"144-179c0d510cf37a00\""}, {"date", "Mon, 19 Oct 2026 10:57:38 GMT"}, {"server", HTTP_SERVER_NAME}};
+    run("hpack/encode_response", 2000000, [&](uint64_t ops)
+        {
+            HpackEncoder enc;
+            string out;
+            for (uint64_t i = 0; i < ops; ++i)
+            {
+                out.clear();
+                for (auto &field : rsp)
+                    enc.Encode(field.first, field.second, &out);
+                keep(out);
+            } });
+
+    string text = req[4].second, huff;
+    Huffman::Encode(text.data(), text.size(), &huff);
+    run("hpack/huffman_decode", 2000000, [&](uint64_t ops)
+        {
+            string out;
+            for (uint64_t i = 0; i < ops; ++i)
+            {
+                out.clear();
+                Huffman::Decode((const uint8_t *)huff.data(), huff.size(), &out);
+                keep(out);
+            } });
+}
+
+/////////////////////////////////////////////////////////////////   路由
+
+static void bench_router()
+{
+    // 48条路由：字面路径、参数、通配尾部混合，查找排在后面的路由；对比原来的逐个regex_match
+    Router<int> router;
+    std::vector<std::pair<std::regex, int>> regexes;
+    const char *resources[] = {"users", "orders", "items", "carts", "reviews", "coupons", "tags", "stores"};
+    int id = 0;
+    for (auto res : resources)
+    {
+        string base = string("/api/v1/") + res;
+        router.Add(base, id);
+        regexes.push_back(std::make_pair(std::regex(base), id++));
+        router.Add(base + "/search", id);
+        regexes.push_back(std::make_pair(std::regex(base + "/search"), id++));
+        router.Add(base + "/:id<int>", id);
+        regexes.push_back(std::make_pair(std::regex(base + "/(\\d+)"), id++));
+        router.Add(base + "/:id<int>/history", id);
+        regexes.push_back(std::make_pair(std::regex(base + "/(\\d+)/history"), id++));
+        router.Add(base + "/:id/:field", id);
+        regexes.push_back(std::make_pair(std::regex(base + "/([^/]+)/([^/]+)"), id++));
+        router.Add(base + "/export/*file", id);
+        regexes.push_back(std::make_pair(std::regex(base + "/export/(.*)"), id++));
+    }
+    string path = "/api/v1/stores/12345/history";
+    run("router/regex_scan", 20000, [&](uint64_t ops)
+        {
+            std::smatch matches;
+            for (uint64_t i = 0; i < ops; ++i)
+            {
+                for (auto &route : regexes)
+                {
+                    if (std::regex_match(path, matches, route.first))
+                        break;
+                }
+                keep(matches);
+            } });
+    run("router/tree_param", 5000000, [&](uint64_t ops)
+        {
+            RouteParams params;
+            for (uint64_t i = 0; i < ops; ++i)
+            {
+                params.clear();
+                keep(router.Find(path, &params, nullptr));
+            } });
+    string literal = "/api/v1/stores/search";
+    run("router/tree_literal", 5000000, [&](uint64_t ops)
+        {
+            RouteParams params;
+            for (uint64_t i = 0; i < ops; ++i)
+            {
+                params.clear();
+                keep(router.Find(literal, &params, nullptr));
+            } });
+}
+
+/////////////////////////////////////////////////////////////////   一个请求的完整处理
+
+static void bench_http_request()
+{
+    // 一个请求的完整处理：解析、路由、处理函数、序列化响应、重置上下文（对应HttpServer::OnMessage中的一轮）
+    Router<int> router;
+    router.Add("/hello", 1);
+    router.Add("/users/:id<int>", 2);
+    string curl = "GET /hello HTTP/1.1\r\nHost: 127.0.0.1:8080\r\nUser-Agent: curl/7.88.1\r\nAccept: */*\r\n\r\n";
+    string query = "GET /users/42?fields=name%2Cemail&lang=zh-CN&page=3 HTTP/1.1\r\nHost: www.example.com\r\nConnection: keep-alive\r\n"
+                   "Accept: application/json\r\n\r\n";
+    for (auto &c : vector<pair<string, string>>{{"curl_get", curl}, {"query_get", query}})
+    {
+        const string &data = c.second;
+        run("http/request_" + c.first, 20000, [&](uint64_t ops)
+            {
+                buffer_t in, out;
+                HttpContext ctx;
+                for (uint64_t i = 0; i < ops; ++i)
+                {
+                    in.write(data);
+                    ctx.RecvHttpRequest(&in);
+                    HttpRequest &req = ctx.Request();
+                    HttpResponse &rsp = ctx.Response();
+                    req._route_params.clear();
+                    const int *route = router.Find(req._path, &req._route_params, &req._matches);
+                    if (route != nullptr && *route == 2)
+                    {
+                        // 处理函数在请求的arena中格式化正文
+                        char *body = req.Arena().Alloc<char>(256);
+                        int n = snprintf(body, 256, "{\"id\":%s,\"fields\":\"%s\"}", req.FindPathParam("id"), req.FindParam("fields"));
+                        rsp.SetContent(body, n, "application/json");
+                    }
+                    else
+                        rsp.SetContent("hello world", "text/plain");
+                    HttpWriter::Write(req, rsp, &out);
+                    keep(out);
+                    out.clear();
+                    ctx.Reset();
+                } });
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1)
+        g_filter = argv[1];
+
+    eventloop loop; // timewheel需要绑定一个eventloop，在本线程中直接执行
+    bench_buffer();
+    bench_timewheel(loop);
+    bench_task_queue();
+    bench_http_parser();
+    bench_http_writer();
+    bench_websocket();
+    bench_hpack();
+    bench_router();
+    bench_http_request();
+
+    // 任务池压测的eventloop线程一直阻塞在epoll中，直接退出进程
+    logger::instance().flush();
+    fflush(stdout);
+    _exit(0);
+}
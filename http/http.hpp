@@ -3,13 +3,28 @@
 #include <iostream>
 #include <fstream>
 #include <regex>
+#include <list>
+#include <climits>
 
 #include <sys/stat.h>
+#include <sys/inotify.h>
+#include <strings.h>
+#include <zlib.h>
 
 // #include "../module_test/servertest.hpp"
 #include "../server/server.hpp"
+#include "websocket.hpp"
+#include "router.hpp"
 
 #define DEFALT_TIMEOUT 30
+#define HTTP_KEEPALIVE_TIMEOUT 15 // 默认长连接两个请求之间的空闲超时（秒）
+#define HTTP_KEEPALIVE_MAX 1000   // 默认每个连接最多处理的请求数
+#define HTTP_HEADER_TIMEOUT 10    // 默认从请求的第一个字节到头部接收完整的时限（秒）
+#define HTTP_BODY_TIMEOUT 30      // 默认接收正文时两次收到数据的最大间隔（秒）
+#define HTTP_SERVER_NAME "muduo-imitation" // 响应中Server头部的值
+#define HTTP_GZIP_MIN 1024                  // 默认达到该大小的文本类响应才压缩，太小的压缩后省不了多少
+#define HTTP_MAX_BODY (64 << 20)            // 默认完整缓存到_body中的正文上限，更大的请求需要注册正文消费者
+#define HTTP_BODY_RESERVE (64 << 10)        // 按Content-Length预先分配的正文空间上限，更大的正文随数据到达增长
 
 std::unordered_map<int, std::string> _statu_msg = {
     {100, "Continue"},
@@ -263,27 +278,37 @@ public:
     // URL解码
     static std::string UrlDecode(const std::string &url, bool convert_plus_to_space = false)
     {
-        // 遇到了%，则将紧随其后的2个字符，转换为数字，第一个数字左移4位，然后加上第二个数字  + -> 2b  %2b->2 << 4 + 11
         std::string res;
-        for (int i = 0; i < url.size(); i++)
+        UrlDecode(url.data(), url.size(), convert_plus_to_space, &res);
+        return res;
+    }
+    // URL解码，结果追加到out后面（out已有的内存可以重复使用，不产生临时字符串）
+    static void UrlDecode(const char *url, const size_t &len, bool convert_plus_to_space, std::string *out)
+    {
+        // 遇到了%，则将紧随其后的2个字符，转换为数字，第一个数字左移4位，然后加上第二个数字  + -> 2b  %2b->2 << 4 + 11
+        size_t run = 0; // 不需要转换的一段，整段追加
+        for (size_t i = 0; i < len; i++)
         {
             if (url[i] == '+' && convert_plus_to_space == true)
             {
-                res += ' ';
+                out->append(url + run, i - run);
+                out->push_back(' ');
+                run = i + 1;
                 continue;
             }
-            if (url[i] == '%' && (i + 2) < url.size())
+            if (url[i] == '%' && (i + 2) < len)
             {
+                out->append(url + run, i - run);
                 char v1 = HEXTOI(url[i + 1]);
                 char v2 = HEXTOI(url[i + 2]);
                 char v = v1 * 16 + v2;
-                res += v;
+                out->push_back(v);
                 i += 2;
+                run = i + 1;
                 continue;
             }
-            res += url[i];
         }
-        return res;
+        out->append(url + run, len - run);
     }
 
     // 响应状态码的描述信息获取
@@ -358,6 +383,1024 @@ public:
         }
         return true;
     }
+
+    // HTTP日期格式（RFC 7231 IMF-fixdate）：Sun, 06 Nov 1994 08:49:37 GMT
+    static std::string HttpDate(const time_t &t)
+    {
+        struct tm tm;
+        gmtime_r(&t, &tm);
+        char buf[64];
+        size_t n = strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+        return std::string(buf, n);
+    }
+    // 解析HTTP日期，只支持IMF-fixdate
+    static bool ParseHttpDate(const std::string &str, time_t *t)
+    {
+        struct tm tm;
+        memset(&tm, 0, sizeof(tm));
+        const char *end = strptime(str.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+        if (end == nullptr || *end != '\0')
+            return false;
+        *t = timegm(&tm);
+        return true;
+    }
+
+    // Accept-Encoding协商：客户端是否接受gzip（gzip/x-gzip的q值不为0，或者没有列出gzip但*的q值不为0）
+    // 直接在头部的值上扫描，不拆分成临时字符串；没有该头部（nullptr）时不接受
+    static bool AcceptGzip(const char *accept_encoding)
+    {
+        if (accept_encoding == nullptr)
+            return false;
+        int star = -1;
+        const char *p = accept_encoding;
+        while (*p != '\0')
+        {
+            while (*p == ' ' || *p == '\t' || *p == ',')
+                ++p;
+            const char *name = p;
+            while (*p != '\0' && *p != ',' && *p != ';' && *p != ' ' && *p != '\t')
+                ++p;
+            size_t len = p - name;
+            bool accept = true;
+            for (; *p != '\0' && *p != ','; ++p) // 参数部分，只关心q值
+            {
+                if (p[0] == 'q' && p[1] == '=')
+                    accept = atof(p + 2) > 0;
+            }
+            if ((len == 4 && strncasecmp(name, "gzip", 4) == 0) || (len == 6 && strncasecmp(name, "x-gzip", 6) == 0))
+                return accept;
+            if (len == 1 && name[0] == '*')
+                star = accept;
+        }
+        return star == 1;
+    }
+    static bool AcceptGzip(const std::string &accept_encoding) { return AcceptGzip(accept_encoding.c_str()); }
+    // 值得压缩的内容类型：文本类，图片、音视频、压缩包本身已经压缩过
+    static bool IsCompressible(const char *mime)
+    {
+        return strncmp(mime, "text/", 5) == 0 || strstr(mime, "json") != nullptr || strstr(mime, "javascript") != nullptr ||
+               strstr(mime, "xml") != nullptr;
+    }
+    static bool IsCompressible(const std::string &mime) { return IsCompressible(mime.c_str()); }
+    // 逗号分隔的列表（Connection、Upgrade等头部的值）中是否有token，不区分大小写；list为nullptr时返回false
+    static bool HasToken(const char *list, const char *token)
+    {
+        if (list == nullptr)
+            return false;
+        size_t n = strlen(token);
+        const char *p = list;
+        while (*p != '\0')
+        {
+            while (*p == ' ' || *p == '\t' || *p == ',')
+                ++p;
+            const char *b = p;
+            while (*p != '\0' && *p != ',')
+                ++p;
+            const char *e = p;
+            while (e > b && (e[-1] == ' ' || e[-1] == '\t'))
+                --e;
+            if ((size_t)(e - b) == n && strncasecmp(b, token, n) == 0)
+                return true;
+        }
+        return false;
+    }
+    // 按协议版本和Connection头部的值判断连接是否保持：HTTP/1.1默认保持，除非带close；HTTP/1.0要明确带keep-alive
+    static bool IsPersistent(const bool &http10, const char *connection)
+    {
+        if (http10)
+            return HasToken(connection, "keep-alive");
+        return !HasToken(connection, "close");
+    }
+    // 解析Keep-Alive头部：timeout=N, max=M，只在出现且比传入的值小时修改（客户端只能调小服务器的设置）
+    static void ParseKeepAlive(const char *value, uint32_t *timeout, uint32_t *max)
+    {
+        for (const char *p = value; p != nullptr && *p != '\0'; ++p)
+        {
+            while (*p == ' ' || *p == '\t' || *p == ',')
+                ++p;
+            uint32_t *dst = strncasecmp(p, "timeout=", 8) == 0 ? timeout : (strncasecmp(p, "max=", 4) == 0 ? max : nullptr);
+            if (dst != nullptr)
+            {
+                unsigned long n = strtoul(strchr(p, '=') + 1, nullptr, 10);
+                if (n < *dst)
+                    *dst = n;
+            }
+            p = strchr(p, ',');
+            if (p == nullptr)
+                break;
+        }
+    }
+
+#define MAX_RANGES 16
+    // 解析Range头部（只支持bytes单位）：a-b、a-、-n，逗号分隔多个，结果是闭区间[first, second]
+    // 返回-1表示忽略该头部（语法错误、不支持的单位或范围太多），0表示没有一个范围可以满足（416），1表示成功
+    // 重叠或相接的范围合并成一个（RFC 7233 4.1），多个范围时按起点升序，"0-,0-,..."不会让正文膨胀成文件的很多倍
+    static int ParseRange(const std::string &header, const uint64_t &size, std::vector<std::pair<uint64_t, uint64_t>> *ranges)
+    {
+        ranges->clear();
+        if (header.compare(0, 6, "bytes=") != 0)
+            return -1;
+        std::vector<std::string> specs;
+        Split(header.substr(6), ",", &specs);
+        if (specs.empty() || specs.size() > MAX_RANGES)
+            return -1;
+        for (auto &spec : specs)
+        {
+            size_t b = spec.find_first_not_of(' '), e = spec.find_last_not_of(' ');
+            if (b == std::string::npos)
+                return -1;
+            std::string s = spec.substr(b, e - b + 1);
+            size_t dash = s.find('-');
+            if (dash == std::string::npos || s.find_first_not_of("0123456789-") != std::string::npos || s.find('-', dash + 1) != std::string::npos)
+                return -1;
+            std::string first = s.substr(0, dash), last = s.substr(dash + 1);
+            if (first.empty()) // -n：最后n个字节
+            {
+                if (last.empty())
+                    return -1;
+                uint64_t n = strtoull(last.c_str(), nullptr, 10);
+                if (n == 0 || size == 0)
+                    continue;
+                ranges->push_back(std::make_pair(n >= size ? 0 : size - n, size - 1));
+                continue;
+            }
+            uint64_t a = strtoull(first.c_str(), nullptr, 10);
+            uint64_t z = last.empty() ? size - 1 : strtoull(last.c_str(), nullptr, 10);
+            if (!last.empty() && z < a)
+                return -1;
+            if (a >= size) // 起点超出文件大小，这一段不能满足
+                continue;
+            ranges->push_back(std::make_pair(a, z >= size ? size - 1 : z));
+        }
+        if (ranges->size() > 1)
+        {
+            std::sort(ranges->begin(), ranges->end());
+            size_t n = 0;
+            for (size_t i = 1; i < ranges->size(); ++i)
+            {
+                auto &last = (*ranges)[n];
+                if ((*ranges)[i].first <= last.second + 1)
+                    last.second = std::max(last.second, (*ranges)[i].second);
+                else
+                    (*ranges)[++n] = (*ranges)[i];
+            }
+            ranges->resize(n + 1);
+        }
+        return ranges->empty() ? 0 : 1;
+    }
+};
+
+// gzip压缩：每个线程为每个压缩级别保留一个z_stream，用deflateReset复用，
+// 避免每次deflateInit分配（约256KB）和初始化内部状态
+class Gzip
+{
+private:
+    struct Streams
+    {
+        z_stream _zs[Z_BEST_COMPRESSION + 1];
+        bool _inited[Z_BEST_COMPRESSION + 1];
+
+        Streams() { memset(_inited, 0, sizeof(_inited)); }
+        ~Streams()
+        {
+            for (int i = 0; i <= Z_BEST_COMPRESSION; ++i)
+                if (_inited[i])
+                    deflateEnd(&_zs[i]);
+        }
+    };
+
+public:
+    // 以level级别（1~9）压缩为gzip格式，结果覆盖写入out
+    static bool Compress(const char *data, const size_t &len, const int &level, std::string *out)
+    {
+        static thread_local Streams t_streams;
+        if (level < Z_BEST_SPEED || level > Z_BEST_COMPRESSION)
+            return false;
+
+        z_stream &zs = t_streams._zs[level];
+        if (!t_streams._inited[level])
+        {
+            memset(&zs, 0, sizeof(zs));
+            // windowBits 15+16：带gzip头和尾
+            if (deflateInit2(&zs, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+                return false;
+            t_streams._inited[level] = true;
+        }
+        else
+            deflateReset(&zs);
+
+        out->resize(deflateBound(&zs, len));
+        zs.next_in = (Bytef *)data;
+        zs.avail_in = len;
+        zs.next_out = (Bytef *)&(*out)[0];
+        zs.avail_out = out->size();
+        int ret = deflate(&zs, Z_FINISH);
+        out->resize(zs.total_out);
+        return ret == Z_STREAM_END;
+    }
+};
+
+// 静态资源文件缓存的一项，创建后只读，可在多个线程间共享
+struct FileEntry
+{
+    bool _exists;               // 是否是一个存在的普通文件，不存在的路径也缓存下来（单独的LRU），省掉动态请求每次的open
+    std::string _path;          // 文件路径
+    std::string _content;       // 文件内容，_on_disk时为空
+    bool _on_disk;              // 文件太大，内容不读入内存，发送时用sendfile从文件发送
+    uint64_t _size;             // 文件大小
+    time_t _mtime;              // 修改时间
+    std::string _mime;          // 内容类型
+    std::string _etag;          // 由大小和修改时间生成："大小-修改时间纳秒"（十六进制）
+    std::string _last_modified; // HTTP日期格式的修改时间
+    std::string _type_header;   // 预先生成的 Content-Type: ...\r\n
+    std::string _validators;    // 预先生成的 ETag: ...\r\nLast-Modified: ...\r\n（有gzip版本时加上Vary）
+
+    // gzip版本：同目录下的.gz文件，或者加载时压缩好的内容，为空表示没有
+    std::string _gzip;
+    std::string _gzip_etag;
+    std::string _gzip_validators;
+
+    FileEntry() : _exists(false), _on_disk(false), _size(0), _mtime(0) {}
+
+    // 计入缓存容量的大小
+    size_t Cost() const { return _content.size() + _gzip.size() + _path.size() + _type_header.size() + _validators.size() + _gzip_validators.size() + sizeof(FileEntry); }
+};
+using FileEntryPtr = std::shared_ptr<const FileEntry>;
+
+// 静态资源缓存：按路径缓存文件内容和预先生成的头部，命中时不访问磁盘（不stat、不读文件）
+// 文件所在目录通过inotify监控，有变化时淘汰对应的项；总大小和项数超过上限时按LRU淘汰
+// 各个eventloop线程共享一份，查找加锁；inotify事件在Attach的eventloop（主线程）中处理
+// 缓存的是文件内容的拷贝而不是mmap：文件被截断时访问映射区会触发SIGBUS
+// 文本类文件同时缓存gzip版本：优先使用同目录下不比原文件旧的.gz文件，没有时在加载时压缩一次
+class FileCache
+{
+#define FILE_CACHE_MAX_BYTES (64 << 20) // 默认缓存总大小上限
+#define FILE_CACHE_MAX_FILE (1 << 20)   // 默认单个文件上限，更大的文件只缓存元信息，内容用sendfile发送
+#define FILE_CACHE_MAX_ENTRIES 16384    // 最多缓存的文件项数
+#define FILE_CACHE_MAX_MISSING 1024     // 最多缓存的不存在路径数，单独一个LRU，随机的404路径不会挤掉真实文件
+
+private:
+    struct Node
+    {
+        FileEntryPtr _entry;
+        std::list<std::string>::iterator _pos; // 在LRU链表中的位置
+    };
+
+    std::mutex _mutex;
+    std::unordered_map<std::string, Node> _entries;
+    std::list<std::string> _lru; // 头部是最近使用的
+    std::unordered_map<std::string, std::list<std::string>::iterator> _missing; // 不存在的路径 -> 在_missing_lru中的位置
+    std::list<std::string> _missing_lru;
+    size_t _bytes;               // 当前缓存的总大小
+    size_t _max_bytes;           // 总大小上限，0表示不缓存
+    size_t _max_file;            // 单个文件上限
+    uint64_t _generation;        // 清空缓存时加一（事件队列溢出、目录本身被删除/移走、修改设置），加载期间清空过的不放入缓存
+    std::unordered_map<int, uint64_t> _wd_generation; // 监控的目录下有文件变化时加一，加载期间所在目录有变化的文件不放入缓存
+    size_t _gzip_min;            // 加载时压缩的最小文件大小，0表示不压缩（.gz文件仍然使用）
+    int _gzip_level;             // 加载时压缩使用的级别，和动态响应的设置相同
+
+    int _inotify_fd;
+    std::unique_ptr<channel> _chan;
+    std::unordered_map<int, std::vector<std::string>> _wd_dirs; // 监控描述符 -> 目录（同一目录可能有多种写法）
+    std::unordered_map<std::string, int> _dir_wd;               // 目录 -> 监控描述符
+
+public:
+    FileCache() : _bytes(0), _max_bytes(FILE_CACHE_MAX_BYTES), _max_file(FILE_CACHE_MAX_FILE), _generation(0), _gzip_min(0), _gzip_level(Z_BEST_SPEED), _inotify_fd(-1) {}
+    ~FileCache()
+    {
+        if (_chan)
+            _chan->cancel_monitor_all_event();
+        if (_inotify_fd != -1)
+            close(_inotify_fd);
+    }
+
+    FileCache(const FileCache &) = delete;
+    FileCache &operator=(const FileCache &) = delete;
+
+private:
+    // 读取整个文件
+    static bool ReadAll(const int &fd, const size_t &size, std::string *out)
+    {
+        out->resize(size);
+        size_t total = 0;
+        while (total < size)
+        {
+            ssize_t n = pread(fd, &(*out)[total], size - total, total);
+            if (n == -1 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            total += n;
+        }
+        return total == size;
+    }
+
+    // 同目录下不比原文件旧的.gz文件
+    static bool LoadSibling(const std::string &path, const struct stat &origin, const size_t &max_file, std::string *out)
+    {
+        int fd = open((path + ".gz").c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        if (-1 == fd)
+            return false;
+        struct stat st;
+        bool ok = 0 == fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_mtime >= origin.st_mtime && (size_t)st.st_size <= max_file && ReadAll(fd, st.st_size, out);
+        close(fd);
+        if (!ok)
+            out->clear();
+        return ok;
+    }
+
+    // 从磁盘加载文件，不是普通文件时返回_exists为false的项
+    // 超过max_file的文件只记录元信息，内容在发送时用sendfile从文件发送；gzip_min不为0时，没有.gz文件的文本类文件压缩一份
+    static std::shared_ptr<FileEntry> Load(const std::string &path, const size_t &gzip_min, const int &gzip_level, const size_t &max_file)
+    {
+        std::shared_ptr<FileEntry> entry(new FileEntry);
+        entry->_path = path;
+        // O_NONBLOCK：路径可能是FIFO，open不能阻塞
+        int fd = open(path.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        if (-1 == fd)
+            return entry;
+
+        struct stat st;
+        if (-1 == fstat(fd, &st) || !S_ISREG(st.st_mode))
+        {
+            close(fd);
+            return entry;
+        }
+        entry->_on_disk = (size_t)st.st_size > max_file;
+        bool ok = entry->_on_disk || ReadAll(fd, st.st_size, &entry->_content);
+        close(fd);
+        if (!ok)
+        {
+            LOG(WARNING, "[read static file failed][%s][%lu]", path.c_str(), (unsigned long)st.st_size);
+            entry->_content.clear();
+            return entry;
+        }
+
+        char etag[64];
+        snprintf(etag, sizeof(etag), "\"%lx-%llx\"", (unsigned long)st.st_size,
+                 (unsigned long long)st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec);
+        entry->_exists = true;
+        entry->_size = st.st_size;
+        entry->_mtime = st.st_mtime;
+        entry->_etag = etag;
+        entry->_last_modified = Util::HttpDate(st.st_mtime);
+        entry->_mime = Util::ExtMime(path);
+        entry->_type_header = "Content-Type: " + entry->_mime + "\r\n";
+        entry->_validators = "ETag: " + entry->_etag + "\r\nLast-Modified: " + entry->_last_modified + "\r\n";
+        if (entry->_on_disk)
+            return entry;
+
+        if (!LoadSibling(path, st, max_file, &entry->_gzip) && gzip_min > 0 && entry->_content.size() >= gzip_min && Util::IsCompressible(entry->_mime))
+        {
+            if (!Gzip::Compress(entry->_content.data(), entry->_content.size(), gzip_level, &entry->_gzip) || entry->_gzip.size() >= entry->_content.size())
+                entry->_gzip.clear();
+        }
+        if (!entry->_gzip.empty())
+        {
+            entry->_gzip_etag = entry->_etag;
+            entry->_gzip_etag.insert(entry->_gzip_etag.size() - 1, "-gz");
+            entry->_validators += "Vary: Accept-Encoding\r\n";
+            entry->_gzip_validators = "ETag: " + entry->_gzip_etag + "\r\nLast-Modified: " + entry->_last_modified + "\r\nVary: Accept-Encoding\r\n";
+            std::string(entry->_gzip).swap(entry->_gzip); // 压缩时按上界分配的空间还回去
+        }
+        return entry;
+    }
+
+    // 监控目录，已经在监控中直接返回，调用时持有锁
+    bool Watch(const std::string &dir)
+    {
+        if (_dir_wd.count(dir))
+            return true;
+        int wd = inotify_add_watch(_inotify_fd, dir.empty() ? "/" : dir.c_str(),
+                                   IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+        if (-1 == wd)
+            return false;
+        _wd_dirs[wd].push_back(dir);
+        _dir_wd[dir] = wd;
+        return true;
+    }
+
+    // 不再监控某个监控描述符下的目录，调用时持有锁
+    void Unwatch(const int &wd)
+    {
+        auto it = _wd_dirs.find(wd);
+        if (it == _wd_dirs.end())
+            return;
+        for (auto &dir : it->second)
+            _dir_wd.erase(dir);
+        _wd_dirs.erase(it);
+        _wd_generation.erase(wd);
+    }
+
+    // 以下调用时持有锁
+    void Erase(const std::string &path)
+    {
+        auto mit = _missing.find(path);
+        if (mit != _missing.end())
+        {
+            _missing_lru.erase(mit->second);
+            _missing.erase(mit);
+        }
+        auto it = _entries.find(path);
+        if (it == _entries.end())
+            return;
+        _bytes -= it->second._entry->Cost();
+        _lru.erase(it->second._pos);
+        _entries.erase(it);
+    }
+
+    // 目录被创建或移入时，路径在它下面的不存在项都淘汰掉（这些项监控的是更上层的目录）
+    void EraseMissingUnder(const std::string &dir)
+    {
+        std::string prefix = dir + "/";
+        for (auto it = _missing_lru.begin(); it != _missing_lru.end();)
+        {
+            if (it->compare(0, prefix.size(), prefix) == 0)
+            {
+                _missing.erase(*it);
+                it = _missing_lru.erase(it);
+            }
+            else
+                ++it;
+        }
+    }
+
+    void Clear()
+    {
+        _entries.clear();
+        _lru.clear();
+        _missing.clear();
+        _missing_lru.clear();
+        _bytes = 0;
+    }
+
+    // 监控path所在的目录；目录不存在时监控最近一层存在的上级目录，这时文件一定不存在，只能缓存为不存在的路径
+    bool WatchParent(const std::string &path, bool *parent_missing, int *wd)
+    {
+        std::string dir = path.substr(0, path.find_last_of('/'));
+        *parent_missing = false;
+        while (!Watch(dir))
+        {
+            size_t pos = dir.find_last_of('/');
+            if ((errno != ENOENT && errno != ENOTDIR) || pos == std::string::npos)
+                return false;
+            dir.resize(pos);
+            *parent_missing = true;
+        }
+        *wd = _dir_wd[dir];
+        return true;
+    }
+
+    void Evict()
+    {
+        while ((_bytes > _max_bytes || _entries.size() > FILE_CACHE_MAX_ENTRIES) && !_lru.empty())
+            Erase(_lru.back());
+    }
+
+    // 只有所在目录的变化才让加载的结果作废，其他目录频繁变化时不会反复加载（和压缩）同一个文件
+    void Insert(const std::string &path, const FileEntryPtr &entry, const uint64_t &generation, const int &wd, const uint64_t &wd_generation)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (generation != _generation || _wd_generation[wd] != wd_generation || _entries.count(path) || _missing.count(path)) // 加载期间目录有变化，或者其他线程已经放入
+            return;
+        if (!entry->_exists)
+        {
+            _missing_lru.push_front(path);
+            _missing.insert(std::make_pair(path, _missing_lru.begin()));
+            if (_missing.size() > FILE_CACHE_MAX_MISSING)
+            {
+                _missing.erase(_missing_lru.back());
+                _missing_lru.pop_back();
+            }
+            return;
+        }
+        _lru.push_front(path);
+        Node node = {entry, _lru.begin()};
+        _entries.insert(std::make_pair(path, node));
+        _bytes += entry->Cost();
+        Evict();
+    }
+
+    // 处理inotify事件：目录下有变化的文件名对应的项淘汰掉，目录本身被删除/移走或者事件队列溢出时清空缓存
+    void OnNotify()
+    {
+        alignas(struct inotify_event) char buf[4096];
+        std::unique_lock<std::mutex> lock(_mutex);
+        while (true)
+        {
+            ssize_t n = read(_inotify_fd, buf, sizeof(buf));
+            if (n <= 0)
+                break;
+            for (char *p = buf; p < buf + n;)
+            {
+                struct inotify_event *ev = (struct inotify_event *)p;
+                p += sizeof(struct inotify_event) + ev->len;
+                if (ev->mask & IN_Q_OVERFLOW)
+                {
+                    ++_generation;
+                    Clear();
+                    continue;
+                }
+                if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED))
+                {
+                    if (!(ev->mask & IN_IGNORED))
+                        inotify_rm_watch(_inotify_fd, ev->wd);
+                    Unwatch(ev->wd);
+                    ++_generation;
+                    Clear();
+                    continue;
+                }
+                auto it = _wd_dirs.find(ev->wd);
+                if (it == _wd_dirs.end() || ev->len == 0)
+                    continue;
+                ++_wd_generation[ev->wd];
+                size_t len = strlen(ev->name);
+                bool gz = len > 3 && strcmp(ev->name + len - 3, ".gz") == 0; // .gz文件变化，原文件的项也要淘汰
+                for (auto &dir : it->second)
+                {
+                    Erase(dir + "/" + ev->name);
+                    if (gz)
+                        Erase(dir + "/" + std::string(ev->name, len - 3));
+                    if ((ev->mask & IN_ISDIR) && !_missing.empty())
+                        EraseMissingUnder(dir + "/" + ev->name);
+                }
+            }
+        }
+    }
+
+public:
+    // 在loop中监控inotify事件；未调用或失败时不缓存，每次都从磁盘读取
+    void Attach(loop_ptr loop)
+    {
+        if (_inotify_fd != -1)
+            return;
+        _inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (-1 == _inotify_fd)
+        {
+            LOG(WARNING, "[inotify init failed, static file cache disabled][%d:%s]", errno, strerror(errno));
+            return;
+        }
+        _chan.reset(new channel(_inotify_fd, loop));
+        _chan->set_trace_tag("inotify");
+        _chan->set_read_event_callbcak(std::bind(&FileCache::OnNotify, this));
+        _chan->monitor_read_event();
+    }
+
+    // 文本类文件达到min_size时在加载时按level压缩一份gzip版本缓存起来，0表示不压缩，设置后清空缓存
+    void SetGzip(const size_t &min_size, const int &level)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _gzip_min = min_size;
+        _gzip_level = level;
+        ++_generation;
+        Clear();
+    }
+
+    // 设置缓存总大小和单个文件大小上限，max_bytes为0表示不缓存
+    void SetLimit(const size_t &max_bytes, const size_t &max_file)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _max_bytes = max_bytes;
+        _max_file = max_file;
+        Evict();
+    }
+
+    // 查找文件，不是普通文件返回空；未命中时从磁盘加载，能缓存的放入缓存
+    FileEntryPtr Lookup(const std::string &path)
+    {
+        uint64_t generation = 0, wd_generation = 0;
+        bool cacheable = false, parent_missing = false;
+        int wd = -1, gzip_level = 0;
+        size_t gzip_min = 0, max_file = 0;
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            auto it = _entries.find(path);
+            if (it != _entries.end())
+            {
+                _lru.splice(_lru.begin(), _lru, it->second._pos);
+                return it->second._entry;
+            }
+            auto mit = _missing.find(path);
+            if (mit != _missing.end())
+            {
+                _missing_lru.splice(_missing_lru.begin(), _missing_lru, mit->second);
+                return FileEntryPtr();
+            }
+            // 先监控所在目录再读取文件，读取之后的变化一定能收到通知
+            generation = _generation;
+            gzip_min = _gzip_min;
+            gzip_level = _gzip_level;
+            max_file = _max_file;
+            cacheable = _inotify_fd != -1 && _max_bytes > 0 && WatchParent(path, &parent_missing, &wd);
+            if (cacheable)
+                wd_generation = _wd_generation[wd];
+        }
+
+        // 不放入缓存的文件每次都要加载，不在加载时压缩；大文件只缓存元信息；所在目录不存在时不用打开
+        std::shared_ptr<FileEntry> entry = parent_missing ? std::make_shared<FileEntry>() : Load(path, cacheable ? gzip_min : 0, gzip_level, max_file);
+        if (cacheable)
+            Insert(path, entry, generation, wd, wd_generation);
+        return entry->_exists ? entry : FileEntryPtr();
+    }
+
+    // 当前缓存的文件项数（不含不存在的路径）和总大小
+    size_t Size()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        return _entries.size();
+    }
+    size_t Bytes()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        return _bytes;
+    }
+};
+
+// 常用头部字段的编号：添加字段时识别出来，之后按编号O(1)查找
+enum HttpHeaderId
+{
+    HDR_CONTENT_LENGTH,
+    HDR_CONTENT_TYPE,
+    HDR_CONTENT_ENCODING,
+    HDR_TRANSFER_ENCODING,
+    HDR_CONNECTION,
+    HDR_KEEP_ALIVE,
+    HDR_HOST,
+    HDR_UPGRADE,
+    HDR_ACCEPT_ENCODING,
+    HDR_RANGE,
+    HDR_IF_RANGE,
+    HDR_IF_NONE_MATCH,
+    HDR_IF_MODIFIED_SINCE,
+    HDR_COOKIE,
+    HDR_DATE,
+    HDR_SERVER,
+    HDR_COUNT,
+    HDR_OTHER = HDR_COUNT
+};
+
+// 头部字段容器：字段名和值依次拷贝到一块连续内存中（各自以'\0'结尾，可以直接当C字符串用），字段只记录偏移
+// 名字按原样保存，查找不区分大小写，常用字段按编号直接定位；重复的字段都保留，查找返回第一个
+// Clear保留内存，同一个连接上的后续请求不再分配；返回的指针在下一次添加字段之前有效
+class HttpHeaders
+{
+private:
+    struct Field
+    {
+        uint32_t _name; // 字段名在_data中的偏移
+        uint32_t _name_len;
+        uint32_t _value;
+        uint32_t _value_len;
+        int _id;
+    };
+    std::string _data;
+    std::vector<Field> _fields;
+    int16_t _index[HDR_COUNT]; // 常用字段第一次出现的下标，-1表示没有
+
+    void Reindex()
+    {
+        memset(_index, -1, sizeof(_index));
+        for (size_t i = _fields.size(); i-- > 0;)
+        {
+            if (_fields[i]._id != HDR_OTHER)
+                _index[_fields[i]._id] = i;
+        }
+    }
+
+public:
+    HttpHeaders() { memset(_index, -1, sizeof(_index)); }
+
+private:
+
+    struct KnownName
+    {
+        const char *_name;
+        size_t _len;
+    };
+    static const KnownName *KnownNames()
+    {
+#define HDR_NAME(s) {s, sizeof(s) - 1}
+        static const KnownName names[HDR_COUNT] = {
+            HDR_NAME("Content-Length"), HDR_NAME("Content-Type"), HDR_NAME("Content-Encoding"), HDR_NAME("Transfer-Encoding"),
+            HDR_NAME("Connection"), HDR_NAME("Keep-Alive"), HDR_NAME("Host"), HDR_NAME("Upgrade"), HDR_NAME("Accept-Encoding"),
+            HDR_NAME("Range"), HDR_NAME("If-Range"), HDR_NAME("If-None-Match"), HDR_NAME("If-Modified-Since"),
+            HDR_NAME("Cookie"), HDR_NAME("Date"), HDR_NAME("Server")};
+#undef HDR_NAME
+        return names;
+    }
+
+public:
+    // 常用字段的标准写法
+    static const char *IdName(const HttpHeaderId &id) { return KnownNames()[id]._name; }
+    // 字段名对应的编号，不是常用字段返回HDR_OTHER
+    static int Id(const char *name, const size_t &len)
+    {
+        const KnownName *names = KnownNames();
+        for (int i = 0; i < HDR_COUNT; ++i)
+        {
+            if (names[i]._len == len && strncasecmp(names[i]._name, name, len) == 0)
+                return i;
+        }
+        return HDR_OTHER;
+    }
+
+    void Clear()
+    {
+        _data.clear();
+        _fields.clear();
+        memset(_index, -1, sizeof(_index));
+    }
+    size_t Size() const { return _fields.size(); }
+    bool Empty() const { return _fields.empty(); }
+
+    // 追加一个字段（不检查是否已经存在）
+    void Add(const char *name, const size_t &nlen, const char *value, const size_t &vlen)
+    {
+        Field field;
+        field._id = Id(name, nlen);
+        field._name = _data.size();
+        field._name_len = nlen;
+        _data.append(name, nlen);
+        _data.push_back('\0');
+        field._value = _data.size();
+        field._value_len = vlen;
+        _data.append(value, vlen);
+        _data.push_back('\0');
+        if (field._id != HDR_OTHER && _index[field._id] == -1)
+            _index[field._id] = _fields.size();
+        _fields.push_back(field);
+    }
+    void Add(const std::string &name, const std::string &value) { Add(name.data(), name.size(), value.data(), value.size()); }
+    // 没有同名字段时才添加
+    void Insert(const std::string &name, const std::string &value)
+    {
+        if (Find(name.data(), name.size()) == -1)
+            Add(name, value);
+    }
+    // 替换掉所有同名字段
+    void Set(const HttpHeaderId &id, const std::string &value)
+    {
+        Erase(id);
+        const KnownName &name = KnownNames()[id];
+        Add(name._name, name._len, value.data(), value.size());
+    }
+    void Set(const std::string &name, const std::string &value)
+    {
+        Erase(name);
+        Add(name, value);
+    }
+    // 删除所有同名字段，名字和值留在_data中，Clear时一起回收
+    void Erase(const HttpHeaderId &id)
+    {
+        if (_index[id] == -1)
+            return;
+        _fields.erase(std::remove_if(_fields.begin(), _fields.end(), [&id](const Field &f)
+                                     { return f._id == id; }),
+                      _fields.end());
+        Reindex();
+    }
+    void Erase(const std::string &name)
+    {
+        int id = Id(name.data(), name.size());
+        if (id != HDR_OTHER)
+            return Erase((HttpHeaderId)id);
+        const char *data = _data.data();
+        _fields.erase(std::remove_if(_fields.begin(), _fields.end(), [&name, data](const Field &f)
+                                     { return f._name_len == name.size() && strncasecmp(data + f._name, name.data(), name.size()) == 0; }),
+                      _fields.end());
+        Reindex();
+    }
+
+    // 查找字段的下标，没有返回-1
+    int Find(const HttpHeaderId &id) const { return _index[id]; }
+    int Find(const char *name, const size_t &len) const
+    {
+        int id = Id(name, len);
+        if (id != HDR_OTHER)
+            return _index[id];
+        for (size_t i = 0; i < _fields.size(); ++i)
+        {
+            if (_fields[i]._name_len == len && strncasecmp(_data.data() + _fields[i]._name, name, len) == 0)
+                return i;
+        }
+        return -1;
+    }
+    int Find(const std::string &name) const { return Find(name.data(), name.size()); }
+    bool Has(const HttpHeaderId &id) const { return _index[id] != -1; }
+    bool Has(const std::string &name) const { return Find(name) != -1; }
+
+    // 字段值，没有返回nullptr；len非空时返回长度
+    const char *Get(const HttpHeaderId &id, size_t *len = nullptr) const { return Value(_index[id], len); }
+    const char *Get(const std::string &name, size_t *len = nullptr) const { return Value(Find(name), len); }
+
+    // 按下标访问，i为-1时返回nullptr
+    const char *Name(const int &i, size_t *len = nullptr) const
+    {
+        if (i < 0)
+            return nullptr;
+        if (len != nullptr)
+            *len = _fields[i]._name_len;
+        return _data.data() + _fields[i]._name;
+    }
+    const char *Value(const int &i, size_t *len = nullptr) const
+    {
+        if (i < 0)
+            return nullptr;
+        if (len != nullptr)
+            *len = _fields[i]._value_len;
+        return _data.data() + _fields[i]._value;
+    }
+    size_t NameLen(const int &i) const { return _fields[i]._name_len; }
+    size_t ValueLen(const int &i) const { return _fields[i]._value_len; }
+    int IdAt(const int &i) const { return _fields[i]._id; }
+};
+
+// 查询字符串容器：和HttpHeaders一样，解码后的键和值依次拷贝到一块连续内存中（各自以'\0'结尾）
+// 键区分大小写，重复的键都保留，查找返回第一个；Clear保留内存
+class HttpParams
+{
+private:
+    struct Item
+    {
+        uint32_t _key; // 键在_data中的偏移
+        uint32_t _key_len;
+        uint32_t _value;
+        uint32_t _value_len;
+    };
+    std::string _data;
+    std::vector<Item> _items;
+
+    // 追加一段并以'\0'结尾，返回解码后的长度
+    size_t Append(const char *s, const size_t &len, const bool &decode)
+    {
+        size_t begin = _data.size();
+        if (decode)
+            Util::UrlDecode(s, len, true, &_data);
+        else
+            _data.append(s, len);
+        size_t n = _data.size() - begin;
+        _data.push_back('\0');
+        return n;
+    }
+
+public:
+    void Clear()
+    {
+        _data.clear();
+        _items.clear();
+    }
+    size_t Size() const { return _items.size(); }
+    bool Empty() const { return _items.empty(); }
+
+    // 追加一个键值，decode为true时按查询字符串的规则URL解码（'+'转空格）
+    void Add(const char *key, const size_t &klen, const char *value, const size_t &vlen, const bool &decode = false)
+    {
+        Item item;
+        item._key = _data.size();
+        item._key_len = Append(key, klen, decode);
+        item._value = _data.size();
+        item._value_len = Append(value, vlen, decode);
+        _items.push_back(item);
+    }
+    // 查找键的下标，没有返回-1
+    int Find(const char *key, const size_t &len) const
+    {
+        for (size_t i = 0; i < _items.size(); ++i)
+        {
+            if (_items[i]._key_len == len && memcmp(_data.data() + _items[i]._key, key, len) == 0)
+                return i;
+        }
+        return -1;
+    }
+    const char *Key(const int &i, size_t *len = nullptr) const
+    {
+        if (len != nullptr)
+            *len = _items[i]._key_len;
+        return _data.data() + _items[i]._key;
+    }
+    // i为-1时返回nullptr
+    const char *Value(const int &i, size_t *len = nullptr) const
+    {
+        if (i < 0)
+            return nullptr;
+        if (len != nullptr)
+            *len = _items[i]._value_len;
+        return _data.data() + _items[i]._value;
+    }
+};
+
+#define HTTP_ARENA_BLOCK 4096       // arena第一次向系统申请的大小
+#define HTTP_ARENA_KEEP (64 << 10)  // Reset之后最多保留的内存，请求和响应的正文超过这个大小时也不保留容量
+// 一个请求期间的临时内存（bump分配）：在当前块中顺序切分，不够时再申请一块，单个对象不释放，Reset时一起回收
+// Reset只把位置拨回开头，内存留给同一个连接上的下一个请求；用到了多块时合并成一块（不超过HTTP_ARENA_KEEP），
+// 之后同样大小的请求只用一块。稳定之后每个请求不再向系统申请内存
+// 分配的对象不调用析构函数，只放字符串、数组这类平凡的数据；拷贝得到的是空的arena（内容不随之拷贝）
+class HttpArena
+{
+private:
+    struct Block
+    {
+        Block *_next;
+        size_t _size; // 块中可用的大小（不含Block本身）
+        char *Data() { return reinterpret_cast<char *>(this + 1); }
+    };
+    Block *_blocks; // 最新的块在前，只有第一块在切分
+    size_t _used;   // 第一块中已经切分出去的大小
+    size_t _hint;   // 下一次申请的大小
+
+    void Free()
+    {
+        while (_blocks != nullptr)
+        {
+            Block *next = _blocks->_next;
+            free(_blocks);
+            _blocks = next;
+        }
+    }
+    void Grow(const size_t &need)
+    {
+        size_t size = std::max(need, _hint);
+        Block *block = (Block *)malloc(sizeof(Block) + size);
+        if (block == nullptr)
+            throw std::bad_alloc();
+        ALLOC_NOTE(ALLOC_HTTP, sizeof(Block) + size);
+        block->_next = _blocks;
+        block->_size = size;
+        _blocks = block;
+        _used = 0;
+        _hint = std::min(size * 2, (size_t)HTTP_ARENA_KEEP);
+    }
+
+public:
+    HttpArena() : _blocks(nullptr), _used(0), _hint(HTTP_ARENA_BLOCK) {}
+    HttpArena(const HttpArena &) : HttpArena() {}
+    HttpArena(HttpArena &&other) : _blocks(other._blocks), _used(other._used), _hint(other._hint)
+    {
+        other._blocks = nullptr;
+        other._used = 0;
+    }
+    HttpArena &operator=(const HttpArena &) { return *this; } // 保留自己的内存
+    ~HttpArena() { Free(); }
+
+    // 分配size字节，按align（2的幂）对齐；第一次分配时才向系统申请
+    void *Alloc(const size_t &size, const size_t &align = alignof(std::max_align_t))
+    {
+        if (_blocks != nullptr)
+        {
+            uintptr_t base = (uintptr_t)_blocks->Data();
+            size_t pos = ((base + _used + align - 1) & ~(uintptr_t)(align - 1)) - base;
+            if (pos + size <= _blocks->_size)
+            {
+                _used = pos + size;
+                return _blocks->Data() + pos;
+            }
+        }
+        Grow(size + align);
+        return Alloc(size, align);
+    }
+    // n个T的数组（T不需要析构），内容未初始化
+    template <typename T>
+    T *Alloc(const size_t &n)
+    {
+        static_assert(std::is_trivially_destructible<T>::value, "HttpArena does not run destructors");
+        return (T *)Alloc(n * sizeof(T), alignof(T));
+    }
+    // 拷贝一段数据，末尾补'\0'
+    char *Copy(const char *data, const size_t &len)
+    {
+        char *p = (char *)Alloc(len + 1, 1);
+        memcpy(p, data, len);
+        p[len] = '\0';
+        return p;
+    }
+    char *Copy(const std::string &s) { return Copy(s.data(), s.size()); }
+
+    // 回收所有分配：只有一块时原样保留，多块时换成一块总大小的（超过上限则全部还给系统）
+    void Reset()
+    {
+        _used = 0;
+        if (_blocks == nullptr || _blocks->_next == nullptr)
+            return;
+        size_t total = 0;
+        for (Block *block = _blocks; block != nullptr; block = block->_next)
+            total += block->_size;
+        Free();
+        if (total <= HTTP_ARENA_KEEP)
+        {
+            _hint = total;
+            Grow(total);
+        }
+        else
+            _hint = HTTP_ARENA_BLOCK;
+    }
+    // 已经向系统申请的大小
+    size_t Capacity() const
+    {
+        size_t total = 0;
+        for (Block *block = _blocks; block != nullptr; block = block->_next)
+            total += block->_size;
+        return total;
+    }
 };
 
 class HttpRequest
@@ -367,84 +1410,263 @@ public:
     std::string _path;                                     // 资源路径
     std::string _version;                                  // 协议版本
     std::string _body;                                     // 请求正文
-    std::smatch _matches;                                  // 资源路径的正则提取数据
-    std::unordered_map<std::string, std::string> _headers; // 头部字段
-    std::unordered_map<std::string, std::string> _params;  // 查询字符串
+    std::smatch _matches;                                  // 资源路径的正则提取数据（正则路由）
+    RouteParams _route_params;                             // 路径参数（:name、*name）
+    HttpHeaders _headers;                                  // 头部字段
+    HttpParams _params;                                    // 查询字符串
+    mutable HttpArena _arena;                              // 这个请求期间的临时内存，处理函数也可以从中分配
 public:
     HttpRequest() : _version("HTTP/1.1") {}
+    // 请求处理完毕后一起重置，各个容器保留内存给下一个请求使用
     void Reset()
     {
         _method.clear();
         _path.clear();
         _version = "HTTP/1.1";
         _body.clear();
-        std::smatch match;
-        _matches.swap(match);
-        _headers.clear();
-        _params.clear();
+        if (_body.capacity() > HTTP_ARENA_KEEP)
+            std::string().swap(_body); // 偶尔的大正文不一直占着
+        if (!_matches.empty())
+        {
+            std::smatch match;
+            _matches.swap(match);
+        }
+        _route_params.clear();
+        _headers.Clear();
+        _params.Clear();
+        _arena.Reset();
     }
+    // 请求期间的临时内存：在处理函数中格式化正文等，请求的响应发出之后一起回收（不能在之后的异步任务中使用）
+    HttpArena &Arena() const { return _arena; }
 
-    // 插入头部字段
-    void SetHeader(const std::string &key, const std::string &val) { _headers.insert(std::make_pair(key, val)); }
-    // 判断是否存在指定头部字段
-    bool HasHeader(const std::string &key) const
-    {
-        auto it = _headers.find(key);
-        if (it == _headers.end())
-            return false;
-
-        return true;
-    }
+    // 插入头部字段，已经有同名字段时不覆盖
+    void SetHeader(const std::string &key, const std::string &val) { _headers.Insert(key, val); }
+    // 判断是否存在指定头部字段（不区分大小写）
+    bool HasHeader(const std::string &key) const { return _headers.Has(key); }
     // 获取指定头部字段的值
     std::string GetHeader(const std::string &key) const
     {
-        auto it = _headers.find(key);
-        if (it == _headers.end())
-            return "";
-
-        return it->second;
+        size_t len = 0;
+        const char *val = _headers.Get(key, &len);
+        return val == nullptr ? std::string() : std::string(val, len);
     }
-    // 插入查询字符串
-    void SetParam(const std::string &key, const std::string &val) { _params.insert(std::make_pair(key, val)); }
-    // 判断是否有某个指定的查询字符串
-    bool HasParam(const std::string &key) const
+    // 插入查询字符串，已经有同名的键时不覆盖
+    void SetParam(const std::string &key, const std::string &val)
     {
-        auto it = _params.find(key);
-        if (it == _params.end())
-            return false;
-
-        return true;
+        if (_params.Find(key.data(), key.size()) == -1)
+            _params.Add(key.data(), key.size(), val.data(), val.size());
     }
+    // 判断是否有某个指定的查询字符串
+    bool HasParam(const std::string &key) const { return _params.Find(key.data(), key.size()) != -1; }
     // 获取指定的查询字符串
     std::string GetParam(const std::string &key) const
     {
-        auto it = _params.find(key);
-        if (it == _params.end())
-            return "";
-
-        return it->second;
+        size_t len = 0;
+        const char *val = FindParam(key.c_str(), &len);
+        return val == nullptr ? std::string() : std::string(val, len);
+    }
+    // 不拷贝的版本：没有返回nullptr，指针在请求重置之前有效
+    const char *FindParam(const char *key, size_t *len = nullptr) const { return _params.Value(_params.Find(key, strlen(key)), len); }
+    // 判断是否有指定的路径参数
+    bool HasPathParam(const std::string &key) const
+    {
+        for (auto &param : _route_params)
+        {
+            if (*param._name == key)
+                return true;
+        }
+        return false;
+    }
+    // 获取指定的路径参数，/users/:id 匹配 /users/42 时 GetPathParam("id") 为 "42"
+    std::string GetPathParam(const std::string &key) const
+    {
+        for (auto &param : _route_params)
+        {
+            if (*param._name == key)
+                return _path.substr(param._pos, param._len);
+        }
+        return "";
     }
-    // 获取正文长度
+    // 不拷贝的版本：值拷贝到请求的arena中（以'\0'结尾），没有返回nullptr
+    const char *FindPathParam(const char *key, size_t *len = nullptr) const
+    {
+        for (auto &param : _route_params)
+        {
+            if (*param._name == key)
+            {
+                if (len != nullptr)
+                    *len = param._len;
+                return _arena.Copy(_path.data() + param._pos, param._len);
+            }
+        }
+        return nullptr;
+    }
+    // 获取正文长度（接收时已经校验过格式）
     size_t ContentLength() const
     {
         // Content-Length: 1234\r\n
-        bool ret = HasHeader("Content-Length");
-        if (ret == false)
-            return 0;
+        const char *clen = _headers.Get(HDR_CONTENT_LENGTH);
+        return clen == nullptr ? 0 : strtoull(clen, nullptr, 10);
+    }
+    // 判断客户端是否希望保持连接：HTTP/1.1没有Connection: close就保持，HTTP/1.0要带Connection: keep-alive
+    bool IsKeepAlive() const { return Util::IsPersistent(_version == "HTTP/1.0", _headers.Get(HDR_CONNECTION)); }
+};
+
+// 流式响应的写入端：头部已经发出，正文由处理函数（或者它交给的其他线程）产生一段发送一段，可在任意线程调用
+// HTTP/1.1使用chunked编码，HTTP/1.0不带长度、发送完毕后关闭连接；HEAD请求丢弃写入的正文
+// 写入的数据一律投递到连接所属线程的任务队列，加锁投递保证多个线程的Write和End按调用顺序到达；
+// Write不阻塞也不限制积压，生产者用Buffered检查对端是否跟得上
+// 压缩时每次Write之后Z_SYNC_FLUSH，已经写入的内容对端立即可以解出（server-sent events等逐条消费的场景）
+#define HTTP_STREAM_GZIP_WBITS 12 // 流式压缩的窗口（4KB）和内存级别取小一些：每个流约48KB，而不是默认的约256KB
+#define HTTP_STREAM_GZIP_MEMLEVEL 6
+class HttpStream
+{
+private:
+    conn_ptr _conn;
+    bool _chunked;
+    bool _discard;                 // HEAD请求，只发头部
+    std::unique_ptr<z_stream> _zs; // 边写边压缩，为空表示不压缩
+    std::mutex _mutex;             // 检查_ended和投递是一个整体，结束块不会排在正文之前
+    bool _ended;                   // 已经调用过End
+    std::shared_ptr<std::atomic<size_t>> _queued; // 已经投递、还没有进入发送缓冲区的字节数，任务可能晚于HttpStream执行
+    std::function<void()> _on_end; // 结束后在连接所属线程中调用，恢复处理后续请求或者关闭连接
 
-        std::string clen = GetHeader("Content-Length");
-        return std::stol(clen);
+    // 在连接所属线程中把数据写入发送缓冲区
+    static void Deliver(const conn_ptr &conn, const std::string &data, const std::shared_ptr<std::atomic<size_t>> &queued)
+    {
+        queued->fetch_sub(data.size(), std::memory_order_relaxed);
+        conn->outbuffer()->write(data.data(), data.size());
+        conn->flush_outbuffer();
     }
-    // 判断是否是长链接
-    bool IsKeepAlive() const
+    // 压缩一段数据追加到out，调用时持有锁
+    bool Deflate(const char *data, const size_t &len, const int &flush, std::string *out)
     {
-        // 没有Connection字段，或者有Connection但是值是close，则都是短链接，否则就是长连接
-        if (HasHeader("Connection") == true && GetHeader("Connection") == "keep-alive")
+        char buf[16384];
+        _zs->next_in = (Bytef *)data;
+        _zs->avail_in = len;
+        do
+        {
+            _zs->next_out = (Bytef *)buf;
+            _zs->avail_out = sizeof(buf);
+            if (deflate(_zs.get(), flush) == Z_STREAM_ERROR)
+                return false;
+            out->append(buf, sizeof(buf) - _zs->avail_out);
+        } while (_zs->avail_out == 0);
+        return true;
+    }
+    // chunked编码时加上块头和块尾，调用时持有锁
+    void PostChunk(std::string &&data)
+    {
+        if (data.empty())
+            return;
+        if (_chunked)
+        {
+            char head[24];
+            int n = snprintf(head, sizeof(head), "%zx\r\n", data.size());
+            data.insert(0, head, n);
+            data.append("\r\n", 2);
+        }
+        Post(std::move(data));
+    }
+    // 调用时持有锁；总是入队而不是在所属线程中直接执行，否则会越过其他线程先投递的数据
+    void Post(std::string &&data)
+    {
+        _queued->fetch_add(data.size(), std::memory_order_relaxed);
+        _conn->get_loop()->push_in_loop(std::bind(&HttpStream::Deliver, _conn, std::move(data), _queued));
+    }
+
+public:
+    // gzip_level不为0时正文用gzip压缩（Content-Encoding头部已经发出），在连接所属线程中创建
+    HttpStream(const conn_ptr &conn, const bool &chunked, const bool &discard, const std::function<void()> &on_end, const int &gzip_level = 0)
+        : _conn(conn), _chunked(chunked), _discard(discard), _ended(false), _queued(std::make_shared<std::atomic<size_t>>(0)), _on_end(on_end)
+    {
+        if (gzip_level == 0 || discard)
+            return;
+        _zs.reset(new z_stream);
+        memset(_zs.get(), 0, sizeof(z_stream));
+        if (deflateInit2(_zs.get(), gzip_level, Z_DEFLATED, HTTP_STREAM_GZIP_WBITS + 16, HTTP_STREAM_GZIP_MEMLEVEL, Z_DEFAULT_STRATEGY) != Z_OK)
+        {
+            // 头部已经声明了gzip，发不出合法的正文，只能关闭连接
+            LOG(WARNING, "[stream deflate init failed, close connection]");
+            _zs.reset();
+            _ended = true;
+            _conn->shutdown();
+        }
+    }
+    ~HttpStream() // 处理函数忘记调用End时，最后一个引用释放时结束
+    {
+        End();
+        if (_zs)
+            deflateEnd(_zs.get());
+    }
+
+    HttpStream(const HttpStream &) = delete;
+    HttpStream &operator=(const HttpStream &) = delete;
+
+    // 发送一段正文，连接已经断开或者已经结束时返回false，空数据不发送（chunked编码中长度0表示结束）
+    bool Write(const char *data, const size_t &len)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (_ended || !_conn->is_connected())
+            return false;
+        if (len == 0 || _discard)
+            return true;
+        if (_zs)
+        {
+            std::string out;
+            if (!Deflate(data, len, Z_SYNC_FLUSH, &out))
+                return false;
+            PostChunk(std::move(out));
             return true;
+        }
+        if (!_chunked)
+        {
+            Post(std::string(data, len));
+            return true;
+        }
+        char head[24];
+        int n = snprintf(head, sizeof(head), "%zx\r\n", len);
+        std::string chunk;
+        chunk.reserve(n + len + 2);
+        chunk.append(head, n);
+        chunk.append(data, len);
+        chunk.append("\r\n", 2);
+        Post(std::move(chunk));
+        return true;
+    }
+    bool Write(const std::string &data) { return Write(data.data(), data.size()); }
 
-        return false;
+    // 已经写入、还没有发给对端的字节数（投递中的加上发送缓冲区中的），可在任意线程调用
+    // 生产者据此反压：超过自己的上限时暂停生产或者丢弃，等回落之后再写
+    size_t Buffered() const { return _queued->load(std::memory_order_relaxed) + _conn->outbuffer_size(); }
+
+    // 结束响应，chunked编码时可以带trailer字段，只有第一次调用有效
+    void End(const std::unordered_map<std::string, std::string> &trailers = std::unordered_map<std::string, std::string>())
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (_ended)
+            return;
+        _ended = true;
+        if (_zs) // 压缩流的结尾（gzip尾部的校验和与长度）
+        {
+            std::string out;
+            Deflate(nullptr, 0, Z_FINISH, &out);
+            PostChunk(std::move(out));
+        }
+        if (_chunked && !_discard)
+        {
+            std::string last = "0\r\n";
+            for (auto &trailer : trailers)
+                last += trailer.first + ": " + trailer.second + "\r\n";
+            last += "\r\n";
+            Post(std::move(last));
+        }
+        // 排在已经发出的数据之后执行，也不会在处理函数的调用栈里重入消息处理
+        _conn->get_loop()->push_in_loop(_on_end);
     }
 };
+using HttpStreamPtr = std::shared_ptr<HttpStream>;
+using StreamHandler = std::function<void(const HttpStreamPtr &)>;
 
 class HttpResponse
 {
@@ -453,42 +1675,59 @@ public:
     bool _redirect_flag;
     std::string _body;
     std::string _redirect_url;
-    std::unordered_map<std::string, std::string> _headers;
+    HttpHeaders _headers;
+    FileEntryPtr _file; // 静态资源响应，正文和Content-Type/ETag/Last-Modified头部取自缓存项，不拷贝到_body
+    bool _file_gzip;    // 发送缓存项的gzip版本
+    file_ptr _file_fd;  // 内容不在内存中的大文件，打开的文件描述符，正文用sendfile发送
+    std::vector<std::pair<uint64_t, uint64_t>> _ranges; // 范围请求（206）要发送的区间，多于一个时用multipart/byteranges
+    std::string _boundary;                              // multipart/byteranges的分隔符
+    StreamHandler _stream; // 流式响应：发出头部后调用，正文通过HttpStream逐段发送
+    int _stream_gzip;      // 流式响应边写边压缩的级别，0表示不压缩
 
 public:
-    HttpResponse(const int &statu = 200) : _redirect_flag(false), _statu(statu) {}
+    HttpResponse(const int &statu = 200) : _redirect_flag(false), _statu(statu), _file_gzip(false), _stream_gzip(0) {}
 
     void Reset()
     {
         _statu = 200;
         _redirect_flag = false;
         _body.clear();
+        if (_body.capacity() > HTTP_ARENA_KEEP)
+            std::string().swap(_body);
         _redirect_url.clear();
-        _headers.clear();
+        _headers.Clear();
+        _file.reset();
+        _file_gzip = false;
+        _file_fd.reset();
+        _ranges.clear();
+        _boundary.clear();
+        _stream = nullptr;
+        _stream_gzip = 0;
     }
-    // 插入头部字段
-    void SetHeader(const std::string &key, const std::string &val) { _headers.insert(std::make_pair(key, val)); }
-    // 判断是否存在指定头部字段
-    bool HasHeader(const std::string &key)
+    // 插入头部字段，已经有同名字段时不覆盖
+    void SetHeader(const std::string &key, const std::string &val) { _headers.Insert(key, val); }
+    // 判断是否存在指定头部字段（不区分大小写）
+    bool HasHeader(const std::string &key) const { return _headers.Has(key); }
+    // 获取指定头部字段的值
+    std::string GetHeader(const std::string &key) const
     {
-        auto it = _headers.find(key);
-        if (it == _headers.end())
-            return false;
-
-        return true;
+        size_t len = 0;
+        const char *val = _headers.Get(key, &len);
+        return val == nullptr ? std::string() : std::string(val, len);
     }
-    // 获取指定头部字段的值
-    std::string GetHeader(const std::string &key)
+    void SetContent(const std::string &body, const std::string &type = "text/html") { SetContent(body.data(), body.size(), type.c_str()); }
+    // 正文拷贝到_body已有的内存中（比如在请求的arena中格式化好的数据），不产生临时字符串
+    void SetContent(const char *body, const size_t &len, const char *type = "text/html")
     {
-        auto it = _headers.find(key);
-        if (it == _headers.end())
-            return "";
-
-        return it->second;
+        _body.assign(body, len);
+        if (!_headers.Has(HDR_CONTENT_TYPE))
+            _headers.Add(HttpHeaders::IdName(HDR_CONTENT_TYPE), 12, type, strlen(type));
     }
-    void SetContent(const std::string &body, const std::string &type = "text/html")
+    // 流式响应：处理函数返回后先发出头部，再以HttpStream调用handler，正文长度事先不需要知道
+    // handler可以同步写完，也可以保存HttpStream在其他线程中继续写入，最后调用End（或者释放所有引用）
+    void SetStream(const StreamHandler &handler, const std::string &type = "text/plain")
     {
-        _body = body;
+        _stream = handler;
         SetHeader("Content-Type", type);
     }
     void SetRedirect(const std::string &url, int statu = 302)
@@ -498,14 +1737,314 @@ public:
         _redirect_url = url;
     }
 
-    // 判断是否是短链接 ?
-    bool IsKeepAlive()
-    {
-        // 没有Connection字段，或者有Connection但是值是close，则都是短链接，否则就是长连接
-        if (HasHeader("Connection") == true && GetHeader("Connection") == "keep-alive")
-            return true;
+    // 判断是否是短链接 ?
+    bool IsKeepAlive()
+    {
+        // 没有Connection字段，或者有Connection但是值是close，则都是短链接，否则就是长连接
+        const char *conn = _headers.Get(HDR_CONNECTION);
+        return conn != nullptr && strcasecmp(conn, "keep-alive") == 0;
+    }
+};
+
+// 服务器对连接保持的决定：_close为true时这个响应之后关闭连接（达到请求数上限等）
+// 保持连接时_timeout不为0则补充 Keep-Alive: timeout=_timeout, max=_max 头部
+struct HttpKeepAlive
+{
+    bool _close;
+    uint32_t _timeout;
+    uint32_t _max;
+
+    HttpKeepAlive(const bool &close = false, const uint32_t &timeout = 0, const uint32_t &max = 0) : _close(close), _timeout(timeout), _max(max) {}
+};
+
+// 响应序列化：不经过stringstream和临时字符串，计算好长度后直接写入发送缓冲区
+// 状态行按协议版本和状态码预先生成，Date头部每个线程（即每个eventloop）每秒只格式化一次，固定的头部直接拷贝静态字节序列
+class HttpWriter
+{
+#define STATUS_CODE_MIN 100
+#define STATUS_CODE_MAX 599
+
+private:
+    std::vector<std::string> _lines[2]; // [0] HTTP/1.0  [1] HTTP/1.1，下标为状态码-STATUS_CODE_MIN
+
+    HttpWriter()
+    {
+        const char *versions[2] = {"HTTP/1.0", "HTTP/1.1"};
+        for (int v = 0; v < 2; ++v)
+            for (int code = STATUS_CODE_MIN; code <= STATUS_CODE_MAX; ++code)
+                _lines[v].push_back(StatusLine(versions[v], code));
+    }
+
+    static std::string StatusLine(const std::string &version, const int &code) { return version + " " + std::to_string(code) + " " + Util::StatusDesc(code) + "\r\n"; }
+
+    static const HttpWriter &Instance()
+    {
+        static HttpWriter s_writer;
+        return s_writer;
+    }
+
+    // 每个线程缓存当前这一秒的Date头部
+    struct DateLine
+    {
+        time_t _sec;
+        size_t _len;
+        char _line[64];
+    };
+
+    static const DateLine &Date()
+    {
+        static thread_local DateLine t_date = {0, 0, {0}};
+        time_t now = time(nullptr);
+        if (now != t_date._sec)
+        {
+            struct tm tm;
+            gmtime_r(&now, &tm);
+            t_date._len = strftime(t_date._line, sizeof(t_date._line), "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", &tm);
+            t_date._sec = now;
+        }
+        return t_date;
+    }
+
+    template <size_t N>
+    static void Put(char *&p, const char (&lit)[N])
+    {
+        memcpy(p, lit, N - 1);
+        p += N - 1;
+    }
+    static void Put(char *&p, const std::string &s)
+    {
+        memcpy(p, s.data(), s.size());
+        p += s.size();
+    }
+    static void Put(char *&p, const char *s, const size_t &len)
+    {
+        memcpy(p, s, len);
+        p += len;
+    }
+    static void PutNumber(char *&p, size_t n)
+    {
+        char tmp[24];
+        char *end = tmp + sizeof(tmp), *q = end;
+        do
+        {
+            *--q = '0' + n % 10;
+            n /= 10;
+        } while (n > 0);
+        memcpy(p, q, end - q);
+        p += end - q;
+    }
+
+public:
+    // 发送文件的一个窗口（文件描述符、偏移、长度），排在已经写入out的数据之后
+    using FileSender = std::function<void(const file_ptr &, const uint64_t &, const uint64_t &)>;
+
+private:
+    // 写入静态资源的一个窗口：内容在内存中直接拷贝；大文件有sender时交给sendfile，否则读到out中
+    static void PutWindow(const HttpResponse &rsp, const uint64_t &offset, const uint64_t &len, buffer_t *out, const FileSender &sender)
+    {
+        if (!rsp._file->_on_disk)
+            return out->write(rsp._file->_content.data() + offset, len);
+        if (sender)
+            return sender(rsp._file_fd, offset, len);
+        out->expand(len);
+        uint64_t total = 0;
+        while (total < len)
+        {
+            ssize_t n = pread(rsp._file_fd->fd(), out->write_addr() + total, len - total, offset + total);
+            if (n == -1 && errno == EINTR)
+                continue;
+            if (n <= 0) // 文件被截断，剩下的补0，保证和Content-Length一致
+            {
+                memset(out->write_addr() + total, 0, len - total);
+                break;
+            }
+            total += n;
+        }
+        out->move_write_pos_back(len);
+    }
+
+public:
+    // multipart/byteranges中每个区间前的分隔行和头部
+    static std::string PartHead(const HttpResponse &rsp, const std::pair<uint64_t, uint64_t> &range)
+    {
+        char buf[96];
+        snprintf(buf, sizeof(buf), "\r\nContent-Range: bytes %llu-%llu/%llu\r\n\r\n", (unsigned long long)range.first,
+                 (unsigned long long)range.second, (unsigned long long)rsp._file->_size);
+        return "\r\n--" + rsp._boundary + "\r\nContent-Type: " + rsp._file->_mime + buf;
+    }
+
+public:
+    // 将响应序列化到out末尾，返回连接是否保持：按请求的版本和Connection头部，上层设置的Connection头部优先，ka要求关闭时一定关闭
+    // 上层没有设置时补充Connection（保持时还有Keep-Alive）、Content-Length、Content-Type、Location、Date、Server头部
+    // 静态资源响应（rsp._file）的正文和Content-Type、ETag、Last-Modified取自缓存项；HEAD请求只发头部
+    // 范围请求只写入请求的窗口，大文件的窗口交给sender（为空时读到out中）
+    static bool Write(const HttpRequest &req, const HttpResponse &rsp, buffer_t *out, const FileSender &sender = FileSender(),
+                      const HttpKeepAlive &ka = HttpKeepAlive())
+    {
+        const HttpWriter &w = Instance();
+        const DateLine &date = Date();
+
+        int v = req._version == "HTTP/1.0" ? 0 : 1;
+        std::string slow_line;
+        const std::string *line = &slow_line;
+        if (rsp._statu >= STATUS_CODE_MIN && rsp._statu <= STATUS_CODE_MAX)
+            line = &w._lines[v][rsp._statu - STATUS_CODE_MIN];
+        else
+            slow_line = StatusLine(v == 0 ? "HTTP/1.0" : "HTTP/1.1", rsp._statu);
+
+        // 遍历一遍上层设置的头部，统计长度并记下哪些需要补充
+        bool keep_alive = !ka._close && req.IsKeepAlive();
+        bool gzip = rsp._file && rsp._file_gzip;
+        const std::string &body = rsp._file ? (gzip ? rsp._file->_gzip : rsp._file->_content) : rsp._body;
+        // 静态资源正文按窗口写入：范围请求、内容不在内存中的大文件；416没有正文
+        bool windowed = rsp._file && (!rsp._ranges.empty() || rsp._file->_on_disk || rsp._statu == 416);
+        const HttpHeaders &headers = rsp._headers;
+        bool has_conn = !ka._close && headers.Has(HDR_CONNECTION), has_len = headers.Has(HDR_CONTENT_LENGTH);
+        bool has_type = rsp._file != nullptr || headers.Has(HDR_CONTENT_TYPE), has_date = headers.Has(HDR_DATE), has_server = headers.Has(HDR_SERVER);
+        if (has_conn)
+            keep_alive = Util::IsPersistent(v == 0, headers.Get(HDR_CONNECTION));
+        size_t size = line->size() + (windowed ? 0 : body.size()) + 2;
+        for (size_t i = 0; i < headers.Size(); ++i)
+            size += headers.NameLen(i) + headers.ValueLen(i) + 4;
+        // 1xx、204、304不能带正文，也不带Content-Length
+        bool no_body = rsp._statu < 200 || rsp._statu == 204 || rsp._statu == 304;
+        bool send_body = !no_body && req._method != "HEAD";
+        // 流式响应没有设置Content-Length时：HTTP/1.1用chunked编码，HTTP/1.0靠关闭连接表示正文结束
+        bool chunked = rsp._stream && !has_len && !no_body && v == 1;
+        if (rsp._stream && !has_len && !no_body && v == 0)
+            keep_alive = false;
+        size += 320 + date._len + rsp._redirect_url.size(); // 需要补充的头部的上限
+        if (rsp._file)
+            size += rsp._file->_type_header.size() + rsp._file->_validators.size() + rsp._file->_gzip_validators.size() + rsp._boundary.size();
+
+        // 正文长度：416没有正文，单个区间是区间长度，多个区间是整个multipart的长度
+        std::vector<std::string> heads;
+        uint64_t length = body.size();
+        if (rsp._file && rsp._statu == 416)
+            length = 0;
+        else if (rsp._file && !rsp._ranges.empty())
+        {
+            length = 0;
+            for (auto &range : rsp._ranges)
+                length += range.second - range.first + 1;
+            if (rsp._ranges.size() > 1)
+            {
+                for (auto &range : rsp._ranges)
+                {
+                    heads.push_back(PartHead(rsp, range));
+                    length += heads.back().size();
+                }
+                length += rsp._boundary.size() + 8; // \r\n--B--\r\n
+            }
+        }
+        else if (rsp._file && rsp._file->_on_disk)
+            length = rsp._file->_size;
+
+        out->expand(size);
+        char *begin = out->write_addr(), *p = begin;
+        Put(p, *line);
+        for (size_t i = 0; i < headers.Size(); ++i)
+        {
+            if (ka._close && headers.IdAt(i) == HDR_CONNECTION)
+                continue; // 服务器决定关闭连接时不采用上层设置的Connection
+            Put(p, headers.Name(i), headers.NameLen(i));
+            Put(p, ": ");
+            Put(p, headers.Value(i), headers.ValueLen(i));
+            Put(p, "\r\n");
+        }
+        if (!has_conn)
+        {
+            if (keep_alive)
+                Put(p, "Connection: keep-alive\r\n");
+            else
+                Put(p, "Connection: close\r\n");
+        }
+        if (!has_conn && keep_alive && ka._timeout > 0)
+        {
+            Put(p, "Keep-Alive: timeout=");
+            PutNumber(p, ka._timeout);
+            if (ka._max > 0)
+            {
+                Put(p, ", max=");
+                PutNumber(p, ka._max);
+            }
+            Put(p, "\r\n");
+        }
+        if (chunked)
+            Put(p, "Transfer-Encoding: chunked\r\n");
+        else if (!has_len && !no_body && !rsp._stream)
+        {
+            Put(p, "Content-Length: ");
+            PutNumber(p, length);
+            Put(p, "\r\n");
+        }
+        if (!has_type && !body.empty())
+            Put(p, "Content-Type: application/octet-stream\r\n");
+        if (rsp._file)
+        {
+            Put(p, "Accept-Ranges: bytes\r\n");
+            if (rsp._statu == 416 || rsp._ranges.size() == 1)
+            {
+                Put(p, "Content-Range: bytes ");
+                if (rsp._statu == 416)
+                    Put(p, "*");
+                else
+                {
+                    PutNumber(p, rsp._ranges[0].first);
+                    Put(p, "-");
+                    PutNumber(p, rsp._ranges[0].second);
+                }
+                Put(p, "/");
+                PutNumber(p, rsp._file->_size);
+                Put(p, "\r\n");
+            }
+            if (rsp._ranges.size() > 1)
+            {
+                Put(p, "Content-Type: multipart/byteranges; boundary=");
+                Put(p, rsp._boundary);
+                Put(p, "\r\n");
+            }
+            else if (!no_body && rsp._statu != 416)
+                Put(p, rsp._file->_type_header);
+            if (gzip && !no_body)
+                Put(p, "Content-Encoding: gzip\r\n");
+            Put(p, gzip ? rsp._file->_gzip_validators : rsp._file->_validators);
+        }
+        if (rsp._redirect_flag)
+        {
+            Put(p, "Location: ");
+            Put(p, rsp._redirect_url);
+            Put(p, "\r\n");
+        }
+        if (!has_date)
+        {
+            memcpy(p, date._line, date._len);
+            p += date._len;
+        }
+        if (!has_server)
+            Put(p, "Server: " HTTP_SERVER_NAME "\r\n");
+        Put(p, "\r\n");
+        if (send_body && !windowed)
+            Put(p, body);
+        out->move_write_pos_back(p - begin);
+        if (!send_body || !windowed || rsp._statu == 416)
+            return keep_alive;
 
-        return false;
+        // 按窗口写正文：sender发送的文件片段排在它之前写入out的数据之后，所以每段头部先写入out再交给sender
+        if (rsp._ranges.empty())
+            PutWindow(rsp, 0, rsp._file->_size, out, sender);
+        else if (rsp._ranges.size() == 1)
+            PutWindow(rsp, rsp._ranges[0].first, rsp._ranges[0].second - rsp._ranges[0].first + 1, out, sender);
+        else
+        {
+            for (size_t i = 0; i < rsp._ranges.size(); ++i)
+            {
+                out->write(heads[i]);
+                PutWindow(rsp, rsp._ranges[i].first, rsp._ranges[i].second - rsp._ranges[i].first + 1, out, sender);
+            }
+            out->write("\r\n--" + rsp._boundary + "--\r\n");
+        }
+        return keep_alive;
     }
 };
 
@@ -518,63 +2057,113 @@ typedef enum
     RECV_HTTP_OVER
 } HttpRecvStatu;
 
+// 连接当前的计时阶段，各阶段的超时时间不同（由HttpServer通过时间轮驱动）
+typedef enum
+{
+    HTTP_TIMER_NONE, // 正在处理请求、发送流式响应，不计时
+    HTTP_TIMER_IDLE, // 两个请求之间的空闲
+    HTTP_TIMER_HEAD, // 接收请求行和头部：从第一个字节开始计时，期间收到数据也不延长
+    HTTP_TIMER_BODY,  // 接收正文：每次收到数据重新计时
+    HTTP_TIMER_CLOSED // 已经决定关闭连接（超时、出错、短连接），之后收到的数据全部丢弃
+} HttpTimerPhase;
+
+// 流式正文消费者：正文到达时逐段调用（数据直接指向接收缓冲区，调用返回后失效），正文结束时以(nullptr, 0)调用一次
+// 返回false表示处理失败，请求以500结束并关闭连接；注册了消费者的请求，处理函数看到的_body为空
+using BodyConsumer = std::function<bool(const char *, size_t)>;
+// 请求头部接收完毕后调用，为这个请求创建消费者（可以捕获打开的文件等状态），返回空则照常缓存到_body中
+using BodyConsumerFactory = std::function<BodyConsumer(const HttpRequest &)>;
+// 头部接收完毕时由上层选择正文消费者（会填入请求的路径参数）
+using BodyConsumerSelector = std::function<BodyConsumer(HttpRequest &)>;
+
 #define MAX_LINE 8192
+#define MAX_HEADERS 128 // 头部（包括chunked编码的trailer）字段数上限
 class HttpContext
 {
 private:
     int _resp_statu;           // 响应状态码
     HttpRecvStatu _recv_statu; // 当前接收及解析的阶段状态
     HttpRequest _request;      // 已经解析得到的请求信息
+    HttpResponse _response;    // 这个请求的响应，和_request一样重置后保留内存给下一个请求
+    uint64_t _body_left;       // 还需要接收的正文长度（chunked编码时是当前块剩余的长度）
+    size_t _max_body;          // 没有消费者时缓存的正文上限
+    BodyConsumer _consumer;    // 当前请求的正文消费者，为空时正文缓存到_request._body
+    enum ChunkStatu
+    {
+        CHUNK_NONE,    // 不是chunked编码，按Content-Length接收
+        CHUNK_SIZE,    // 等待块大小行
+        CHUNK_DATA,    // 接收块数据
+        CHUNK_CRLF,    // 块数据之后的空行
+        CHUNK_TRAILER, // 最后一个块之后的trailer字段
+    } _chunk_statu;
+    uint64_t _body_total;  // chunked编码时已经解码的正文长度
+    bool _streaming;       // 流式响应还没有结束，后续请求暂不处理
+    uint32_t _requests;    // 这个连接上已经处理的请求数，Reset时不清零
+    HttpTimerPhase _timer; // 当前的计时阶段
 private:
-    // 对一行内容解析
-    bool ParseHttpLine(const std::string &line)
+    // 支持的请求方法（不区分大小写），返回标准写法，不支持返回nullptr
+    static const char *MatchMethod(const char *p, const size_t &len)
     {
-        std::smatch matches;
-        std::regex e("(GET|HEAD|POST|PUT|DELETE) ([^?]*)(?:\\?(.*))? (HTTP/1\\.[01])(?:\n|\r\n)?", std::regex::icase);
-        bool ret = std::regex_match(line, matches, e);
-        if (ret == false)
+        static const char *methods[] = {"GET", "HEAD", "POST", "PUT", "DELETE"};
+        for (const char *method : methods)
         {
-            _recv_statu = RECV_HTTP_ERROR;
-            _resp_statu = 400; // BAD REQUEST
+            if (strlen(method) == len && strncasecmp(method, p, len) == 0)
+                return method;
+        }
+        return nullptr;
+    }
+    // 解析请求行 [begin, end)（不含行尾的换行）：方法 请求目标 HTTP/1.x，直接从接收缓冲区拷贝到请求中
+    // 方法和版本不区分大小写，请求目标中'?'之前是路径（URL解码），之后是查询字符串 key=val&key=val
+    bool ParseHttpLine(const char *begin, const char *end)
+    {
+        if (end > begin && end[-1] == '\r')
+            --end;
+        const char *sp = (const char *)memchr(begin, ' ', end - begin);
+        const char *method = sp == nullptr ? nullptr : MatchMethod(begin, sp - begin);
+        // 版本固定是行尾的8个字符，前面一个空格（请求目标可以为空）
+        const char *version = end - 8;
+        if (method == nullptr || end - sp < 10 || version[-1] != ' ' || strncasecmp(version, "HTTP/1.", 7) != 0 ||
+            (version[7] != '0' && version[7] != '1'))
+        {
+            SetError(400); // BAD REQUEST
             return false;
         }
-        // 请求方法的获取
-        _request._method = matches[1];
-        std::transform(_request._method.begin(), _request._method.end(), _request._method.begin(), ::toupper);
+        _request._method.assign(method);
+        _request._version.assign(version[7] == '0' ? "HTTP/1.0" : "HTTP/1.1");
         // 资源路径的获取，需要进行URL解码操作，但是不需要+转空格
-        _request._path = Util::UrlDecode(matches[2], false);
-        // 协议版本的获取
-        _request._version = matches[4];
-        // 查询字符串的获取与处理
-        std::vector<std::string> query_string_arry;
-        std::string query_string = matches[3];
-        // 查询字符串的格式 key=val&key=val....., 先以 & 符号进行分割，得到各个字串
-        Util::Split(query_string, "&", &query_string_arry);
-        // 针对各个字串，以 = 符号进行分割，得到key 和val， 得到之后也需要进行URL解码
-        for (auto &str : query_string_arry)
-        {
-            size_t pos = str.find("=");
-            if (pos == std::string::npos)
+        const char *target = sp + 1, *target_end = version - 1;
+        const char *query = (const char *)memchr(target, '?', target_end - target);
+        _request._path.clear();
+        Util::UrlDecode(target, (query == nullptr ? target_end : query) - target, false, &_request._path);
+        if (query == nullptr)
+            return true;
+        // 查询字符串的格式 key=val&key=val....., 先以 & 符号进行分割（跳过空的），再以 = 分割出key和val，都需要URL解码
+        for (const char *p = query + 1; p < target_end;)
+        {
+            const char *amp = (const char *)memchr(p, '&', target_end - p);
+            const char *item_end = amp == nullptr ? target_end : amp;
+            if (item_end > p)
             {
-                _recv_statu = RECV_HTTP_ERROR;
-                _resp_statu = 400; // BAD REQUEST
-                return false;
+                const char *eq = (const char *)memchr(p, '=', item_end - p);
+                if (eq == nullptr)
+                {
+                    SetError(400); // BAD REQUEST
+                    return false;
+                }
+                _request._params.Add(p, eq - p, eq + 1, item_end - eq - 1, true);
             }
-            std::string key = Util::UrlDecode(str.substr(0, pos), true);
-            std::string val = Util::UrlDecode(str.substr(pos + 1), true);
-            _request.SetParam(key, val);
+            p = item_end + 1;
         }
         return true;
     }
-    // 取出请求行并解析
+    // 取出请求行并解析，直接在接收缓冲区上解析，不先取出成临时字符串
     bool RecvHttpLine(buffer_t *buf)
     {
         if (_recv_statu != RECV_HTTP_LINE)
             return false;
         // 1. 获取一行数据，带有末尾的换行
-        std::string line = buf->getline();
+        const char *line_end = buf->findCRLF();
         // 2. 需要考虑的一些要素：缓冲区中的数据不足一行， 获取的一行数据超大
-        if (line.size() == 0)
+        if (line_end == nullptr)
         {
             // 缓冲区中的数据不足一行，则需要判断缓冲区的可读数据长度，如果很长了都不足一行，这是有问题的
             if (buf->valid_data_size() > MAX_LINE)
@@ -586,13 +2175,16 @@ private:
             // 缓冲区中数据不足一行，但是也不多，就等等新数据的到来
             return true;
         }
-        if (line.size() > MAX_LINE)
+        const char *line_begin = buf->read_addr();
+        size_t len = line_end - line_begin + 1;
+        if (len > MAX_LINE)
         {
             _recv_statu = RECV_HTTP_ERROR;
             _resp_statu = 414; // URI TOO LONG
             return false;
         }
-        bool ret = ParseHttpLine(line);
+        bool ret = ParseHttpLine(line_begin, line_end);
+        buf->move_read_pos_back(len);
         if (ret == false)
         {
             return false;
@@ -601,36 +2193,40 @@ private:
         _recv_statu = RECV_HTTP_HEAD;
         return true;
     }
-    // 取出头部所有字段并解析
-    bool ParseHttpHead(std::string &line)
+    // 解析一个头部字段（不含行尾的换行），直接从[begin, end)拷贝到请求的头部容器中
+    bool ParseHttpHead(const char *begin, const char *end)
     {
         // key: val\r\nkey: val\r\n....
-        if (line.back() == '\n')
-            line.pop_back(); // 末尾是换行则去掉换行字符
-        if (line.back() == '\r')
-            line.pop_back(); // 末尾是回车则去掉回车字符
-        size_t pos = line.find(": ");
-        if (pos == std::string::npos)
+        while (end > begin && (end[-1] == '\n' || end[-1] == '\r'))
+            --end; // 去掉末尾的回车换行
+        const char *colon = (const char *)memchr(begin, ':', end - begin);
+        // 字段名不能为空，也不能含有空白（RFC 7230 3.2.4）
+        if (colon == nullptr || colon == begin || std::find_if(begin, colon, [](char c)
+                                                             { return c == ' ' || c == '\t'; }) != colon)
         {
             _recv_statu = RECV_HTTP_ERROR;
             _resp_statu = 400; //
             return false;
         }
-        std::string key = line.substr(0, pos);
-        std::string val = line.substr(pos + 2);
-        _request.SetHeader(key, val);
+        const char *val = colon + 1;
+        while (val < end && (*val == ' ' || *val == '\t'))
+            ++val;
+        while (end > val && (end[-1] == ' ' || end[-1] == '\t'))
+            --end;
+        _request._headers.Add(begin, colon - begin, val, end - val);
         return true;
     }
     bool RecvHttpHead(buffer_t *buf)
     {
         if (_recv_statu != RECV_HTTP_HEAD)
             return false;
-        // 一行一行取出数据，直到遇到空行为止， 头部的格式 key: val\r\nkey: val\r\n....
+        // 一行一行处理，直到遇到空行为止， 头部的格式 key: val\r\nkey: val\r\n....
+        // 字段直接在接收缓冲区上解析，不先取出成临时字符串
         while (1)
         {
-            std::string line = buf->getline();
+            const char *line_end = buf->findCRLF();
             // 2. 需要考虑的一些要素：缓冲区中的数据不足一行， 获取的一行数据超大
-            if (line.size() == 0)
+            if (line_end == nullptr)
             {
                 // 缓冲区中的数据不足一行，则需要判断缓冲区的可读数据长度，如果很长了都不足一行，这是有问题的
                 if (buf->valid_data_size() > MAX_LINE)
@@ -642,63 +2238,230 @@ private:
                 // 缓冲区中数据不足一行，但是也不多，就等等新数据的到来
                 return true;
             }
-            if (line.size() > MAX_LINE)
+            const char *line_begin = buf->read_addr();
+            size_t len = line_end - line_begin + 1;
+            if (len > MAX_LINE)
             {
                 _recv_statu = RECV_HTTP_ERROR;
                 _resp_statu = 414; // URI TOO LONG
                 return false;
             }
-            if (line == "\n" || line == "\r\n")
+            if (len == 1 || (len == 2 && line_begin[0] == '\r'))
             {
+                buf->move_read_pos_back(len);
                 break;
             }
-            bool ret = ParseHttpHead(line);
+            if (_request._headers.Size() >= MAX_HEADERS)
+            {
+                SetError(431); // REQUEST HEADER FIELDS TOO LARGE
+                return false;
+            }
+            bool ret = ParseHttpHead(line_begin, line_end);
             if (ret == false)
             {
                 return false;
             }
+            buf->move_read_pos_back(len);
         }
         // 头部处理完毕，进入正文获取阶段
         _recv_statu = RECV_HTTP_BODY;
         return true;
     }
 
-    bool RecvHttpBody(buffer_t *buf)
+    void SetError(const int &statu)
     {
-        if (_recv_statu != RECV_HTTP_BODY)
-            return false;
-        // 1. 获取正文长度
-        size_t content_length = _request.ContentLength();
-        if (content_length == 0)
+        _recv_statu = RECV_HTTP_ERROR;
+        _resp_statu = statu;
+    }
+    // 头部接收完毕：确定正文长度，选择正文消费者
+    bool BeginHttpBody(const BodyConsumerSelector &selector)
+    {
+        _body_left = 0;
+        _body_total = 0;
+        _chunk_statu = CHUNK_NONE;
+        HttpHeaders &headers = _request._headers;
+        size_t len = 0;
+        const char *te = headers.Get(HDR_TRANSFER_ENCODING, &len);
+        if (te != nullptr)
         {
-            // 没有正文，则请求接收解析完毕
-            _recv_statu = RECV_HTTP_OVER;
+            // 只支持chunked，而且必须是最后一个编码；同时有Content-Length时忽略它（避免请求走私）
+            // 值的首尾空白在解析时已经去掉
+            if (len < 7 || strncasecmp(te + len - 7, "chunked", 7) != 0 || (len > 7 && te[len - 8] != ',' && te[len - 8] != ' '))
+            {
+                SetError(501); // NOT IMPLEMENTED
+                return false;
+            }
+            headers.Erase(HDR_CONTENT_LENGTH);
+            _chunk_statu = CHUNK_SIZE;
+            if (selector)
+                _consumer = selector(_request);
             return true;
         }
-        // 2. 当前已经接收了多少正文,其实就是往  _request._body 中放了多少数据了
-        size_t real_len = content_length - _request._body.size(); // 实际还需要接收的正文长度
-        // 3. 接收正文放到body中，但是也要考虑当前缓冲区中的数据，是否是全部的正文
-        //   3.1 缓冲区中数据，包含了当前请求的所有正文，则取出所需的数据
-        if (buf->valid_data_size() >= real_len)
+        const char *clen = headers.Get(HDR_CONTENT_LENGTH, &len);
+        if (clen != nullptr)
+        {
+            _body_left = strtoull(clen, nullptr, 10);
+            if (len == 0 || strspn(clen, "0123456789") != len || _body_left == ULLONG_MAX)
+            {
+                SetError(400); // BAD REQUEST
+                return false;
+            }
+        }
+        if (_body_left > 0 && selector)
+            _consumer = selector(_request);
+        if (!_consumer && _body_left > _max_body)
+        {
+            SetError(413); // PAYLOAD TOO LARGE
+            return false;
+        }
+        // 正文还没有到达，只预留有限的空间：否则一个头部就能让每个连接占住_max_body的内存
+        if (!_consumer)
+            _request._body.reserve(std::min<uint64_t>(_body_left, HTTP_BODY_RESERVE));
+        return true;
+    }
+    // 交给正文消费者或者缓存到_body中，data为nullptr表示正文结束
+    bool DeliverBody(const char *data, const size_t &len)
+    {
+        if (!_consumer)
         {
-            _request._body.append(buf->read_addr(), real_len);
-            buf->move_read_pos_back(real_len);
-            _recv_statu = RECV_HTTP_OVER;
+            if (data != nullptr)
+                _request._body.append(data, len);
+            return true;
+        }
+        if (_consumer(data, len))
             return true;
+        SetError(500); // INTERNAL SERVER ERROR
+        return false;
+    }
+    // 取出一行（chunked编码的块大小行、trailer），不足一行返回空，超长时设置错误
+    bool GetLine(buffer_t *buf, std::string *line)
+    {
+        *line = buf->getline();
+        if (line->empty() ? buf->valid_data_size() > MAX_LINE : line->size() > MAX_LINE)
+        {
+            SetError(400); // BAD REQUEST
+            return false;
         }
-        //  3.2 缓冲区中数据，无法满足当前正文的需要，数据不足，取出数据，然后等待新数据到来
-        _request._body.append(buf->read_addr(), buf->valid_data_size());
-        buf->move_read_pos_back(buf->valid_data_size());
+        if (line->empty())
+            return false;
+        while (!line->empty() && (line->back() == '\n' || line->back() == '\r'))
+            line->pop_back();
+        return true;
+    }
+    // 正文全部接收完毕
+    bool EndHttpBody()
+    {
+        if (_consumer && !DeliverBody(nullptr, 0))
+            return false;
+        _recv_statu = RECV_HTTP_OVER;
         return true;
     }
+    // chunked编码的正文：块大小(十六进制)[;扩展]\r\n 数据\r\n ... 0\r\n trailer\r\n \r\n
+    // 解码完成后Transfer-Encoding去掉，Content-Length设为解码后的长度，处理函数看到的和普通请求一样
+    bool RecvChunkedBody(buffer_t *buf)
+    {
+        std::string line;
+        while (true)
+        {
+            switch (_chunk_statu)
+            {
+            case CHUNK_SIZE:
+            {
+                if (!GetLine(buf, &line))
+                    return _recv_statu != RECV_HTTP_ERROR;
+                size_t end = std::min(line.find_first_not_of("0123456789abcdefABCDEF"), line.size());
+                if (end == 0 || end > 15 || (end < line.size() && line[end] != ';' && line[end] != ' ' && line[end] != '\t'))
+                {
+                    SetError(400); // BAD REQUEST
+                    return false;
+                }
+                _body_left = strtoull(line.c_str(), nullptr, 16);
+                if (!_consumer && _body_total + _body_left > _max_body)
+                {
+                    SetError(413); // PAYLOAD TOO LARGE
+                    return false;
+                }
+                _chunk_statu = _body_left == 0 ? CHUNK_TRAILER : CHUNK_DATA;
+                break;
+            }
+            case CHUNK_DATA:
+            {
+                size_t len = buf->valid_data_size() < _body_left ? buf->valid_data_size() : _body_left;
+                if (len == 0)
+                    return true;
+                if (!DeliverBody(buf->read_addr(), len))
+                    return false;
+                buf->move_read_pos_back(len);
+                _body_left -= len;
+                _body_total += len;
+                if (_body_left == 0)
+                    _chunk_statu = CHUNK_CRLF;
+                break;
+            }
+            case CHUNK_CRLF:
+                if (!GetLine(buf, &line))
+                    return _recv_statu != RECV_HTTP_ERROR;
+                if (!line.empty())
+                {
+                    SetError(400); // BAD REQUEST
+                    return false;
+                }
+                _chunk_statu = CHUNK_SIZE;
+                break;
+            case CHUNK_TRAILER:
+                if (!GetLine(buf, &line))
+                    return _recv_statu != RECV_HTTP_ERROR;
+                if (!line.empty())
+                {
+                    if (_request._headers.Size() >= MAX_HEADERS || !ParseHttpHead(line.data(), line.data() + line.size()))
+                    {
+                        SetError(400); // BAD REQUEST
+                        return false;
+                    }
+                    break;
+                }
+                _request._headers.Erase(HDR_TRANSFER_ENCODING);
+                _request._headers.Set(HDR_CONTENT_LENGTH, std::to_string(_body_total));
+                _chunk_statu = CHUNK_NONE;
+                return EndHttpBody();
+            default:
+                return false;
+            }
+        }
+    }
+    bool RecvHttpBody(buffer_t *buf)
+    {
+        if (_recv_statu != RECV_HTTP_BODY)
+            return false;
+        if (_chunk_statu != CHUNK_NONE)
+            return RecvChunkedBody(buf);
+        // 接收正文，缓冲区中的数据可能只是一部分，取出已有的数据，然后等待新数据到来
+        size_t len = buf->valid_data_size() < _body_left ? buf->valid_data_size() : _body_left;
+        if (len > 0)
+        {
+            if (!DeliverBody(buf->read_addr(), len))
+                return false;
+            buf->move_read_pos_back(len);
+            _body_left -= len;
+        }
+        if (_body_left > 0)
+            return true;
+        return EndHttpBody();
+    }
 
 public:
-    HttpContext() : _resp_statu(200), _recv_statu(RECV_HTTP_LINE) {}
+    HttpContext(size_t max_body = HTTP_MAX_BODY) : _resp_statu(200), _recv_statu(RECV_HTTP_LINE), _body_left(0), _max_body(max_body), _chunk_statu(CHUNK_NONE), _body_total(0), _streaming(false),
+                                               _requests(0), _timer(HTTP_TIMER_NONE) {}
     void Reset()
     {
         _resp_statu = 200;
         _recv_statu = RECV_HTTP_LINE;
         _request.Reset();
+        _response.Reset();
+        _body_left = 0;
+        _consumer = nullptr;
+        _chunk_statu = CHUNK_NONE;
+        _body_total = 0;
     }
 
     int RespStatu() { return _resp_statu; }
@@ -707,8 +2470,21 @@ public:
 
     HttpRequest &Request() { return _request; }
 
-    // 接收并解析HTTP请求
-    void RecvHttpRequest(buffer_t *buf)
+    HttpResponse &Response() { return _response; }
+
+    // 流式响应期间不处理同一连接上的后续请求，保证响应按请求的顺序发出
+    bool Streaming() const { return _streaming; }
+    void SetStreaming(const bool &streaming) { _streaming = streaming; }
+
+    // 已经处理的请求数，用于每个连接的请求数上限
+    uint32_t Requests() const { return _requests; }
+    void AddRequest() { ++_requests; }
+
+    HttpTimerPhase Timer() const { return _timer; }
+    void SetTimer(const HttpTimerPhase &phase) { _timer = phase; }
+
+    // 接收并解析HTTP请求，头部接收完毕时通过selector选择正文消费者
+    void RecvHttpRequest(buffer_t *buf, const BodyConsumerSelector &selector = BodyConsumerSelector())
     {
         // 不同的状态，做不同的事情，但是这里不要break， 因为处理完请求行后，应该立即处理头部，而不是退出等新数据
         switch (_recv_statu)
@@ -716,24 +2492,46 @@ public:
         case RECV_HTTP_LINE:
             RecvHttpLine(buf);
         case RECV_HTTP_HEAD:
-            RecvHttpHead(buf);
+            if (RecvHttpHead(buf) && _recv_statu == RECV_HTTP_BODY && !BeginHttpBody(selector))
+                return;
         case RECV_HTTP_BODY:
             RecvHttpBody(buf);
         }
     }
 };
 
+#include "http2.hpp"
+
 class HttpServer
 {
 private:
+    // 路由表按请求方法下标存放，HEAD使用GET的路由表
+    enum Method
+    {
+        METHOD_GET,
+        METHOD_POST,
+        METHOD_PUT,
+        METHOD_DELETE,
+        METHOD_COUNT
+    };
     using Handler = std::function<void(const HttpRequest &, HttpResponse *)>;
-    using Handlers = std::vector<std::pair<std::regex, Handler>>;
-    Handlers _get_route;
-    Handlers _post_route;
-    Handlers _put_route;
-    Handlers _delete_route;
+    Router<Handler> _route[METHOD_COUNT];
+    Router<BodyConsumerFactory> _body_route[METHOD_COUNT]; // 流式接收正文的路由，只用到POST/PUT
+    BodyConsumerSelector _selector;
+    Router<std::shared_ptr<const WsHandlers>> _ws_route; // WebSocket路由
+    uint32_t _ws_ping;                                   // WebSocket保活间隔（秒）
+    uint32_t _keepalive_timeout; // 长连接两个请求之间的空闲超时（秒），0表示不保持连接
+    uint32_t _keepalive_max;     // 每个连接最多处理的请求数，0表示不限制
+    uint32_t _header_timeout;    // 请求行和头部的接收时限（秒）
+    uint32_t _body_timeout;      // 接收正文时两次收到数据的最大间隔（秒）
+    bool _http2;          // 是否接受h2c（连接序言或者Upgrade: h2c）
+    H2Handlers _h2;       // HTTP/2的流交给这里的路由处理
+    size_t _max_body;     // 没有注册正文消费者的请求，正文上限
     std::string _basedir; // 静态资源根目录
+    int _gzip_level;      // 动态响应的压缩级别，0表示不压缩
+    size_t _gzip_min;     // 达到该大小的动态响应才压缩
     TcpServer _server;
+    FileCache _file_cache; // 静态资源缓存，inotify事件在_server的主线程中处理，要先于_server析构
 
 private:
     void ErrorHandler(const HttpRequest &req, HttpResponse *rsp)
@@ -755,36 +2553,23 @@ private:
         // 2. 将页面数据，当作响应正文，放入rsp中
         rsp->SetContent(body, "text/html");
     }
-    // 将HttpResponse中的要素按照http协议格式进行组织，发送
-    void WriteReponse(const conn_ptr &conn, const HttpRequest &req, HttpResponse &rsp)
+    // 将HttpResponse中的要素按照http协议格式进行组织，发送，返回连接是否保持
+    bool WriteReponse(const conn_ptr &conn, const HttpRequest &req, HttpResponse &rsp, const HttpKeepAlive &ka = HttpKeepAlive())
     {
-        // 1. 先完善头部字段
-        if (req.IsKeepAlive())
-            rsp.SetHeader("Connection", "keep-alive");
-        else
-            rsp.SetHeader("Connection", "close");
-
-        if (rsp._body.empty() == false && rsp.HasHeader("Content-Length") == false)
-            rsp.SetHeader("Content-Length", std::to_string(rsp._body.size()));
-
-        if (rsp._body.empty() == false && rsp.HasHeader("Content-Type") == false)
-            rsp.SetHeader("Content-Type", "application/octet-stream");
-
-        if (rsp._redirect_flag == true)
-            rsp.SetHeader("Location", rsp._redirect_url);
-
-        // 2. 将rsp中的要素，按照http协议格式进行组织
-        std::stringstream rsp_str;
-        rsp_str << req._version << " " << std::to_string(rsp._statu) << " " << Util::StatusDesc(rsp._statu) << "\r\n";
-        for (auto &head : rsp._headers)
-            rsp_str << head.first << ": " << head.second << "\r\n";
-
-        rsp_str << "\r\n";
-        rsp_str << rsp._body;
-        // 3. 发送数据
-        conn->send_peer(rsp_str.str());
+        // 在连接所属线程中（正常的请求处理流程）直接序列化到发送缓冲区
+        if (conn->get_loop()->is_in_loop())
+        {
+            bool keep_alive = HttpWriter::Write(req, rsp, conn->outbuffer(), [&conn](const file_ptr &file, const uint64_t &offset, const uint64_t &len)
+                                                { conn->send_file(file, offset, len); }, ka);
+            conn->flush_outbuffer();
+            return keep_alive;
+        }
+        buffer_t buf;
+        bool keep_alive = HttpWriter::Write(req, rsp, &buf, HttpWriter::FileSender(), ka);
+        conn->send_peer(buf.read_addr(), buf.valid_data_size());
+        return keep_alive;
     }
-    bool IsFileHandler(const HttpRequest &req)
+    bool IsFileHandler(const HttpRequest &req, FileEntryPtr *file)
     {
         // 1. 必须设置了静态资源根目录
         if (_basedir.empty())
@@ -798,7 +2583,7 @@ private:
         if (Util::IsValidPath(req._path) == false)
             return false;
 
-        // 4. 请求的资源必须存在,且是一个普通文件
+        // 4. 请求的资源必须存在,且是一个普通文件（查静态资源缓存，命中时不访问磁盘）
         //    有一种请求比较特殊 -- 目录：/, /image/， 这种情况给后边默认追加一个 index.html
         // index.html    /image/a.png
         // 不要忘了前缀的相对根目录,也就是将请求路径转换为实际存在的路径  /image/a.png  ->   ./wwwroot/image/a.png
@@ -806,43 +2591,147 @@ private:
         if (req._path.back() == '/')
             req_path += "index.html";
 
-        if (Util::IsRegularFile(req_path) == false)
+        *file = _file_cache.Lookup(req_path);
+        return *file != nullptr;
+    }
+    // 条件请求：If-None-Match优先，其次If-Modified-Since，资源未修改时返回true
+    static bool NotModified(const HttpRequest &req, const std::string &etag, const FileEntry &file)
+    {
+        const char *inm = req._headers.Get(HDR_IF_NONE_MATCH);
+        if (inm != nullptr)
+        {
+            // 逗号分隔的ETag列表，弱比较（忽略W/前缀），*匹配任意
+            std::vector<std::string> tags;
+            Util::Split(inm, ",", &tags);
+            for (auto &tag : tags)
+            {
+                size_t b = tag.find_first_not_of(' '), e = tag.find_last_not_of(' ');
+                if (b == std::string::npos)
+                    continue;
+                std::string t = tag.substr(b, e - b + 1);
+                if (t.compare(0, 2, "W/") == 0)
+                    t.erase(0, 2);
+                if (t == "*" || t == etag)
+                    return true;
+            }
             return false;
-
-        return true;
+        }
+        const char *ims = req._headers.Get(HDR_IF_MODIFIED_SINCE);
+        if (ims != nullptr)
+        {
+            if (file._last_modified == ims)
+                return true;
+            time_t t = 0;
+            return Util::ParseHttpDate(ims, &t) && t >= file._mtime;
+        }
+        return false;
     }
-    // 静态资源的请求处理 --- 将静态资源文件的数据读取出来，放到rsp的_body中, 并设置mime
-    void FileHandler(const HttpRequest &req, HttpResponse *rsp)
+    // If-Range：强ETag相同或者日期等于Last-Modified时，Range才生效，否则发送整个文件
+    static bool IfRangeMatch(const HttpRequest &req, const FileEntry &file)
     {
-        std::string req_path = _basedir + req._path;
-        if (req._path.back() == '/')
-            req_path += "index.html";
-
-        bool ret = Util::ReadFile(req_path, &rsp->_body);
-        if (ret == false)
+        const char *val = req._headers.Get(HDR_IF_RANGE);
+        if (val == nullptr)
+            return true;
+        if (val[0] == '"' || strncmp(val, "W/", 2) == 0)
+            return file._etag == val;
+        return file._last_modified == val;
+    }
+    // 静态资源的请求处理 --- 正文直接引用缓存项，不拷贝到rsp的_body中；条件请求命中时返回304
+    // GET请求带Range时返回206（多个区间用multipart/byteranges）或416，范围请求不压缩
+    void FileHandler(const HttpRequest &req, HttpResponse *rsp, const FileEntryPtr &file)
+    {
+        rsp->_file = file;
+        const char *range = req._headers.Get(HDR_RANGE);
+        bool ranged = range != nullptr && req._method == "GET" && IfRangeMatch(req, *file);
+        rsp->_file_gzip = !ranged && !file->_gzip.empty() && Util::AcceptGzip(req._headers.Get(HDR_ACCEPT_ENCODING));
+        if (NotModified(req, rsp->_file_gzip ? file->_gzip_etag : file->_etag, *file))
+        {
+            rsp->_statu = 304;
+            return;
+        }
+        if (file->_on_disk && req._method != "HEAD")
+        {
+            int fd = open(file->_path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (-1 == fd)
+            {
+                rsp->_file.reset();
+                rsp->_statu = 404;
+                return;
+            }
+            rsp->_file_fd.reset(new open_file(fd));
+        }
+        if (!ranged)
+            return;
+        int ret = Util::ParseRange(range, file->_size, &rsp->_ranges);
+        if (ret == 0)
+            rsp->_statu = 416;
+        else if (ret == 1)
+            rsp->_statu = 206;
+        if (rsp->_ranges.size() > 1)
+        {
+            char boundary[32];
+            snprintf(boundary, sizeof(boundary), "%016llx", (unsigned long long)std::hash<std::string>()(file->_etag) ^ (unsigned long long)rsp->_ranges.size());
+            rsp->_boundary = boundary;
+        }
+    }
+    // 动态响应正文足够大、是文本类、客户端接受gzip时压缩正文；流式响应长度未知，只看类型，由HttpStream边写边压缩
+    void CompressBody(const HttpRequest &req, HttpResponse *rsp)
+    {
+        if (_gzip_level == 0 || rsp->_file || (!rsp->_stream && rsp->_body.size() < _gzip_min) || req._method == "HEAD")
+            return;
+        if (rsp->_statu < 200 || rsp->_statu == 204 || rsp->_statu == 304 || rsp->HasHeader("Content-Encoding"))
+            return;
+        const char *type = rsp->_headers.Get(HDR_CONTENT_TYPE);
+        if (type == nullptr || !Util::IsCompressible(type) || !Util::AcceptGzip(req._headers.Get(HDR_ACCEPT_ENCODING)))
             return;
+        if (rsp->_stream)
+        {
+            rsp->_stream_gzip = _gzip_level;
+            rsp->SetHeader("Content-Encoding", "gzip");
+            rsp->SetHeader("Vary", "Accept-Encoding");
+            return;
+        }
 
-        std::string mime = Util::ExtMime(req_path);
-        rsp->SetHeader("Content-Type", mime);
+        static thread_local std::string t_out; // 复用压缩输出的空间，交换后保存的是原来的正文
+        if (!Gzip::Compress(rsp->_body.data(), rsp->_body.size(), _gzip_level, &t_out) || t_out.size() >= rsp->_body.size())
+            return;
+        rsp->_body.swap(t_out);
+        rsp->SetHeader("Content-Encoding", "gzip");
+        rsp->SetHeader("Vary", "Accept-Encoding");
+    }
+    // 请求方法对应的路由表下标，不支持的方法返回METHOD_COUNT；按长度和首字母确定候选，只比较一次
+    static int MethodIndex(const std::string &method)
+    {
+        const char *p = method.data();
+        switch (method.size())
+        {
+        case 3:
+            if (p[0] == 'G')
+                return memcmp(p, "GET", 3) == 0 ? METHOD_GET : METHOD_COUNT;
+            return memcmp(p, "PUT", 3) == 0 ? METHOD_PUT : METHOD_COUNT;
+        case 4:
+            if (p[0] == 'H')
+                return memcmp(p, "HEAD", 4) == 0 ? METHOD_GET : METHOD_COUNT;
+            return memcmp(p, "POST", 4) == 0 ? METHOD_POST : METHOD_COUNT;
+        case 6:
+            return memcmp(p, "DELETE", 6) == 0 ? METHOD_DELETE : METHOD_COUNT;
+        }
+        return METHOD_COUNT;
     }
     // 功能性请求的分类处理
-    void Dispatcher(HttpRequest &req, HttpResponse *rsp, Handlers &handlers)
+    void Dispatcher(HttpRequest &req, HttpResponse *rsp, const Router<Handler> &router)
     {
         // 在对应请求方法的路由表中，查找是否含有对应资源请求的处理函数，有则调用，没有则返回404
-        // 思想：路由表存储的时键值对 -- 正则表达式 & 处理函数
-        // 使用正则表达式，对请求的资源路径进行正则匹配，匹配成功就使用对应函数进行处理
-        //   /numbers/(\d+)       /numbers/12345
-        for (auto &handler : handlers)
-        {
-            const std::regex &re = handler.first;
-            const Handler &functor = handler.second;
-            bool ret = std::regex_match(req._path, req._matches, re);
-            if (ret == false)
-                continue;
-
-            return functor(req, rsp); // 传入请求信息，和空的rsp，执行处理函数
+        //   /users/:id           /users/12345         GetPathParam("id")
+        //   /numbers/(\d+)       /numbers/12345       _matches[1]（正则路由）
+        req._route_params.clear();
+        const Handler *functor = router.Find(req._path, &req._route_params, &req._matches);
+        if (functor == nullptr)
+        {
+            rsp->_statu = 404;
+            return;
         }
-        rsp->_statu = 404;
+        (*functor)(req, rsp); // 传入请求信息，和空的rsp，执行处理函数
     }
     void Route(HttpRequest &req, HttpResponse *rsp)
     {
@@ -850,66 +2739,289 @@ private:
         //    静态资源请求，则进行静态资源的处理
         //    功能性请求，则需要通过几个请求路由表来确定是否有处理函数
         //    既不是静态资源请求，也没有设置对应的功能性请求处理函数，就返回405
-        if (IsFileHandler(req) == true)
-            return FileHandler(req, rsp); // 是一个静态资源请求, 则进行静态资源请求的处理
-
-        if (req._method == "GET" || req._method == "HEAD")
-            return Dispatcher(req, rsp, _get_route);
-        else if (req._method == "POST")
-            return Dispatcher(req, rsp, _post_route);
-        else if (req._method == "PUT")
-            return Dispatcher(req, rsp, _put_route);
-        else if (req._method == "DELETE")
-            return Dispatcher(req, rsp, _delete_route);
+        FileEntryPtr file;
+        if (IsFileHandler(req, &file) == true)
+            return FileHandler(req, rsp, file); // 是一个静态资源请求, 则进行静态资源请求的处理
+
+        int method = MethodIndex(req._method);
+        if (method != METHOD_COUNT)
+            return Dispatcher(req, rsp, _route[method]);
 
         rsp->_statu = 405; // Method Not Allowed
     }
+    // 头部字段值（逗号分隔的列表）中是否有token，不区分大小写
+    static bool HasToken(const HttpRequest &req, const HttpHeaderId &id, const char *token) { return Util::HasToken(req._headers.Get(id), token); }
+    // WebSocket握手（RFC 6455 4.2）：不是注册了WebSocket路由的升级请求返回0；
+    // 请求不合法返回-1（rsp中设置好错误状态）；合法返回1，rsp中是101响应，*handlers是路由的回调
+    int WebSocketHandshake(const HttpRequest &req, HttpResponse *rsp, std::shared_ptr<const WsHandlers> *handlers)
+    {
+        if (_ws_route.Empty() || req._method != "GET" || req._version != "HTTP/1.1" || !HasToken(req, HDR_UPGRADE, "websocket"))
+            return 0;
+        const std::shared_ptr<const WsHandlers> *route = _ws_route.Find(req._path, nullptr, nullptr);
+        if (route == nullptr)
+            return 0;
+        *handlers = *route;
+        std::string key = req.GetHeader("Sec-WebSocket-Key");
+        if (!HasToken(req, HDR_CONNECTION, "upgrade") || key.size() != 24)
+        {
+            rsp->_statu = 400;
+            return -1;
+        }
+        if (req.GetHeader("Sec-WebSocket-Version") != "13")
+        {
+            rsp->_statu = 426; // UPGRADE REQUIRED
+            rsp->SetHeader("Sec-WebSocket-Version", "13");
+            return -1;
+        }
+        rsp->_statu = 101;
+        rsp->SetHeader("Upgrade", "websocket");
+        rsp->SetHeader("Connection", "Upgrade");
+        rsp->SetHeader("Sec-WebSocket-Accept", WsProtocol::AcceptKey(key));
+        return 1;
+    }
+    // 发出101响应后把连接切换为WebSocket，握手请求之后已经到达的帧接着按WebSocket处理
+    void UpgradeWebSocket(const conn_ptr &conn, const HttpRequest &req, HttpResponse &rsp, const std::shared_ptr<const WsHandlers> &handlers, buf_ptr buffer)
+    {
+        WriteReponse(conn, req, rsp);
+        std::string path = req._path;
+        WsProtocol::Attach(conn, handlers, path, _ws_ping); // 之后req所在的HttpContext已经销毁
+        if (buffer->valid_data_size() > 0)
+            WsProtocol::OnMessage(conn, buffer);
+    }
+    // h2c升级请求（RFC 7540 3.2）：Upgrade带h2c、Connection带Upgrade和HTTP2-Settings，HTTP2-Settings能解码
+    bool Http2Upgrade(const HttpRequest &req, std::string *settings)
+    {
+        if (!_http2 || req._version != "HTTP/1.1" || !HasToken(req, HDR_UPGRADE, "h2c"))
+            return false;
+        if (!HasToken(req, HDR_CONNECTION, "Upgrade") || !HasToken(req, HDR_CONNECTION, "HTTP2-Settings"))
+            return false;
+        const char *val = req._headers.Get("HTTP2-Settings");
+        return val != nullptr && H2Protocol::ParseSettings(val, settings);
+    }
+    // 发出101响应后把连接切换为HTTP/2，升级请求作为流1处理，它的响应以HTTP/2发出
+    void UpgradeHttp2(const conn_ptr &conn, HttpRequest &req, const std::string &settings, buf_ptr buffer)
+    {
+        HttpResponse rsp(101);
+        rsp.SetHeader("Connection", "Upgrade");
+        rsp.SetHeader("Upgrade", "h2c");
+        WriteReponse(conn, req, rsp);
+        HttpRequest upgraded = std::move(req); // 之后req所在的HttpContext就销毁了
+        H2Protocol::Attach(conn, &_h2, _max_body, buffer, &upgraded, settings);
+    }
+    // HTTP/2的一个流接收完毕：和HTTP/1.x的请求一样路由处理
+    void RouteHttp2(HttpRequest &req, HttpResponse *rsp)
+    {
+        ALLOC_SCOPE(ALLOC_HTTP);
+        Route(req, rsp);
+        CompressBody(req, rsp);
+        ALLOC_COUNT_REQUEST();
+    }
+    // 请求头部接收完毕时，按请求方法和路径查找正文消费者
+    BodyConsumer SelectConsumer(HttpRequest &req)
+    {
+        int method = MethodIndex(req._method);
+        if (method != METHOD_POST && method != METHOD_PUT)
+            return BodyConsumer();
+        req._route_params.clear();
+        const BodyConsumerFactory *factory = _body_route[method].Find(req._path, &req._route_params, &req._matches);
+        return factory != nullptr ? (*factory)(req) : BodyConsumer();
+    }
+    // 头部已经发出，把HttpStream交给处理函数；流式响应结束前暂停读取和处理后续请求
+    void StartStream(const conn_ptr &conn, HttpContext *context, const HttpRequest &req, HttpResponse &rsp, const bool &keep_alive, const uint32_t &idle)
+    {
+        bool no_body = rsp._statu < 200 || rsp._statu == 204 || rsp._statu == 304;
+        bool chunked = !no_body && req._version != "HTTP/1.0" && !rsp._headers.Has(HDR_CONTENT_LENGTH);
+        context->SetStreaming(true);
+        conn->pause_reading();
+        HttpStreamPtr stream(new HttpStream(conn, chunked, no_body || req._method == "HEAD", [this, conn, keep_alive, idle]()
+                                            {
+                                                if (!conn->is_connected())
+                                                    return; // 流式响应期间连接已经关闭
+                                                HttpContext *context = conn->get_context()->get<HttpContext>();
+                                                context->SetStreaming(false);
+                                                if (!keep_alive)
+                                                {
+                                                    ArmTimer(conn, context, HTTP_TIMER_CLOSED);
+                                                    return conn->shutdown();
+                                                }
+                                                ArmTimer(conn, context, HTTP_TIMER_IDLE, idle);
+                                                conn->resume_reading();
+                                                conn->redeliver_inbuffer(); // 处理流式响应期间到达的后续请求
+                                            },
+                                            no_body ? 0 : rsp._stream_gzip));
+        StreamHandler handler;
+        handler.swap(rsp._stream);
+        context->Reset();
+        handler(stream);
+    }
     // 设置上下文
     void OnConnected(const conn_ptr &conn)
     {
-        conn->set_context(HttpContext());
+        ALLOC_SCOPE(ALLOC_HTTP);
+        conn->set_context(HttpContext(_max_body));
+        // 连上之后一直不发请求的连接按头部时限直接断开，收到第一个字节后才开始计算头部时限
+        ArmTimer(conn, conn->get_context()->get<HttpContext>(), HTTP_TIMER_IDLE, _header_timeout);
         LOG(DEBUG, "NEW CONNECTION %p", conn.get());
     }
+    // HTTP/1.x的计时任务id，和连接的非活跃销毁（连接id）、WebSocket保活（第62位）区分开
+    static uint64_t TimerId(const conn_ptr &conn) { return conn->get_id() | ((uint64_t)1 << 61); }
+    // 切换连接的计时阶段：离开原来的阶段时取消它的任务，进入新的阶段时按sec秒计时；接收正文阶段再次调用时重新计时
+    void ArmTimer(const conn_ptr &conn, HttpContext *context, const HttpTimerPhase &phase, uint32_t sec = 0)
+    {
+        loop_ptr loop = conn->get_loop();
+        uint64_t id = TimerId(conn);
+        if (context->Timer() == HTTP_TIMER_CLOSED)
+            return;
+        if (context->Timer() == phase)
+        {
+            if (phase == HTTP_TIMER_BODY)
+                loop->refresh_task_delaytime(id);
+            return;
+        }
+        if (context->Timer() != HTTP_TIMER_NONE)
+            loop->cancel_task(id);
+        context->SetTimer(phase);
+        if (phase == HTTP_TIMER_NONE || phase == HTTP_TIMER_CLOSED || !conn->is_connected())
+            return;
+        // 时间轮一圈60秒，超过一圈的延时会被折算错
+        sec = sec == 0 ? 1 : (sec < SECWHEELCAP ? sec : SECWHEELCAP - 1);
+        std::weak_ptr<connection> weak = conn;
+        loop->add_delayed_task(id, sec, [this, weak, phase]()
+                               {
+                                   conn_ptr conn = weak.lock();
+                                   if (conn)
+                                       OnTimeout(conn, phase); });
+    }
+    // 计时到期：空闲的长连接直接关闭；请求没有在时限内接收完整（慢速客户端）回复408后关闭
+    void OnTimeout(const conn_ptr &conn, const HttpTimerPhase &phase)
+    {
+        if (!conn->is_connected())
+            return;
+        HttpContext *context = conn->get_context()->get<HttpContext>();
+        if (context->Timer() != phase)
+            return;
+        context->SetTimer(HTTP_TIMER_CLOSED);
+        LOG(DEBUG, "[http %s timeout, close][conn id:%lu]", phase == HTTP_TIMER_IDLE ? "idle" : (phase == HTTP_TIMER_HEAD ? "header" : "body"),
+            (unsigned long)conn->get_id());
+        if (phase != HTTP_TIMER_IDLE)
+        {
+            HttpRequest &req = context->Request();
+            HttpResponse rsp(408); // REQUEST TIMEOUT
+            ErrorHandler(req, &rsp);
+            WriteReponse(conn, req, rsp, HttpKeepAlive(true));
+        }
+        context->Reset();
+        conn->shutdown();
+    }
+    // 这个请求之后连接是否保持：客户端不要求关闭、没有达到请求数上限；客户端的Keep-Alive: timeout=, max=可以调小两者
+    HttpKeepAlive KeepAliveFor(HttpContext *context, const HttpRequest &req)
+    {
+        uint32_t timeout = _keepalive_timeout;
+        uint32_t left = _keepalive_max == 0 ? UINT32_MAX : (_keepalive_max > context->Requests() ? _keepalive_max - context->Requests() : 0);
+        const char *hint = req._headers.Get(HDR_KEEP_ALIVE);
+        if (hint != nullptr)
+            Util::ParseKeepAlive(hint, &timeout, &left);
+        if (timeout == 0 || left == 0)
+            return HttpKeepAlive(true);
+        return HttpKeepAlive(false, timeout, left == UINT32_MAX ? 0 : left);
+    }
     // 缓冲区数据解析+处理
     void OnMessage(const conn_ptr &conn, buf_ptr buffer)
     {
+        ALLOC_SCOPE(ALLOC_HTTP);
         while (buffer->valid_data_size() > 0)
         {
             // 1. 获取上下文
             HttpContext *context = conn->get_context()->get<HttpContext>();
+            if (context->Timer() == HTTP_TIMER_CLOSED)
+                return buffer->move_read_pos_back(buffer->valid_data_size()); // 关闭过程中不再处理后续请求
+            if (context->Streaming())
+                return; // 上一个请求的流式响应还没有结束，后续请求留在缓冲区中，结束后再处理
+            // 新请求以HTTP/2连接序言开头（prior knowledge）时切换为HTTP/2
+            if (_http2 && context->RecvStatu() == RECV_HTTP_LINE)
+            {
+                int preface = H2Protocol::MatchPreface(buffer);
+                if (preface == 0)
+                    return;
+                if (preface > 0)
+                {
+                    ArmTimer(conn, context, HTTP_TIMER_NONE);
+                    return H2Protocol::Attach(conn, &_h2, _max_body, buffer);
+                }
+            }
+            // 收到新请求的第一个字节，开始计算头部接收时限（空闲计时随之取消）
+            if (context->RecvStatu() == RECV_HTTP_LINE)
+                ArmTimer(conn, context, HTTP_TIMER_HEAD, _header_timeout);
             // 2. 通过上下文对缓冲区数据进行解析，得到HttpRequest对象
             //   1. 如果缓冲区的数据解析出错，就直接回复出错响应
             //   2. 如果解析正常，且请求已经获取完毕，才开始去进行处理
-            context->RecvHttpRequest(buffer);
+            uint64_t begin = metrics_clock::now_ns();
+            context->RecvHttpRequest(buffer, _selector);
             HttpRequest &req = context->Request();
-            HttpResponse rsp(context->RespStatu());
+            HttpResponse &rsp = context->Response(); // 和请求一起在context->Reset()时重置
+            rsp._statu = context->RespStatu();
             if (context->RespStatu() >= 400)
             {
                 // 进行错误响应，关闭连接
+                ArmTimer(conn, context, HTTP_TIMER_CLOSED);
                 ErrorHandler(req, &rsp);                               // 填充一个错误显示页面数据到rsp中
-                WriteReponse(conn, req, rsp);                          // 组织响应发送给客户端
+                WriteReponse(conn, req, rsp, HttpKeepAlive(true));     // 组织响应发送给客户端
                 context->Reset();                                      // 重置状态，不然下次不会取出数据
                 buffer->move_read_pos_back(buffer->valid_data_size()); // 出错了就把缓冲区数据清空 ？
                 return conn->shutdown();                               // 关闭连接
             }
             if (context->RecvStatu() != RECV_HTTP_OVER)
+            {
+                if (context->RecvStatu() == RECV_HTTP_BODY)
+                    ArmTimer(conn, context, HTTP_TIMER_BODY, _body_timeout);
                 return; // 当前请求还没有接收完整,则退出，等新数据到来再重新继续处理
+            }
+            ArmTimer(conn, context, HTTP_TIMER_NONE); // 处理请求期间不计时
+            context->AddRequest();
 
-            // 3. 请求路由 + 业务处理
-            Route(req, &rsp);
+            // 3. 请求路由 + 业务处理（WebSocket握手成功、h2c升级时切换协议，之后不再经过这里）
+            std::string settings;
+            if (Http2Upgrade(req, &settings))
+                return UpgradeHttp2(conn, req, settings, buffer);
+            std::shared_ptr<const WsHandlers> ws;
+            int handshake = WebSocketHandshake(req, &rsp, &ws);
+            if (handshake > 0)
+                return UpgradeWebSocket(conn, req, rsp, ws, buffer);
+            if (handshake == 0)
+            {
+                Route(req, &rsp);
+                CompressBody(req, &rsp);
+            }
+            else
+                ErrorHandler(req, &rsp);
             // 4. 对HttpResponse进行组织发送
-            WriteReponse(conn, req, rsp);
+            HttpKeepAlive ka = KeepAliveFor(context, req);
+            bool keep_alive = WriteReponse(conn, req, rsp, ka);
+            conn->get_loop()->get_metrics()->record(M_REQUEST_SERVICE, metrics_clock::now_ns() - begin);
+            ALLOC_COUNT_REQUEST();
+            if (rsp._stream)
+                return StartStream(conn, context, req, rsp, keep_alive, ka._timeout);
             // 5. 重置上下文
             context->Reset();
             // 6. 根据长短连接判断是否关闭连接或者继续处理
-            if (!rsp.IsKeepAlive())
-                conn->shutdown(); // 短链接则直接关闭
+            if (!keep_alive)
+            {
+                ArmTimer(conn, context, HTTP_TIMER_CLOSED);
+                return conn->shutdown(); // 短链接则直接关闭
+            }
+            if (buffer->valid_data_size() == 0)
+                ArmTimer(conn, context, HTTP_TIMER_IDLE, ka._timeout);
         }
     }
 
 public:
-    HttpServer(int port, int timeout = DEFALT_TIMEOUT) : _server(port)
+    HttpServer(int port, int timeout = DEFALT_TIMEOUT) : _ws_ping(WS_PING_INTERVAL), _keepalive_timeout(HTTP_KEEPALIVE_TIMEOUT), _keepalive_max(HTTP_KEEPALIVE_MAX),
+                                                         _header_timeout(HTTP_HEADER_TIMEOUT), _body_timeout(HTTP_BODY_TIMEOUT), _http2(false), _max_body(HTTP_MAX_BODY), _gzip_level(0), _gzip_min(HTTP_GZIP_MIN), _server(port)
     {
+        _selector = std::bind(&HttpServer::SelectConsumer, this, std::placeholders::_1);
+        _h2._route = std::bind(&HttpServer::RouteHttp2, this, std::placeholders::_1, std::placeholders::_2);
+        _h2._error = std::bind(&HttpServer::ErrorHandler, this, std::placeholders::_1, std::placeholders::_2);
+        _h2._selector = _selector;
         _server.set_inactive_release(timeout);
         _server.set_build_conn_callback(std::bind(&HttpServer::OnConnected, this, std::placeholders::_1));
         _server.set_handle_message_callback(std::bind(&HttpServer::OnMessage, this, std::placeholders::_1, std::placeholders::_2));
@@ -918,12 +3030,85 @@ public:
     {
         assert(Util::IsDirectory(path) == true);
         _basedir = path;
+        _file_cache.Attach(_server.get_main_loop());
+    }
+    // 启用gzip压缩（客户端的Accept-Encoding接受gzip时）：
+    //   动态响应正文达到min_size时以level级别（1~9，越大越省带宽也越耗CPU）即时压缩，0表示不压缩
+    //   静态资源优先发送同目录下的.gz文件，没有时在放入缓存时以最高级别压缩一次，之后直接使用缓存的压缩版本
+    void SetCompression(int level, size_t min_size = HTTP_GZIP_MIN)
+    {
+        _gzip_level = level < 0 ? 0 : (level > Z_BEST_COMPRESSION ? Z_BEST_COMPRESSION : level);
+        _gzip_min = min_size;
+        _file_cache.SetGzip(_gzip_level > 0 ? min_size : 0, _gzip_level);
+    }
+    // 设置静态资源缓存总大小和单个文件大小上限，max_bytes为0表示不缓存
+    void SetFileCacheLimit(size_t max_bytes, size_t max_file) { _file_cache.SetLimit(max_bytes, max_file); }
+    /*设置/添加，请求（路由模式，写法见router.hpp：字面路径、:name参数、*通配尾部，或者正则表达式）与处理函数的映射关系*/
+    void Get(const std::string &pattern, const Handler &handler) { _route[METHOD_GET].Add(pattern, handler); }
+    void Post(const std::string &pattern, const Handler &handler) { _route[METHOD_POST].Add(pattern, handler); }
+    void Put(const std::string &pattern, const Handler &handler) { _route[METHOD_PUT].Add(pattern, handler); }
+    void Delete(const std::string &pattern, const Handler &handler) { _route[METHOD_DELETE].Add(pattern, handler); }
+    /*为POST/PUT请求注册流式正文消费者：正文边接收边交给消费者，不缓存到_body中，接收完毕后照常调用Post/Put注册的处理函数*/
+    void PostBody(const std::string &pattern, const BodyConsumerFactory &factory) { _body_route[METHOD_POST].Add(pattern, factory); }
+    void PutBody(const std::string &pattern, const BodyConsumerFactory &factory) { _body_route[METHOD_PUT].Add(pattern, factory); }
+    /*WebSocket路由：路径匹配pattern的升级请求完成握手后切换为WebSocket，之后由handlers处理消息*/
+    void WebSocket(const std::string &pattern, const WsHandlers &handlers) { _ws_route.Add(pattern, std::make_shared<const WsHandlers>(handlers)); }
+    // WebSocket保活：这么多秒（1~59）没有收到数据就发送ping，再过同样时间仍没有数据则断开
+    void SetWebSocketPing(uint32_t sec) { _ws_ping = sec; }
+    // 长连接：两个请求之间空闲timeout秒（1~59，0表示每个请求之后都关闭）后关闭，每个连接最多处理max_requests个请求（0表示不限制）
+    // 响应中以Keep-Alive: timeout=, max=告知客户端，客户端的Keep-Alive头部只能调小这两个值
+    void SetKeepAlive(uint32_t timeout, uint32_t max_requests = HTTP_KEEPALIVE_MAX)
+    {
+        _keepalive_timeout = timeout;
+        _keepalive_max = max_requests;
+    }
+    // 防御慢速请求（slowloris）：请求行和头部需在header_sec秒内收完，正文每次收到数据的间隔不能超过body_sec秒，超时回复408并关闭
+    void SetRequestTimeouts(uint32_t header_sec, uint32_t body_sec)
+    {
+        _header_timeout = header_sec;
+        _body_timeout = body_sec;
+    }
+    // 接受明文HTTP/2（h2c）：以连接序言开头的连接（prior knowledge），或者HTTP/1.1的Upgrade: h2c请求
+    // 各个流照常经过上面注册的路由和处理函数，流式响应（SetStream）在HTTP/2上回复501
+    void EnableHttp2(bool on = true) { _http2 = on; }
+    // 没有注册正文消费者的请求，正文完整缓存到_body中，超过max_body回复413（需在Start之前调用）
+    void SetMaxBodySize(size_t max_body) { _max_body = max_body; }
+    // 收到SIGUSR2时热升级（需在SetThreadCount之前调用）
+    void EnableHotUpgrade(char *const argv[]) { _server.enable_hot_upgrade(argv); }
+    // 在path上以Prometheus文本格式提供本服务器各eventloop的运行指标
+    void EnableMetrics(const std::string &path = "/metrics")
+    {
+        Get(path, [this](const HttpRequest &, HttpResponse *rsp)
+            { rsp->SetContent(_server.prometheus_text(), "text/plain; version=0.0.4"); });
+    }
+    // 在path上提供连接统计（文本表格）：?id=N 查询单个连接，?loop=N 只看某个eventloop，
+    // 否则按?sort=bytes|outbuf|inbuf|rtt|retrans|idle 列出最重的?top=N个连接（默认按bytes取前20个）
+    void EnableConnStats(const std::string &path = "/connections")
+    {
+        Get(path, [this](const HttpRequest &req, HttpResponse *rsp)
+            {
+                std::vector<conn_stats_t> stats;
+                if (req.HasParam("id"))
+                {
+                    conn_stats_t st;
+                    if (_server.conn_stats(strtoull(req.GetParam("id").c_str(), nullptr, 10), &st))
+                        stats.push_back(st);
+                }
+                else if (req.HasParam("loop"))
+                    stats = _server.conn_stats(atoi(req.GetParam("loop").c_str()));
+                else
+                {
+                    static const std::unordered_map<std::string, conn_stats_key> keys = {
+                        {"bytes", CONN_BY_BYTES}, {"outbuf", CONN_BY_OUTBUFFER}, {"inbuf", CONN_BY_INBUFFER},
+                        {"rtt", CONN_BY_RTT}, {"retrans", CONN_BY_RETRANS}, {"idle", CONN_BY_IDLE}};
+                    auto it = keys.find(req.GetParam("sort"));
+                    size_t top = req.HasParam("top") ? strtoul(req.GetParam("top").c_str(), nullptr, 10) : 20;
+                    stats = _server.top_conns(top, it == keys.end() ? CONN_BY_BYTES : it->second);
+                }
+                rsp->SetContent(conn_stats_t::format(stats), "text/plain"); });
     }
-    /*设置/添加，请求（请求的正则表达）与处理函数的映射关系*/
-    void Get(const std::string &pattern, const Handler &handler) { _get_route.push_back(std::make_pair(std::regex(pattern), handler)); }
-    void Post(const std::string &pattern, const Handler &handler) { _post_route.push_back(std::make_pair(std::regex(pattern), handler)); }
-    void Put(const std::string &pattern, const Handler &handler) { _put_route.push_back(std::make_pair(std::regex(pattern), handler)); }
-    void Delete(const std::string &pattern, const Handler &handler) { _delete_route.push_back(std::make_pair(std::regex(pattern), handler)); }
+    // 卡顿检测：处理函数超过slow_callback_ms记录告警，eventloop超过stall_ms没有完成一轮循环时打印正在执行的回调
+    void EnableStallDetector(uint32_t stall_ms, uint32_t slow_callback_ms) { _server.enable_stall_detector(stall_ms, slow_callback_ms); }
     void SetThreadCount(int count) { _server.set_thread_num(count); }
     void Start() { _server.start(); }
 };
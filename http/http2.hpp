@@ -0,0 +1,1676 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <algorithm>
+#include <unordered_map>
+
+#include <cstring>
+#include <cstdint>
+
+// HTTP/2明文版本h2c（RFC 7540/7541）：连接序言或者Upgrade: h2c之后，通过connection::upgrade把连接交给H2Session
+// 每个流组装成HttpRequest后照常经过HttpServer的路由和处理函数，HttpResponse再编码成HEADERS+DATA帧
+// 帧直接在连接的接收缓冲区上解析，发送时直接写入发送缓冲区；不支持服务器推送，流式响应（SetStream）只支持HTTP/1.x
+// 用到HttpRequest/HttpResponse/HttpWriter，由http.hpp在HttpServer之前包含
+
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN 24
+#define H2_FRAME_HEADER_LEN 9
+#define H2_DEFAULT_WINDOW 65535
+#define H2_MAX_WINDOW 0x7FFFFFFF
+#define H2_MIN_FRAME 16384            // SETTINGS_MAX_FRAME_SIZE的默认值，也是接收的帧负载上限
+#define H2_MAX_FRAME 16777215
+#define H2_RECV_WINDOW (1 << 20)      // 每个流和整个连接的接收窗口
+#define H2_MAX_STREAMS 256            // 同时处理的流数上限
+#define H2_MAX_HEADER_LIST (64 << 10) // 头部列表大小上限（按RFC 7541 4.1的算法，每个字段额外算32字节）
+#define H2_OUT_HIGH (256 << 10)       // 发送缓冲区达到该值时停止生成DATA帧，回落到1/4时继续
+#define HPACK_TABLE_SIZE 4096         // 动态表大小，双方都使用默认值
+#define HPACK_STATIC_SIZE 61
+
+enum H2FrameType
+{
+    H2_DATA = 0x0,
+    H2_HEADERS = 0x1,
+    H2_PRIORITY = 0x2,
+    H2_RST_STREAM = 0x3,
+    H2_SETTINGS = 0x4,
+    H2_PUSH_PROMISE = 0x5,
+    H2_PING = 0x6,
+    H2_GOAWAY = 0x7,
+    H2_WINDOW_UPDATE = 0x8,
+    H2_CONTINUATION = 0x9
+};
+
+enum H2Flag
+{
+    H2_FLAG_END_STREAM = 0x1,
+    H2_FLAG_ACK = 0x1,
+    H2_FLAG_END_HEADERS = 0x4,
+    H2_FLAG_PADDED = 0x8,
+    H2_FLAG_PRIORITY = 0x20
+};
+
+enum H2ErrorCode
+{
+    H2_NO_ERROR = 0x0,
+    H2_PROTOCOL_ERROR = 0x1,
+    H2_INTERNAL_ERROR = 0x2,
+    H2_FLOW_CONTROL_ERROR = 0x3,
+    H2_STREAM_CLOSED = 0x5,
+    H2_FRAME_SIZE_ERROR = 0x6,
+    H2_REFUSED_STREAM = 0x7,
+    H2_CANCEL = 0x8,
+    H2_COMPRESSION_ERROR = 0x9,
+    H2_ENHANCE_YOUR_CALM = 0xb
+};
+
+enum H2SettingId
+{
+    H2_SETTINGS_HEADER_TABLE_SIZE = 0x1,
+    H2_SETTINGS_ENABLE_PUSH = 0x2,
+    H2_SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+    H2_SETTINGS_INITIAL_WINDOW_SIZE = 0x4,
+    H2_SETTINGS_MAX_FRAME_SIZE = 0x5,
+    H2_SETTINGS_MAX_HEADER_LIST_SIZE = 0x6
+};
+
+// HPACK的Huffman编码（RFC 7541附录B）
+// 解码用按4位一步的状态机：状态是解码树的内部结点，启动时由编码表生成，每步最多产生一个符号（最短的码也有5位）
+class Huffman
+{
+private:
+    struct Sym
+    {
+        uint32_t _code;
+        uint8_t _len;
+    };
+
+    static const Sym *Codes()
+    {
+        static const Sym codes[257] = {
+            {0x1ff8, 13}, {0x7fffd8, 23}, {0xfffffe2, 28}, {0xfffffe3, 28},
+            {0xfffffe4, 28}, {0xfffffe5, 28}, {0xfffffe6, 28}, {0xfffffe7, 28},
+            {0xfffffe8, 28}, {0xffffea, 24}, {0x3ffffffc, 30}, {0xfffffe9, 28},
+            {0xfffffea, 28}, {0x3ffffffd, 30}, {0xfffffeb, 28}, {0xfffffec, 28},
+            {0xfffffed, 28}, {0xfffffee, 28}, {0xfffffef, 28}, {0xffffff0, 28},
+            {0xffffff1, 28}, {0xffffff2, 28}, {0x3ffffffe, 30}, {0xffffff3, 28},
+            {0xffffff4, 28}, {0xffffff5, 28}, {0xffffff6, 28}, {0xffffff7, 28},
+            {0xffffff8, 28}, {0xffffff9, 28}, {0xffffffa, 28}, {0xffffffb, 28},
+            {0x14, 6}, {0x3f8, 10}, {0x3f9, 10}, {0xffa, 12},
+            {0x1ff9, 13}, {0x15, 6}, {0xf8, 8}, {0x7fa, 11},
+            {0x3fa, 10}, {0x3fb, 10}, {0xf9, 8}, {0x7fb, 11},
+            {0xfa, 8}, {0x16, 6}, {0x17, 6}, {0x18, 6},
+            {0x0, 5}, {0x1, 5}, {0x2, 5}, {0x19, 6},
+            {0x1a, 6}, {0x1b, 6}, {0x1c, 6}, {0x1d, 6},
+            {0x1e, 6}, {0x1f, 6}, {0x5c, 7}, {0xfb, 8},
+            {0x7ffc, 15}, {0x20, 6}, {0xffb, 12}, {0x3fc, 10},
+            {0x1ffa, 13}, {0x21, 6}, {0x5d, 7}, {0x5e, 7},
+            {0x5f, 7}, {0x60, 7}, {0x61, 7}, {0x62, 7},
+            {0x63, 7}, {0x64, 7}, {0x65, 7}, {0x66, 7},
+            {0x67, 7}, {0x68, 7}, {0x69, 7}, {0x6a, 7},
+            {0x6b, 7}, {0x6c, 7}, {0x6d, 7}, {0x6e, 7},
+            {0x6f, 7}, {0x70, 7}, {0x71, 7}, {0x72, 7},
+            {0xfc, 8}, {0x73, 7}, {0xfd, 8}, {0x1ffb, 13},
+            {0x7fff0, 19}, {0x1ffc, 13}, {0x3ffc, 14}, {0x22, 6},
+            {0x7ffd, 15}, {0x3, 5}, {0x23, 6}, {0x4, 5},
+            {0x24, 6}, {0x5, 5}, {0x25, 6}, {0x26, 6},
+            {0x27, 6}, {0x6, 5}, {0x74, 7}, {0x75, 7},
+            {0x28, 6}, {0x29, 6}, {0x2a, 6}, {0x7, 5},
+            {0x2b, 6}, {0x76, 7}, {0x2c, 6}, {0x8, 5},
+            {0x9, 5}, {0x2d, 6}, {0x77, 7}, {0x78, 7},
+            {0x79, 7}, {0x7a, 7}, {0x7b, 7}, {0x7ffe, 15},
+            {0x7fc, 11}, {0x3ffd, 14}, {0x1ffd, 13}, {0xffffffc, 28},
+            {0xfffe6, 20}, {0x3fffd2, 22}, {0xfffe7, 20}, {0xfffe8, 20},
+            {0x3fffd3, 22}, {0x3fffd4, 22}, {0x3fffd5, 22}, {0x7fffd9, 23},
+            {0x3fffd6, 22}, {0x7fffda, 23}, {0x7fffdb, 23}, {0x7fffdc, 23},
+            {0x7fffdd, 23}, {0x7fffde, 23}, {0xffffeb, 24}, {0x7fffdf, 23},
+            {0xffffec, 24}, {0xffffed, 24}, {0x3fffd7, 22}, {0x7fffe0, 23},
+            {0xffffee, 24}, {0x7fffe1, 23}, {0x7fffe2, 23}, {0x7fffe3, 23},
+            {0x7fffe4, 23}, {0x1fffdc, 21}, {0x3fffd8, 22}, {0x7fffe5, 23},
+            {0x3fffd9, 22}, {0x7fffe6, 23}, {0x7fffe7, 23}, {0xffffef, 24},
+            {0x3fffda, 22}, {0x1fffdd, 21}, {0xfffe9, 20}, {0x3fffdb, 22},
+            {0x3fffdc, 22}, {0x7fffe8, 23}, {0x7fffe9, 23}, {0x1fffde, 21},
+            {0x7fffea, 23}, {0x3fffdd, 22}, {0x3fffde, 22}, {0xfffff0, 24},
+            {0x1fffdf, 21}, {0x3fffdf, 22}, {0x7fffeb, 23}, {0x7fffec, 23},
+            {0x1fffe0, 21}, {0x1fffe1, 21}, {0x3fffe0, 22}, {0x1fffe2, 21},
+            {0x7fffed, 23}, {0x3fffe1, 22}, {0x7fffee, 23}, {0x7fffef, 23},
+            {0xfffea, 20}, {0x3fffe2, 22}, {0x3fffe3, 22}, {0x3fffe4, 22},
+            {0x7ffff0, 23}, {0x3fffe5, 22}, {0x3fffe6, 22}, {0x7ffff1, 23},
+            {0x3ffffe0, 26}, {0x3ffffe1, 26}, {0xfffeb, 20}, {0x7fff1, 19},
+            {0x3fffe7, 22}, {0x7ffff2, 23}, {0x3fffe8, 22}, {0x1ffffec, 25},
+            {0x3ffffe2, 26}, {0x3ffffe3, 26}, {0x3ffffe4, 26}, {0x7ffffde, 27},
+            {0x7ffffdf, 27}, {0x3ffffe5, 26}, {0xfffff1, 24}, {0x1ffffed, 25},
+            {0x7fff2, 19}, {0x1fffe3, 21}, {0x3ffffe6, 26}, {0x7ffffe0, 27},
+            {0x7ffffe1, 27}, {0x3ffffe7, 26}, {0x7ffffe2, 27}, {0xfffff2, 24},
+            {0x1fffe4, 21}, {0x1fffe5, 21}, {0x3ffffe8, 26}, {0x3ffffe9, 26},
+            {0xffffffd, 28}, {0x7ffffe3, 27}, {0x7ffffe4, 27}, {0x7ffffe5, 27},
+            {0xfffec, 20}, {0xfffff3, 24}, {0xfffed, 20}, {0x1fffe6, 21},
+            {0x3fffe9, 22}, {0x1fffe7, 21}, {0x1fffe8, 21}, {0x7ffff3, 23},
+            {0x3fffea, 22}, {0x3fffeb, 22}, {0x1ffffee, 25}, {0x1ffffef, 25},
+            {0xfffff4, 24}, {0xfffff5, 24}, {0x3ffffea, 26}, {0x7ffff4, 23},
+            {0x3ffffeb, 26}, {0x7ffffe6, 27}, {0x3ffffec, 26}, {0x3ffffed, 26},
+            {0x7ffffe7, 27}, {0x7ffffe8, 27}, {0x7ffffe9, 27}, {0x7ffffea, 27},
+            {0x7ffffeb, 27}, {0xffffffe, 28}, {0x7ffffec, 27}, {0x7ffffed, 27},
+            {0x7ffffee, 27}, {0x7ffffef, 27}, {0x7fffff0, 27}, {0x3ffffee, 26},
+            {0x3fffffff, 30}}; // EOS
+        return codes;
+    }
+
+    enum
+    {
+        STEP_SYM = 1,    // 这一步产生了一个符号
+        STEP_FAIL = 2,   // 遇到EOS
+        STEP_ACCEPT = 4, // 停在这里时，自上一个符号以来的位都是1且不足8位，可以作为填充结束
+    };
+    struct Step
+    {
+        uint8_t _state;
+        uint8_t _flags;
+        uint8_t _sym;
+    };
+
+    struct Machine
+    {
+        Step _steps[256][16];
+        bool _accept[256];
+
+        Machine()
+        {
+            // 建解码树：结点的两个子结点，正数是内部结点下标，负数是-(符号+1)，0表示还没有
+            std::vector<std::pair<int, int>> tree(1, std::make_pair(0, 0));
+            const Sym *codes = Codes();
+            for (int sym = 0; sym < 257; ++sym)
+            {
+                int node = 0;
+                for (int i = codes[sym]._len - 1; i >= 0; --i)
+                {
+                    int &child = (codes[sym]._code >> i) & 1 ? tree[node].second : tree[node].first;
+                    if (i == 0)
+                    {
+                        child = -(sym + 1);
+                        break;
+                    }
+                    if (child == 0)
+                    {
+                        child = tree.size();
+                        tree.push_back(std::make_pair(0, 0)); // child可能因此失效，之后不再使用
+                    }
+                    node = (codes[sym]._code >> i) & 1 ? tree[node].second : tree[node].first;
+                }
+            }
+            // 从根沿着全1走不超过7步的结点可以作为结束状态
+            memset(_accept, 0, sizeof(_accept));
+            for (int node = 0, depth = 0; depth < 8 && node >= 0; ++depth)
+            {
+                _accept[node] = true;
+                node = tree[node].second;
+            }
+            for (size_t state = 0; state < tree.size(); ++state)
+            {
+                for (int nibble = 0; nibble < 16; ++nibble)
+                {
+                    Step step = {0, 0, 0};
+                    int node = state;
+                    for (int i = 3; i >= 0; --i)
+                    {
+                        int next = (nibble >> i) & 1 ? tree[node].second : tree[node].first;
+                        if (next < 0)
+                        {
+                            if (next == -257)
+                            {
+                                step._flags |= STEP_FAIL;
+                                break;
+                            }
+                            step._flags |= STEP_SYM;
+                            step._sym = -next - 1;
+                            next = 0;
+                        }
+                        node = next;
+                    }
+                    step._state = node;
+                    _steps[state][nibble] = step;
+                }
+            }
+        }
+    };
+
+    static const Machine &Instance()
+    {
+        static Machine s_machine;
+        return s_machine;
+    }
+
+public:
+    static size_t EncodedSize(const char *data, const size_t &len)
+    {
+        const Sym *codes = Codes();
+        uint64_t bits = 0;
+        for (size_t i = 0; i < len; ++i)
+            bits += codes[(uint8_t)data[i]]._len;
+        return (bits + 7) / 8;
+    }
+
+    static void Encode(const char *data, const size_t &len, std::string *out)
+    {
+        const Sym *codes = Codes();
+        uint64_t acc = 0;
+        int n = 0;
+        for (size_t i = 0; i < len; ++i)
+        {
+            const Sym &s = codes[(uint8_t)data[i]];
+            acc = (acc << s._len) | s._code;
+            n += s._len;
+            while (n >= 8)
+            {
+                n -= 8;
+                *out += (char)(acc >> n);
+            }
+        }
+        if (n > 0) // 用EOS的高位（全1）补齐最后一个字节
+            *out += (char)((acc << (8 - n)) | (0xFF >> n));
+    }
+
+    // 解码失败（含EOS、填充超过7位或者不全是1）返回false
+    static bool Decode(const uint8_t *data, const size_t &len, std::string *out)
+    {
+        const Machine &m = Instance();
+        uint8_t state = 0;
+        for (size_t i = 0; i < len; ++i)
+        {
+            for (int half = 0; half < 2; ++half)
+            {
+                const Step &step = m._steps[state][half == 0 ? data[i] >> 4 : data[i] & 0xF];
+                if (step._flags & STEP_FAIL)
+                    return false;
+                if (step._flags & STEP_SYM)
+                    *out += (char)step._sym;
+                state = step._state;
+            }
+        }
+        return m._accept[state];
+    }
+};
+
+// HPACK的头部表：1~61是静态表，之后是动态表（新加入的下标最小）
+class HpackTable
+{
+private:
+    std::deque<std::pair<std::string, std::string>> _entries;
+    size_t _size;     // 按RFC 7541 4.1计算的大小：名字+值+32
+    size_t _max_size; // 当前的最大大小
+
+    static const std::vector<std::pair<std::string, std::string>> &Static()
+    {
+        static const std::vector<std::pair<std::string, std::string>> s_table = {
+            {":authority", ""}, {":method", "GET"}, {":method", "POST"},
+            {":path", "/"}, {":path", "/index.html"}, {":scheme", "http"},
+            {":scheme", "https"}, {":status", "200"}, {":status", "204"},
+            {":status", "206"}, {":status", "304"}, {":status", "400"},
+            {":status", "404"}, {":status", "500"}, {"accept-charset", ""},
+            {"accept-encoding", "gzip, deflate"}, {"accept-language", ""}, {"accept-ranges", ""},
+            {"accept", ""}, {"access-control-allow-origin", ""}, {"age", ""},
+            {"allow", ""}, {"authorization", ""}, {"cache-control", ""},
+            {"content-disposition", ""}, {"content-encoding", ""}, {"content-language", ""},
+            {"content-length", ""}, {"content-location", ""}, {"content-range", ""},
+            {"content-type", ""}, {"cookie", ""}, {"date", ""},
+            {"etag", ""}, {"expect", ""}, {"expires", ""},
+            {"from", ""}, {"host", ""}, {"if-match", ""},
+            {"if-modified-since", ""}, {"if-none-match", ""}, {"if-range", ""},
+            {"if-unmodified-since", ""}, {"last-modified", ""}, {"link", ""},
+            {"location", ""}, {"max-forwards", ""}, {"proxy-authenticate", ""},
+            {"proxy-authorization", ""}, {"range", ""}, {"referer", ""},
+            {"refresh", ""}, {"retry-after", ""}, {"server", ""},
+            {"set-cookie", ""}, {"strict-transport-security", ""}, {"transfer-encoding", ""},
+            {"user-agent", ""}, {"vary", ""}, {"via", ""},
+            {"www-authenticate", ""}
+        };
+        return s_table;
+    }
+    // 静态表中名字第一次出现的下标
+    static std::unordered_map<std::string, size_t> BuildNames()
+    {
+        std::unordered_map<std::string, size_t> names;
+        for (size_t i = Static().size(); i > 0; --i)
+            names[Static()[i - 1].first] = i;
+        return names;
+    }
+    static const std::unordered_map<std::string, size_t> &StaticNames()
+    {
+        static const std::unordered_map<std::string, size_t> s_names = BuildNames();
+        return s_names;
+    }
+
+    static size_t EntrySize(const std::string &name, const std::string &value) { return name.size() + value.size() + 32; }
+
+    void Evict(const size_t &room)
+    {
+        while (!_entries.empty() && _size + room > _max_size)
+        {
+            _size -= EntrySize(_entries.back().first, _entries.back().second);
+            _entries.pop_back();
+        }
+    }
+
+public:
+    HpackTable() : _size(0), _max_size(HPACK_TABLE_SIZE) {}
+
+    size_t MaxSize() const { return _max_size; }
+    void SetMaxSize(const size_t &max_size)
+    {
+        _max_size = max_size;
+        Evict(0);
+    }
+
+    // 加入动态表，比整个表还大的项只是清空表
+    void Add(const std::string &name, const std::string &value)
+    {
+        size_t size = EntrySize(name, value);
+        Evict(size);
+        if (size > _max_size)
+            return;
+        _entries.push_front(std::make_pair(name, value));
+        _size += size;
+    }
+
+    const std::pair<std::string, std::string> *Get(const uint64_t &index) const
+    {
+        if (index == 0)
+            return nullptr;
+        if (index <= HPACK_STATIC_SIZE)
+            return &Static()[index - 1];
+        if (index - HPACK_STATIC_SIZE > _entries.size())
+            return nullptr;
+        return &_entries[index - HPACK_STATIC_SIZE - 1];
+    }
+
+    // 查找可以引用的项：名字和值都相同时*full为true，否则是名字相同的项，没有返回0
+    size_t Find(const std::string &name, const std::string &value, bool *full) const
+    {
+        *full = false;
+        size_t name_index = 0;
+        auto it = StaticNames().find(name);
+        if (it != StaticNames().end())
+        {
+            name_index = it->second;
+            for (size_t i = it->second; i <= HPACK_STATIC_SIZE && Static()[i - 1].first == name; ++i)
+            {
+                if (Static()[i - 1].second == value)
+                {
+                    *full = true;
+                    return i;
+                }
+            }
+        }
+        for (size_t i = 0; i < _entries.size(); ++i)
+        {
+            if (_entries[i].first != name)
+                continue;
+            if (_entries[i].second == value)
+            {
+                *full = true;
+                return HPACK_STATIC_SIZE + 1 + i;
+            }
+            if (name_index == 0)
+                name_index = HPACK_STATIC_SIZE + 1 + i;
+        }
+        return name_index;
+    }
+};
+
+// HPACK基本类型：带前缀的整数和字符串（RFC 7541 5.1/5.2）
+class Hpack
+{
+public:
+    static void PutInt(std::string *out, const uint8_t &first, const int &prefix, uint64_t value)
+    {
+        uint8_t max = (1 << prefix) - 1;
+        if (value < max)
+        {
+            *out += (char)(first | value);
+            return;
+        }
+        *out += (char)(first | max);
+        value -= max;
+        while (value >= 128)
+        {
+            *out += (char)(0x80 | (value & 0x7F));
+            value >>= 7;
+        }
+        *out += (char)value;
+    }
+
+    // 整数超过32位视为错误
+    static bool GetInt(const uint8_t *&p, const uint8_t *end, const int &prefix, uint64_t *value)
+    {
+        if (p == end)
+            return false;
+        uint8_t max = (1 << prefix) - 1;
+        *value = *p++ & max;
+        if (*value < max)
+            return true;
+        for (int shift = 0; p < end && shift <= 28; shift += 7)
+        {
+            uint8_t b = *p++;
+            *value += (uint64_t)(b & 0x7F) << shift;
+            if (!(b & 0x80))
+                return *value <= UINT32_MAX;
+        }
+        return false;
+    }
+
+    // Huffman编码更短时使用Huffman编码
+    static void PutString(std::string *out, const std::string &str)
+    {
+        size_t huff = Huffman::EncodedSize(str.data(), str.size());
+        if (huff < str.size())
+        {
+            PutInt(out, 0x80, 7, huff);
+            Huffman::Encode(str.data(), str.size(), out);
+            return;
+        }
+        PutInt(out, 0x00, 7, str.size());
+        out->append(str);
+    }
+
+    static bool GetString(const uint8_t *&p, const uint8_t *end, std::string *str)
+    {
+        if (p == end)
+            return false;
+        bool huff = *p & 0x80;
+        uint64_t len = 0;
+        if (!GetInt(p, end, 7, &len) || len > (uint64_t)(end - p))
+            return false;
+        str->clear();
+        if (huff && !Huffman::Decode(p, len, str))
+            return false;
+        if (!huff)
+            str->assign((const char *)p, len);
+        p += len;
+        return true;
+    }
+};
+
+using HeaderList = std::vector<std::pair<std::string, std::string>>;
+
+// 头部块解码，动态表大小以本端的SETTINGS_HEADER_TABLE_SIZE（默认值）为上限
+class HpackDecoder
+{
+private:
+    HpackTable _table;
+
+public:
+    // 解码一个完整的头部块，失败（连接错误COMPRESSION_ERROR）返回false
+    // 解码边累计头部列表大小，超过H2_MAX_HEADER_LIST后的字段不再放入headers，只维护动态表，*too_large置为true
+    // 不能等解码完再检查：一个很小的头部块可以反复引用动态表中的大字段，展开后占用大量内存
+    bool Decode(const uint8_t *p, const size_t &len, HeaderList *headers, bool *too_large)
+    {
+        const uint8_t *end = p + len;
+        bool first = true;
+        size_t list_size = 0;
+        *too_large = false;
+        while (p < end)
+        {
+            uint8_t b = *p;
+            uint64_t index = 0;
+            if (b & 0x80) // 索引
+            {
+                if (!Hpack::GetInt(p, end, 7, &index))
+                    return false;
+                const std::pair<std::string, std::string> *entry = _table.Get(index);
+                if (entry == nullptr)
+                    return false;
+                list_size += entry->first.size() + entry->second.size() + 32;
+                if (list_size > H2_MAX_HEADER_LIST)
+                    *too_large = true;
+                else
+                    headers->push_back(*entry);
+            }
+            else if ((b & 0xE0) == 0x20) // 动态表大小更新，只能出现在头部块开头
+            {
+                if (!first || !Hpack::GetInt(p, end, 5, &index) || index > HPACK_TABLE_SIZE)
+                    return false;
+                _table.SetMaxSize(index);
+                continue;
+            }
+            else // 字面值：01增量索引，0000不索引，0001永不索引
+            {
+                int prefix = (b & 0xC0) == 0x40 ? 6 : 4;
+                if (!Hpack::GetInt(p, end, prefix, &index))
+                    return false;
+                std::pair<std::string, std::string> field;
+                if (index > 0)
+                {
+                    const std::pair<std::string, std::string> *entry = _table.Get(index);
+                    if (entry == nullptr)
+                        return false;
+                    field.first = entry->first;
+                }
+                else if (!Hpack::GetString(p, end, &field.first))
+                    return false;
+                if (!Hpack::GetString(p, end, &field.second))
+                    return false;
+                if (prefix == 6)
+                    _table.Add(field.first, field.second);
+                list_size += field.first.size() + field.second.size() + 32;
+                if (list_size > H2_MAX_HEADER_LIST)
+                    *too_large = true;
+                else
+                    headers->push_back(std::move(field));
+            }
+            first = false;
+        }
+        return true;
+    }
+};
+
+// 头部块编码：能引用的引用静态表/动态表，其余以字面值发出，常见且取值变化少的字段加入动态表
+class HpackEncoder
+{
+private:
+    HpackTable _table;
+    bool _resize;       // 对端改了表大小，下一个头部块开头要发出大小更新
+    size_t _min_size;   // 两个头部块之间出现过的最小表大小，要先于最终大小发出
+
+    // 每个响应都不同的字段不加入动态表，免得挤掉有用的项
+    static bool Indexable(const std::string &name)
+    {
+        return name != "content-length" && name != "content-range" && name != "etag" && name != "last-modified" && name != "location";
+    }
+
+public:
+    HpackEncoder() : _resize(false), _min_size(HPACK_TABLE_SIZE) {}
+
+    // 对端的SETTINGS_HEADER_TABLE_SIZE，本端最多使用默认大小
+    void SetMaxSize(size_t size)
+    {
+        size = std::min<size_t>(size, HPACK_TABLE_SIZE);
+        if (size == _table.MaxSize() && !_resize)
+            return;
+        _min_size = _resize ? std::min(_min_size, size) : size;
+        _resize = true;
+        _table.SetMaxSize(size);
+    }
+
+    void Begin(std::string *out)
+    {
+        if (!_resize)
+            return;
+        if (_min_size < _table.MaxSize())
+            Hpack::PutInt(out, 0x20, 5, _min_size);
+        Hpack::PutInt(out, 0x20, 5, _table.MaxSize());
+        _resize = false;
+    }
+
+    // name必须是小写
+    void Encode(const std::string &name, const std::string &value, std::string *out)
+    {
+        bool full = false;
+        size_t index = _table.Find(name, value, &full);
+        if (full)
+            return Hpack::PutInt(out, 0x80, 7, index);
+        if (name == "set-cookie" || name == "authorization")
+            Hpack::PutInt(out, 0x10, 4, index);
+        else if (Indexable(name))
+        {
+            Hpack::PutInt(out, 0x40, 6, index);
+            _table.Add(name, value);
+        }
+        else
+            Hpack::PutInt(out, 0x00, 4, index);
+        if (index == 0)
+            Hpack::PutString(out, name);
+        Hpack::PutString(out, value);
+    }
+};
+
+// HttpServer提供的请求处理
+struct H2Handlers
+{
+    std::function<void(HttpRequest &, HttpResponse *)> _route;       // 路由和业务处理（包括压缩等后处理）
+    std::function<void(const HttpRequest &, HttpResponse *)> _error; // 按rsp的状态码填充错误页面
+    BodyConsumerSelector _selector;                                  // 选择流式正文消费者
+};
+
+// 一个流：请求的接收状态和响应正文的发送状态
+struct H2Stream
+{
+    uint32_t _id;
+    HttpRequest _req;
+    BodyConsumer _consumer;
+    bool _end_recv;          // 收到了END_STREAM（半关闭（远端））
+    uint64_t _recv_bytes;    // 收到的正文长度，用来校验Content-Length
+    int64_t _recv_window;    // 本端的接收窗口
+    uint32_t _recv_unacked;  // 已经消费、还没有通过WINDOW_UPDATE归还的窗口
+    int64_t _send_window;    // 对端的接收窗口，可以因为SETTINGS变成负数
+    bool _queued;            // 在发送队列中
+    bool _responded;         // 已经发出响应头部（包括提前回复的错误），之后收到的正文和trailer只做流量控制，不再交给上层
+
+    // multipart正文中还没有开始发送的段：段头部和文件窗口，大文件的多个范围逐段读取，不一次读入内存
+    struct Part
+    {
+        std::string _head;
+        uint64_t _offset;
+        uint64_t _len;
+    };
+
+    // 响应正文：先发内存中的数据，再发文件窗口，都发完后换到下一段
+    std::string _body;   // 动态响应正文、拼好的multipart正文、当前段的头部
+    FileEntryPtr _file;  // 正文直接引用缓存项时保持引用
+    const char *_data;
+    uint64_t _data_left;
+    file_ptr _fd;        // 内容不在内存中的大文件
+    uint64_t _file_offset;
+    uint64_t _file_left;
+    std::deque<Part> _parts;
+    uint64_t _parts_left; // _parts的总字节数
+
+    H2Stream(const uint32_t &id, const int64_t &send_window)
+        : _id(id), _end_recv(false), _recv_bytes(0), _recv_window(H2_RECV_WINDOW), _recv_unacked(0), _send_window(send_window),
+          _queued(false), _responded(false), _data(nullptr), _data_left(0), _file_offset(0), _file_left(0), _parts_left(0) {}
+
+    uint64_t Pending() const { return _data_left + _file_left + _parts_left; }
+    // 当前段的字节数，当前段发完时先换到下一段
+    uint64_t Current()
+    {
+        while (_data_left + _file_left == 0 && !_parts.empty())
+        {
+            Part &part = _parts.front();
+            _body.swap(part._head);
+            _data = _body.data();
+            _data_left = _body.size();
+            _file_offset = part._offset;
+            _file_left = part._len;
+            _parts_left -= _data_left + _file_left;
+            _parts.pop_front();
+        }
+        return _data_left + _file_left;
+    }
+};
+
+class H2Session;
+using H2SessionPtr = std::shared_ptr<H2Session>;
+
+// 一个HTTP/2连接，作为连接的上下文，只在连接所属的线程中使用
+class H2Session
+{
+    friend class H2Protocol;
+
+private:
+    const H2Handlers *_handlers;
+    size_t _max_body;             // 没有正文消费者的请求，正文上限
+    connection *_conn;            // 处理收到的数据期间有效
+    size_t _preface_left;         // 还没有收到的连接序言字节数
+    bool _settings_recv;          // 收到过对端的SETTINGS，序言之后的第一个帧必须是SETTINGS
+    bool _dead;                   // 已经发出GOAWAY，丢弃之后收到的数据
+    bool _peer_goaway;            // 对端发来了GOAWAY，处理完已有的流后关闭
+    HpackDecoder _decoder;
+    HpackEncoder _encoder;
+    std::unordered_map<uint32_t, std::unique_ptr<H2Stream>> _streams;
+    std::deque<uint32_t> _send_queue; // 有正文待发送的流，轮流发送
+    uint32_t _last_stream_id;     // 收到的最大流标识
+    uint32_t _cont_stream;        // 头部块还没有结束（等待CONTINUATION）的流，0表示没有
+    bool _cont_end_stream;        // 该头部块的HEADERS帧带有END_STREAM
+    std::string _header_block;    // 分成多个帧的头部块
+    int64_t _send_window;         // 连接级的发送窗口
+    int64_t _recv_window;         // 连接级的接收窗口
+    uint32_t _recv_unacked;
+    uint32_t _peer_initial_window; // 对端的SETTINGS_INITIAL_WINDOW_SIZE
+    uint32_t _peer_max_frame;      // 对端的SETTINGS_MAX_FRAME_SIZE
+    std::string _block_out;        // 复用的头部块编码空间
+
+public:
+    H2Session(const H2Handlers *handlers, const size_t &max_body)
+        : _handlers(handlers), _max_body(max_body), _conn(nullptr), _preface_left(H2_PREFACE_LEN), _settings_recv(false), _dead(false),
+          _peer_goaway(false), _last_stream_id(0), _cont_stream(0), _cont_end_stream(false), _send_window(H2_DEFAULT_WINDOW),
+          _recv_window(H2_DEFAULT_WINDOW), _recv_unacked(0), _peer_initial_window(H2_DEFAULT_WINDOW), _peer_max_frame(H2_MIN_FRAME) {}
+
+    H2Session(const H2Session &) = delete;
+    H2Session &operator=(const H2Session &) = delete;
+
+private:
+    static uint32_t Get32(const uint8_t *p) { return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3]; }
+    static void Put32(char *p, const uint32_t &v)
+    {
+        p[0] = (char)(v >> 24);
+        p[1] = (char)(v >> 16);
+        p[2] = (char)(v >> 8);
+        p[3] = (char)v;
+    }
+
+    /*发送*/
+    void WriteFrameHeader(const size_t &len, const uint8_t &type, const uint8_t &flags, const uint32_t &id)
+    {
+        char head[H2_FRAME_HEADER_LEN];
+        head[0] = (char)(len >> 16);
+        head[1] = (char)(len >> 8);
+        head[2] = (char)len;
+        head[3] = (char)type;
+        head[4] = (char)flags;
+        Put32(head + 5, id);
+        _conn->outbuffer()->write(head, sizeof(head));
+    }
+    void WriteFrame(const uint8_t &type, const uint8_t &flags, const uint32_t &id, const char *payload, const size_t &len)
+    {
+        WriteFrameHeader(len, type, flags, id);
+        if (len > 0)
+            _conn->outbuffer()->write(payload, len);
+    }
+    void WriteRst(const uint32_t &id, const uint32_t &code)
+    {
+        char payload[4];
+        Put32(payload, code);
+        WriteFrame(H2_RST_STREAM, 0, id, payload, 4);
+    }
+    void WriteWindowUpdate(const uint32_t &id, const uint32_t &increment)
+    {
+        char payload[4];
+        Put32(payload, increment);
+        WriteFrame(H2_WINDOW_UPDATE, 0, id, payload, 4);
+    }
+    void WriteSettings()
+    {
+        const uint32_t settings[][2] = {{H2_SETTINGS_MAX_CONCURRENT_STREAMS, H2_MAX_STREAMS},
+                                        {H2_SETTINGS_INITIAL_WINDOW_SIZE, H2_RECV_WINDOW},
+                                        {H2_SETTINGS_MAX_HEADER_LIST_SIZE, H2_MAX_HEADER_LIST}};
+        char payload[sizeof(settings) / sizeof(settings[0]) * 6];
+        for (size_t i = 0; i < sizeof(settings) / sizeof(settings[0]); ++i)
+        {
+            payload[i * 6] = (char)(settings[i][0] >> 8);
+            payload[i * 6 + 1] = (char)settings[i][0];
+            Put32(payload + i * 6 + 2, settings[i][1]);
+        }
+        WriteFrame(H2_SETTINGS, 0, 0, payload, sizeof(payload));
+    }
+    // 头部块超过对端的帧大小上限时拆成HEADERS+CONTINUATION
+    void WriteHeaders(const uint32_t &id, const HeaderList &headers, const bool &end_stream)
+    {
+        _block_out.clear();
+        _encoder.Begin(&_block_out);
+        for (auto &field : headers)
+            _encoder.Encode(field.first, field.second, &_block_out);
+        size_t offset = 0;
+        do
+        {
+            size_t n = std::min<size_t>(_block_out.size() - offset, _peer_max_frame);
+            uint8_t flags = offset + n == _block_out.size() ? H2_FLAG_END_HEADERS : 0;
+            if (offset == 0 && end_stream)
+                flags |= H2_FLAG_END_STREAM;
+            WriteFrame(offset == 0 ? H2_HEADERS : H2_CONTINUATION, flags, id, _block_out.data() + offset, n);
+            offset += n;
+        } while (offset < _block_out.size());
+    }
+
+    // 连接错误：发出GOAWAY后关闭连接，之后收到的数据都丢弃
+    void GoAway(const uint32_t &code)
+    {
+        if (_dead)
+            return;
+        char payload[8];
+        Put32(payload, _last_stream_id);
+        Put32(payload + 4, code);
+        WriteFrame(H2_GOAWAY, 0, 0, payload, sizeof(payload));
+        _dead = true;
+        _streams.clear();
+        _send_queue.clear();
+        _conn->flush_outbuffer();
+        _conn->shutdown();
+    }
+
+    /*响应*/
+    static std::string Lower(const std::string &s)
+    {
+        std::string out(s);
+        std::transform(out.begin(), out.end(), out.begin(), ::tolower);
+        return out;
+    }
+    // HTTP/2不允许的连接级字段
+    static bool ConnectionSpecific(const std::string &name)
+    {
+        return name == "connection" || name == "keep-alive" || name == "proxy-connection" || name == "transfer-encoding" || name == "upgrade";
+    }
+    // 缓存项中预先生成的 "名字: 值\r\n" 头部行
+    static void AddLines(const std::string &lines, HeaderList *headers)
+    {
+        size_t pos = 0;
+        while (pos < lines.size())
+        {
+            size_t colon = lines.find(": ", pos), eol = lines.find("\r\n", pos);
+            if (colon == std::string::npos || eol == std::string::npos || colon > eol)
+                break;
+            headers->push_back(std::make_pair(Lower(lines.substr(pos, colon - pos)), lines.substr(colon + 2, eol - colon - 2)));
+            pos = eol + 2;
+        }
+    }
+    static const std::string &Date()
+    {
+        static thread_local time_t t_sec = 0;
+        static thread_local std::string t_date;
+        time_t now = time(nullptr);
+        if (now != t_sec)
+        {
+            t_date = Util::HttpDate(now);
+            t_sec = now;
+        }
+        return t_date;
+    }
+    // 读出大文件的一个窗口，文件被截断时剩下的补0，保证和content-length一致
+    static void ReadWindow(const file_ptr &fd, const uint64_t &offset, const uint64_t &len, char *dst)
+    {
+        uint64_t total = 0;
+        while (total < len)
+        {
+            ssize_t n = pread(fd->fd(), dst + total, len - total, offset + total);
+            if (n == -1 && errno == EINTR)
+                continue;
+            if (n <= 0)
+            {
+                memset(dst + total, 0, len - total);
+                break;
+            }
+            total += n;
+        }
+    }
+
+    // 和HttpWriter::Write相同的规则生成响应头部，正文交给流，返回是否有正文要发送
+    bool PrepareResponse(H2Stream *st, HttpResponse &rsp, HeaderList *headers)
+    {
+        bool no_body = rsp._statu < 200 || rsp._statu == 204 || rsp._statu == 304;
+        bool send_body = !no_body && st->_req._method != "HEAD";
+        bool gzip = rsp._file && rsp._file_gzip;
+        const HttpHeaders &fields = rsp._headers;
+        bool has_len = fields.Has(HDR_CONTENT_LENGTH), has_type = rsp._file != nullptr || fields.Has(HDR_CONTENT_TYPE);
+        bool has_date = fields.Has(HDR_DATE), has_server = fields.Has(HDR_SERVER);
+        headers->push_back(std::make_pair(std::string(":status"), std::to_string(rsp._statu)));
+        for (size_t i = 0; i < fields.Size(); ++i)
+        {
+            int id = fields.IdAt(i);
+            if (id == HDR_CONNECTION || id == HDR_KEEP_ALIVE || id == HDR_TRANSFER_ENCODING || id == HDR_UPGRADE)
+                continue;
+            std::string name = Lower(std::string(fields.Name(i), fields.NameLen(i)));
+            if (id == HDR_OTHER && ConnectionSpecific(name))
+                continue;
+            headers->push_back(std::make_pair(name, std::string(fields.Value(i), fields.ValueLen(i))));
+        }
+
+        uint64_t length = 0;
+        if (!rsp._file)
+        {
+            length = rsp._body.size();
+            if (send_body)
+            {
+                st->_body.swap(rsp._body);
+                st->_data = st->_body.data();
+                st->_data_left = st->_body.size();
+            }
+        }
+        else if (rsp._statu != 416)
+        {
+            const FileEntry &file = *rsp._file;
+            const std::string &content = gzip ? file._gzip : file._content;
+            if (rsp._ranges.size() > 1 && !file._on_disk)
+            {
+                for (auto &range : rsp._ranges)
+                {
+                    st->_body += HttpWriter::PartHead(rsp, range);
+                    st->_body.append(content, range.first, range.second - range.first + 1);
+                }
+                st->_body += "\r\n--" + rsp._boundary + "--\r\n";
+                length = st->_body.size();
+                st->_data = st->_body.data();
+                st->_data_left = send_body ? length : 0;
+            }
+            else if (rsp._ranges.size() > 1) // 大文件：每段在发送时才读出当前帧需要的部分
+            {
+                for (auto &range : rsp._ranges)
+                {
+                    H2Stream::Part part = {HttpWriter::PartHead(rsp, range), range.first, range.second - range.first + 1};
+                    length += part._head.size() + part._len;
+                    if (send_body)
+                        st->_parts.push_back(std::move(part));
+                }
+                H2Stream::Part tail = {"\r\n--" + rsp._boundary + "--\r\n", 0, 0};
+                length += tail._head.size();
+                if (send_body)
+                {
+                    st->_parts.push_back(std::move(tail));
+                    st->_parts_left = length;
+                    st->_fd = rsp._file_fd;
+                }
+            }
+            else
+            {
+                uint64_t offset = rsp._ranges.empty() ? 0 : rsp._ranges[0].first;
+                length = rsp._ranges.empty() ? (file._on_disk ? file._size : content.size()) : rsp._ranges[0].second - offset + 1;
+                if (send_body && !file._on_disk)
+                {
+                    st->_file = rsp._file;
+                    st->_data = content.data() + offset;
+                    st->_data_left = length;
+                }
+                else if (send_body)
+                {
+                    st->_fd = rsp._file_fd;
+                    st->_file_offset = offset;
+                    st->_file_left = length;
+                }
+            }
+        }
+
+        if (!has_len && !no_body)
+            headers->push_back(std::make_pair(std::string("content-length"), std::to_string(length)));
+        if (!has_type && length > 0)
+            headers->push_back(std::make_pair(std::string("content-type"), std::string("application/octet-stream")));
+        if (rsp._file)
+        {
+            headers->push_back(std::make_pair(std::string("accept-ranges"), std::string("bytes")));
+            if (rsp._statu == 416 || rsp._ranges.size() == 1)
+            {
+                std::string range = rsp._statu == 416 ? "*" : std::to_string(rsp._ranges[0].first) + "-" + std::to_string(rsp._ranges[0].second);
+                headers->push_back(std::make_pair(std::string("content-range"), "bytes " + range + "/" + std::to_string(rsp._file->_size)));
+            }
+            if (rsp._ranges.size() > 1)
+                headers->push_back(std::make_pair(std::string("content-type"), "multipart/byteranges; boundary=" + rsp._boundary));
+            else if (!no_body && rsp._statu != 416)
+                AddLines(rsp._file->_type_header, headers);
+            if (gzip && !no_body)
+                headers->push_back(std::make_pair(std::string("content-encoding"), std::string("gzip")));
+            AddLines(gzip ? rsp._file->_gzip_validators : rsp._file->_validators, headers);
+        }
+        if (rsp._redirect_flag)
+            headers->push_back(std::make_pair(std::string("location"), rsp._redirect_url));
+        if (!has_date)
+            headers->push_back(std::make_pair(std::string("date"), Date()));
+        if (!has_server)
+            headers->push_back(std::make_pair(std::string("server"), std::string(HTTP_SERVER_NAME)));
+        return st->Pending() > 0;
+    }
+
+    // 流结束：请求还没有接收完（提前响应）时以NO_ERROR复位，让对端停止发送正文
+    void CloseStream(H2Stream *st)
+    {
+        if (!st->_end_recv)
+            WriteRst(st->_id, H2_NO_ERROR);
+        _streams.erase(st->_id);
+    }
+    void ResetStream(H2Stream *st, const uint32_t &code)
+    {
+        WriteRst(st->_id, code);
+        _streams.erase(st->_id);
+    }
+
+    // 发出响应头部，正文排入发送队列；之后st可能已经销毁
+    void Respond(H2Stream *st, HttpResponse &rsp)
+    {
+        st->_responded = true;
+        HeaderList headers;
+        bool has_body = PrepareResponse(st, rsp, &headers);
+        WriteHeaders(st->_id, headers, !has_body);
+        if (!has_body)
+            return CloseStream(st);
+        Queue(st);
+    }
+    void RespondError(H2Stream *st, const int &statu)
+    {
+        HttpResponse rsp(statu);
+        _handlers->_error(st->_req, &rsp);
+        Respond(st, rsp);
+    }
+
+    // 请求接收完毕，交给HttpServer的路由处理
+    void Dispatch(H2Stream *st)
+    {
+        uint64_t begin = metrics_clock::now_ns();
+        HttpResponse rsp(200);
+        _handlers->_route(st->_req, &rsp);
+        if (rsp._stream) // 流式响应只支持HTTP/1.x
+        {
+            rsp.Reset();
+            rsp._statu = 501;
+            _handlers->_error(st->_req, &rsp);
+        }
+        Respond(st, rsp);
+        _conn->get_loop()->get_metrics()->record(M_REQUEST_SERVICE, metrics_clock::now_ns() - begin);
+    }
+
+    void Queue(H2Stream *st)
+    {
+        if (st->_queued || st->Pending() == 0 || st->_send_window <= 0)
+            return;
+        st->_queued = true;
+        _send_queue.push_back(st->_id);
+    }
+
+    // 在连接级和流级窗口允许的范围内，各个流轮流每次发送一个DATA帧
+    // 发送缓冲区到了H2_OUT_HIGH就停下：窗口可以很大，不能一次把所有正文都读进发送缓冲区，剩下的等低水位回调再发
+    void Flush()
+    {
+        // Upgrade时等收到客户端的连接序言再发送正文，和101响应一起到达的数据不宜过多
+        while (_preface_left == 0 && !_dead && !_send_queue.empty() && _send_window > 0 && _conn->outbuffer()->valid_data_size() < H2_OUT_HIGH)
+        {
+            uint32_t id = _send_queue.front();
+            _send_queue.pop_front();
+            auto it = _streams.find(id);
+            if (it == _streams.end())
+                continue;
+            H2Stream *st = it->second.get();
+            st->_queued = false;
+            if (st->_send_window <= 0)
+                continue; // 等对端的WINDOW_UPDATE
+            uint64_t left = st->Pending();
+            uint64_t n = std::min<uint64_t>(std::min<uint64_t>(st->Current(), _peer_max_frame), std::min(_send_window, st->_send_window));
+            WriteFrameHeader(n, H2_DATA, n == left ? H2_FLAG_END_STREAM : 0, id);
+            uint64_t mem = std::min(n, st->_data_left);
+            if (mem > 0)
+            {
+                _conn->outbuffer()->write(st->_data, mem);
+                st->_data += mem;
+                st->_data_left -= mem;
+            }
+            if (n > mem)
+            {
+                buffer_t *out = _conn->outbuffer();
+                out->expand(n - mem);
+                ReadWindow(st->_fd, st->_file_offset, n - mem, out->write_addr());
+                out->move_write_pos_back(n - mem);
+                st->_file_offset += n - mem;
+                st->_file_left -= n - mem;
+            }
+            _send_window -= n;
+            st->_send_window -= n;
+            if (n == left)
+                CloseStream(st);
+            else
+                Queue(st);
+        }
+    }
+
+    /*接收*/
+    // 字段名保持小写，上层查找不区分大小写
+    static void AddRequestHeader(HttpRequest *req, const std::string &name, const std::string &value)
+    {
+        HttpHeaders &headers = req->_headers;
+        size_t len = 0;
+        const char *cookie = name == "cookie" ? headers.Get(HDR_COOKIE, &len) : nullptr;
+        if (cookie != nullptr) // cookie可以拆成多个字段，合并回一个
+            headers.Set(HDR_COOKIE, std::string(cookie, len) + "; " + value);
+        else
+            headers.Add(name, value);
+    }
+    // 检查一个普通字段：名字必须小写，不能有连接级字段，TE只能是trailers
+    static bool ValidField(const std::string &name, const std::string &value)
+    {
+        for (auto c : name)
+        {
+            if (c >= 'A' && c <= 'Z')
+                return false;
+        }
+        if (ConnectionSpecific(name))
+            return false;
+        return name != "te" || value == "trailers";
+    }
+
+    // 头部列表转成HttpRequest，不合法（RFC 7540 8.1.2）返回-1，查询字符串不合法返回400，否则返回0
+    static int BuildRequest(const HeaderList &headers, HttpRequest *req)
+    {
+        bool regular = false;
+        std::string scheme, path, authority;
+        for (auto &field : headers)
+        {
+            const std::string &name = field.first;
+            if (name.empty())
+                return -1;
+            if (name[0] != ':')
+            {
+                if (!ValidField(name, field.second))
+                    return -1;
+                regular = true;
+                AddRequestHeader(req, name, field.second);
+                continue;
+            }
+            // 伪头部只能出现在普通字段之前，且每个只能有一个
+            std::string *dst = nullptr;
+            if (name == ":method")
+                dst = &req->_method;
+            else if (name == ":scheme")
+                dst = &scheme;
+            else if (name == ":path")
+                dst = &path;
+            else if (name == ":authority")
+                dst = &authority;
+            if (regular || dst == nullptr || !dst->empty() || field.second.empty())
+                return -1;
+            *dst = field.second;
+        }
+        if (req->_method.empty() || scheme.empty() || path.empty())
+            return -1;
+        size_t len = 0;
+        const char *clen = req->_headers.Get(HDR_CONTENT_LENGTH, &len);
+        if (clen != nullptr && (len == 0 || len > 18 || strspn(clen, "0123456789") != len))
+            return -1;
+        if (!authority.empty() && !req->_headers.Has(HDR_HOST))
+            req->_headers.Add("host", authority);
+        req->_version = "HTTP/2.0";
+
+        // 和HTTP/1.x的请求行相同的处理：路径URL解码，查询字符串拆成参数
+        size_t query = path.find('?');
+        req->_path = Util::UrlDecode(path.substr(0, query), false);
+        if (query == std::string::npos)
+            return 0;
+        std::vector<std::string> items;
+        Util::Split(path.substr(query + 1), "&", &items);
+        for (auto &item : items)
+        {
+            size_t pos = item.find("=");
+            if (pos == std::string::npos)
+                return 400;
+            req->SetParam(Util::UrlDecode(item.substr(0, pos), true), Util::UrlDecode(item.substr(pos + 1), true));
+        }
+        return 0;
+    }
+
+    // 请求正文到达，返回false时流已经结束（提前回复了错误）
+    bool OnBody(H2Stream *st, const char *data, const size_t &len)
+    {
+        st->_recv_bytes += len;
+        if (len == 0)
+            return true;
+        if (st->_consumer)
+        {
+            if (st->_consumer(data, len))
+                return true;
+            st->_consumer = nullptr;
+            RespondError(st, 500);
+            return false;
+        }
+        if (st->_req._body.size() + len > _max_body)
+        {
+            RespondError(st, 413); // PAYLOAD TOO LARGE
+            return false;
+        }
+        st->_req._body.append(data, len);
+        return true;
+    }
+
+    // 收到END_STREAM：结束正文消费者，校验Content-Length，然后处理请求
+    void FinishRequest(H2Stream *st)
+    {
+        st->_end_recv = true;
+        if (st->_consumer)
+        {
+            BodyConsumer consumer;
+            consumer.swap(st->_consumer);
+            if (!consumer(nullptr, 0))
+                return RespondError(st, 500);
+        }
+        // 没有Content-Length时和HTTP/1.1的chunked请求一样，补上实际收到的正文长度
+        const char *clen = st->_req._headers.Get(HDR_CONTENT_LENGTH);
+        if (clen == nullptr && st->_recv_bytes > 0)
+            st->_req._headers.Set(HDR_CONTENT_LENGTH, std::to_string(st->_recv_bytes));
+        else if (clen != nullptr && strtoull(clen, nullptr, 10) != st->_recv_bytes)
+            return ResetStream(st, H2_PROTOCOL_ERROR);
+        Dispatch(st);
+    }
+
+    // 头部块接收完整：新的流、或者请求的trailer
+    bool OnHeaderBlock(const uint32_t &id, const bool &end_stream)
+    {
+        HeaderList headers;
+        bool too_large = false;
+        bool ok = _decoder.Decode((const uint8_t *)_header_block.data(), _header_block.size(), &headers, &too_large);
+        _header_block.clear();
+        if (!ok)
+        {
+            GoAway(H2_COMPRESSION_ERROR);
+            return false;
+        }
+
+        auto it = _streams.find(id);
+        if (it != _streams.end()) // trailer：必须带END_STREAM，只能有普通字段
+        {
+            H2Stream *st = it->second.get();
+            if (st->_end_recv)
+            {
+                ResetStream(st, H2_STREAM_CLOSED);
+                return true;
+            }
+            if (st->_responded) // 提前回复过错误，trailer只用来结束接收
+            {
+                if (end_stream)
+                    st->_end_recv = true;
+                else
+                    ResetStream(st, H2_PROTOCOL_ERROR);
+                return true;
+            }
+            if (too_large)
+            {
+                ResetStream(st, H2_ENHANCE_YOUR_CALM);
+                return true;
+            }
+            for (auto &field : headers)
+            {
+                if (!end_stream || field.first.empty() || field.first[0] == ':' || !ValidField(field.first, field.second))
+                {
+                    ResetStream(st, H2_PROTOCOL_ERROR);
+                    return true;
+                }
+                AddRequestHeader(&st->_req, field.first, field.second);
+            }
+            FinishRequest(st);
+            return true;
+        }
+        if (id <= _last_stream_id) // 已经关闭的流
+        {
+            WriteRst(id, H2_STREAM_CLOSED);
+            return true;
+        }
+        _last_stream_id = id;
+        if (_peer_goaway)
+            return true;
+        if (_streams.size() >= H2_MAX_STREAMS)
+        {
+            WriteRst(id, H2_REFUSED_STREAM);
+            return true;
+        }
+
+        std::unique_ptr<H2Stream> stream(new H2Stream(id, _peer_initial_window));
+        H2Stream *st = stream.get();
+        int ret = BuildRequest(headers, &st->_req);
+        if (ret < 0)
+        {
+            WriteRst(id, H2_PROTOCOL_ERROR);
+            return true;
+        }
+        _streams[id] = std::move(stream);
+        st->_end_recv = end_stream;
+        if (too_large) // 超出上限的字段已经丢弃，伪头部在最前面，请求行是完整的
+            ret = 431; // REQUEST HEADER FIELDS TOO LARGE
+        if (ret > 0)
+        {
+            RespondError(st, ret);
+            return true;
+        }
+        if (end_stream)
+            FinishRequest(st);
+        else if (_handlers->_selector)
+            st->_consumer = _handlers->_selector(st->_req);
+        return true;
+    }
+
+    bool ApplySettings(const uint8_t *p, const size_t &len)
+    {
+        for (size_t i = 0; i + 6 <= len; i += 6)
+        {
+            uint16_t id = (uint16_t)p[i] << 8 | p[i + 1];
+            uint32_t value = Get32(p + i + 2);
+            switch (id)
+            {
+            case H2_SETTINGS_HEADER_TABLE_SIZE:
+                _encoder.SetMaxSize(value);
+                break;
+            case H2_SETTINGS_ENABLE_PUSH:
+                if (value > 1)
+                    return GoAway(H2_PROTOCOL_ERROR), false;
+                break;
+            case H2_SETTINGS_INITIAL_WINDOW_SIZE:
+            {
+                if (value > H2_MAX_WINDOW)
+                    return GoAway(H2_FLOW_CONTROL_ERROR), false;
+                // 已有的流按差值调整发送窗口
+                int64_t delta = (int64_t)value - _peer_initial_window;
+                _peer_initial_window = value;
+                for (auto &it : _streams)
+                {
+                    it.second->_send_window += delta;
+                    if (it.second->_send_window > H2_MAX_WINDOW)
+                        return GoAway(H2_FLOW_CONTROL_ERROR), false;
+                    Queue(it.second.get());
+                }
+                break;
+            }
+            case H2_SETTINGS_MAX_FRAME_SIZE:
+                if (value < H2_MIN_FRAME || value > H2_MAX_FRAME)
+                    return GoAway(H2_PROTOCOL_ERROR), false;
+                _peer_max_frame = value;
+                break;
+            default: // 未知的设置忽略
+                break;
+            }
+        }
+        return true;
+    }
+
+    // 接收窗口：收到的DATA（包括填充）先扣除，消费之后攒够一半再一起归还
+    void ConsumeWindow(const uint32_t &len)
+    {
+        _recv_unacked += len;
+        if (_recv_unacked >= H2_RECV_WINDOW / 2)
+        {
+            WriteWindowUpdate(0, _recv_unacked);
+            _recv_window += _recv_unacked;
+            _recv_unacked = 0;
+        }
+    }
+    void ConsumeWindow(H2Stream *st, const uint32_t &len)
+    {
+        st->_recv_unacked += len;
+        if (st->_recv_unacked >= H2_RECV_WINDOW / 2)
+        {
+            WriteWindowUpdate(st->_id, st->_recv_unacked);
+            st->_recv_window += st->_recv_unacked;
+            st->_recv_unacked = 0;
+        }
+    }
+
+    // 去掉PADDED帧的填充，填充不合法返回false
+    static bool StripPadding(const uint8_t &flags, const uint8_t *&p, size_t &len)
+    {
+        if (!(flags & H2_FLAG_PADDED))
+            return true;
+        if (len < 1 || p[0] >= len)
+            return false;
+        len -= p[0] + 1;
+        ++p;
+        return true;
+    }
+
+    void OnData(const uint8_t &flags, const uint32_t &id, const uint8_t *p, size_t len)
+    {
+        if (id == 0)
+            return GoAway(H2_PROTOCOL_ERROR);
+        if ((int64_t)len > _recv_window)
+            return GoAway(H2_FLOW_CONTROL_ERROR);
+        _recv_window -= len;
+        ConsumeWindow(len);
+        uint32_t frame_len = len;
+        if (!StripPadding(flags, p, len))
+            return GoAway(H2_PROTOCOL_ERROR);
+
+        auto it = _streams.find(id);
+        if (it == _streams.end())
+        {
+            if (id > _last_stream_id) // 还没有打开的流
+                return GoAway(H2_PROTOCOL_ERROR);
+            return; // 已经结束（例如提前回复了413）的流，丢弃
+        }
+        H2Stream *st = it->second.get();
+        if (st->_end_recv)
+            return ResetStream(st, H2_STREAM_CLOSED);
+        if ((int64_t)frame_len > st->_recv_window)
+            return ResetStream(st, H2_FLOW_CONTROL_ERROR);
+        st->_recv_window -= frame_len;
+        if (st->_responded) // 提前回复过错误：丢弃正文，窗口照常归还，对端可以发完；不再调用消费者、不再路由
+        {
+            if (flags & H2_FLAG_END_STREAM)
+                st->_end_recv = true;
+            else
+                ConsumeWindow(st, frame_len);
+            return;
+        }
+        if (!OnBody(st, (const char *)p, len))
+            return;
+        if (flags & H2_FLAG_END_STREAM)
+            return FinishRequest(st);
+        ConsumeWindow(st, frame_len);
+    }
+
+    void OnHeaders(const uint8_t &flags, const uint32_t &id, const uint8_t *p, size_t len)
+    {
+        if (id == 0 || id % 2 == 0) // 客户端发起的流是奇数
+            return GoAway(H2_PROTOCOL_ERROR);
+        if (!StripPadding(flags, p, len))
+            return GoAway(H2_PROTOCOL_ERROR);
+        if (flags & H2_FLAG_PRIORITY) // 不按优先级调度，跳过
+        {
+            if (len < 5)
+                return GoAway(H2_FRAME_SIZE_ERROR);
+            if ((Get32(p) & H2_MAX_WINDOW) == id)
+                return WriteRst(id, H2_PROTOCOL_ERROR);
+            p += 5;
+            len -= 5;
+        }
+        _header_block.assign((const char *)p, len);
+        if (flags & H2_FLAG_END_HEADERS)
+        {
+            OnHeaderBlock(id, flags & H2_FLAG_END_STREAM);
+            return;
+        }
+        _cont_stream = id;
+        _cont_end_stream = flags & H2_FLAG_END_STREAM;
+    }
+
+    void OnContinuation(const uint8_t &flags, const uint32_t &id, const uint8_t *p, const size_t &len)
+    {
+        if (_cont_stream == 0 || id != _cont_stream)
+            return GoAway(H2_PROTOCOL_ERROR);
+        if (_header_block.size() + len > H2_MAX_HEADER_LIST * 2) // 不断发送CONTINUATION的攻击
+            return GoAway(H2_ENHANCE_YOUR_CALM);
+        _header_block.append((const char *)p, len);
+        if (!(flags & H2_FLAG_END_HEADERS))
+            return;
+        _cont_stream = 0;
+        OnHeaderBlock(id, _cont_end_stream);
+    }
+
+    void OnSettings(const uint8_t &flags, const uint32_t &id, const uint8_t *p, const size_t &len)
+    {
+        if (id != 0)
+            return GoAway(H2_PROTOCOL_ERROR);
+        if (flags & H2_FLAG_ACK)
+        {
+            if (len != 0)
+                GoAway(H2_FRAME_SIZE_ERROR);
+            return;
+        }
+        if (len % 6 != 0)
+            return GoAway(H2_FRAME_SIZE_ERROR);
+        if (ApplySettings(p, len))
+            WriteFrame(H2_SETTINGS, H2_FLAG_ACK, 0, nullptr, 0);
+    }
+
+    void OnWindowUpdate(const uint32_t &id, const uint8_t *p, const size_t &len)
+    {
+        if (len != 4)
+            return GoAway(H2_FRAME_SIZE_ERROR);
+        uint32_t increment = Get32(p) & H2_MAX_WINDOW;
+        if (id == 0)
+        {
+            if (increment == 0)
+                return GoAway(H2_PROTOCOL_ERROR);
+            if (_send_window + increment > H2_MAX_WINDOW)
+                return GoAway(H2_FLOW_CONTROL_ERROR);
+            _send_window += increment;
+            return;
+        }
+        auto it = _streams.find(id);
+        if (it == _streams.end())
+            return;
+        H2Stream *st = it->second.get();
+        if (increment == 0)
+            return ResetStream(st, H2_PROTOCOL_ERROR);
+        if (st->_send_window + increment > H2_MAX_WINDOW)
+            return ResetStream(st, H2_FLOW_CONTROL_ERROR);
+        st->_send_window += increment;
+        Queue(st);
+    }
+
+    void OnFrame(const uint8_t &type, const uint8_t &flags, const uint32_t &id, const uint8_t *p, const size_t &len)
+    {
+        // 头部块没有结束时只能是同一个流的CONTINUATION
+        if (_cont_stream != 0 && type != H2_CONTINUATION)
+            return GoAway(H2_PROTOCOL_ERROR);
+        if (!_settings_recv && type != H2_SETTINGS)
+            return GoAway(H2_PROTOCOL_ERROR);
+        switch (type)
+        {
+        case H2_DATA:
+            return OnData(flags, id, p, len);
+        case H2_HEADERS:
+            return OnHeaders(flags, id, p, len);
+        case H2_CONTINUATION:
+            return OnContinuation(flags, id, p, len);
+        case H2_PRIORITY:
+            if (id == 0)
+                return GoAway(H2_PROTOCOL_ERROR);
+            if (len != 5)
+                return WriteRst(id, H2_FRAME_SIZE_ERROR);
+            return;
+        case H2_RST_STREAM:
+            if (id == 0 || id > _last_stream_id)
+                return GoAway(H2_PROTOCOL_ERROR);
+            if (len != 4)
+                return GoAway(H2_FRAME_SIZE_ERROR);
+            _streams.erase(id); // 正在接收正文的消费者随流一起销毁，不会收到结束调用
+            return;
+        case H2_SETTINGS:
+            _settings_recv = true;
+            return OnSettings(flags, id, p, len);
+        case H2_PUSH_PROMISE: // 客户端不能推送
+            return GoAway(H2_PROTOCOL_ERROR);
+        case H2_PING:
+            if (id != 0)
+                return GoAway(H2_PROTOCOL_ERROR);
+            if (len != 8)
+                return GoAway(H2_FRAME_SIZE_ERROR);
+            if (!(flags & H2_FLAG_ACK))
+                WriteFrame(H2_PING, H2_FLAG_ACK, 0, (const char *)p, 8);
+            return;
+        case H2_GOAWAY:
+            if (id != 0)
+                return GoAway(H2_PROTOCOL_ERROR);
+            _peer_goaway = true;
+            return;
+        case H2_WINDOW_UPDATE:
+            return OnWindowUpdate(id, p, len);
+        default: // 未知类型的帧忽略
+            return;
+        }
+    }
+
+    // 开始：发出SETTINGS并放大连接级接收窗口；Upgrade时把升级请求作为流1（已经半关闭）处理
+    void Start(const conn_ptr &conn, HttpRequest *upgraded, const std::string &settings)
+    {
+        _conn = conn.get();
+        WriteSettings();
+        WriteWindowUpdate(0, H2_RECV_WINDOW - H2_DEFAULT_WINDOW);
+        _recv_window = H2_RECV_WINDOW;
+        if (upgraded && ApplySettings((const uint8_t *)settings.data(), settings.size()))
+        {
+            std::unique_ptr<H2Stream> stream(new H2Stream(1, _peer_initial_window));
+            H2Stream *st = stream.get();
+            st->_end_recv = true;
+            st->_req = std::move(*upgraded);
+            _streams[1] = std::move(stream);
+            _last_stream_id = 1;
+            Dispatch(st);
+            Flush();
+        }
+        conn->flush_outbuffer();
+        _conn = nullptr;
+    }
+
+    void OnMessage(const conn_ptr &conn, buf_ptr buf)
+    {
+        if (_dead) // 关闭连接时重入
+            return buf->move_read_pos_back(buf->valid_data_size());
+        _conn = conn.get();
+        // 连接序言，可能分几次到达
+        while (!_dead && _preface_left > 0 && buf->valid_data_size() > 0)
+        {
+            size_t n = std::min<size_t>(_preface_left, buf->valid_data_size());
+            if (memcmp(buf->read_addr(), H2_PREFACE + H2_PREFACE_LEN - _preface_left, n) != 0)
+                GoAway(H2_PROTOCOL_ERROR);
+            buf->move_read_pos_back(n);
+            _preface_left -= n;
+        }
+        while (!_dead && _preface_left == 0 && buf->valid_data_size() >= H2_FRAME_HEADER_LEN)
+        {
+            const uint8_t *h = (const uint8_t *)buf->read_addr();
+            size_t len = (size_t)h[0] << 16 | (size_t)h[1] << 8 | h[2];
+            if (len > H2_MIN_FRAME)
+            {
+                GoAway(H2_FRAME_SIZE_ERROR);
+                break;
+            }
+            if (buf->valid_data_size() < H2_FRAME_HEADER_LEN + len)
+                break;
+            // 先移动读位置：处理过程中关闭连接时会重入消息处理，数据本身在这次处理完之前仍然有效
+            buf->move_read_pos_back(H2_FRAME_HEADER_LEN + len);
+            OnFrame(h[3], h[4], Get32(h + 5) & H2_MAX_WINDOW, h + H2_FRAME_HEADER_LEN, len);
+        }
+        if (_dead)
+        {
+            buf->move_read_pos_back(buf->valid_data_size());
+            _conn = nullptr;
+            return;
+        }
+        Flush();
+        conn->flush_outbuffer();
+        if (_peer_goaway && _streams.empty())
+        {
+            _dead = true;
+            conn->shutdown();
+        }
+        _conn = nullptr;
+    }
+
+    // 发送缓冲区回落到低水位：继续发送队列中的正文；可能在处理消息期间的flush_outbuffer中重入
+    void OnWritable(const conn_ptr &conn)
+    {
+        if (_dead)
+            return;
+        connection *outer = _conn;
+        _conn = conn.get();
+        Flush();
+        conn->flush_outbuffer();
+        if (_peer_goaway && _streams.empty())
+        {
+            _dead = true;
+            conn->shutdown();
+        }
+        _conn = outer;
+    }
+};
+
+class H2Protocol
+{
+public:
+    // 接收缓冲区开头是否是HTTP/2连接序言：是返回1，不是返回-1，数据还不够判断返回0
+    static int MatchPreface(buffer_t *buf)
+    {
+        size_t n = std::min<size_t>(buf->valid_data_size(), H2_PREFACE_LEN);
+        if (memcmp(buf->read_addr(), H2_PREFACE, n) != 0)
+            return -1;
+        return n == H2_PREFACE_LEN ? 1 : 0;
+    }
+
+    // 解析HTTP2-Settings头部（base64url编码的SETTINGS帧负载）
+    static bool ParseSettings(const std::string &value, std::string *settings) { return Base64::Decode(value, settings) && settings->size() % 6 == 0; }
+
+    // 在连接所属线程中调用：替换连接的上下文和回调，之后收到的数据按HTTP/2帧解析
+    // Upgrade时101响应已经写入发送缓冲区，upgraded是升级请求（原来的HttpContext随之销毁，需要调用者先拷贝出来）
+    static void Attach(const conn_ptr &conn, const H2Handlers *handlers, const size_t &max_body, buf_ptr buf,
+                       HttpRequest *upgraded = nullptr, const std::string &settings = "")
+    {
+        H2SessionPtr s(new H2Session(handlers, max_body));
+        conn->upgrade(any_t(s), nullptr, &H2Protocol::OnMessage, nullptr, nullptr);
+        conn->set_water_mark(H2_OUT_HIGH, H2_OUT_HIGH / 4);
+        conn->set_low_water_mark_callback(&H2Protocol::OnWritable);
+        s->Start(conn, upgraded, settings);
+        if (buf->valid_data_size() > 0)
+            OnMessage(conn, buf);
+    }
+
+    static void OnMessage(const conn_ptr &conn, buf_ptr buf)
+    {
+        H2SessionPtr s = *conn->get_context()->get<H2SessionPtr>(); // 处理期间保持会话
+        s->OnMessage(conn, buf);
+    }
+
+    static void OnWritable(const conn_ptr &conn, size_t)
+    {
+        H2SessionPtr s = *conn->get_context()->get<H2SessionPtr>();
+        s->OnWritable(conn);
+    }
+};
@@ -11,13 +11,13 @@ std::string RequestStr(const HttpRequest &req)
 {
     std::stringstream ss;
     ss << req._method << " " << req._path << " " << req._version << "\r\n";
-    for (auto &it : req._params)
+    for (size_t i = 0; i < req._params.Size(); ++i)
     {
-        ss << it.first << ": " << it.second << "\r\n";
+        ss << req._params.Key(i) << ": " << req._params.Value(i) << "\r\n";
     }
-    for (auto &it : req._headers)
+    for (size_t i = 0; i < req._headers.Size(); ++i)
     {
-        ss << it.first << ": " << it.second << "\r\n";
+        ss << req._headers.Name(i) << ": " << req._headers.Value(i) << "\r\n";
     }
     ss << "\r\n";
     ss << req._body;
@@ -34,10 +34,92 @@ void Login(const HttpRequest &req, HttpResponse *rsp)
     rsp->SetContent(RequestStr(req), "text/plain");
 }
 
+// 上传的文件边接收边写入临时文件，接收完毕后改名，内存占用与文件大小无关
+BodyConsumer PutFileBody(const HttpRequest &req)
+{
+    std::string pathname = WWWROOT + req._path;
+    std::string tmpname = pathname + ".part";
+    std::shared_ptr<FILE> fp(fopen(tmpname.c_str(), "wb"), [tmpname](FILE *fp)
+                             {
+                                 if (fp != nullptr)
+                                     fclose(fp);
+                                 remove(tmpname.c_str()); // 接收完毕时已经改名，这里只会删掉中止的上传
+                             });
+    return [fp, pathname, tmpname](const char *data, size_t len)
+    {
+        if (fp == nullptr)
+            return false;
+        if (data != nullptr)
+            return fwrite(data, 1, len, fp.get()) == len;
+        return fflush(fp.get()) == 0 && rename(tmpname.c_str(), pathname.c_str()) == 0;
+    };
+}
+
 void PutFile(const HttpRequest &req, HttpResponse *rsp)
 {
     std::string pathname = WWWROOT + req._path;
-    Util::WriteFile(pathname, req._body);
+    if (req.ContentLength() == 0) // 有正文时已经由PutFileBody写入
+        Util::WriteFile(pathname, req._body);
+}
+
+// 流式响应示例：server-sent events，每秒推送一个事件，?n=N（最多EVENTS_MAX）个之后结束
+// 所有订阅者由一个后台线程统一推送，不占用eventloop，也不为每个请求创建线程；
+// 对端读得慢、积压超过EVENTS_BACKLOG时跳过这一秒，不让发送缓冲区无限增长
+#define EVENTS_MAX 60
+#define EVENTS_BACKLOG (64 << 10)
+
+struct EventSub
+{
+    HttpStreamPtr _stream;
+    int _next; // 下一个事件的序号
+    int _total;
+};
+std::mutex g_events_mutex;
+std::vector<EventSub> g_events;
+
+void EventsTicker()
+{
+    std::vector<EventSub> subs, keep;
+    while (true)
+    {
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+        {
+            std::unique_lock<std::mutex> lock(g_events_mutex);
+            subs.swap(g_events);
+        }
+        keep.clear();
+        for (auto &sub : subs)
+        {
+            if (sub._stream->Buffered() > EVENTS_BACKLOG)
+            {
+                keep.push_back(sub);
+                continue;
+            }
+            if (!sub._stream->Write("data: " + std::to_string(sub._next) + "\n\n"))
+                continue; // 客户端已经断开
+            if (++sub._next < sub._total)
+                keep.push_back(sub);
+            else
+                sub._stream->End();
+        }
+        subs.clear();
+        std::unique_lock<std::mutex> lock(g_events_mutex);
+        g_events.insert(g_events.end(), keep.begin(), keep.end());
+    }
+}
+
+void Events(const HttpRequest &req, HttpResponse *rsp)
+{
+    int n = req.HasParam("n") ? atoi(req.GetParam("n").c_str()) : 5;
+    n = std::max(0, std::min(n, EVENTS_MAX));
+    rsp->SetHeader("Cache-Control", "no-cache");
+    rsp->SetStream([n](const HttpStreamPtr &stream)
+                   {
+                       if (n == 0 || !stream->Write("data: 0\n\n") || n == 1)
+                           return stream->End();
+                       std::unique_lock<std::mutex> lock(g_events_mutex);
+                       g_events.push_back(EventSub{stream, 1, n}); },
+                   "text/event-stream");
 }
 
 void DelFile(const HttpRequest &req, HttpResponse *rsp)
@@ -45,15 +127,48 @@ void DelFile(const HttpRequest &req, HttpResponse *rsp)
     rsp->SetContent(RequestStr(req), "text/plain");
 }
 
-int main()
+// WebSocket示例：/echo 原样返回收到的消息，/chat 把收到的消息广播给所有在线的连接
+WsGroup g_chat;
+
+WsHandlers EchoHandlers()
+{
+    WsHandlers handlers;
+    handlers._on_message = [](const WsSessionPtr &ws, const WsMessage &msg)
+    { ws->Send(msg._data, msg._len, msg._binary); };
+    return handlers;
+}
+
+WsHandlers ChatHandlers()
+{
+    WsHandlers handlers;
+    handlers._on_open = [](const WsSessionPtr &ws)
+    { g_chat.Join(ws); };
+    handlers._on_message = [](const WsSessionPtr &, const WsMessage &msg)
+    { g_chat.Broadcast(msg._data, msg._len, msg._binary); };
+    return handlers;
+}
+
+int main(int, char *argv[])
 {
     std::unique_ptr<HttpServer> ps(new HttpServer(8080));
+    ps->EnableHotUpgrade(argv); // kill -USR2 <pid> 平滑重启：新进程接管监听套接字，旧进程处理完已有连接后退出
     ps->SetThreadCount(3);
+    ps->SetCompression(Z_BEST_SPEED); // 客户端接受gzip时压缩文本类响应，动态响应用最快的级别
+    ps->SetKeepAlive(15, 1000); // 长连接空闲15秒关闭，每个连接最多处理1000个请求
+    ps->SetRequestTimeouts(10, 30); // 慢速请求：头部10秒内收完、正文30秒内没有新数据时回复408
+    ps->EnableHttp2(); // 接受h2c：curl --http2-prior-knowledge 或者 curl --http2（Upgrade: h2c）
     ps->SetBaseDir(WWWROOT); // 设置静态资源根目录，告诉服务器有静态资源请求到来，需要到哪里去找资源文件
     ps->Get("/hello", Hello);
     ps->Post("/login", Login);
     ps->Put("/1234.txt", PutFile);
+    ps->PutBody("/1234.txt", PutFileBody);
     ps->Delete("/1234.txt", DelFile);
+    ps->Get("/events", Events);
+    std::thread(EventsTicker).detach(); // /events的推送线程
+    ps->WebSocket("/echo", EchoHandlers());
+    ps->WebSocket("/chat", ChatHandlers());
+    ps->EnableMetrics(); // GET /metrics 获取Prometheus格式的运行指标
+    ps->EnableConnStats(); // GET /connections?top=10&sort=outbuf 查看最重的连接
     ps->Start();
 
     return 0;
@@ -0,0 +1,299 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <regex>
+
+#include <cstring>
+
+// 路由表：字面路径放在基数树（压缩前缀树）中，查找只按路径逐字符走一遍，不分配内存
+// 路由模式的写法：
+//   /users/list          字面路径（'.'按字面匹配）
+//   /users/:id           命名参数，匹配一个非空的路径段（不含'/'）
+//   /users/:id<int>      带类型的参数，目前支持int（十进制数字）
+//   /static/*path        通配尾部，匹配剩下的全部路径（可以为空、可以含'/'），只能是最后一段；名字可以省略
+// 含有其他正则元字符（\ ^ $ | ( ) [ ] { } ? + 以及不在段首的*）的模式按正则表达式整体匹配，
+// 只在基数树中没有匹配时按注册顺序尝试，捕获的子串放在HttpRequest的_matches中
+// 同一位置的优先级：字面 > int参数 > 普通参数 > 通配尾部；同一个模式重复注册时先注册的生效
+
+// 一个路径参数：值是请求路径中的一段，名字指向路由树中的节点，路由表在Start之后不再修改
+struct RouteParam
+{
+    const std::string *_name;
+    size_t _pos;
+    size_t _len;
+};
+using RouteParams = std::vector<RouteParam>;
+
+template <typename T>
+class Router
+{
+private:
+    enum ParamType
+    {
+        PARAM_INT, // 排在前面，先于普通参数尝试
+        PARAM_STR
+    };
+    struct Node;
+    struct Param
+    {
+        ParamType _type;
+        std::string _name;
+        std::unique_ptr<Node> _node;
+    };
+    struct Node
+    {
+        std::string _label;                          // 从父节点到这里的字面边
+        std::string _indices;                        // 各个字面子节点_label的首字符，互不相同
+        std::vector<std::unique_ptr<Node>> _statics; // 与_indices一一对应
+        std::vector<Param> _params;                  // 参数子节点，int类型在前
+        std::string _wild_name;
+        bool _has_wild;
+        T _wild;
+        bool _has_value;
+        T _value;
+
+        Node() : _has_wild(false), _has_value(false) {}
+    };
+
+    Node _root;
+    std::vector<std::pair<std::regex, T>> _regexes; // 需要正则表达式的路由
+    size_t _count;
+
+private:
+    static bool IsNameChar(const char &c) { return isalnum((unsigned char)c) || c == '_'; }
+    static bool IsName(const std::string &s, const size_t &b, const size_t &e)
+    {
+        if (b >= e)
+            return false;
+        for (size_t i = b; i < e; ++i)
+        {
+            if (!IsNameChar(s[i]))
+                return false;
+        }
+        return true;
+    }
+
+    // 一个路径段是不是基数树能表示的：字面段、:name、:name<int>、*name（最后一段）
+    static bool IsTreeSegment(const std::string &s, const size_t &b, const size_t &e, const bool &last)
+    {
+        if (b < e && s[b] == ':')
+        {
+            if (e - b > 6 && s.compare(e - 5, 5, "<int>") == 0)
+                return IsName(s, b + 1, e - 5);
+            return IsName(s, b + 1, e);
+        }
+        if (b < e && s[b] == '*')
+            return last && (b + 1 == e || IsName(s, b + 1, e));
+        for (size_t i = b; i < e; ++i)
+        {
+            if (strchr("\\^$|()[]{}?+*", s[i]) != nullptr)
+                return false;
+        }
+        return true;
+    }
+    static bool IsTreePattern(const std::string &pattern)
+    {
+        if (pattern.empty() || pattern[0] != '/')
+            return false;
+        size_t b = 1;
+        while (true)
+        {
+            size_t e = pattern.find('/', b);
+            bool last = e == std::string::npos;
+            if (last)
+                e = pattern.size();
+            if (!IsTreeSegment(pattern, b, e, last))
+                return false;
+            if (last)
+                return true;
+            b = e + 1;
+        }
+    }
+
+    // 插入一段字面值，返回它末尾对应的节点；与已有的边有公共前缀时拆分边
+    static Node *InsertStatic(Node *n, const std::string &s, size_t b, const size_t &e)
+    {
+        while (b < e)
+        {
+            size_t idx = n->_indices.find(s[b]);
+            if (idx == std::string::npos)
+            {
+                std::unique_ptr<Node> child(new Node);
+                child->_label = s.substr(b, e - b);
+                n->_indices.push_back(s[b]);
+                n->_statics.push_back(std::move(child));
+                return n->_statics.back().get();
+            }
+            Node *child = n->_statics[idx].get();
+            size_t common = 0;
+            while (common < child->_label.size() && b + common < e && child->_label[common] == s[b + common])
+                ++common;
+            if (common < child->_label.size())
+            {
+                std::unique_ptr<Node> mid(new Node);
+                mid->_label = child->_label.substr(0, common);
+                n->_statics[idx]->_label.erase(0, common);
+                mid->_indices.push_back(n->_statics[idx]->_label[0]);
+                mid->_statics.push_back(std::move(n->_statics[idx]));
+                n->_statics[idx] = std::move(mid);
+                child = n->_statics[idx].get();
+            }
+            n = child;
+            b += common;
+        }
+        return n;
+    }
+
+    static Node *InsertParam(Node *n, const ParamType &type, const std::string &name)
+    {
+        for (auto &param : n->_params)
+        {
+            if (param._type == type && param._name == name)
+                return param._node.get();
+        }
+        Param param;
+        param._type = type;
+        param._name = name;
+        param._node.reset(new Node);
+        Node *child = param._node.get();
+        // int参数排在所有普通参数之前，同类型的按注册顺序
+        auto pos = n->_params.begin();
+        if (type == PARAM_INT)
+        {
+            while (pos != n->_params.end() && pos->_type == PARAM_INT)
+                ++pos;
+        }
+        else
+            pos = n->_params.end();
+        n->_params.insert(pos, std::move(param));
+        return child;
+    }
+
+    static bool IsDigits(const std::string &path, const size_t &b, const size_t &e)
+    {
+        for (size_t i = b; i < e; ++i)
+        {
+            if (path[i] < '0' || path[i] > '9')
+                return false;
+        }
+        return true;
+    }
+
+    // 从节点n、路径的pos处开始匹配；字面边优先，失败时回退尝试参数，最后是通配尾部
+    static const T *Match(const Node *n, const std::string &path, const size_t &pos, RouteParams *params)
+    {
+        size_t size = path.size();
+        if (pos == size && n->_has_value)
+            return &n->_value;
+        if (pos < size)
+        {
+            const char *p = (const char *)memchr(n->_indices.data(), path[pos], n->_indices.size());
+            if (p != nullptr)
+            {
+                const Node *child = n->_statics[p - n->_indices.data()].get();
+                const std::string &label = child->_label;
+                if (size - pos >= label.size() && memcmp(path.data() + pos, label.data(), label.size()) == 0)
+                {
+                    const T *ret = Match(child, path, pos + label.size(), params);
+                    if (ret != nullptr)
+                        return ret;
+                }
+            }
+            if (!n->_params.empty())
+            {
+                const char *slash = (const char *)memchr(path.data() + pos, '/', size - pos);
+                size_t end = slash == nullptr ? size : slash - path.data();
+                for (size_t i = 0; end > pos && i < n->_params.size(); ++i)
+                {
+                    const Param &param = n->_params[i];
+                    if (param._type == PARAM_INT && !IsDigits(path, pos, end))
+                        continue;
+                    if (params != nullptr)
+                        params->push_back(RouteParam{&param._name, pos, end - pos});
+                    const T *ret = Match(param._node.get(), path, end, params);
+                    if (ret != nullptr)
+                        return ret;
+                    if (params != nullptr)
+                        params->pop_back();
+                }
+            }
+        }
+        if (n->_has_wild)
+        {
+            if (params != nullptr && !n->_wild_name.empty())
+                params->push_back(RouteParam{&n->_wild_name, pos, size - pos});
+            return &n->_wild;
+        }
+        return nullptr;
+    }
+
+public:
+    Router() : _count(0) {}
+
+    Router(const Router &) = delete;
+    Router &operator=(const Router &) = delete;
+
+    void Add(const std::string &pattern, const T &value)
+    {
+        ++_count;
+        if (!IsTreePattern(pattern))
+        {
+            _regexes.push_back(std::make_pair(std::regex(pattern), value));
+            return;
+        }
+        Node *n = &_root;
+        size_t b = 0;
+        while (b < pattern.size())
+        {
+            if (pattern[b] == '*')
+            {
+                if (n->_has_wild)
+                    return;
+                n->_has_wild = true;
+                n->_wild_name = pattern.substr(b + 1);
+                n->_wild = value;
+                return;
+            }
+            if (pattern[b] == ':')
+            {
+                size_t e = pattern.find('/', b);
+                if (e == std::string::npos)
+                    e = pattern.size();
+                bool is_int = e - b > 6 && pattern.compare(e - 5, 5, "<int>") == 0;
+                std::string name = pattern.substr(b + 1, e - b - 1 - (is_int ? 5 : 0));
+                n = InsertParam(n, is_int ? PARAM_INT : PARAM_STR, name);
+                b = e;
+                continue;
+            }
+            // 字面部分一直到下一个参数或者通配段（都只出现在'/'之后）
+            size_t e = b + 1;
+            while (e < pattern.size() && !(pattern[e - 1] == '/' && (pattern[e] == ':' || pattern[e] == '*')))
+                ++e;
+            n = InsertStatic(n, pattern, b, e);
+            b = e;
+        }
+        if (n->_has_value)
+            return;
+        n->_has_value = true;
+        n->_value = value;
+    }
+
+    // 查找路径对应的路由，没有返回nullptr；params非空时追加路径参数，正则路由的捕获放到matches中
+    const T *Find(const std::string &path, RouteParams *params, std::smatch *matches) const
+    {
+        const T *ret = Match(&_root, path, 0, params);
+        if (ret != nullptr)
+            return ret;
+        for (auto &route : _regexes)
+        {
+            bool ok = matches != nullptr ? std::regex_match(path, *matches, route.first) : std::regex_match(path, route.first);
+            if (ok)
+                return &route.second;
+        }
+        return nullptr;
+    }
+
+    bool Empty() const { return _count == 0; }
+};
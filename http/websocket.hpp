@@ -0,0 +1,681 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <cstring>
+#include <cstdint>
+
+#include "../server/server.hpp"
+
+// WebSocket（RFC 6455）：握手由HttpServer完成，之后通过connection::upgrade切换到这里的消息处理
+// 帧直接在连接的接收缓冲区上解析和原地去掩码，发送时直接序列化到发送缓冲区；没有协商扩展（不支持permessage-deflate）
+
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define WS_MAX_MESSAGE (16 << 20) // 单条消息（合并分片后）上限，超过时以1009关闭
+#define WS_PING_INTERVAL 15       // 默认这么多秒没有收到数据就发送ping，再过这么久仍然没有数据则断开
+
+enum WsOpcode
+{
+    WS_CONTINUATION = 0x0,
+    WS_TEXT = 0x1,
+    WS_BINARY = 0x2,
+    WS_CLOSE = 0x8,
+    WS_PING = 0x9,
+    WS_PONG = 0xA
+};
+
+enum WsCloseCode
+{
+    WS_CLOSE_NORMAL = 1000,
+    WS_CLOSE_GOING_AWAY = 1001,
+    WS_CLOSE_PROTOCOL_ERROR = 1002,
+    WS_CLOSE_NO_STATUS = 1005, // 对端的关闭帧没有带关闭码，不会出现在发出的帧中
+    WS_CLOSE_ABNORMAL = 1006,  // 没有收到关闭帧连接就断开了，不会出现在发出的帧中
+    WS_CLOSE_TOO_BIG = 1009
+};
+
+// SHA-1（RFC 3174），只用于握手时计算Sec-WebSocket-Accept
+class Sha1
+{
+private:
+    static uint32_t Rol(const uint32_t &x, const int &n) { return (x << n) | (x >> (32 - n)); }
+
+    static void Block(uint32_t h[5], const unsigned char *p)
+    {
+        uint32_t w[80];
+        for (int i = 0; i < 16; ++i)
+            w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16 | (uint32_t)p[4 * i + 2] << 8 | (uint32_t)p[4 * i + 3];
+        for (int i = 16; i < 80; ++i)
+            w[i] = Rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for (int i = 0; i < 80; ++i)
+        {
+            uint32_t f, k;
+            if (i < 20)
+                f = (b & c) | (~b & d), k = 0x5A827999;
+            else if (i < 40)
+                f = b ^ c ^ d, k = 0x6ED9EBA1;
+            else if (i < 60)
+                f = (b & c) | (b & d) | (c & d), k = 0x8F1BBCDC;
+            else
+                f = b ^ c ^ d, k = 0xCA62C1D6;
+            uint32_t t = Rol(a, 5) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = Rol(b, 30);
+            b = a;
+            a = t;
+        }
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+    }
+
+public:
+    static void Digest(const char *data, const size_t &len, unsigned char out[20])
+    {
+        uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+        size_t i = 0;
+        for (; i + 64 <= len; i += 64)
+            Block(h, (const unsigned char *)data + i);
+
+        // 末尾补0x80和0，最后8字节是以位为单位的长度（大端）
+        unsigned char tail[128] = {0};
+        size_t rest = len - i;
+        memcpy(tail, data + i, rest);
+        tail[rest] = 0x80;
+        size_t n = rest + 9 <= 64 ? 64 : 128;
+        uint64_t bits = (uint64_t)len * 8;
+        for (int j = 0; j < 8; ++j)
+            tail[n - 1 - j] = (unsigned char)(bits >> (8 * j));
+        Block(h, tail);
+        if (n == 128)
+            Block(h, tail + 64);
+
+        for (int j = 0; j < 5; ++j)
+        {
+            out[4 * j] = (unsigned char)(h[j] >> 24);
+            out[4 * j + 1] = (unsigned char)(h[j] >> 16);
+            out[4 * j + 2] = (unsigned char)(h[j] >> 8);
+            out[4 * j + 3] = (unsigned char)h[j];
+        }
+    }
+};
+
+class Base64
+{
+public:
+    static std::string Encode(const unsigned char *data, const size_t &len)
+    {
+        static const char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        std::string out;
+        out.reserve((len + 2) / 3 * 4);
+        size_t i = 0;
+        for (; i + 3 <= len; i += 3)
+        {
+            uint32_t v = (uint32_t)data[i] << 16 | (uint32_t)data[i + 1] << 8 | data[i + 2];
+            out += table[v >> 18];
+            out += table[(v >> 12) & 0x3F];
+            out += table[(v >> 6) & 0x3F];
+            out += table[v & 0x3F];
+        }
+        if (i < len)
+        {
+            uint32_t v = (uint32_t)data[i] << 16 | (i + 1 < len ? (uint32_t)data[i + 1] << 8 : 0);
+            out += table[v >> 18];
+            out += table[(v >> 12) & 0x3F];
+            out += i + 1 < len ? table[(v >> 6) & 0x3F] : '=';
+            out += '=';
+        }
+        return out;
+    }
+
+    // 解码，标准字母表和URL安全字母表（-_）都接受，末尾的=可有可无；有非法字符时返回false
+    static bool Decode(const std::string &in, std::string *out)
+    {
+        out->clear();
+        uint32_t v = 0;
+        int bits = 0;
+        size_t end = in.find_last_not_of('=');
+        end = end == std::string::npos ? 0 : end + 1;
+        for (size_t i = 0; i < end; ++i)
+        {
+            char c = in[i];
+            int d;
+            if (c >= 'A' && c <= 'Z')
+                d = c - 'A';
+            else if (c >= 'a' && c <= 'z')
+                d = c - 'a' + 26;
+            else if (c >= '0' && c <= '9')
+                d = c - '0' + 52;
+            else if (c == '+' || c == '-')
+                d = 62;
+            else if (c == '/' || c == '_')
+                d = 63;
+            else
+                return false;
+            v = (v << 6) | d;
+            bits += 6;
+            if (bits >= 8)
+            {
+                bits -= 8;
+                *out += (char)(v >> bits);
+            }
+        }
+        return true;
+    }
+};
+
+// 帧头
+struct WsFrame
+{
+    bool _fin;
+    int _opcode;
+    bool _masked;
+    unsigned char _mask[4];
+    uint64_t _len;  // 负载长度
+    size_t _header; // 帧头长度（包括掩码）
+};
+
+// 帧的解析和序列化，都直接在buffer_t的内存上进行
+class WsCodec
+{
+public:
+    // 解析帧头：数据不足返回0，成功返回1，不合法（保留位不为0、未知的操作码、长度最高位为1）返回-1
+    static int ParseHeader(const char *data, const size_t &n, WsFrame *f)
+    {
+        if (n < 2)
+            return 0;
+        const unsigned char *p = (const unsigned char *)data;
+        if (p[0] & 0x70) // 没有协商扩展，RSV1-3必须为0
+            return -1;
+        f->_fin = p[0] & 0x80;
+        f->_opcode = p[0] & 0x0F;
+        if (f->_opcode > WS_BINARY && (f->_opcode < WS_CLOSE || f->_opcode > WS_PONG))
+            return -1;
+        f->_masked = p[1] & 0x80;
+        uint64_t len = p[1] & 0x7F;
+        size_t pos = 2;
+        if (len == 126)
+        {
+            if (n < 4)
+                return 0;
+            len = (uint64_t)p[2] << 8 | p[3];
+            pos = 4;
+        }
+        else if (len == 127)
+        {
+            if (n < 10)
+                return 0;
+            len = 0;
+            for (int i = 0; i < 8; ++i)
+                len = len << 8 | p[2 + i];
+            if (len >> 63)
+                return -1;
+            pos = 10;
+        }
+        if (f->_masked)
+        {
+            if (n < pos + 4)
+                return 0;
+            memcpy(f->_mask, p + pos, 4);
+            pos += 4;
+        }
+        f->_len = len;
+        f->_header = pos;
+        return 1;
+    }
+
+    // 原地去掩码：按8字节一组异或（编译器可以进一步向量化），不足8字节的尾部逐字节处理
+    static void Unmask(char *data, const size_t &len, const unsigned char mask[4])
+    {
+        uint32_t m32;
+        memcpy(&m32, mask, 4);
+        uint64_t m64 = (uint64_t)m32 << 32 | m32; // 两个掩码首尾相接，内存中的字节顺序与大小端无关
+        size_t i = 0;
+        for (; i + 8 <= len; i += 8)
+        {
+            uint64_t v;
+            memcpy(&v, data + i, 8);
+            v ^= m64;
+            memcpy(data + i, &v, 8);
+        }
+        for (; i < len; ++i)
+            data[i] ^= mask[i & 3];
+    }
+
+    static size_t HeaderSize(const uint64_t &len) { return len < 126 ? 2 : (len <= 0xFFFF ? 4 : 10); }
+
+    // 写入服务端发出的帧头（不带掩码），返回帧头之后的位置
+    static char *PutHeader(char *out, const int &opcode, const uint64_t &len, const bool &fin = true)
+    {
+        unsigned char *p = (unsigned char *)out;
+        p[0] = (fin ? 0x80 : 0) | (opcode & 0x0F);
+        if (len < 126)
+        {
+            p[1] = (unsigned char)len;
+            return out + 2;
+        }
+        if (len <= 0xFFFF)
+        {
+            p[1] = 126;
+            p[2] = (unsigned char)(len >> 8);
+            p[3] = (unsigned char)len;
+            return out + 4;
+        }
+        p[1] = 127;
+        for (int i = 0; i < 8; ++i)
+            p[2 + i] = (unsigned char)(len >> (56 - 8 * i));
+        return out + 10;
+    }
+
+    // 把一帧序列化到out末尾
+    static void Write(buffer_t *out, const int &opcode, const char *data, const size_t &len, const bool &fin = true)
+    {
+        out->expand(HeaderSize(len) + len);
+        char *begin = out->write_addr();
+        char *p = PutHeader(begin, opcode, len, fin);
+        if (len > 0)
+            memcpy(p, data, len);
+        out->move_write_pos_back(p - begin + len);
+    }
+
+    // 序列化成一个独立的字符串，用于跨线程发送和广播
+    static std::string Frame(const int &opcode, const char *data, const size_t &len)
+    {
+        std::string frame(HeaderSize(len) + len, '\0');
+        char *p = PutHeader(&frame[0], opcode, len);
+        if (len > 0)
+            memcpy(p, data, len);
+        return frame;
+    }
+};
+
+// 收到的一条完整消息，数据指向接收缓冲区（或者分片合并后的缓存），回调返回后失效
+struct WsMessage
+{
+    const char *_data;
+    size_t _len;
+    bool _binary;
+
+    std::string Str() const { return std::string(_data, _len); }
+};
+
+class WsSession;
+class WsGroup;
+using WsSessionPtr = std::shared_ptr<WsSession>;
+
+// 一个WebSocket路由的回调，都在连接所属的eventloop线程中调用
+struct WsHandlers
+{
+    std::function<void(const WsSessionPtr &)> _on_open;                     // 握手完成
+    std::function<void(const WsSessionPtr &, const WsMessage &)> _on_message; // 收到一条完整的文本/二进制消息
+    std::function<void(const WsSessionPtr &, const uint16_t &)> _on_close;    // 连接断开，参数是关闭码
+};
+
+// 一个WebSocket连接；发送接口可以在任意线程调用，其余状态只在连接所属的eventloop线程中访问
+// 只持有连接的weak_ptr：连接的上下文持有会话，反过来也持有就会形成循环引用
+class WsSession : public std::enable_shared_from_this<WsSession>
+{
+    friend class WsProtocol;
+    friend class WsGroup;
+
+private:
+    std::weak_ptr<connection> _conn;
+    loop_ptr _loop;
+    uint64_t _timer_id;
+    uint32_t _ping_interval;
+    std::shared_ptr<const WsHandlers> _handlers;
+    std::string _path; // 握手请求的路径
+    any_t _context;    // 组件使用者的会话数据
+
+    std::string _message;         // 未完成的分片消息
+    int _msg_opcode;              // 分片消息的类型，WS_CONTINUATION表示没有未完成的分片消息
+    bool _closing;                // 已经发出关闭帧，之后不再发送数据帧
+    bool _failed;                 // 协议错误，丢弃之后收到的数据
+    bool _closed;                 // 连接已经断开
+    bool _alive;                  // 上次定时检查以来收到过数据
+    bool _ping_sent;              // 已经发出ping，还没有收到任何数据
+    uint16_t _close_code;         // 收到的关闭码
+    std::vector<WsGroup *> _groups; // 加入的广播组，断开时退出
+
+public:
+    WsSession(const conn_ptr &conn, const std::shared_ptr<const WsHandlers> &handlers, const std::string &path, const uint32_t &ping_interval)
+        : _conn(conn), _loop(conn->get_loop()), _timer_id(conn->get_id() | ((uint64_t)1 << 62)), _ping_interval(ping_interval),
+          _handlers(handlers), _path(path), _msg_opcode(WS_CONTINUATION), _closing(false), _failed(false), _closed(false),
+          _alive(false), _ping_sent(false), _close_code(WS_CLOSE_ABNORMAL) {}
+
+    const std::string &Path() const { return _path; }
+    any_t *Context() { return &_context; }
+    conn_ptr Conn() const { return _conn.lock(); }
+
+    // 发送一条消息，连接已经断开时返回false
+    bool Send(const char *data, const size_t &len, const bool &binary = false) { return SendFrame(binary ? WS_BINARY : WS_TEXT, data, len); }
+    bool Send(const std::string &msg, const bool &binary = false) { return Send(msg.data(), msg.size(), binary); }
+    bool Ping(const std::string &payload = "") { return SendFrame(WS_PING, payload.data(), payload.size() > 125 ? 125 : payload.size()); }
+
+    // 发起关闭：发出关闭帧，等对端回复关闭帧后断开（对端不回复时由ping定时器断开）
+    void Close(const uint16_t &code = WS_CLOSE_NORMAL, const std::string &reason = "")
+    {
+        std::string payload;
+        payload += (char)(code >> 8);
+        payload += (char)(code & 0xFF);
+        payload.append(reason, 0, 123);
+        _loop->run_in_loop(std::bind(&WsSession::CloseInLoop, shared_from_this(), payload));
+    }
+
+private:
+    bool SendFrame(const int &opcode, const char *data, const size_t &len)
+    {
+        conn_ptr conn = _conn.lock();
+        if (!conn)
+            return false;
+        if (_loop->is_in_loop())
+            return WriteFrame(opcode, data, len);
+        std::string frame = WsCodec::Frame(opcode, data, len);
+        WsSessionPtr self = shared_from_this();
+        std::shared_ptr<std::string> shared(new std::string(std::move(frame)));
+        _loop->run_in_loop([self, shared]()
+                           { self->WriteRaw(shared->data(), shared->size()); });
+        return true;
+    }
+
+    // 以下在连接所属的线程中调用
+    bool WriteFrame(const int &opcode, const char *data, const size_t &len)
+    {
+        conn_ptr conn = _conn.lock();
+        if (!conn || _closed || (_closing && opcode != WS_CLOSE))
+            return false;
+        WsCodec::Write(conn->outbuffer(), opcode, data, len);
+        conn->flush_outbuffer();
+        return true;
+    }
+    // 已经序列化好的帧（跨线程发送、广播）
+    void WriteRaw(const char *frame, const size_t &len)
+    {
+        conn_ptr conn = _conn.lock();
+        if (!conn || _closed || _closing)
+            return;
+        conn->outbuffer()->write(frame, len);
+        conn->flush_outbuffer();
+    }
+
+    void CloseInLoop(const std::string &payload)
+    {
+        if (_closing || _closed)
+            return;
+        WriteFrame(WS_CLOSE, payload.data(), payload.size());
+        _closing = true;
+    }
+
+    // 协议错误：发出关闭帧后关闭连接，之后收到的数据都丢弃
+    void Fail(const uint16_t &code)
+    {
+        if (!_closing)
+        {
+            char payload[2] = {(char)(code >> 8), (char)(code & 0xFF)};
+            WriteFrame(WS_CLOSE, payload, 2);
+            _closing = true;
+        }
+        _failed = true;
+        _close_code = code;
+        conn_ptr conn = _conn.lock();
+        if (conn)
+            conn->shutdown();
+    }
+
+    void Deliver(const int &opcode, const char *data, const size_t &len)
+    {
+        if (_handlers->_on_message)
+            _handlers->_on_message(shared_from_this(), WsMessage{data, len, opcode == WS_BINARY});
+    }
+
+    // 处理一帧（负载已经去掩码）
+    void HandleFrame(const WsFrame &f, const char *payload)
+    {
+        switch (f._opcode)
+        {
+        case WS_PING:
+            WriteFrame(WS_PONG, payload, f._len);
+            return;
+        case WS_PONG:
+            return;
+        case WS_CLOSE:
+        {
+            if (f._len == 1)
+                return Fail(WS_CLOSE_PROTOCOL_ERROR);
+            _close_code = f._len >= 2 ? ((uint16_t)(unsigned char)payload[0] << 8 | (unsigned char)payload[1]) : WS_CLOSE_NO_STATUS;
+            if (!_closing) // 对端发起的关闭，回复关闭帧（带同样的关闭码）
+            {
+                WriteFrame(WS_CLOSE, payload, f._len >= 2 ? 2 : 0);
+                _closing = true;
+            }
+            _failed = true; // 关闭帧之后不应该再有数据
+            conn_ptr conn = _conn.lock();
+            if (conn)
+                conn->shutdown();
+            return;
+        }
+        case WS_CONTINUATION:
+            if (_msg_opcode == WS_CONTINUATION)
+                return Fail(WS_CLOSE_PROTOCOL_ERROR);
+            _message.append(payload, f._len);
+            if (!f._fin)
+                return;
+            Deliver(_msg_opcode, _message.data(), _message.size());
+            _msg_opcode = WS_CONTINUATION;
+            std::string().swap(_message); // 大消息的空间不留在空闲连接上
+            return;
+        default: // WS_TEXT、WS_BINARY
+            if (_msg_opcode != WS_CONTINUATION)
+                return Fail(WS_CLOSE_PROTOCOL_ERROR);
+            if (f._fin) // 没有分片：直接从接收缓冲区交给回调，不拷贝
+                return Deliver(f._opcode, payload, f._len);
+            _msg_opcode = f._opcode;
+            _message.assign(payload, f._len);
+            return;
+        }
+    }
+
+    // 从接收缓冲区中解析出所有完整的帧
+    void OnData(buffer_t *buf)
+    {
+        while (buf->valid_data_size() > 0)
+        {
+            if (_failed || _closed)
+                return buf->move_read_pos_back(buf->valid_data_size());
+            WsFrame f;
+            int ret = WsCodec::ParseHeader(buf->read_addr(), buf->valid_data_size(), &f);
+            if (ret == 0)
+                return;
+            // 客户端发出的帧必须带掩码；控制帧不能分片，负载不超过125字节
+            bool control = f._opcode >= WS_CLOSE;
+            if (ret < 0 || !f._masked || (control && (!f._fin || f._len > 125)))
+                return Fail(WS_CLOSE_PROTOCOL_ERROR);
+            if (!control && _message.size() + f._len > WS_MAX_MESSAGE)
+                return Fail(WS_CLOSE_TOO_BIG);
+            if (buf->valid_data_size() < f._header + f._len)
+                return; // 等待整帧到达
+            _alive = true;
+            _ping_sent = false;
+            // 先移动读位置再处理：处理中可能关闭连接，关闭时会把缓冲区中剩下的数据再交给OnData丢弃
+            char *payload = buf->read_addr() + f._header;
+            WsCodec::Unmask(payload, f._len, f._mask);
+            buf->move_read_pos_back(f._header + f._len);
+            HandleFrame(f, payload);
+        }
+    }
+
+    // 保活：一个间隔内没有收到任何数据就发ping，发出ping后又一个间隔仍然没有数据（或者发起关闭后对端一直没回复）就断开
+    void StartTimer()
+    {
+        std::weak_ptr<WsSession> weak = shared_from_this();
+        _loop->add_delayed_task(_timer_id, _ping_interval, [weak]()
+                                {
+                                    WsSessionPtr s = weak.lock();
+                                    if (s)
+                                        s->OnTimer(); });
+    }
+    void OnTimer()
+    {
+        conn_ptr conn = _conn.lock();
+        if (!conn || _closed)
+            return;
+        if ((_ping_sent && !_alive) || _closing)
+        {
+            LOG(DEBUG, "[websocket peer not responding, close][conn id:%lu]", (unsigned long)conn->get_id());
+            return conn->force_close();
+        }
+        if (!_alive)
+        {
+            WriteFrame(WS_PING, nullptr, 0);
+            _ping_sent = true;
+        }
+        _alive = false;
+        // 时间轮正在执行这个任务，同一个id要等它从时间轮中移除之后才能再加入
+        _loop->push_in_loop(std::bind(&WsSession::StartTimer, shared_from_this()));
+    }
+
+    void OnClosed();
+};
+
+// 广播组：一条消息只序列化一次，按eventloop分桶，每个eventloop只投递一个任务，由它把同一帧写入本线程的所有成员
+// 每个桶只在自己的eventloop线程中访问，不需要锁；组对象的生命周期要长于其成员连接（通常和HttpServer一样长）
+class WsGroup
+{
+private:
+    struct Bucket
+    {
+        loop_ptr _loop;
+        std::unordered_set<WsSession *> _members; // 成员断开时在本线程中移除，所以裸指针总是有效
+    };
+
+    std::mutex _mutex; // 保护_buckets本身（桶的创建）
+    std::unordered_map<loop_ptr, std::unique_ptr<Bucket>> _buckets;
+    std::atomic<size_t> _size;
+
+    Bucket *GetBucket(const loop_ptr &loop)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        std::unique_ptr<Bucket> &bucket = _buckets[loop];
+        if (!bucket)
+        {
+            bucket.reset(new Bucket);
+            bucket->_loop = loop;
+        }
+        return bucket.get();
+    }
+
+    void JoinInLoop(const WsSessionPtr &s, Bucket *bucket)
+    {
+        if (s->_closed || !bucket->_members.insert(s.get()).second)
+            return;
+        s->_groups.push_back(this);
+        _size.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void LeaveInLoop(const WsSessionPtr &s, Bucket *bucket)
+    {
+        if (bucket->_members.erase(s.get()) == 0)
+            return;
+        for (auto it = s->_groups.begin(); it != s->_groups.end(); ++it)
+        {
+            if (*it == this)
+            {
+                s->_groups.erase(it);
+                break;
+            }
+        }
+        _size.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    friend class WsSession;
+
+public:
+    WsGroup() : _size(0) {}
+    WsGroup(const WsGroup &) = delete;
+    WsGroup &operator=(const WsGroup &) = delete;
+
+    // 加入/退出可以在任意线程调用，在成员所属的eventloop中生效；断开的成员自动退出
+    void Join(const WsSessionPtr &s) { s->_loop->run_in_loop(std::bind(&WsGroup::JoinInLoop, this, s, GetBucket(s->_loop))); }
+    void Leave(const WsSessionPtr &s) { s->_loop->run_in_loop(std::bind(&WsGroup::LeaveInLoop, this, s, GetBucket(s->_loop))); }
+
+    size_t Size() const { return _size.load(std::memory_order_relaxed); }
+
+    // 向所有成员发送一条消息，可以在任意线程调用
+    void Broadcast(const char *data, const size_t &len, const bool &binary = false)
+    {
+        std::shared_ptr<const std::string> frame(new std::string(WsCodec::Frame(binary ? WS_BINARY : WS_TEXT, data, len)));
+        std::vector<Bucket *> buckets;
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            for (auto &it : _buckets)
+                buckets.push_back(it.second.get());
+        }
+        for (Bucket *bucket : buckets)
+        {
+            bucket->_loop->run_in_loop([bucket, frame]()
+                                       {
+                                           for (WsSession *s : bucket->_members)
+                                               s->WriteRaw(frame->data(), frame->size()); });
+        }
+    }
+    void Broadcast(const std::string &msg, const bool &binary = false) { Broadcast(msg.data(), msg.size(), binary); }
+};
+
+// 连接断开：退出所有广播组，取消保活定时器，通知上层
+inline void WsSession::OnClosed()
+{
+    if (_closed)
+        return;
+    WsSessionPtr self = shared_from_this();
+    std::vector<WsGroup *> groups = _groups; // LeaveInLoop会从_groups中移除
+    for (WsGroup *group : groups)
+        group->LeaveInLoop(self, group->GetBucket(_loop));
+    _closed = true;
+    if (_loop->has_dalayed_task(_timer_id))
+        _loop->cancel_task(_timer_id);
+    if (_handlers->_on_close)
+        _handlers->_on_close(self, _close_code);
+}
+
+// 把完成握手的连接切换为WebSocket协议
+class WsProtocol
+{
+public:
+    // 计算握手响应的Sec-WebSocket-Accept：base64(sha1(key + GUID))
+    static std::string AcceptKey(const std::string &key)
+    {
+        std::string src = key + WS_GUID;
+        unsigned char digest[20];
+        Sha1::Digest(src.data(), src.size(), digest);
+        return Base64::Encode(digest, sizeof(digest));
+    }
+
+    // 在连接所属线程中调用（101响应已经写入发送缓冲区）：替换连接的上下文和回调，之后收到的数据按帧解析
+    // 调用之后原来的上下文（HttpContext）已经销毁；接收缓冲区中握手之后的数据由调用者交给OnMessage
+    static WsSessionPtr Attach(const conn_ptr &conn, const std::shared_ptr<const WsHandlers> &handlers, const std::string &path, uint32_t ping_interval)
+    {
+        if (ping_interval == 0 || ping_interval >= SECWHEELCAP)
+            ping_interval = WS_PING_INTERVAL;
+        WsSessionPtr s(new WsSession(conn, handlers, path, ping_interval));
+        conn->stop_inactive_release(); // 改由ping/pong判断对端是否还在
+        conn->upgrade(any_t(s), nullptr, &WsProtocol::OnMessage, &WsProtocol::OnClosed, nullptr);
+        s->StartTimer();
+        if (handlers->_on_open)
+            handlers->_on_open(s);
+        return s;
+    }
+
+    static void OnMessage(const conn_ptr &conn, buf_ptr buf) { (*conn->get_context()->get<WsSessionPtr>())->OnData(buf); }
+    static void OnClosed(const conn_ptr &conn) { (*conn->get_context()->get<WsSessionPtr>())->OnClosed(); }
+};
@@ -0,0 +1,140 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "../server/log.hpp"
+
+using namespace std;
+
+// 把logger::set_binary_file写出的二进制日志解码成和LOG相同格式的文本
+// 用法：logdecode <binlog文件> [更多文件...]，按参数顺序依次解码到标准输出
+
+struct format_def
+{
+    bool _valid = false;
+    int _lv = 0;
+    uint32_t _line = 0;
+    string _file;
+    string _fmt;
+};
+
+template <class T>
+static bool get(const char *&p, const char *end, T *out)
+{
+    if (end - p < (ptrdiff_t)sizeof(T))
+        return false;
+    memcpy(out, p, sizeof(T));
+    p += sizeof(T);
+    return true;
+}
+
+static bool get_str(const char *&p, const char *end, string *out)
+{
+    uint16_t len = 0;
+    if (!get(p, end, &len) || end - p < len)
+        return false;
+    out->assign(p, len);
+    p += len;
+    return true;
+}
+
+static bool decode_file(const char *path)
+{
+    ifstream in(path, ios::binary);
+    if (!in)
+    {
+        cerr << path << ": open failed\n";
+        return false;
+    }
+    stringstream ss;
+    ss << in.rdbuf();
+    string content = ss.str();
+
+    if (content.size() < BINLOG_MAGIC_LEN || content.compare(0, BINLOG_MAGIC_LEN, BINLOG_MAGIC) != 0)
+    {
+        cerr << path << ": not a binary log file\n";
+        return false;
+    }
+
+    vector<format_def> formats;
+    const char *p = content.data() + BINLOG_MAGIC_LEN;
+    const char *end = content.data() + content.size();
+    string line;
+    while (p < end)
+    {
+        char type = 0;
+        uint32_t len = 0;
+        if (!get(p, end, &type) || !get(p, end, &len) || end - p < len)
+        {
+            cerr << path << ": truncated record at offset " << (p - content.data()) << "\n";
+            return false;
+        }
+        const char *rec = p;
+        const char *rec_end = p + len;
+        p += len;
+
+        if (type == 'F')
+        {
+            uint32_t id = 0;
+            uint8_t lv = 0;
+            format_def def;
+            if (!get(rec, rec_end, &id) || !get(rec, rec_end, &lv) || !get(rec, rec_end, &def._line) ||
+                !get_str(rec, rec_end, &def._file) || !get_str(rec, rec_end, &def._fmt))
+                continue;
+            def._lv = lv;
+            def._valid = true;
+            if (id >= formats.size())
+                formats.resize(id + 1);
+            formats[id] = def;
+        }
+        else if (type == 'R')
+        {
+            uint32_t id = 0;
+            uint64_t ns = 0;
+            uint32_t tid = 0;
+            if (!get(rec, rec_end, &id) || !get(rec, rec_end, &ns) || !get(rec, rec_end, &tid))
+                continue;
+            if (id >= formats.size() || !formats[id]._valid)
+            {
+                cout << "<unknown format id " << id << ">\n";
+                continue;
+            }
+
+            const format_def &def = formats[id];
+            time_t sec = ns / 1000000000;
+            struct tm lt;
+            localtime_r(&sec, &lt);
+            char tmbuf[16];
+            strftime(tmbuf, sizeof(tmbuf), "%H:%M:%S", &lt);
+            char prefix[256];
+            snprintf(prefix, sizeof(prefix), "[pid:0X%X][%s.%06u %s:%u][%s] ", tid, tmbuf, (unsigned)(ns % 1000000000 / 1000),
+                     def._file.c_str(), def._line, level_str((level)def._lv));
+
+            line = prefix;
+            binlog_render::render(def._fmt, rec, rec_end, &line);
+            line.push_back('\n');
+            cout << line;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        cerr << "usage: " << argv[0] << " <binlog file>...\n";
+        return 1;
+    }
+
+    int ret = 0;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (!decode_file(argv[i]))
+            ret = 1;
+    }
+    logger::instance().stop();
+    return ret;
+}
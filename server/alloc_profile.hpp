@@ -0,0 +1,168 @@
+#pragma once
+
+#include <string>
+#include <atomic>
+#include <new>
+
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+
+// 按子系统统计内存分配（可选的插桩构建）：编译时加 -DALLOC_PROFILE 启用
+// 启用后替换全局operator new/delete，按当前线程的分配标签（ALLOC_SCOPE设置，内层覆盖外层）累计次数和字节数；
+// 直接malloc的地方（缓冲区存储空间）用ALLOC_NOTE单独记账。不启用时两个宏都是空的，不产生任何代码
+// 只适合单个编译单元的程序（本项目的用法），全局operator new只能定义一次
+
+enum alloc_tag
+{
+    ALLOC_OTHER,      // 未标记
+    ALLOC_BUFFER,     // 收发缓冲区的存储空间
+    ALLOC_TASK,       // eventloop任务池
+    ALLOC_TIMER,      // 时间轮定时任务
+    ALLOC_CONNECTION, // 连接的建立和销毁
+    ALLOC_HTTP,       // http请求解析、路由和响应
+    ALLOC_TAG_NUM
+};
+
+class alloc_profile
+{
+private:
+    // 插桩构建只用于分析，计数直接用全局原子变量
+    std::atomic<uint64_t> _allocs[ALLOC_TAG_NUM];
+    std::atomic<uint64_t> _bytes[ALLOC_TAG_NUM];
+    std::atomic<uint64_t> _frees;
+    std::atomic<uint64_t> _requests;
+    std::atomic<uint64_t> _connections;
+
+    alloc_profile() : _frees(0), _requests(0), _connections(0)
+    {
+        for (int i = 0; i < ALLOC_TAG_NUM; ++i)
+        {
+            _allocs[i].store(0, std::memory_order_relaxed);
+            _bytes[i].store(0, std::memory_order_relaxed);
+        }
+    }
+
+public:
+    // 静态存储，不经过operator new，进程生命周期内一直有效
+    static alloc_profile &instance()
+    {
+        static alloc_profile s_profile;
+        return s_profile;
+    }
+
+    static const char *tag_name(const int &tag)
+    {
+        static const char *names[ALLOC_TAG_NUM] = {"other", "buffer", "task", "timer", "connection", "http"};
+        return names[tag];
+    }
+
+    // 当前线程的分配标签
+    static int &current_tag()
+    {
+        static thread_local int t_tag = ALLOC_OTHER;
+        return t_tag;
+    }
+
+    void on_alloc(const int &tag, const size_t &size)
+    {
+        _allocs[tag].fetch_add(1, std::memory_order_relaxed);
+        _bytes[tag].fetch_add(size, std::memory_order_relaxed);
+    }
+    void on_free() { _frees.fetch_add(1, std::memory_order_relaxed); }
+
+    // 统计分母：处理完的请求数、建立的连接数
+    void count_request() { _requests.fetch_add(1, std::memory_order_relaxed); }
+    void count_connection() { _connections.fetch_add(1, std::memory_order_relaxed); }
+
+    uint64_t allocs(const int &tag) const { return _allocs[tag].load(std::memory_order_relaxed); }
+    uint64_t bytes(const int &tag) const { return _bytes[tag].load(std::memory_order_relaxed); }
+    uint64_t frees() const { return _frees.load(std::memory_order_relaxed); }
+    uint64_t requests() const { return _requests.load(std::memory_order_relaxed); }
+    uint64_t connections() const { return _connections.load(std::memory_order_relaxed); }
+
+    // 各标签的分配次数、字节数以及平均到每个请求/每个连接上的值
+    std::string report() const
+    {
+        std::string out;
+        char buf[256];
+        uint64_t req = requests(), conn = connections();
+        snprintf(buf, sizeof(buf), "%-12s %14s %16s %12s %12s\n", "tag", "allocs", "bytes", "allocs/req", "allocs/conn");
+        out += buf;
+        uint64_t total = 0, total_bytes = 0;
+        for (int i = 0; i <= ALLOC_TAG_NUM; ++i)
+        {
+            uint64_t a = i < ALLOC_TAG_NUM ? allocs(i) : total;
+            uint64_t b = i < ALLOC_TAG_NUM ? bytes(i) : total_bytes;
+            snprintf(buf, sizeof(buf), "%-12s %14llu %16llu %12.2f %12.2f\n", i < ALLOC_TAG_NUM ? tag_name(i) : "total",
+                     (unsigned long long)a, (unsigned long long)b, req ? (double)a / req : 0.0, conn ? (double)a / conn : 0.0);
+            out += buf;
+            total += a;
+            total_bytes += b;
+        }
+        snprintf(buf, sizeof(buf), "frees %llu, requests %llu, connections %llu\n", (unsigned long long)frees(), (unsigned long long)req, (unsigned long long)conn);
+        out += buf;
+        return out;
+    }
+};
+
+// 作用域内的分配记到tag上，离开时恢复外层标签
+class alloc_scope
+{
+private:
+    int _prev;
+
+public:
+    explicit alloc_scope(const alloc_tag &tag) : _prev(alloc_profile::current_tag()) { alloc_profile::current_tag() = tag; }
+    ~alloc_scope() { alloc_profile::current_tag() = _prev; }
+};
+
+#ifdef ALLOC_PROFILE
+
+#define ALLOC_PROFILE_CAT_(a, b) a##b
+#define ALLOC_PROFILE_CAT(a, b) ALLOC_PROFILE_CAT_(a, b)
+#define ALLOC_SCOPE(tag) alloc_scope ALLOC_PROFILE_CAT(__alloc_scope_, __LINE__)(tag)
+#define ALLOC_NOTE(tag, size) alloc_profile::instance().on_alloc(tag, size)
+#define ALLOC_COUNT_REQUEST() alloc_profile::instance().count_request()
+#define ALLOC_COUNT_CONNECTION() alloc_profile::instance().count_connection()
+
+void *operator new(size_t size)
+{
+    alloc_profile::instance().on_alloc(alloc_profile::current_tag(), size);
+    void *p = malloc(size == 0 ? 1 : size);
+    if (p == nullptr)
+        throw std::bad_alloc();
+    return p;
+}
+
+void *operator new[](size_t size) { return operator new(size); }
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept
+{
+    alloc_profile::instance().on_alloc(alloc_profile::current_tag(), size);
+    return malloc(size == 0 ? 1 : size);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &tag) noexcept { return operator new(size, tag); }
+
+void operator delete(void *p) noexcept
+{
+    if (p == nullptr)
+        return;
+    alloc_profile::instance().on_free();
+    free(p);
+}
+
+void operator delete[](void *p) noexcept { operator delete(p); }
+void operator delete(void *p, const std::nothrow_t &) noexcept { operator delete(p); }
+void operator delete[](void *p, const std::nothrow_t &) noexcept { operator delete(p); }
+
+#else
+
+// 展开成一条空语句，放在if之后不会变成空的if体（-Wempty-body）
+#define ALLOC_SCOPE(tag)
+#define ALLOC_NOTE(tag, size) do {} while (0)
+#define ALLOC_COUNT_REQUEST() do {} while (0)
+#define ALLOC_COUNT_CONNECTION() do {} while (0)
+
+#endif
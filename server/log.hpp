@@ -0,0 +1,797 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <type_traits>
+
+#include <cstring>
+#include <cerrno>
+#include <cstdlib>
+#include <cstdio>
+#include <cstdarg>
+#include <ctime>
+#include <cstddef>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+
+enum level
+{
+    TRACE,
+    DEBUG,
+    WARNING,
+    ERROR,
+    FATAL
+};
+
+#define DEFAULT_LEVEL WARNING // 运行时默认的最低日志级别，可通过logger::set_level修改
+
+// 编译期的最低日志级别，低于它的LOG/BLOG调用在编译期就被整个去掉（条件是常量，优化后不产生任何代码）
+// release构建（-DNDEBUG）默认去掉TRACE和DEBUG，也可以 -DLOG_COMPILE_LEVEL=ERROR 之类直接指定
+// 仓库中的makefile都不定义NDEBUG（保留assert），http、echo、bench的makefile直接指定了WARNING
+#ifndef LOG_COMPILE_LEVEL
+#ifdef NDEBUG
+#define LOG_COMPILE_LEVEL WARNING
+#else
+#define LOG_COMPILE_LEVEL TRACE
+#endif
+#endif
+
+const char *level_str(level lv)
+{
+    switch (lv)
+    {
+    case TRACE:
+        return "TRACE";
+        break;
+    case DEBUG:
+        return "DEBUG";
+        break;
+    case WARNING:
+        return "WARNING";
+        break;
+    case ERROR:
+        return "ERROR";
+        break;
+    case FATAL:
+        return "FATAL";
+        break;
+    default:
+        return nullptr;
+        break;
+    }
+}
+
+// 缓存的时间戳：每个线程只在秒数变化时才调用一次localtime_r/strftime
+class log_clock
+{
+public:
+    // 当前时间 HH:MM:SS，返回线程私有的缓冲区
+    static const char *now_str()
+    {
+        static thread_local time_t t_last = 0;
+        static thread_local char t_buf[16] = {0};
+
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME_COARSE, &ts); // vDSO，不陷入内核
+        if (ts.tv_sec != t_last)
+        {
+            t_last = ts.tv_sec;
+            struct tm lt;
+            localtime_r(&t_last, &lt);
+            strftime(t_buf, sizeof(t_buf), "%H:%M:%S", &lt);
+        }
+        return t_buf;
+    }
+};
+
+// 单生产者单消费者的无锁环形缓冲区，每个写日志的线程一个，由后台线程消费
+// 每条记录为 [uint32 长度][数据]，长度的最高位标记二进制记录，写满时丢弃新记录并计数
+class log_ring
+{
+#define LOG_RING_SIZE (256 * 1024) // 必须是2的幂
+#define LOG_REC_BINARY 0x80000000u // 二进制记录标志
+
+private:
+    char _data[LOG_RING_SIZE];
+    std::atomic<uint64_t> _head; // 生产者写入位置，只增不减
+    std::atomic<uint64_t> _tail; // 消费者读取位置，只增不减
+    std::atomic<uint64_t> _dropped;
+
+    void copy_in(uint64_t pos, const char *src, size_t len)
+    {
+        size_t off = pos & (LOG_RING_SIZE - 1);
+        size_t first = std::min(len, (size_t)LOG_RING_SIZE - off);
+        memcpy(_data + off, src, first);
+        memcpy(_data, src + first, len - first);
+    }
+
+    void copy_out(uint64_t pos, char *dst, size_t len) const
+    {
+        size_t off = pos & (LOG_RING_SIZE - 1);
+        size_t first = std::min(len, (size_t)LOG_RING_SIZE - off);
+        memcpy(dst, _data + off, first);
+        memcpy(dst + first, _data, len - first);
+    }
+
+public:
+    log_ring() : _head(0), _tail(0), _dropped(0) {}
+
+    // 生产者：放入一条记录，空间不够返回false
+    bool push(const char *rec, const uint32_t &len, const bool &binary = false)
+    {
+        uint64_t head = _head.load(std::memory_order_relaxed);
+        uint64_t tail = _tail.load(std::memory_order_acquire);
+        if (LOG_RING_SIZE - (head - tail) < sizeof(len) + len)
+        {
+            _dropped.store(_dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            return false;
+        }
+        uint32_t tagged = binary ? (len | LOG_REC_BINARY) : len;
+        copy_in(head, (const char *)&tagged, sizeof(tagged));
+        copy_in(head + sizeof(tagged), rec, len);
+        _head.store(head + sizeof(tagged) + len, std::memory_order_release);
+        return true;
+    }
+
+    // 消费者：取出所有记录（保留 [长度][数据] 的格式）追加到out中，返回取出的条数
+    size_t drain(std::string *out)
+    {
+        uint64_t tail = _tail.load(std::memory_order_relaxed);
+        uint64_t head = _head.load(std::memory_order_acquire);
+        if (tail == head)
+            return 0;
+
+        size_t n = 0;
+        size_t old = out->size();
+        out->resize(old + (head - tail));
+        copy_out(tail, &(*out)[old], head - tail);
+        for (size_t off = old; off < out->size(); ++n)
+        {
+            uint32_t len = 0;
+            memcpy(&len, out->data() + off, sizeof(len));
+            off += sizeof(len) + (len & ~LOG_REC_BINARY);
+        }
+        _tail.store(head, std::memory_order_release);
+        return n;
+    }
+
+    bool empty() const { return _tail.load(std::memory_order_acquire) == _head.load(std::memory_order_acquire); }
+
+    // 取出并清零丢弃计数
+    uint64_t take_dropped() { return _dropped.exchange(0, std::memory_order_relaxed); }
+};
+
+// 二进制日志：调用处只记录格式串id和原始参数，不做格式化；格式串在每个调用处注册一次
+// 文件格式：文件头BINLOG_MAGIC，之后是一条条 [uint8 类型][uint32 长度][内容]
+//   'F' 格式串定义：uint32 id, uint8 级别, uint32 行号, uint16 文件名长度, 文件名, uint16 格式串长度, 格式串
+//   'R' 日志记录：  uint32 id, uint64 时间戳(ns), uint32 线程, 参数...
+// 参数：uint8 类型标记 + 值，'i' int64 / 'u' uint64 / 'd' double / 'p' 指针 / 's' uint16 长度 + 字符串
+#define BINLOG_MAGIC "MDBINLG1"
+#define BINLOG_MAGIC_LEN 8
+#define BINLOG_STR_MAX 255 // 字符串参数最多记录的长度
+
+class binlog_encoder
+{
+private:
+    char *_cur;
+    char *_end;
+
+    void raw(const void *p, const size_t &n)
+    {
+        if (_cur == nullptr || _end - _cur < (ptrdiff_t)n)
+        {
+            _cur = nullptr; // 超长，整条记录作废
+            return;
+        }
+        memcpy(_cur, p, n);
+        _cur += n;
+    }
+
+    void tag(const char &t) { raw(&t, 1); }
+
+public:
+    binlog_encoder(char *buf, const size_t &cap) : _cur(buf), _end(buf + cap) {}
+
+    // 编码结束的位置，编码失败返回空
+    char *cur() const { return _cur; }
+
+    template <class T>
+    typename std::enable_if<std::is_integral<T>::value && std::is_signed<T>::value>::type put(const T &v)
+    {
+        int64_t x = v;
+        tag('i');
+        raw(&x, sizeof(x));
+    }
+    template <class T>
+    typename std::enable_if<std::is_integral<T>::value && !std::is_signed<T>::value>::type put(const T &v)
+    {
+        uint64_t x = v;
+        tag('u');
+        raw(&x, sizeof(x));
+    }
+    template <class T>
+    typename std::enable_if<std::is_enum<T>::value>::type put(const T &v) { put((int64_t)v); }
+    void put(const double &v)
+    {
+        tag('d');
+        raw(&v, sizeof(v));
+    }
+    void put(const float &v) { put((double)v); }
+    void put(const char *s)
+    {
+        if (s == nullptr)
+            s = "(null)";
+        size_t n = strlen(s);
+        put_str(s, n);
+    }
+    void put(const std::string &s) { put_str(s.data(), s.size()); }
+    void put(const void *p)
+    {
+        uint64_t x = (uint64_t)(uintptr_t)p;
+        tag('p');
+        raw(&x, sizeof(x));
+    }
+    void put_str(const char *s, size_t n)
+    {
+        uint16_t len = (uint16_t)std::min(n, (size_t)BINLOG_STR_MAX);
+        tag('s');
+        raw(&len, sizeof(len));
+        raw(s, len);
+    }
+
+    void encode() {}
+    template <class T, class... Rest>
+    void encode(const T &v, const Rest &...rest)
+    {
+        put(v);
+        encode(rest...);
+    }
+};
+
+// 按格式串把二进制参数还原成文本，日志后台线程和离线解码工具共用
+// 每个转换说明符的长度修饰符会被替换成参数实际记录的类型
+class binlog_render
+{
+private:
+    template <class T>
+    static bool get(const char *&p, const char *end, T *out)
+    {
+        if (end - p < (ptrdiff_t)sizeof(T))
+            return false;
+        memcpy(out, p, sizeof(T));
+        p += sizeof(T);
+        return true;
+    }
+
+public:
+    static void render(const std::string &fmt, const char *args, const char *end, std::string *out)
+    {
+        char spec[32];
+        char buf[512];
+        for (size_t i = 0; i < fmt.size(); ++i)
+        {
+            if (fmt[i] != '%')
+            {
+                out->push_back(fmt[i]);
+                continue;
+            }
+            if (i + 1 < fmt.size() && fmt[i + 1] == '%')
+            {
+                out->push_back('%');
+                ++i;
+                continue;
+            }
+            // 取出 %[flags][width][.precision]，跳过长度修饰符，得到转换字符
+            size_t j = i + 1;
+            size_t k = 0;
+            spec[k++] = '%';
+            while (j < fmt.size() && strchr("-+ #0123456789.", fmt[j]) != nullptr && k < sizeof(spec) - 4)
+                spec[k++] = fmt[j++];
+            while (j < fmt.size() && strchr("hlLqjzt", fmt[j]) != nullptr)
+                ++j;
+            if (j >= fmt.size())
+                break;
+            char conv = fmt[j];
+            i = j;
+
+            char t = 0;
+            if (!get(args, end, &t))
+            {
+                out->append("<missing>");
+                continue;
+            }
+            int n = 0;
+            if (t == 'i' || t == 'u')
+            {
+                uint64_t v = 0;
+                get(args, end, &v);
+                spec[k++] = 'l';
+                spec[k++] = 'l';
+                spec[k++] = strchr("cdiouxX", conv) != nullptr ? conv : (t == 'i' ? 'd' : 'u');
+                spec[k] = 0;
+                if (spec[k - 1] == 'c')
+                    n = snprintf(buf, sizeof(buf), "%c", (int)v);
+                else if (t == 'i')
+                    n = snprintf(buf, sizeof(buf), spec, (long long)v);
+                else
+                    n = snprintf(buf, sizeof(buf), spec, (unsigned long long)v);
+            }
+            else if (t == 'd')
+            {
+                double v = 0;
+                get(args, end, &v);
+                spec[k++] = strchr("eEfFgGaA", conv) != nullptr ? conv : 'f';
+                spec[k] = 0;
+                n = snprintf(buf, sizeof(buf), spec, v);
+            }
+            else if (t == 'p')
+            {
+                uint64_t v = 0;
+                get(args, end, &v);
+                n = snprintf(buf, sizeof(buf), "%p", (void *)(uintptr_t)v);
+            }
+            else if (t == 's')
+            {
+                uint16_t len = 0;
+                get(args, end, &len);
+                if (end - args < len)
+                    break;
+                std::string str(args, len);
+                args += len;
+                spec[k++] = 's';
+                spec[k] = 0;
+                n = snprintf(buf, sizeof(buf), spec, str.c_str());
+            }
+            else
+            {
+                out->append("<bad arg>");
+                break;
+            }
+            if (n > 0)
+                out->append(buf, std::min((size_t)n, sizeof(buf) - 1));
+        }
+    }
+};
+
+// 日志输出目标：标准输出或按大小滚动的文件
+struct log_sink
+{
+    int _fd;           // 输出目标，-1表示未启用
+    std::string _path; // 日志文件路径，为空表示不是文件
+    size_t _file_size; // 当前文件大小
+    size_t _max_size;  // 单个文件大小上限
+    int _max_files;    // 保留的历史文件数量
+
+    log_sink(const int &fd) : _fd(fd), _file_size(0), _max_size(0), _max_files(0) {}
+
+    bool open_file(const std::string &path, const size_t &max_size, const int &max_files, const bool &truncate = false)
+    {
+        int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC | (truncate ? O_TRUNC : 0), 0644);
+        if (fd == -1)
+            return false;
+        if (_fd > STDERR_FILENO)
+            ::close(_fd);
+        _fd = fd;
+        _path = path;
+        _file_size = lseek(fd, 0, SEEK_END);
+        _max_size = max_size;
+        _max_files = max_files;
+        return true;
+    }
+
+    void write_all(const char *data, const size_t &len)
+    {
+        size_t off = 0;
+        while (off < len && _fd != -1)
+        {
+            ssize_t n = ::write(_fd, data + off, len - off);
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                break; // 输出目标出错，丢弃这一批
+            }
+            off += n;
+        }
+        _file_size += len;
+    }
+
+    bool need_rotate() const { return !_path.empty() && _file_size >= _max_size; }
+
+    // 滚动：path.(n-1) -> path.n ... path -> path.1，再重新打开path
+    void rotate()
+    {
+        ::close(_fd);
+        for (int i = _max_files - 1; i >= 1; --i)
+        {
+            std::string from = _path + "." + std::to_string(i);
+            std::string to = _path + "." + std::to_string(i + 1);
+            ::rename(from.c_str(), to.c_str());
+        }
+        ::rename(_path.c_str(), (_path + ".1").c_str());
+        _fd = ::open(_path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        _file_size = 0;
+    }
+};
+
+// 异步日志：各线程格式化后写入自己的环形缓冲区，后台线程批量写出到标准输出或文件（按大小滚动）
+// 对象故意不析构（进程退出时仍可能有线程在写日志），退出时由atexit刷新并停止后台线程
+class logger
+{
+#define LOG_LINE_MAX 1024                // 单条日志最大长度，超出截断
+#define LOG_FLUSH_INTERVAL_MS 10         // 后台线程空闲时的轮询间隔
+#define DEFAULT_LOG_FILE_SIZE (64 << 20) // 单个日志文件大小上限
+#define DEFAULT_LOG_FILE_NUM 5           // 保留的历史日志文件数量
+
+    // 二进制日志调用处注册的格式串
+    struct format_def
+    {
+        level _lv;
+        int _line;
+        std::string _file;
+        std::string _fmt;
+    };
+
+private:
+    std::mutex _mutex; // 保护_rings的注册、格式串注册和输出目标的切换，不在写日志的路径上
+    std::condition_variable _cond;
+    std::vector<std::shared_ptr<log_ring>> _rings;
+    std::vector<format_def> _formats;
+
+    log_sink _text;                     // 文本日志输出目标
+    log_sink _binary;                   // 二进制日志输出目标，未设置时二进制记录渲染成文本写入_text
+    size_t _formats_written;            // 已写入当前二进制文件的格式串定义数量
+    std::atomic<uint64_t> _total_drop;  // 累计丢弃的记录数
+    std::atomic<int> _runtime_level;    // 运行时的最低日志级别
+
+    bool _stop;
+    uint64_t _flush_req;  // 刷新请求序号
+    uint64_t _flush_done; // 已完成的刷新序号
+    std::thread _writer;
+
+    logger() : _text(STDOUT_FILENO), _binary(-1), _formats_written(0), _total_drop(0), _runtime_level(DEFAULT_LEVEL),
+               _stop(false), _flush_req(0), _flush_done(0)
+    {
+        _writer = std::thread(&logger::writer_entry, this);
+    }
+
+    static void shutdown_at_exit() { instance().stop(); }
+
+    // 当前线程的环形缓冲区，第一次使用时注册
+    log_ring *local_ring()
+    {
+        static thread_local std::shared_ptr<log_ring> t_ring;
+        if (!t_ring)
+        {
+            t_ring = std::make_shared<log_ring>();
+            std::unique_lock<std::mutex> lock(_mutex);
+            _rings.push_back(t_ring);
+        }
+        return t_ring.get();
+    }
+
+    // 把所有线程的日志记录收集到batch中，顺带清理已退出且已写完的线程的缓冲区
+    size_t collect(std::string *batch, uint64_t *dropped)
+    {
+        std::vector<std::shared_ptr<log_ring>> rings;
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            for (size_t i = 0; i < _rings.size();)
+            {
+                if (_rings[i].use_count() == 1 && _rings[i]->empty())
+                {
+                    _rings[i] = _rings.back();
+                    _rings.pop_back();
+                    continue;
+                }
+                rings.push_back(_rings[i]);
+                ++i;
+            }
+        }
+
+        size_t n = 0;
+        for (auto &r : rings)
+        {
+            n += r->drain(batch);
+            *dropped += r->take_dropped();
+        }
+        _total_drop += *dropped;
+        return n;
+    }
+
+    // 把二进制记录渲染成一行文本
+    void render_binary(const char *rec, const uint32_t &len, std::string *text)
+    {
+        uint32_t id = 0;
+        uint64_t ns = 0;
+        uint32_t tid = 0;
+        if (len < sizeof(id) + sizeof(ns) + sizeof(tid))
+            return;
+        memcpy(&id, rec, sizeof(id));
+        memcpy(&ns, rec + sizeof(id), sizeof(ns));
+        memcpy(&tid, rec + sizeof(id) + sizeof(ns), sizeof(tid));
+        if (id >= _formats.size())
+            return;
+
+        const format_def &def = _formats[id];
+        time_t sec = ns / 1000000000;
+        struct tm lt;
+        localtime_r(&sec, &lt);
+        char tmbuf[16];
+        strftime(tmbuf, sizeof(tmbuf), "%H:%M:%S", &lt);
+        char prefix[256];
+        int n = snprintf(prefix, sizeof(prefix), "[pid:0X%X][%s %s:%d][%s] ", tid, tmbuf, def._file.c_str(), def._line, level_str(def._lv));
+        text->append(prefix, std::min((size_t)n, sizeof(prefix) - 1));
+        binlog_render::render(def._fmt, rec + sizeof(id) + sizeof(ns) + sizeof(tid), rec + len, text);
+        text->push_back('\n');
+    }
+
+    // 写入二进制文件的一条记录
+    static void append_binary(std::string *out, const char &type, const char *payload, const uint32_t &len)
+    {
+        out->push_back(type);
+        out->append((const char *)&len, sizeof(len));
+        out->append(payload, len);
+    }
+
+    // 新的二进制文件：写文件头以及全部格式串定义；否则只补写新注册的格式串定义
+    void write_format_defs(std::string *out, const bool &new_file)
+    {
+        if (new_file)
+        {
+            out->append(BINLOG_MAGIC, BINLOG_MAGIC_LEN);
+            _formats_written = 0;
+        }
+        for (; _formats_written < _formats.size(); ++_formats_written)
+        {
+            const format_def &def = _formats[_formats_written];
+            std::string payload;
+            uint32_t id = _formats_written;
+            uint8_t lv = def._lv;
+            uint32_t line = def._line;
+            uint16_t flen = def._file.size();
+            uint16_t slen = def._fmt.size();
+            payload.append((const char *)&id, sizeof(id));
+            payload.append((const char *)&lv, sizeof(lv));
+            payload.append((const char *)&line, sizeof(line));
+            payload.append((const char *)&flen, sizeof(flen));
+            payload.append(def._file);
+            payload.append((const char *)&slen, sizeof(slen));
+            payload.append(def._fmt);
+            append_binary(out, 'F', payload.data(), payload.size());
+        }
+    }
+
+    // 分拣一批记录：文本记录写入文本日志，二进制记录写入二进制日志（未设置则渲染成文本）
+    void write_out(const std::string &batch, const uint64_t &dropped)
+    {
+        std::string text;
+        std::string binary;
+        text.reserve(batch.size());
+
+        std::unique_lock<std::mutex> lock(_mutex);
+        for (size_t off = 0; off + sizeof(uint32_t) <= batch.size();)
+        {
+            uint32_t len = 0;
+            memcpy(&len, batch.data() + off, sizeof(len));
+            off += sizeof(len);
+            bool is_binary = len & LOG_REC_BINARY;
+            len &= ~LOG_REC_BINARY;
+            if (!is_binary)
+                text.append(batch.data() + off, len);
+            else if (_binary._fd != -1)
+                append_binary(&binary, 'R', batch.data() + off, len);
+            else
+                render_binary(batch.data() + off, len, &text);
+            off += len;
+        }
+        if (dropped > 0)
+        {
+            char buf[128];
+            int len = snprintf(buf, sizeof(buf), "[logger][%s] %lu log records dropped, ring buffer full\n", log_clock::now_str(), (unsigned long)dropped);
+            text.append(buf, len);
+        }
+
+        if (!text.empty())
+        {
+            _text.write_all(text.data(), text.size());
+            if (_text.need_rotate())
+                _text.rotate();
+        }
+        if (!binary.empty())
+        {
+            // 批内记录用到的格式串一定在收集之前就注册好了，先补写定义再写记录
+            std::string defs;
+            write_format_defs(&defs, false);
+            _binary.write_all(defs.data(), defs.size());
+            _binary.write_all(binary.data(), binary.size());
+            if (_binary.need_rotate())
+            {
+                _binary.rotate();
+                defs.clear();
+                write_format_defs(&defs, true);
+                _binary.write_all(defs.data(), defs.size());
+            }
+        }
+    }
+
+    void writer_entry()
+    {
+        // 后台线程不处理信号：日志在进程启动时就创建，之后才屏蔽的信号（热升级的SIGUSR2）不能投递到这里执行默认动作
+        sigset_t all;
+        sigfillset(&all);
+        pthread_sigmask(SIG_BLOCK, &all, nullptr);
+        std::string batch;
+        batch.reserve(1 << 20);
+        while (true)
+        {
+            uint64_t flush_req = 0;
+            bool stop = false;
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                flush_req = _flush_req;
+                stop = _stop;
+            }
+
+            batch.clear();
+            uint64_t dropped = 0;
+            size_t n = collect(&batch, &dropped);
+            if (!batch.empty() || dropped > 0)
+                write_out(batch, dropped);
+
+            std::unique_lock<std::mutex> lock(_mutex);
+            if (flush_req != _flush_done)
+            {
+                _flush_done = flush_req;
+                _cond.notify_all();
+            }
+            if (stop && n == 0)
+                break;
+            if (n == 0 && _flush_req == _flush_done && !_stop)
+                _cond.wait_for(lock, std::chrono::milliseconds(LOG_FLUSH_INTERVAL_MS));
+        }
+    }
+
+public:
+    static logger &instance()
+    {
+        static logger *s_logger = nullptr;
+        static std::once_flag s_once;
+        std::call_once(s_once, []()
+                       {
+                           s_logger = new logger;
+                           atexit(&logger::shutdown_at_exit); });
+        return *s_logger;
+    }
+
+    // 运行时的最低日志级别（在编译期级别之上再过滤）
+    static int runtime_level() { return instance()._runtime_level.load(std::memory_order_relaxed); }
+    static void set_level(const level &lv) { instance()._runtime_level.store(lv, std::memory_order_relaxed); }
+
+    // 写入一条已格式化好的日志，只涉及本线程的环形缓冲区，不加锁也不做系统调用
+    void append(const char *line, const size_t &len) { local_ring()->push(line, (uint32_t)len); }
+
+    // 注册二进制日志的格式串，每个调用处只注册一次，返回格式串id
+    uint32_t register_format(const level &lv, const char *file, const int &line, const char *fmt)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        format_def def;
+        def._lv = lv;
+        def._line = line;
+        def._file = file;
+        def._fmt = fmt;
+        _formats.push_back(def);
+        return _formats.size() - 1;
+    }
+
+    // 写入一条二进制日志：格式串id + 时间戳 + 线程 + 原始参数
+    template <class... Args>
+    void append_binary(const uint32_t &id, const Args &...args)
+    {
+        char rec[LOG_LINE_MAX];
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        uint64_t ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+        uint32_t tid = (uint32_t)pthread_self();
+        memcpy(rec, &id, sizeof(id));
+        memcpy(rec + sizeof(id), &ns, sizeof(ns));
+        memcpy(rec + sizeof(id) + sizeof(ns), &tid, sizeof(tid));
+
+        binlog_encoder enc(rec + sizeof(id) + sizeof(ns) + sizeof(tid), sizeof(rec) - sizeof(id) - sizeof(ns) - sizeof(tid));
+        enc.encode(args...);
+        if (enc.cur() == nullptr)
+            return;
+        local_ring()->push(rec, enc.cur() - rec, true);
+    }
+
+    // 等待后台线程把此前提交的日志全部写出
+    void flush()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (_stop)
+            return;
+        uint64_t req = ++_flush_req;
+        _cond.notify_all();
+        _cond.wait(lock, [&]()
+                   { return _flush_done >= req || _stop; });
+    }
+
+    // 文本日志输出到文件，单个文件超过max_size时滚动，保留max_files个历史文件
+    bool set_file(const std::string &path, const size_t &max_size = DEFAULT_LOG_FILE_SIZE, const int &max_files = DEFAULT_LOG_FILE_NUM)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        return _text.open_file(path, max_size, max_files);
+    }
+
+    // 二进制日志输出到文件（用logdecode离线解码），不设置时二进制日志渲染成文本写入文本日志
+    bool set_binary_file(const std::string &path, const size_t &max_size = DEFAULT_LOG_FILE_SIZE, const int &max_files = DEFAULT_LOG_FILE_NUM)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        // 格式串id只在本进程内有效，不能接着旧文件写，总是从新文件开始
+        if (!_binary.open_file(path, max_size, max_files, true))
+            return false;
+        std::string defs;
+        write_format_defs(&defs, true);
+        _binary.write_all(defs.data(), defs.size());
+        return true;
+    }
+
+    // 累计丢弃的记录数
+    uint64_t dropped() const { return _total_drop.load(std::memory_order_relaxed); }
+
+    // 写出剩余日志并停止后台线程
+    void stop()
+    {
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            if (_stop)
+                return;
+            _stop = true;
+            _cond.notify_all();
+        }
+        if (_writer.joinable())
+            _writer.join();
+    }
+};
+
+// 格式化在调用线程完成（时间戳使用缓存），写出交给后台线程；FATAL级别等待写出后再返回，随后通常就是exit
+// 低于LOG_COMPILE_LEVEL的调用条件恒为假，整个被编译器去掉
+#define LOG(lv, format, ...)                                                                                                                  \
+    do                                                                                                                                        \
+    {                                                                                                                                         \
+        if (lv < LOG_COMPILE_LEVEL || lv < logger::runtime_level())                                                                           \
+            break;                                                                                                                            \
+        char __logbuf[LOG_LINE_MAX];                                                                                                          \
+        int __n = snprintf(__logbuf, LOG_LINE_MAX, "[pid:0X%X][%s %s:%d][%s] " format "\n", (unsigned int)pthread_self(), log_clock::now_str(), \
+                           __FILE__, __LINE__, level_str((enum level)lv), ##__VA_ARGS__);                                                     \
+        if (__n < 0)                                                                                                                          \
+            break;                                                                                                                            \
+        if (__n >= LOG_LINE_MAX)                                                                                                              \
+        {                                                                                                                                     \
+            __n = LOG_LINE_MAX - 1;                                                                                                           \
+            __logbuf[__n - 1] = '\n';                                                                                                         \
+        }                                                                                                                                     \
+        logger::instance().append(__logbuf, __n);                                                                                             \
+        if (lv == FATAL)                                                                                                                      \
+            logger::instance().flush();                                                                                                       \
+    } while (0)
+
+// 二进制日志：调用处不做任何格式化，只拷贝格式串id和参数，解码在后台线程或离线完成
+#define BLOG(lv, format, ...)                                                                                           \
+    do                                                                                                                  \
+    {                                                                                                                   \
+        if (lv < LOG_COMPILE_LEVEL || lv < logger::runtime_level())                                                     \
+            break;                                                                                                      \
+        static const uint32_t __fmt_id = logger::instance().register_format((enum level)lv, __FILE__, __LINE__, format); \
+        logger::instance().append_binary(__fmt_id, ##__VA_ARGS__);                                                      \
+    } while (0)
@@ -0,0 +1,371 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+
+#include <cstdio>
+#include <cstdint>
+#include <ctime>
+
+#include "alloc_profile.hpp"
+
+// 运行指标：每个eventloop一份计数器和延迟直方图，只由所属线程写（不加锁、不用带锁前缀的原子指令），
+// 需要时由任意线程汇总读取，可以通过API获取，也可以输出Prometheus文本格式
+
+// 单调时钟，纳秒
+class metrics_clock
+{
+public:
+    static uint64_t now_ns()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts); // vDSO，不陷入内核
+        return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    }
+};
+
+// 直方图快照，可以合并多个loop的数据再求分位数
+struct histogram_snapshot
+{
+    std::vector<uint64_t> _counts; // 每个桶的计数
+    uint64_t _count;               // 样本总数
+    uint64_t _sum;                 // 样本之和（纳秒）
+    uint64_t _max;                 // 最大样本（纳秒）
+
+    histogram_snapshot() : _count(0), _sum(0), _max(0) {}
+
+    histogram_snapshot &operator+=(const histogram_snapshot &other)
+    {
+        if (_counts.size() < other._counts.size())
+            _counts.resize(other._counts.size(), 0);
+        for (size_t i = 0; i < other._counts.size(); ++i)
+            _counts[i] += other._counts[i];
+        _count += other._count;
+        _sum += other._sum;
+        _max = std::max(_max, other._max);
+        return *this;
+    }
+
+    // 分位数（q取0~1），返回所在桶的上界，不超过最大样本
+    uint64_t percentile(const double &q) const;
+
+    double mean() const { return _count == 0 ? 0 : (double)_sum / _count; }
+};
+
+// HDR风格的对数线性直方图：每个2的幂区间再等分为HIST_SUB_COUNT个桶，相对误差不超过1/HIST_SUB_COUNT
+// 记录只是一次下标计算加一次单线程的计数累加
+class latency_histogram
+{
+#define HIST_SUB_BITS 3                                                    // 每个2的幂区间细分为8个桶，误差不超过12.5%
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)                                //
+#define HIST_MAX_SHIFT 40                                                  // 最大约2^40ns（18分钟），更大的计入最后一个桶
+#define HIST_BUCKETS ((HIST_MAX_SHIFT - HIST_SUB_BITS + 1) * HIST_SUB_COUNT) // 桶的数量
+
+private:
+    std::atomic<uint64_t> _counts[HIST_BUCKETS];
+    std::atomic<uint64_t> _count;
+    std::atomic<uint64_t> _sum;
+    std::atomic<uint64_t> _max;
+
+    static void bump(std::atomic<uint64_t> &counter, const uint64_t &delta) { counter.store(counter.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed); }
+
+public:
+    latency_histogram() : _count(0), _sum(0), _max(0)
+    {
+        for (int i = 0; i < HIST_BUCKETS; ++i)
+            _counts[i].store(0, std::memory_order_relaxed);
+    }
+
+    latency_histogram(const latency_histogram &) = delete;
+    latency_histogram &operator=(const latency_histogram &) = delete;
+
+    // 样本所在的桶：小于HIST_SUB_COUNT的值一个值一个桶，之后每个2的幂区间HIST_SUB_COUNT个桶
+    static int bucket_index(uint64_t v)
+    {
+        if (v < HIST_SUB_COUNT)
+            return (int)v;
+        if (v >= ((uint64_t)1 << HIST_MAX_SHIFT))
+            return HIST_BUCKETS - 1;
+        int msb = 63 - __builtin_clzll(v);
+        int shift = msb - HIST_SUB_BITS;
+        return (shift + 1) * HIST_SUB_COUNT + (int)((v >> shift) & (HIST_SUB_COUNT - 1));
+    }
+
+    // 桶能容纳的最大值
+    static uint64_t bucket_upper(const int &idx)
+    {
+        if (idx < HIST_SUB_COUNT)
+            return idx;
+        int shift = idx / HIST_SUB_COUNT - 1;
+        uint64_t lower = (uint64_t)(HIST_SUB_COUNT + idx % HIST_SUB_COUNT) << shift;
+        return lower + ((uint64_t)1 << shift) - 1;
+    }
+
+    // 记录一个样本，只能在所属线程调用
+    void record(const uint64_t &ns)
+    {
+        bump(_counts[bucket_index(ns)], 1);
+        bump(_count, 1);
+        bump(_sum, ns);
+        if (ns > _max.load(std::memory_order_relaxed))
+            _max.store(ns, std::memory_order_relaxed);
+    }
+
+    // 获取快照，可在任意线程调用
+    histogram_snapshot snapshot() const
+    {
+        histogram_snapshot st;
+        st._counts.resize(HIST_BUCKETS);
+        for (int i = 0; i < HIST_BUCKETS; ++i)
+            st._counts[i] = _counts[i].load(std::memory_order_relaxed);
+        st._count = _count.load(std::memory_order_relaxed);
+        st._sum = _sum.load(std::memory_order_relaxed);
+        st._max = _max.load(std::memory_order_relaxed);
+        return st;
+    }
+};
+
+uint64_t histogram_snapshot::percentile(const double &q) const
+{
+    uint64_t total = 0;
+    for (uint64_t c : _counts)
+        total += c;
+    if (total == 0)
+        return 0;
+
+    uint64_t rank = (uint64_t)(q * total + 0.5);
+    rank = std::max<uint64_t>(rank, 1);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < _counts.size(); ++i)
+    {
+        seen += _counts[i];
+        if (seen >= rank)
+            return std::min(latency_histogram::bucket_upper(i), _max);
+    }
+    return _max;
+}
+
+// 计数器
+enum metrics_counter
+{
+    M_ACCEPTS,       // 获取的新连接
+    M_READS,         // 读取次数
+    M_WRITES,        // 发送次数
+    M_BYTES_IN,      // 读取的字节数
+    M_BYTES_OUT,     // 发送的字节数
+    M_TASKS_QUEUED,  // 其他线程压入任务池的任务
+    M_TASKS_RUN,     // 执行的任务池任务
+    M_TIMER_FIRES,   // 时间轮定时器触发次数
+    M_EPOLL_WAKEUPS, // epoll_wait返回次数
+    M_COUNTER_NUM
+};
+
+// 延迟直方图
+enum metrics_histogram
+{
+    M_LOOP_ITERATION,   // 一轮循环中处理就绪事件和任务的耗时
+    M_TASK_QUEUE_DELAY, // 任务从压入任务池到开始执行的等待时间
+    M_REQUEST_SERVICE,  // 上层协议处理一个请求的耗时
+    M_HISTOGRAM_NUM
+};
+
+// 一个eventloop的指标快照，可以累加得到整个服务器的数据
+struct metrics_snapshot
+{
+    int _loop_id;
+    uint64_t _counters[M_COUNTER_NUM];
+    histogram_snapshot _histograms[M_HISTOGRAM_NUM];
+
+    metrics_snapshot() : _loop_id(-1)
+    {
+        for (int i = 0; i < M_COUNTER_NUM; ++i)
+            _counters[i] = 0;
+    }
+
+    metrics_snapshot &operator+=(const metrics_snapshot &other)
+    {
+        for (int i = 0; i < M_COUNTER_NUM; ++i)
+            _counters[i] += other._counters[i];
+        for (int i = 0; i < M_HISTOGRAM_NUM; ++i)
+            _histograms[i] += other._histograms[i];
+        return *this;
+    }
+};
+
+// 每个eventloop持有一份，构造时注册到metrics_registry，析构时注销
+class loop_metrics
+{
+private:
+    int _loop_id;
+    std::atomic<uint64_t> _counters[M_COUNTER_NUM];
+    latency_histogram _histograms[M_HISTOGRAM_NUM];
+
+public:
+    loop_metrics();
+    ~loop_metrics();
+
+    loop_metrics(const loop_metrics &) = delete;
+    loop_metrics &operator=(const loop_metrics &) = delete;
+
+    int loop_id() const { return _loop_id; }
+
+    // 计数器累加，只能在所属线程调用
+    void add(const metrics_counter &c, const uint64_t &delta = 1) { _counters[c].store(_counters[c].load(std::memory_order_relaxed) + delta, std::memory_order_relaxed); }
+    // 计数器累加，可在任意线程调用
+    void add_shared(const metrics_counter &c, const uint64_t &delta = 1) { _counters[c].fetch_add(delta, std::memory_order_relaxed); }
+    // 记录一个延迟样本（纳秒），只能在所属线程调用
+    void record(const metrics_histogram &h, const uint64_t &ns) { _histograms[h].record(ns); }
+
+    // 获取快照，可在任意线程调用
+    metrics_snapshot snapshot() const
+    {
+        metrics_snapshot st;
+        st._loop_id = _loop_id;
+        for (int i = 0; i < M_COUNTER_NUM; ++i)
+            st._counters[i] = _counters[i].load(std::memory_order_relaxed);
+        for (int i = 0; i < M_HISTOGRAM_NUM; ++i)
+            st._histograms[i] = _histograms[i].snapshot();
+        return st;
+    }
+};
+
+// 所有eventloop指标的登记处，汇总只在读取时进行
+// 对象故意不析构，避免进程退出时和仍在运行的线程发生析构顺序问题
+class metrics_registry
+{
+private:
+    std::mutex _mutex;
+    std::vector<loop_metrics *> _loops;
+    int _next_id;
+
+    metrics_registry() : _next_id(0) {}
+
+public:
+    static metrics_registry &instance()
+    {
+        static metrics_registry *s_registry = new metrics_registry;
+        return *s_registry;
+    }
+
+    static const char *counter_name(const int &c)
+    {
+        static const char *names[M_COUNTER_NUM] = {"accepts", "reads", "writes", "bytes_in", "bytes_out",
+                                                   "tasks_queued", "tasks_run", "timer_fires", "epoll_wakeups"};
+        return names[c];
+    }
+
+    static const char *histogram_name(const int &h)
+    {
+        static const char *names[M_HISTOGRAM_NUM] = {"loop_iteration", "task_queue_delay", "request_service"};
+        return names[h];
+    }
+
+    // 登记，返回分配的loop编号
+    int add(loop_metrics *m)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _loops.push_back(m);
+        return _next_id++;
+    }
+
+    void remove(loop_metrics *m)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        auto it = std::find(_loops.begin(), _loops.end(), m);
+        if (it != _loops.end())
+            _loops.erase(it);
+    }
+
+    // 汇总loop的指标，per_loop不为空时带出每个loop各自的快照
+    // 登记处是进程全局的，only不为空时只汇总其中的loop（一个TcpServer自己的loop），否则汇总进程中所有的loop
+    metrics_snapshot snapshot(std::vector<metrics_snapshot> *per_loop = nullptr, const std::vector<loop_metrics *> *only = nullptr)
+    {
+        std::vector<metrics_snapshot> loops;
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            for (loop_metrics *m : _loops)
+            {
+                if (only == nullptr || std::find(only->begin(), only->end(), m) != only->end())
+                    loops.push_back(m->snapshot());
+            }
+        }
+
+        metrics_snapshot total;
+        for (auto &st : loops)
+            total += st;
+        if (per_loop != nullptr)
+            per_loop->swap(loops);
+        return total;
+    }
+
+    // Prometheus文本格式：计数器按loop分别输出，直方图输出为summary（分位数、总和、样本数，单位秒）
+    // only的含义同snapshot；内存分配统计（ALLOC_PROFILE）只有进程全局的一份
+    std::string prometheus_text(const std::vector<loop_metrics *> *only = nullptr)
+    {
+        std::vector<metrics_snapshot> loops;
+        snapshot(&loops, only);
+
+        static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+        std::string out;
+        char buf[256];
+        for (int c = 0; c < M_COUNTER_NUM; ++c)
+        {
+            snprintf(buf, sizeof(buf), "# TYPE eventloop_%s_total counter\n", counter_name(c));
+            out += buf;
+            for (auto &st : loops)
+            {
+                snprintf(buf, sizeof(buf), "eventloop_%s_total{loop=\"%d\"} %llu\n", counter_name(c), st._loop_id, (unsigned long long)st._counters[c]);
+                out += buf;
+            }
+        }
+        for (int h = 0; h < M_HISTOGRAM_NUM; ++h)
+        {
+            snprintf(buf, sizeof(buf), "# TYPE eventloop_%s_seconds summary\n", histogram_name(h));
+            out += buf;
+            for (auto &st : loops)
+            {
+                const histogram_snapshot &hs = st._histograms[h];
+                for (double q : quantiles)
+                {
+                    snprintf(buf, sizeof(buf), "eventloop_%s_seconds{loop=\"%d\",quantile=\"%g\"} %.9f\n", histogram_name(h), st._loop_id, q, hs.percentile(q) / 1e9);
+                    out += buf;
+                }
+                snprintf(buf, sizeof(buf), "eventloop_%s_seconds_sum{loop=\"%d\"} %.9f\n", histogram_name(h), st._loop_id, hs._sum / 1e9);
+                out += buf;
+                snprintf(buf, sizeof(buf), "eventloop_%s_seconds_count{loop=\"%d\"} %llu\n", histogram_name(h), st._loop_id, (unsigned long long)hs._count);
+                out += buf;
+            }
+        }
+#ifdef ALLOC_PROFILE
+        alloc_profile &ap = alloc_profile::instance();
+        out += "# TYPE alloc_allocations_total counter\n";
+        for (int t = 0; t < ALLOC_TAG_NUM; ++t)
+        {
+            snprintf(buf, sizeof(buf), "alloc_allocations_total{tag=\"%s\"} %llu\n", alloc_profile::tag_name(t), (unsigned long long)ap.allocs(t));
+            out += buf;
+        }
+        out += "# TYPE alloc_bytes_total counter\n";
+        for (int t = 0; t < ALLOC_TAG_NUM; ++t)
+        {
+            snprintf(buf, sizeof(buf), "alloc_bytes_total{tag=\"%s\"} %llu\n", alloc_profile::tag_name(t), (unsigned long long)ap.bytes(t));
+            out += buf;
+        }
+        snprintf(buf, sizeof(buf), "# TYPE alloc_requests_total counter\nalloc_requests_total %llu\n# TYPE alloc_connections_total counter\nalloc_connections_total %llu\n",
+                 (unsigned long long)ap.requests(), (unsigned long long)ap.connections());
+        out += buf;
+#endif
+        return out;
+    }
+};
+
+loop_metrics::loop_metrics()
+{
+    for (int i = 0; i < M_COUNTER_NUM; ++i)
+        _counters[i].store(0, std::memory_order_relaxed);
+    _loop_id = metrics_registry::instance().add(this);
+}
+
+loop_metrics::~loop_metrics() { metrics_registry::instance().remove(this); }
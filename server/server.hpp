@@ -3,6 +3,7 @@
 #include <iostream>
 #include <string>
 #include <vector>
+#include <deque>
 #include <algorithm>
 #include <unordered_map>
 #include <functional>
@@ -11,6 +12,7 @@
 #include <thread>
 #include <mutex>
 #include <condition_variable>
+#include <atomic>
 
 #include <cstring>
 #include <cerrno>
@@ -26,10 +28,20 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <sys/epoll.h>
 #include <sys/timerfd.h>
 #include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+
+#include "alloc_profile.hpp"
+#include "log.hpp"
+#include "metrics.hpp"
+#include "watchdog.hpp"
 
 class any_t;
 class channel;
@@ -78,53 +90,11 @@ enum ERR
     TIMERFD_CREATE_ERR,
     TIMERFD_READ_ERR,
     TIMERFD_WRITE_ERR,
-    TIMERFD_READ_MINITOR_ERR
-};
-
-enum level
-{
-    DEBUG,
-    WARNING,
-    ERROR,
-    FATAL
+    TIMERFD_READ_MINITOR_ERR,
+    SIGNALFD_CREATE_ERR,
+    UPGRADE_INHERIT_ERR
 };
 
-#define DEFAULT_LEVEL WARNING
-
-const char *level_str(level lv)
-{
-    switch (lv)
-    {
-    case DEBUG:
-        return "DEBUG";
-        break;
-    case WARNING:
-        return "WARNING";
-        break;
-    case ERROR:
-        return "ERROR";
-        break;
-    case FATAL:
-        return "FATAL";
-        break;
-    default:
-        return nullptr;
-        break;
-    }
-}
-
-#define LOG(lv, format, ...)                                                                                                                           \
-    do                                                                                                                                                 \
-    {                                                                                                                                                  \
-        if (lv < DEFAULT_LEVEL)                                                                                                                        \
-            break;                                                                                                                                     \
-        time_t t = time(nullptr);                                                                                                                      \
-        struct tm *lt = localtime(&t);                                                                                                                 \
-        char tmbuf[32] = {0};                                                                                                                          \
-        strftime(tmbuf, 31, "%H:%M:%S", lt);                                                                                                           \
-        fprintf(stdout, "[pid:0X%X][%s %s:%d][%s] " format "\n", pthread_self(), tmbuf, __FILE__, __LINE__, level_str((enum level)lv), ##__VA_ARGS__); \
-    } while (0)
-
 class any_t
 {
 private:
@@ -302,7 +272,7 @@ public:
             // if(errno == EAGAIN)
             if (errno == EAGAIN || errno == EWOULDBLOCK)
             {
-                LOG(WARNING, "[accept conditions were not met][%d:%s]", errno, strerror(errno)); // 读取条件尚不满足
+                LOG(DEBUG, "[accept conditions were not met][%d:%s]", errno, strerror(errno)); // 读取条件尚不满足，非阻塞套接字上的正常情况
                 return 0;
             }
             else if (errno == EINTR)
@@ -339,7 +309,7 @@ public:
             // if(errno == EAGAIN)
             if (errno == EAGAIN || errno == EWOULDBLOCK)
             {
-                LOG(WARNING, "[send conditions were not met][%d:%s]", errno, strerror(errno)); // 读取条件尚不满足
+                LOG(DEBUG, "[send conditions were not met][%d:%s]", errno, strerror(errno)); // 读取条件尚不满足，非阻塞套接字上的正常情况
                 return 0;
             }
             else if (errno == EINTR)
@@ -373,7 +343,7 @@ public:
             // if(errno == EAGAIN)
             if (errno == EAGAIN || errno == EWOULDBLOCK)
             {
-                LOG(WARNING, "[recv conditions were not met][%d:%s]", errno, strerror(errno)); // 读取条件尚不满足
+                LOG(DEBUG, "[recv conditions were not met][%d:%s]", errno, strerror(errno)); // 读取条件尚不满足，非阻塞套接字上的正常情况
                 return 0;
             }
             else if (errno == EINTR)
@@ -430,6 +400,232 @@ public:
         fcntl(fd, F_SETFL, fl | O_NONBLOCK);
         return true;
     }
+
+    // 交出描述符的所有权，析构时不再关闭（热升级时把监听套接字交给acceptor或新进程）
+    int release_()
+    {
+        int fd = _listensock;
+        _listensock = -1;
+        return fd;
+    }
+
+    // 通过Unix域套接字把描述符传给另一个进程（SCM_RIGHTS）
+    static bool send_fd(const int &unixfd, const int &fd)
+    {
+        char data = 'F'; // 至少要携带一个字节的普通数据，辅助数据才会被发送
+        struct iovec iov;
+        iov.iov_base = &data;
+        iov.iov_len = 1;
+
+        char ctrl[CMSG_SPACE(sizeof(int))];
+        memset(ctrl, 0, sizeof(ctrl));
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = ctrl;
+        msg.msg_controllen = sizeof(ctrl);
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+        if (-1 == sendmsg(unixfd, &msg, 0))
+        {
+            LOG(ERROR, "[send fd failed][fd:%d][%d:%s]", fd, errno, strerror(errno));
+            return false;
+        }
+        return true;
+    }
+
+    // 从Unix域套接字上接收另一个进程传来的描述符，失败返回-1
+    static int recv_fd(const int &unixfd)
+    {
+        char data = 0;
+        struct iovec iov;
+        iov.iov_base = &data;
+        iov.iov_len = 1;
+
+        char ctrl[CMSG_SPACE(sizeof(int))];
+        memset(ctrl, 0, sizeof(ctrl));
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = ctrl;
+        msg.msg_controllen = sizeof(ctrl);
+
+        ssize_t n = recvmsg(unixfd, &msg, MSG_CMSG_CLOEXEC);
+        if (n <= 0)
+        {
+            LOG(ERROR, "[recv fd failed][%d:%s]", errno, strerror(errno));
+            return -1;
+        }
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg == nullptr || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+        {
+            LOG(ERROR, "[recv fd failed][no SCM_RIGHTS message]");
+            return -1;
+        }
+
+        int fd = -1;
+        memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+        return fd;
+    }
+};
+
+// 按2的幂划分大小等级的内存块池，每个eventloop一个
+// 只在所属eventloop的线程中分配和归还，因此不需要加锁；其他线程归还的块直接交还给malloc
+class buffer_pool
+{
+#define POOL_MIN_SHIFT 10                 // 最小块 1KB
+#define POOL_MAX_SHIFT 22                 // 最大缓存块 4MB，更大的直接走malloc
+#define POOL_CLASS_NUM (POOL_MAX_SHIFT - POOL_MIN_SHIFT + 1)
+#define POOL_MAX_CACHED_BYTES (32 << 20) // 池中最多缓存的空闲内存
+
+public:
+    // 池的统计信息，单线程写，任意线程读
+    struct stats_t
+    {
+        uint64_t _acquires;      // 分配次数
+        uint64_t _releases;      // 归还次数
+        uint64_t _hits;          // 从空闲链表中取到的次数
+        uint64_t _misses;        // 调用malloc的次数
+        uint64_t _foreign_frees; // 其他线程归还，直接free的次数
+        uint64_t _cached_bytes;  // 空闲链表中缓存的内存
+        uint64_t _in_use_bytes;  // 已分配出去的内存
+
+        stats_t() : _acquires(0), _releases(0), _hits(0), _misses(0), _foreign_frees(0), _cached_bytes(0), _in_use_bytes(0) {}
+
+        stats_t &operator+=(const stats_t &other)
+        {
+            _acquires += other._acquires;
+            _releases += other._releases;
+            _hits += other._hits;
+            _misses += other._misses;
+            _foreign_frees += other._foreign_frees;
+            _cached_bytes += other._cached_bytes;
+            _in_use_bytes += other._in_use_bytes;
+            return *this;
+        }
+    };
+
+private:
+    std::thread::id _thread_id;
+    std::vector<char *> _free[POOL_CLASS_NUM]; // 每个大小等级的空闲块
+
+    // 统计信息只由所属线程写，用load+store代替fetch_add，避免加锁的原子指令
+    std::atomic<uint64_t> _acquires;
+    std::atomic<uint64_t> _releases;
+    std::atomic<uint64_t> _hits;
+    std::atomic<uint64_t> _misses;
+    std::atomic<uint64_t> _foreign_frees;
+    std::atomic<uint64_t> _cached_bytes;
+    std::atomic<uint64_t> _in_use_bytes;
+    std::atomic<uint64_t> _foreign_bytes; // 其他线程归还的大小，多个线程都会写，用fetch_add，读取时从_in_use_bytes中扣除
+
+    static void bump(std::atomic<uint64_t> &counter, const int64_t &delta) { counter.store(counter.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed); }
+
+    // 大小对应的等级，超出最大等级返回-1
+    static int size_class(const size_t &size)
+    {
+        int shift = POOL_MIN_SHIFT;
+        while (shift <= POOL_MAX_SHIFT && ((size_t)1 << shift) < size)
+            ++shift;
+        return shift > POOL_MAX_SHIFT ? -1 : shift - POOL_MIN_SHIFT;
+    }
+
+public:
+    buffer_pool() : _thread_id(std::this_thread::get_id()), _acquires(0), _releases(0), _hits(0), _misses(0), _foreign_frees(0), _cached_bytes(0), _in_use_bytes(0), _foreign_bytes(0) {}
+    ~buffer_pool()
+    {
+        for (int i = 0; i < POOL_CLASS_NUM; ++i)
+            for (char *p : _free[i])
+                free(p);
+    }
+
+    buffer_pool(const buffer_pool &) = delete;
+    buffer_pool &operator=(const buffer_pool &) = delete;
+
+    // 是否处于所属线程
+    bool is_owner() const { return _thread_id == std::this_thread::get_id(); }
+
+    // 按块大小向上取整，池化的大小是2的幂
+    static size_t round_up(const size_t &size)
+    {
+        int cls = size_class(size);
+        return cls == -1 ? size : (size_t)1 << (cls + POOL_MIN_SHIFT);
+    }
+
+    // 分配一块至少size大小的内存，实际大小由*capacity带出
+    char *acquire(const size_t &size, size_t *capacity)
+    {
+        *capacity = round_up(size);
+        bump(_acquires, 1);
+        bump(_in_use_bytes, *capacity);
+
+        int cls = size_class(*capacity);
+        if (cls != -1 && !_free[cls].empty())
+        {
+            char *p = _free[cls].back();
+            _free[cls].pop_back();
+            bump(_hits, 1);
+            bump(_cached_bytes, -(int64_t)*capacity);
+            return p;
+        }
+
+        bump(_misses, 1);
+        ALLOC_NOTE(ALLOC_BUFFER, *capacity);
+        char *p = (char *)malloc(*capacity);
+        if (p == nullptr)
+            throw std::bad_alloc();
+        return p;
+    }
+
+    // 归还内存块，capacity必须是acquire带出的大小
+    void release(char *p, const size_t &capacity)
+    {
+        if (p == nullptr)
+            return;
+
+        // 其他线程归还（比如连接最终在主线程析构），不能碰空闲链表
+        if (!is_owner())
+        {
+            _foreign_frees.fetch_add(1, std::memory_order_relaxed);
+            _foreign_bytes.fetch_add(capacity, std::memory_order_relaxed);
+            free(p);
+            return;
+        }
+
+        bump(_releases, 1);
+        bump(_in_use_bytes, -(int64_t)capacity);
+
+        int cls = size_class(capacity);
+        if (cls == -1 || _cached_bytes.load(std::memory_order_relaxed) + capacity > POOL_MAX_CACHED_BYTES)
+            return free(p);
+
+        _free[cls].push_back(p);
+        bump(_cached_bytes, capacity);
+    }
+
+    // 获取统计信息，可在任意线程调用
+    stats_t get_stats() const
+    {
+        stats_t st;
+        st._acquires = _acquires.load(std::memory_order_relaxed);
+        st._releases = _releases.load(std::memory_order_relaxed);
+        st._hits = _hits.load(std::memory_order_relaxed);
+        st._misses = _misses.load(std::memory_order_relaxed);
+        st._foreign_frees = _foreign_frees.load(std::memory_order_relaxed);
+        st._cached_bytes = _cached_bytes.load(std::memory_order_relaxed);
+        st._in_use_bytes = _in_use_bytes.load(std::memory_order_relaxed) - _foreign_bytes.load(std::memory_order_relaxed);
+        return st;
+    }
 };
 
 class buffer_t
@@ -437,13 +633,36 @@ class buffer_t
 #define DEFAULTBUFFERSIZE 1024
 #define DEFAULTPOS 0
 public:
-    buffer_t(size_t buffersize = DEFAULTBUFFERSIZE) : _buffer(buffersize), _read_pos(DEFAULTPOS), _write_pos(DEFAULTPOS) {}
-    // ~buffer_t() {}
+    // 存储空间在第一次写入时才分配，buffersize是最小的块大小
+    buffer_t(size_t buffersize = DEFAULTBUFFERSIZE)
+        : _data(nullptr), _capacity(0), _min_capacity(buffersize), _pool(nullptr), _read_pos(DEFAULTPOS), _write_pos(DEFAULTPOS) {}
+
+    buffer_t(const buffer_t &other)
+        : _data(nullptr), _capacity(0), _min_capacity(other._min_capacity), _pool(nullptr), _read_pos(DEFAULTPOS), _write_pos(DEFAULTPOS) { write(other); }
+
+    buffer_t &operator=(const buffer_t &other)
+    {
+        if (this != &other)
+        {
+            clear();
+            write(other);
+        }
+        return *this;
+    }
+
+    ~buffer_t() { release_storage(); }
+
+    // 设置存储空间来源的内存池，必须在分配存储空间之前设置
+    void set_pool(buffer_pool *pool)
+    {
+        assert(_data == nullptr);
+        _pool = pool;
+    }
 
     // _buffer起始地址
-    char *begin() { return &(*(_buffer.begin())); }
+    char *begin() { return _data; }
 
-    const char *begin() const { return &(*(_buffer.begin())); }
+    const char *begin() const { return _data; }
 
     // 获取当前写入起始地址
     char *write_addr() { return begin() + _write_pos; }
@@ -451,10 +670,12 @@ public:
     const char *write_addr() const { return begin() + _write_pos; }
 
     // 获取当前读取起始地址
+    char *read_addr() { return begin() + _read_pos; }
+
     const char *read_addr() const { return begin() + _read_pos; }
 
     // 获取缓冲区有效数据后空闲空间  after write pos
-    uint64_t tail_vacancy() const { return _buffer.size() - _write_pos; }
+    uint64_t tail_vacancy() const { return _capacity - _write_pos; }
     // 获取缓冲区有效数据前空闲空间  before read pos
     uint64_t head_vacancy() const { return _read_pos; }
 
@@ -482,20 +703,48 @@ public:
             return;
 
         // 末尾空闲空间不够，加上头部空闲空间足够
-        if (tail_vacancy() + head_vacancy() > size)
+        if (tail_vacancy() + head_vacancy() >= size)
         {
             uint64_t vsz = valid_data_size();
             std::copy(read_addr(), read_addr() + vsz, begin());
             _read_pos = 0;
             _write_pos = vsz;
         }
-        // 末尾空闲空间加上头部空闲空间不够
+        // 末尾空闲空间加上头部空闲空间不够，换一块更大的，只拷贝有效数据，不做多余的清零
+        // 至少翻倍：超过池的最大等级后round_up不再取整，按需增长会让每次写入都重新分配、拷贝整个缓冲区
         else
         {
-            _buffer.resize(_write_pos + size);
+            reallocate(std::max<uint64_t>(std::max<uint64_t>(valid_data_size() + size, _min_capacity), _capacity * 2));
         }
     }
 
+    // 缓冲区已空时把过大的存储空间换回最小的块
+    void shrink()
+    {
+        if (valid_data_size() != 0)
+            return;
+        clear();
+        if (_capacity > buffer_pool::round_up(_min_capacity))
+            reallocate(_min_capacity);
+    }
+
+    // 缓冲区已空时归还全部存储空间，下次写入时重新分配
+    void release_storage()
+    {
+        if (_data == nullptr)
+            return;
+        if (_pool != nullptr)
+            _pool->release(_data, _capacity);
+        else
+            free(_data);
+        _data = nullptr;
+        _capacity = 0;
+        _read_pos = _write_pos = DEFAULTPOS;
+    }
+
+    // 当前持有的存储空间大小
+    uint64_t capacity() const { return _capacity; }
+
     // 写入数据
     void write(const char *data_ptr, const uint64_t &size)
     {
@@ -550,13 +799,18 @@ public:
 
         size_t n = endpos - read_addr();
         std::string out(n, 0);
-        std::copy(read_addr(), endpos, &(out.front()));
+        std::copy(static_cast<const char *>(read_addr()), endpos, &(out.front()));
         _read_pos += n; // !!!!!!!!! danger 纯指针操作
         return out;
     }
 
-    // http
-    const char *findCRLF() { return std::find<const char *, char>(read_addr(), read_addr() + valid_data_size(), '\n'); }
+    // http  找到换行符的位置，没找到返回空
+    const char *findCRLF()
+    {
+        const char *end = read_addr() + valid_data_size();
+        const char *pos = std::find<const char *, char>(read_addr(), end, '\n');
+        return pos == end ? nullptr : pos;
+    }
 
     std::string getline()
     {
@@ -571,7 +825,31 @@ public:
     }
 
 private:
-    std::vector<char> _buffer;
+    // 换一块至少size大小的存储空间，有效数据搬到开头
+    void reallocate(const uint64_t &size)
+    {
+        size_t newcap = 0;
+        char *newdata = _pool != nullptr ? _pool->acquire(size, &newcap) : (char *)malloc(newcap = buffer_pool::round_up(size));
+        if (newdata == nullptr)
+            throw std::bad_alloc();
+        if (_pool == nullptr)
+            ALLOC_NOTE(ALLOC_BUFFER, newcap);
+
+        uint64_t vsz = valid_data_size();
+        if (vsz > 0)
+            std::copy(read_addr(), read_addr() + vsz, newdata);
+        release_storage();
+        _data = newdata;
+        _capacity = newcap;
+        _read_pos = 0;
+        _write_pos = vsz;
+    }
+
+private:
+    char *_data;            // 存储空间，来自_pool或者malloc
+    uint64_t _capacity;     // 存储空间大小
+    uint64_t _min_capacity; // 最小的块大小
+    buffer_pool *_pool;     // 存储空间来源的内存池，为空则直接使用malloc
     // 这里使用deque或者写出环形缓冲区真的有更好吗？
 
     uint64_t _read_pos;  // 读开始位置
@@ -586,6 +864,33 @@ enum conn_status
     CONNECTED      // 正在连接状态
 };
 
+// 接收缓冲区达到上限后的处理策略
+enum inbuffer_overflow_policy
+{
+    OVERFLOW_PAUSE, // 暂停读取，等上层消费掉数据后再恢复，让TCP的流量控制反压到对端；单个消息超过上限（上层无法消费）时关闭连接
+    OVERFLOW_DROP,  // 继续从套接字读取，超出上限的数据直接丢弃
+    OVERFLOW_CLOSE  // 直接关闭连接
+};
+
+// 暂停读取的原因，任一原因存在都不监控读事件
+enum read_pause_reason
+{
+    PAUSE_BY_USER = 1,       // 组件使用者调用pause_reading
+    PAUSE_BY_HIGH_WATER = 2, // 发送缓冲区越过高水位
+    PAUSE_BY_INBUFFER = 4    // 接收缓冲区达到上限
+};
+
+// 连接统计排序依据，用于找出最重的连接
+enum conn_stats_key
+{
+    CONN_BY_BYTES,     // 收发字节数之和
+    CONN_BY_OUTBUFFER, // 发送缓冲区待发送数据量
+    CONN_BY_INBUFFER,  // 接收缓冲区待处理数据量
+    CONN_BY_RTT,       // 平滑RTT
+    CONN_BY_RETRANS,   // 累计重传次数
+    CONN_BY_IDLE       // 无活动时长
+};
+
 // class channel : public std::enable_shared_from_this<channel>
 class channel
 {
@@ -602,8 +907,16 @@ private:
     evcb_t _error_event_callbcak; // 异常事件回调函数
     evcb_t _close_event_callbcak; // 连接断开事件回调函数
     evcb_t _any_event_callbcak;   // 任意事件回调函数
+
+    // 慢回调/卡顿检测时用于标识回调的所属对象
+    const char *_trace_tag;
+    uint64_t _trace_id;
+
+    // 所属eventloop的跟踪器
+    loop_tracer *tracer() const;
+
 public:
-    channel(int fd, loop_ptr loop) : _fd(fd), _loop(loop), _events(0), _revents(0) {}
+    channel(int fd, loop_ptr loop) : _fd(fd), _loop(loop), _events(0), _revents(0), _trace_tag("fd"), _trace_id(0) {}
     // ~channel();
 
     int get_fd() const { return _fd; }
@@ -621,6 +934,13 @@ public:
     void set_close_event_callbcak(const evcb_t &cb) { _close_event_callbcak = cb; }
     void set_any_event_callbcak(const evcb_t &cb) { _any_event_callbcak = cb; }
 
+    // 设置回调的所属对象（tag须是字符串常量），慢回调记录和卡顿报告中用来定位
+    void set_trace_tag(const char *tag, const uint64_t &id = 0)
+    {
+        _trace_tag = tag;
+        _trace_id = id;
+    }
+
     // 是否监控了可读
     bool is_read_monitored() const { return _events & EPOLLIN; }
     // 是否监控了可写
@@ -685,7 +1005,10 @@ public:
             // 读取加数据处理的时间会相对比较长，需要在此之前调用一次任意事件回调吗？
             // 这个函数调用之后，这个对象或者说connection会不会已经被清理了呢！？？
             if (_read_event_callbcak)
+            {
+                trace_scope ts(tracer(), _trace_tag, "read", _fd, _trace_id);
                 _read_event_callbcak();
+            }
         }
 
         if (_revents & EPOLLOUT) // ??？ 这里也会触发段错误吗！！！？？？
@@ -695,7 +1018,10 @@ public:
 
             // 这个函数调用之后，这个对象或者说connection会不会已经被清理了呢！？？
             if (_write_event_callbcak)
+            {
+                trace_scope ts(tracer(), _trace_tag, "write", _fd, _trace_id);
                 _write_event_callbcak();
+            }
         }
         else if (_revents & EPOLLERR)
         {
@@ -706,7 +1032,10 @@ public:
             //     _any_event_callbcak();
 
             if (_error_event_callbcak)
+            {
+                trace_scope ts(tracer(), _trace_tag, "error", _fd, _trace_id);
                 _error_event_callbcak();
+            }
         }
         else if ((_revents & EPOLLHUP) || (_revents & EPOLLRDHUP))
         {
@@ -717,14 +1046,20 @@ public:
             //     _any_event_callbcak();
 
             if (_close_event_callbcak)
+            {
+                trace_scope ts(tracer(), _trace_tag, "close", _fd, _trace_id);
                 _close_event_callbcak();
+            }
         }
 
         // 写完后再刷新活跃度  ???
         // 任意事件被触发都调用该函数（如果已经被设置过的话）
 
         if (_any_event_callbcak) // 这里可能会有bug  压力测试的时候这里会触发段错误，即上面的调用中，这里已经资源释放了，这里还在访问
+        {
+            trace_scope ts(tracer(), _trace_tag, "any", _fd, _trace_id);
             _any_event_callbcak();
+        }
     }
 };
 
@@ -898,6 +1233,9 @@ public:
     void set_release(const rmfunc_t &rm) { _release = rm; }
 
     void cancle() { _is_cancle = false; }
+
+    // 是否已经被取消
+    bool is_cancled() const { return !_is_cancle; }
 };
 
 class timewheel
@@ -922,6 +1260,7 @@ public:
     timewheel(loop_ptr loop) : _tick(DEFAULTTICK), _capacity(SECWHEELCAP), _timer(create_timerfd()), _loop(loop), _timer_chan(new channel(_timer, _loop)), _wheel(SECWHEELCAP)
     {
         _timer_chan->set_read_event_callbcak(std::bind(&timewheel::timeout, this));
+        _timer_chan->set_trace_tag("timer");
         if (!_timer_chan->monitor_read_event())
         {
             LOG(FATAL, "[read timerfd set read event monitor failed][timerfd:%d]", _timer);
@@ -932,10 +1271,11 @@ public:
 
 private:
     // 定时任务执行时，回调此函数，将该任务从_ttmap中移除
+    // 同一个id已经换成了新的任务（取消后重新添加、回调中重新添加）时不能移除
     void remove_ttwp(const uint64_t &id)
     {
         auto it = _ttmap.find(id);
-        if (it != _ttmap.end())
+        if (it != _ttmap.end() && it->second.expired())
             _ttmap.erase(it);
     }
 
@@ -982,11 +1322,18 @@ private:
     // 向定时任务池中加入需定时执行的任务
     void add(const uint64_t &taskid, const uint32_t &delaytime, const timefunc_t task)
     {
+        ALLOC_SCOPE(ALLOC_TIMER);
         size_t pos = (_tick + delaytime) % _capacity; // 循环队列的访问  但是sec超过cap呢？bug
 
         // 如果已存在该任务，则重复添加
-        if (is_task_exist(taskid))
-            return _wheel[pos].push_back(_ttmap[taskid].lock());
+        // 已经取消、或者正在执行（在它自己的回调中重新添加）的任务不能复用，换成新的任务
+        auto it = _ttmap.find(taskid);
+        if (it != _ttmap.end())
+        {
+            ttsp_t old = it->second.lock();
+            if (old && !old->is_cancled())
+                return _wheel[pos].push_back(old);
+        }
 
         ttsp_t tsp(new time_task_t(taskid, delaytime, task));
         tsp->set_release(std::bind(&timewheel::remove_ttwp, this, taskid)); // 设置清理map资源的函数
@@ -997,10 +1344,13 @@ private:
     // 刷新根据id指定的任务的过期时间，使其执行倒计时重新计时
     void refresh(const uint64_t &taskid)
     {
+        ALLOC_SCOPE(ALLOC_TIMER);
         if (!is_task_exist(taskid))
             return;
 
         ttsp_t tsp = _ttmap[taskid].lock();
+        if (!tsp) // 正在执行
+            return;
         size_t pos = (_tick + tsp->get_delaytime()) % _capacity; // 循环队列的访问  但是sec超过cap呢？bug
         _wheel[pos].push_back(tsp);
     }
@@ -1035,6 +1385,13 @@ public:
 
     void cancel_task(const uint64_t &taskid);
 
+    // 手动拨动时间轮ticks格，只能在绑定eventloop对应的线程中使用，测试和压测中代替timerfd驱动
+    void advance(const uint32_t &ticks)
+    {
+        for (uint32_t i = 0; i < ticks; ++i)
+            tick_tock();
+    }
+
     // 判断该任务是否存在 这个接口存在线程安全问题！！！  只能在绑定eventloop模块以及在该模块对应的线程中使用
     bool is_task_exist(const uint64_t &taskid) { return _ttmap.end() != _ttmap.find(taskid); }
 };
@@ -1048,12 +1405,16 @@ private:
     std::unique_ptr<channel> _evfd_chan; //_evfd对应的事件
     // chan_ptr _evfd_chan;         //_evfd对应的事件
     timewheel _wheel;            // 延时任务池
-    std::vector<taskf_t> _tasks; // 线程安全任务池
+    std::vector<std::pair<taskf_t, uint64_t>> _tasks; // 线程安全任务池，附带压入时间
     std::mutex _mutex_task;
+    buffer_pool _buf_pool;       // 本线程所有连接缓冲区的内存池
+    loop_metrics _metrics;       // 本线程的运行指标
+    loop_tracer _tracer;         // 本线程的回调跟踪，用于慢回调和卡顿检测
 
 public:
-    eventloop(/* args */) : _thread_id(std::this_thread::get_id()), _evfd(create_eventfd()), _evfd_chan(new channel(_evfd, this)), _wheel(this)
+    eventloop(/* args */) : _thread_id(std::this_thread::get_id()), _evfd(create_eventfd()), _evfd_chan(new channel(_evfd, this)), _wheel(this), _tracer(_metrics.loop_id())
     {
+        _evfd_chan->set_trace_tag("eventfd");
         // 设置读事件处理函数
         _evfd_chan->set_read_event_callbcak(std::bind(&eventloop::read_eventfd, this));
         // 设置监控读事件
@@ -1068,13 +1429,18 @@ public:
 private:
     void run_all_task()
     {
-        std::vector<taskf_t> tasks;
+        std::vector<std::pair<taskf_t, uint64_t>> tasks;
         {
             std::unique_lock<std::mutex> lock(_mutex_task);
             tasks.swap(_tasks);
         }
-        for (const auto &f : tasks)
-            f();
+        for (const auto &t : tasks)
+        {
+            _metrics.record(M_TASK_QUEUE_DELAY, metrics_clock::now_ns() - t.second);
+            trace_scope ts(&_tracer, "task", "task", -1, 0);
+            t.first();
+        }
+        _metrics.add(M_TASKS_RUN, tasks.size());
     }
 
     static int create_eventfd()
@@ -1132,10 +1498,12 @@ public:
     // 将操作压入任务池
     void push_in_loop(const taskf_t &cb)
     {
+        ALLOC_SCOPE(ALLOC_TASK);
         {
             std::unique_lock<std::mutex> lock(_mutex_task);
-            _tasks.push_back(cb);
+            _tasks.push_back(std::make_pair(cb, metrics_clock::now_ns()));
         }
+        _metrics.add_shared(M_TASKS_QUEUED);
         write_eventfd(); // 向eventfd上写入数据，防止epoll事件监控时阻塞
     }
 
@@ -1154,6 +1522,15 @@ public:
     // 移除描述符的监控
     bool remove_events(const chan_ptr &chan) { return _epo.remove(chan); }
 
+    // 获取本线程的缓冲区内存池
+    buffer_pool *get_buffer_pool() { return &_buf_pool; }
+
+    // 获取本线程的运行指标
+    loop_metrics *get_metrics() { return &_metrics; }
+
+    // 获取本线程的回调跟踪器
+    loop_tracer *get_tracer() { return &_tracer; }
+
     // 添加定时任务
     void add_delayed_task(const uint64_t &taskid, const uint32_t &delaytime, const timefunc_t task) { _wheel.add_task(taskid, delaytime, task); }
     // 取消定时任务
@@ -1171,6 +1548,9 @@ public:
             // 1. 事件监控
             std::vector<chan_ptr> active_links;
             _epo.wait(active_links);
+            uint64_t begin = metrics_clock::now_ns();
+            _metrics.add(M_EPOLL_WAKEUPS);
+            _tracer.iteration_begin(begin);
 
             // 2. 就绪事件处理
             for (const auto &e : active_links)
@@ -1178,6 +1558,8 @@ public:
 
             // 3. 执行任务
             run_all_task();
+            _metrics.record(M_LOOP_ITERATION, metrics_clock::now_ns() - begin);
+            _tracer.iteration_end();
         }
     }
 };
@@ -1198,6 +1580,13 @@ public:
     acceptor(loop_ptr loop, const uint16_t &port, const std::string &ip = "0.0.0.0") : _sock(port, ip), _loop(loop), _chan(new channel(_sock.get_fd(), loop))
     {
         _chan->set_read_event_callbcak(std::bind(&acceptor::handle_accept, this));
+        _chan->set_trace_tag("acceptor");
+    }
+    // 接管一个已经处于监听状态的套接字（热升级时由旧进程传递过来），不再调用create_server
+    acceptor(loop_ptr loop, const int &listenfd) : _sock(listenfd), _loop(loop), _chan(new channel(listenfd, loop))
+    {
+        _chan->set_read_event_callbcak(std::bind(&acceptor::handle_accept, this));
+        _chan->set_trace_tag("acceptor");
     }
     // ~acceptor();
 
@@ -1205,6 +1594,8 @@ private:
     void handle_accept()
     {
         int fd = _sock.accept_();
+        if (0 == fd) // 监听套接字是非阻塞的，新旧进程共享监听套接字时连接可能已被对方取走
+            return;
         if (-1 == fd)
         {
             LOG(ERROR, "[accept failed!!!]");
@@ -1212,6 +1603,7 @@ private:
             return;
         }
 
+        _loop->get_metrics()->add(M_ACCEPTS);
         if (acceptor_cb)
             acceptor_cb(fd);
     }
@@ -1224,6 +1616,122 @@ public:
         if (!_chan->monitor_read_event())
             exit(SOCK_READ_MINITOR_ERR);
     }
+
+    // 获取监听套接字
+    int get_fd() const { return _sock.get_fd(); }
+
+    // 停止获取新连接并关闭本进程持有的监听套接字（已交给新进程的副本不受影响）
+    void stop()
+    {
+        _chan->cancel_monitor_all_event();
+        _sock.close_();
+    }
+};
+
+// 共享的文件描述符，最后一个持有者释放时关闭，用于通过sendfile发送文件内容
+class open_file
+{
+private:
+    int _fd;
+
+public:
+    explicit open_file(const int &fd) : _fd(fd) {}
+    ~open_file()
+    {
+        if (_fd != -1)
+            close(_fd);
+    }
+
+    open_file(const open_file &) = delete;
+    open_file &operator=(const open_file &) = delete;
+
+    int fd() const { return _fd; }
+};
+using file_ptr = std::shared_ptr<open_file>;
+
+// 所有连接发送缓冲区的内存预算，由TcpServer持有，各个连接在自己的线程中累加/扣减
+struct outbuffer_budget
+{
+    std::atomic<int64_t> _total;      // 所有连接发送缓冲区中待发送数据的总量
+    std::atomic<bool> _shed_pending;  // 已经通知过超出预算，还没处理完
+    size_t _limit;                    // 预算上限，0表示不限制
+    std::function<void()> _on_exceed; // 超出预算时的回调（投递到主线程处理）
+
+    outbuffer_budget() : _total(0), _shed_pending(false), _limit(0) {}
+};
+
+// 单个连接的统计快照，可在任意线程获取，不需要停下连接所属的eventloop
+struct conn_stats_t
+{
+    uint64_t _conn_id;
+    int _fd;
+    int _loop_id;
+    std::string _peer;      // 对端地址 ip:port
+    uint64_t _bytes_in;     // 累计读取字节数
+    uint64_t _bytes_out;    // 累计发送字节数
+    uint64_t _reads;        // 读取次数
+    uint64_t _writes;       // 发送次数
+    uint64_t _messages;     // 交给上层处理的次数
+    uint64_t _write_armed;  // 启动写事件监控（EPOLLOUT）的次数，发送缓冲区积压的次数
+    double _age_sec;        // 连接建立至今的时长
+    double _idle_sec;       // 距最近一次收发的时长
+    size_t _inbuffer_size;  // 接收缓冲区待处理数据量
+    size_t _outbuffer_size; // 发送缓冲区待发送数据量
+
+    // getsockopt(TCP_INFO)，连接已关闭时_has_tcp_info为false
+    bool _has_tcp_info;
+    uint8_t _tcp_state;
+    uint32_t _rtt_us;        // 平滑RTT（微秒）
+    uint32_t _rttvar_us;     // RTT偏差（微秒）
+    uint32_t _snd_cwnd;      // 拥塞窗口（报文段）
+    uint32_t _unacked;       // 已发送未确认的报文段
+    uint32_t _retransmits;   // 当前未确认数据的重传次数
+    uint32_t _total_retrans; // 累计重传次数
+
+    conn_stats_t() : _conn_id(0), _fd(-1), _loop_id(-1), _bytes_in(0), _bytes_out(0), _reads(0), _writes(0), _messages(0), _write_armed(0),
+                     _age_sec(0), _idle_sec(0), _inbuffer_size(0), _outbuffer_size(0), _has_tcp_info(false), _tcp_state(0),
+                     _rtt_us(0), _rttvar_us(0), _snd_cwnd(0), _unacked(0), _retransmits(0), _total_retrans(0) {}
+
+    // 排序依据对应的值
+    double key_value(const conn_stats_key &key) const
+    {
+        switch (key)
+        {
+        case CONN_BY_OUTBUFFER:
+            return _outbuffer_size;
+        case CONN_BY_INBUFFER:
+            return _inbuffer_size;
+        case CONN_BY_RTT:
+            return _rtt_us;
+        case CONN_BY_RETRANS:
+            return _total_retrans;
+        case CONN_BY_IDLE:
+            return _idle_sec;
+        default:
+            return (double)_bytes_in + _bytes_out;
+        }
+    }
+
+    // 表格形式的文本，每个连接一行
+    static std::string format(const std::vector<conn_stats_t> &stats)
+    {
+        std::string out;
+        char buf[512];
+        snprintf(buf, sizeof(buf), "%-8s %-5s %-4s %-21s %12s %12s %8s %8s %8s %6s %9s %8s %9s %9s %8s %6s %7s %7s\n",
+                 "id", "fd", "loop", "peer", "bytes_in", "bytes_out", "reads", "writes", "msgs", "armed", "age_s", "idle_s",
+                 "inbuf", "outbuf", "rtt_us", "cwnd", "unacked", "retrans");
+        out += buf;
+        for (const conn_stats_t &st : stats)
+        {
+            snprintf(buf, sizeof(buf), "%-8llu %-5d %-4d %-21s %12llu %12llu %8llu %8llu %8llu %6llu %9.1f %8.1f %9lu %9lu %8u %6u %7u %7u\n",
+                     (unsigned long long)st._conn_id, st._fd, st._loop_id, st._peer.c_str(), (unsigned long long)st._bytes_in, (unsigned long long)st._bytes_out,
+                     (unsigned long long)st._reads, (unsigned long long)st._writes, (unsigned long long)st._messages, (unsigned long long)st._write_armed,
+                     st._age_sec, st._idle_sec, (unsigned long)st._inbuffer_size, (unsigned long)st._outbuffer_size,
+                     st._rtt_us, st._snd_cwnd, st._unacked, st._total_retrans);
+            out += buf;
+        }
+        return out;
+    }
 };
 
 class connection : public std::enable_shared_from_this<connection>
@@ -1232,13 +1740,15 @@ class connection : public std::enable_shared_from_this<connection>
     using message_cb_t = std::function<void(const conn_ptr &, buf_ptr)>;
     using close_cb_t = std::function<void(const conn_ptr &)>;
     using anyevent_cb_t = std::function<void(const conn_ptr &)>;
+    using water_mark_cb_t = std::function<void(const conn_ptr &, size_t)>;
 
 private:
     // uint64_t _timer_id;        //连接对应的唯一定时器ID,由于连接ID也是唯一的，这里为了简化操作，直接使用连接ID作为定时器ID
     uint64_t _conn_id;         // 连接对应的唯一ID       真的有必要吗？？？
     int _sockfd;               // 连接关联的文件描述符
     bool _is_inactive_release; // 非活跃连接销毁的标志位，默认为false，即非活跃不销毁
-    conn_status _status;       // 连接状态
+    std::atomic<conn_status> _status; // 连接状态，只在所属线程中修改，is_connected可以在其他线程读取
+    bool _release_queued;      // 已经投递了释放任务
     loop_ptr _loop;
     tcp_sock _socket; // 套接字管理模块
     channel _chan;    // 连接的事件管理
@@ -1256,20 +1766,80 @@ private:
     // 组件内关闭连接的回调，用于清理组件内连接对应的资源
     close_cb_t _conn_manager_close_cb;
 
+    // 发送缓冲区高低水位线：待发送数据超过高水位时通知生产者暂停，回落到低水位以下时通知恢复
+    size_t _high_water_mark;             // 0表示不启用
+    size_t _low_water_mark;              // 回落到该值及以下视为恢复
+    bool _is_above_high_water;           // 当前是否处于高水位之上
+    bool _pause_read_on_high_water;      // 高水位之上时是否停止读取对端数据
+    water_mark_cb_t _high_water_cb;      // 越过高水位时回调
+    water_mark_cb_t _low_water_cb;       // 回落到低水位时回调
+    outbuffer_budget *_budget;           // 服务器级别的发送缓冲区内存预算
+    std::atomic<size_t> _outbuffer_size; // 发送缓冲区数据量的镜像，供其他线程读取
+
+    // 空闲连接归还缓冲区存储空间
+    uint32_t _idle_buffer_release; // 无活动多少秒后归还空缓冲区的存储空间，0表示不启用
+
+    // 读取流量控制
+    uint32_t _read_pause_flags;               // 暂停读取的原因（read_pause_reason按位或）
+    size_t _max_inbuffer_size;                // 接收缓冲区上限，0表示不限制
+    inbuffer_overflow_policy _overflow_policy; // 接收缓冲区达到上限后的处理策略
+
+    // 连接统计：只由所属线程写（不用带锁前缀的原子指令），任意线程可以读
+    std::atomic<uint64_t> _stat_bytes_in;
+    std::atomic<uint64_t> _stat_bytes_out;
+    std::atomic<uint64_t> _stat_reads;
+    std::atomic<uint64_t> _stat_writes;
+    std::atomic<uint64_t> _stat_messages;
+    std::atomic<uint64_t> _stat_write_armed;
+    std::atomic<uint64_t> _last_active_ns; // 最近一次收发的时间
+    std::atomic<size_t> _inbuffer_size;    // 接收缓冲区数据量的镜像
+    uint64_t _created_ns;                  // 连接建立的时间
+    std::mutex _sock_mutex;                // 其他线程读取TCP_INFO时，保证描述符没有被关闭（复用）
+    bool _sock_closed;                     // 描述符已关闭，由_sock_mutex保护
+
+    // 待发送的文件片段：不经过发送缓冲区，轮到时用sendfile直接从文件发送
+    struct file_segment
+    {
+        file_ptr _file;
+        uint64_t _pos;    // 在输出流中的位置：发送缓冲区累计发出这么多字节之后轮到该片段
+        uint64_t _offset; // 文件偏移
+        uint64_t _len;    // 剩余长度
+    };
+    std::deque<file_segment> _file_segments;
+    uint64_t _out_sent; // 发送缓冲区累计发出的字节数
+
 public:
     connection(const uint64_t &conn_id, const int &fd, loop_ptr loop)
-        : _conn_id(conn_id), _sockfd(fd), _is_inactive_release(false), _status(CONNECTING), _loop(loop), _socket(fd), _chan(fd, loop)
+        : _conn_id(conn_id), _sockfd(fd), _is_inactive_release(false), _status(CONNECTING), _release_queued(false), _loop(loop), _socket(fd), _chan(fd, loop),
+          _high_water_mark(0), _low_water_mark(0), _is_above_high_water(false), _pause_read_on_high_water(false), _budget(nullptr), _outbuffer_size(0),
+          _idle_buffer_release(0), _read_pause_flags(0), _max_inbuffer_size(0), _overflow_policy(OVERFLOW_PAUSE),
+          _stat_bytes_in(0), _stat_bytes_out(0), _stat_reads(0), _stat_writes(0), _stat_messages(0), _stat_write_armed(0),
+          _last_active_ns(metrics_clock::now_ns()), _inbuffer_size(0), _created_ns(_last_active_ns.load(std::memory_order_relaxed)), _sock_closed(false), _out_sent(0)
     {
         _chan.set_read_event_callbcak(std::bind(&connection::handle_read, this));
+        _chan.set_trace_tag("conn", conn_id);
         _chan.set_write_event_callbcak(std::bind(&connection::handle_write, this));
         _chan.set_close_event_callbcak(std::bind(&connection::handle_close, this));
         _chan.set_error_event_callbcak(std::bind(&connection::handle_error, this));
         _chan.set_any_event_callbcak(std::bind(&connection::handle_anyevnet, this));
+
+        // 缓冲区存储空间在所属线程第一次读写时才从该线程的内存池分配
+        _inbuffer.set_pool(loop->get_buffer_pool());
+        _outbuffer.set_pool(loop->get_buffer_pool());
     }
-    ~connection() { LOG(DEBUG, "[connection is released successfully][fd:%d][%p]", _sockfd, this); }
+    ~connection() { BLOG(DEBUG, "[connection is released successfully][fd:%d][%p]", _sockfd, (const void *)this); }
     // ~connection() {}
 
 private:
+    static void stat_bump(std::atomic<uint64_t> &counter, const uint64_t &delta) { counter.store(counter.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed); }
+
+    // 启动写事件监控，记录次数：次数多说明对端收得慢，数据经常积压在发送缓冲区
+    void arm_write_event()
+    {
+        stat_bump(_stat_write_armed, 1);
+        _chan.monitor_write_event(); // 失败？
+    }
+
     //  切换协议---重置上下文以及阶段性处理函数
     void upgrade_in_loop(const any_t &context, const gainconn_cb_t &conncb, const message_cb_t &msgcb,
                          const close_cb_t &closecb, const anyevent_cb_t &anycb)
@@ -1285,33 +1855,177 @@ private:
     void handle_read()
     {
 #define BUFFSIZE 65536
+        // 接收缓冲区有上限时，暂停策略下最多只读到上限，剩下的留在内核缓冲区里
+        size_t want = BUFFSIZE;
+        if (_max_inbuffer_size > 0 && _overflow_policy == OVERFLOW_PAUSE)
+        {
+            size_t space = _inbuffer.valid_data_size() < _max_inbuffer_size ? _max_inbuffer_size - _inbuffer.valid_data_size() : 0;
+            if (space == 0)
+                return check_inbuffer_limit();
+            want = std::min(want, space);
+        }
+
         // 创建局部缓冲区，将数据从tcp缓冲区中读上来
-        char buf[BUFFSIZE] = {0};
-        ssize_t n = _socket.recv_nonblcok(buf, BUFFSIZE);
+        char buf[BUFFSIZE];
+        ssize_t n = _socket.recv_nonblcok(buf, want);
         if (-1 == n)
             return shutdown_in_loop(); // 交给这个接口去关闭连接
+        _loop->get_metrics()->add(M_READS);
+        _loop->get_metrics()->add(M_BYTES_IN, n);
+        stat_bump(_stat_reads, 1);
+        stat_bump(_stat_bytes_in, n);
+        _last_active_ns.store(metrics_clock::now_ns(), std::memory_order_relaxed);
 
         // 将数据写入接收缓冲区
+        if (_max_inbuffer_size > 0 && _inbuffer.valid_data_size() + n > _max_inbuffer_size)
+        {
+            if (_overflow_policy == OVERFLOW_CLOSE)
+            {
+                LOG(WARNING, "[inbuffer overflow, close connection][conn id:%lu][limit:%lu]", (unsigned long)_conn_id, (unsigned long)_max_inbuffer_size);
+                return force_close_in_loop();
+            }
+            // OVERFLOW_DROP 只保留上限以内的部分
+            size_t keep = _inbuffer.valid_data_size() < _max_inbuffer_size ? _max_inbuffer_size - _inbuffer.valid_data_size() : 0;
+            LOG(WARNING, "[inbuffer overflow, drop data][conn id:%lu][dropped:%lu]", (unsigned long)_conn_id, (unsigned long)(n - keep));
+            n = keep;
+        }
         _inbuffer.write(buf, n);
-        if (_inbuffer.valid_data_size() > 0)         // 接收缓冲区内有有效数据时
-            _msg_cb(shared_from_this(), &_inbuffer); // shared_from_this() 获取指向自身的conn_ptr对象
+        if (_inbuffer.valid_data_size() > 0) // 接收缓冲区内有有效数据时
+        {
+            stat_bump(_stat_messages, 1);
+            deliver_inbuffer();
+        }
+        else
+            check_inbuffer_limit();
     }
-    // 描述符可写事件触发后调用的函数，将发送缓冲区中的数据发送出去
-    void handle_write()
+
+    // 把接收缓冲区交给上层处理，之后按剩下的数据量决定是否暂停读取
+    void deliver_inbuffer()
     {
-        ssize_t n = _socket.send_nonblock(_outbuffer.read_addr(), _outbuffer.valid_data_size());
-        if (-1 == n)
+        size_t before = _inbuffer.valid_data_size();
+        _msg_cb(shared_from_this(), &_inbuffer); // shared_from_this() 获取指向自身的conn_ptr对象
+        _inbuffer.shrink();                      // 数据处理完了，突发流量撑大的缓冲区换回最小的块
+        _inbuffer_size.store(_inbuffer.valid_data_size(), std::memory_order_relaxed);
+        // 暂停策略下缓冲区满了而上层一个字节也没有消费：单个消息超过了上限，上层要等消息完整才能处理，
+        // 暂停下去永远不会恢复，只能关闭。上层自己暂停了读取（稍后重新投递）时不算
+        if (_max_inbuffer_size > 0 && _overflow_policy == OVERFLOW_PAUSE && _status == CONNECTED && before >= _max_inbuffer_size &&
+            _inbuffer.valid_data_size() >= before && !(_read_pause_flags & PAUSE_BY_USER))
         {
-            // 关闭连接
-            if (_inbuffer.valid_data_size() > 0) // 关闭连接前将inbuffer缓冲区中的待处理数据处理掉  有必要吗？？？
-                _msg_cb(shared_from_this(), &_inbuffer);
+            LOG(WARNING, "[inbuffer full and message not consumed, close connection][conn id:%lu][limit:%lu]", (unsigned long)_conn_id, (unsigned long)_max_inbuffer_size);
+            return force_close_in_loop();
+        }
+        check_inbuffer_limit();
+    }
 
-            // return release_in_loop();
-            return release();
+    // 上层处理完之后，接收缓冲区仍处于上限则暂停读取，降下来了则恢复
+    // 上层在消息回调之外消费了数据（异步处理完之后）时，通过resume_reading或者redeliver_inbuffer重新检查
+    void check_inbuffer_limit()
+    {
+        if (_max_inbuffer_size == 0 || _overflow_policy != OVERFLOW_PAUSE || _status == DISCONNECTED)
+            return;
+
+        if (_inbuffer.valid_data_size() >= _max_inbuffer_size)
+            pause_read_for(PAUSE_BY_INBUFFER);
+        else
+            resume_read_for(PAUSE_BY_INBUFFER);
+    }
+
+    // 因为某个原因暂停读取，第一个原因出现时取消读事件监控
+    void pause_read_for(const read_pause_reason &reason)
+    {
+        if (_read_pause_flags == 0 && _chan.is_read_monitored())
+            _chan.cancel_monitor_read_event();
+        _read_pause_flags |= reason;
+    }
+
+    // 某个暂停原因消失，所有原因都消失后恢复读事件监控
+    void resume_read_for(const read_pause_reason &reason)
+    {
+        if (!(_read_pause_flags & reason))
+            return;
+        _read_pause_flags &= ~reason;
+        if (_read_pause_flags == 0 && _status == CONNECTED && !_chan.is_read_monitored())
+            _chan.monitor_read_event();
+    }
+
+    void pause_reading_in_loop() { pause_read_for(PAUSE_BY_USER); }
+
+    void resume_reading_in_loop()
+    {
+        resume_read_for(PAUSE_BY_USER);
+        check_inbuffer_limit(); // 暂停期间上层可能已经消费了接收缓冲区的数据
+    }
+
+    void redeliver_inbuffer_in_loop()
+    {
+        if (_status == CONNECTED && _inbuffer.valid_data_size() > 0)
+            return deliver_inbuffer();
+        check_inbuffer_limit();
+    }
+    // 发送出错，关闭连接
+    void handle_write_error()
+    {
+        if (_inbuffer.valid_data_size() > 0) // 关闭连接前将inbuffer缓冲区中的待处理数据处理掉  有必要吗？？？
+            _msg_cb(shared_from_this(), &_inbuffer);
+
+        // return release_in_loop();
+        release();
+    }
+    void count_write(const ssize_t &n)
+    {
+        _loop->get_metrics()->add(M_WRITES);
+        _loop->get_metrics()->add(M_BYTES_OUT, n);
+        stat_bump(_stat_writes, 1);
+        stat_bump(_stat_bytes_out, n);
+        _last_active_ns.store(metrics_clock::now_ns(), std::memory_order_relaxed);
+    }
+    // 描述符可写事件触发后调用的函数，按输出流的顺序发送发送缓冲区中的数据和文件片段，直到套接字写满
+    void handle_write()
+    {
+        while (true)
+        {
+            // 发送缓冲区中排在下一个文件片段之前的数据
+            uint64_t limit = _outbuffer.valid_data_size();
+            if (!_file_segments.empty())
+                limit = std::min<uint64_t>(limit, _file_segments.front()._pos - _out_sent);
+            if (limit > 0)
+            {
+                ssize_t n = _socket.send_nonblock(_outbuffer.read_addr(), limit);
+                if (-1 == n)
+                    return handle_write_error();
+                count_write(n);
+                _outbuffer.move_read_pos_back(n);
+                _out_sent += n;
+                update_outbuffer_size();
+                if ((uint64_t)n < limit) // 套接字发送缓冲区满了
+                    break;
+                continue;
+            }
+            if (_file_segments.empty())
+                break;
+
+            // 轮到文件片段
+            file_segment &seg = _file_segments.front();
+            off_t off = seg._offset;
+            ssize_t n = sendfile(_sockfd, seg._file->fd(), &off, seg._len);
+            if (-1 == n && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+                break;
+            if (n <= 0) // 出错，或者文件被截断，已经承诺的长度发不完了
+            {
+                LOG(WARNING, "[sendfile failed][conn id:%lu][%d:%s]", (unsigned long)_conn_id, errno, n == 0 ? "file truncated" : strerror(errno));
+                return handle_write_error();
+            }
+            count_write(n);
+            seg._offset += n;
+            seg._len -= n;
+            if (seg._len > 0)
+                break;
+            _file_segments.pop_front();
         }
-        _outbuffer.move_read_pos_back(n);
-        if (0 == _outbuffer.valid_data_size()) // 发送缓冲区没数据了
+
+        if (0 == _outbuffer.valid_data_size() && _file_segments.empty()) // 发送缓冲区没数据了
         {
+            _outbuffer.shrink();
             _chan.cancel_monitor_write_event(); // 关闭写事件监控
             if (_status == DISCONNECTING)       // 如果连接状态为待关闭，则调用release_in_loop关闭连接
                 return release();
@@ -1336,6 +2050,9 @@ private:
         if (_is_inactive_release) // 如果有设置连接非活跃销毁，刷新连接活跃度
             _loop->refresh_task_delaytime(_conn_id);
 
+        if (_idle_buffer_release > 0) // 有活动就推迟归还缓冲区，已经归还过的重新计时
+            arm_idle_buffer_release();
+
         if (_anyev_cb) // 调用组件使用者的设置的任意事件回调函数
             _anyev_cb(shared_from_this());
     }
@@ -1343,6 +2060,7 @@ private:
     // 连接获取之后。所处的状态下要进行各种设置（给channel设置回调，启动监控事件）
     void establish_connn_in_loop()
     {
+        ALLOC_SCOPE(ALLOC_CONNECTION);
         // 修改连接状态
         assert(_status == CONNECTING);
         _status = CONNECTED;
@@ -1350,8 +2068,9 @@ private:
         // 连接到这里，各项参数，回调已经被组件调用设置过，更新完连接状态，启动完读事件监控才算是一个完整的开始工作的连接
         // 如果在构造函数内，或者在设置各项回调之前启动事件监控，有可能事件已经发生了，但是因为回调还没有被设置，从而错过处理机会
         // 如果非活跃销毁被启用，还会导致有事件发生而活跃度没被刷新
-        // 启动读事件监控
-        _chan.monitor_read_event(); // 失败？
+        // 启动读事件监控（建立之前就被要求暂停读取的不启动）
+        if (_read_pause_flags == 0)
+            _chan.monitor_read_event(); // 失败？
 
         // 调用回调函数
         if (_conn_cb)
@@ -1360,6 +2079,7 @@ private:
     // 真正的释放接口
     void release_in_loop()
     {
+        ALLOC_SCOPE(ALLOC_CONNECTION);
         // LOG(DEBUG, "[release_in_loop is called][fd:%d]", _sockfd);
 
         if (_status == DISCONNECTED)
@@ -1370,13 +2090,28 @@ private:
 
         // 改变连接状态
         _status = DISCONNECTED;
+        // 未发送的数据随连接一起丢弃，从内存预算中扣除
+        _outbuffer.clear();
+        update_outbuffer_size();
+        _file_segments.clear();
+        // 在所属线程中把缓冲区存储空间还给内存池（连接对象可能最终在主线程析构）
+        _inbuffer.clear();
+        _inbuffer_size.store(0, std::memory_order_relaxed);
+        _inbuffer.release_storage();
+        _outbuffer.release_storage();
         // 如果启动了非活跃销毁，则取消该延时任务
         if (_is_inactive_release && _loop->has_dalayed_task(_conn_id))
             _loop->cancel_task(_conn_id);
+        if (_idle_buffer_release > 0 && _loop->has_dalayed_task(idle_buffer_task_id()))
+            _loop->cancel_task(idle_buffer_task_id());
         // 取消事件监控/将文件描述符对应的节点从epoll模型中移除
         _chan.cancel_monitor_all_event(); // 失败？
         // 关闭文件描述符
-        _socket.close_();
+        {
+            std::unique_lock<std::mutex> lock(_sock_mutex);
+            _sock_closed = true;
+            _socket.close_();
+        }
         // 调用用户设置的关闭事件回调 这里调用？
         if (_close_cb)
             _close_cb(shared_from_this());
@@ -1386,16 +2121,79 @@ private:
     }
 
     // 为了防止上层某个连接处理时间太长导致后续连接超时被立即释放，访问后续连接时出现段错误，或者连接被立即释放导致事件派发里后续事件的访问出出现段错误
-    void release() { _loop->push_in_loop(std::bind(&connection::release_in_loop, this)); }
+    // 同一轮里可能从几条路径（对端挂断、发送完毕、上层shutdown）各调用一次，只投递一个释放任务
+    void release()
+    {
+        if (_release_queued)
+            return;
+        _release_queued = true;
+        _loop->push_in_loop(std::bind(&connection::release_in_loop, this));
+    }
 
     // 发送数据，将数据放到发送缓冲区，启动写事件监控
     void send_peer_in_loop(const std::string data) // 此接口要保证传的是右值引用
     {
+        if (_status == DISCONNECTED) // 连接已释放，数据无处可发
+            return;
         // 将数据放入发送缓冲区
         _outbuffer.write(data.c_str(), data.size());
+        update_outbuffer_size();
         // 如果读事件监控没有开启就启动读事件监控
         if (!_chan.is_write_monitored())
-            _chan.monitor_write_event(); // 失败？
+            arm_write_event();
+    }
+
+    // 文件片段排在已经写入发送缓冲区的数据之后
+    void send_file_in_loop(const file_ptr &file, const uint64_t &offset, const uint64_t &len)
+    {
+        if (_status == DISCONNECTED || len == 0)
+            return;
+        file_segment seg = {file, _out_sent + _outbuffer.valid_data_size(), offset, len};
+        _file_segments.push_back(seg);
+        if (!_chan.is_write_monitored())
+            arm_write_event();
+    }
+
+    // 发送缓冲区数据量变化后调用：同步镜像和内存预算，检查是否越过水位线
+    void update_outbuffer_size()
+    {
+        size_t cur = _outbuffer.valid_data_size();
+        size_t old = _outbuffer_size.exchange(cur, std::memory_order_relaxed);
+        if (_budget != nullptr && cur != old)
+        {
+            int64_t delta = (int64_t)cur - (int64_t)old;
+            int64_t total = _budget->_total.fetch_add(delta, std::memory_order_relaxed) + delta;
+            if (_budget->_limit > 0 && total > (int64_t)_budget->_limit && !_budget->_shed_pending.exchange(true))
+                _budget->_on_exceed();
+        }
+
+        if (_high_water_mark == 0 || _status == DISCONNECTED)
+            return;
+
+        if (!_is_above_high_water && cur >= _high_water_mark)
+        {
+            _is_above_high_water = true;
+            if (_pause_read_on_high_water)
+                pause_read_for(PAUSE_BY_HIGH_WATER); // 对端读得慢，就先不读它的请求，让TCP的流量控制反压回去
+            if (_high_water_cb)
+                _high_water_cb(shared_from_this(), cur);
+        }
+        else if (_is_above_high_water && cur <= _low_water_mark)
+        {
+            _is_above_high_water = false;
+            if (_pause_read_on_high_water)
+                resume_read_for(PAUSE_BY_HIGH_WATER);
+            if (_low_water_cb)
+                _low_water_cb(shared_from_this(), cur);
+        }
+    }
+
+    // 强制关闭：丢弃待发送数据，直接释放
+    void force_close_in_loop()
+    {
+        if (_status == DISCONNECTED)
+            return;
+        release_in_loop();
     }
     // void send_peer_in_loop(const std::string &data) // ?
     // {
@@ -1418,6 +2216,8 @@ private:
     void shutdown_in_loop()
     {
         // LOG(DEBUG, "[shutdown_in_loop is called][fd:%d]", _sockfd);
+        if (_status == DISCONNECTED) // 已经释放（例如对端先关闭），不能再改回DISCONNECTING重复释放
+            return;
 
         // 改变连接状态
         _status = DISCONNECTING;
@@ -1426,12 +2226,13 @@ private:
             _msg_cb(shared_from_this(), &_inbuffer); // 要么在这往发送缓冲区写入数据时出错，直接关闭
 
         // 发出发送缓冲区待发送数据
-        if (_outbuffer.valid_data_size() > 0) // 要么在这清空发送缓冲区之后关闭
+        bool pending = _outbuffer.valid_data_size() > 0 || !_file_segments.empty();
+        if (pending) // 要么在这清空发送缓冲区之后关闭
             if (!_chan.is_write_monitored())
-                _chan.monitor_write_event();
+                arm_write_event();
 
         // 确认能处理并发送的数据已处理完毕，就释放资源
-        if (_outbuffer.valid_data_size() == 0)
+        if (!pending)
             release();
         // release_in_loop();
     }
@@ -1446,6 +2247,39 @@ private:
         else
             _loop->add_delayed_task(_conn_id, sec, std::bind(&connection::release, this)); // 如果定时任务不存在，则添加定时任务
     }
+    // 归还缓冲区的定时任务id，与非活跃销毁的定时任务（使用连接id）区分开
+    uint64_t idle_buffer_task_id() const { return _conn_id | ((uint64_t)1 << 63); }
+
+    // 添加或刷新归还缓冲区的定时任务
+    void arm_idle_buffer_release()
+    {
+        if (_status == DISCONNECTED)
+            return;
+        if (_loop->has_dalayed_task(idle_buffer_task_id()))
+            _loop->refresh_task_delaytime(idle_buffer_task_id());
+        else
+            _loop->add_delayed_task(idle_buffer_task_id(), _idle_buffer_release, std::bind(&connection::release_idle_buffers, this));
+    }
+
+    // 空闲超时：空的缓冲区把存储空间还给内存池，下次读写时再重新分配
+    void release_idle_buffers()
+    {
+        if (_status == DISCONNECTED)
+            return;
+        if (_inbuffer.valid_data_size() == 0)
+            _inbuffer.release_storage();
+        if (_outbuffer.valid_data_size() == 0)
+            _outbuffer.release_storage();
+    }
+
+    void start_idle_buffer_release_in_loop(const uint32_t &sec)
+    {
+        // 时间轮一圈60秒，超过一圈的延时会被折算错
+        _idle_buffer_release = sec < SECWHEELCAP ? sec : SECWHEELCAP - 1;
+        if (_idle_buffer_release > 0)
+            arm_idle_buffer_release();
+    }
+
     //  取消非活跃销毁
     void stop_inactive_release_in_loop()
     {
@@ -1461,7 +2295,9 @@ public:
     int get_fd() const { return _sockfd; }
     // 获取id
     uint64_t get_id() const { return _conn_id; }
-    // 判断连接是否就绪
+    // 获取连接所属的eventloop
+    loop_ptr get_loop() const { return _loop; }
+    // 判断连接是否就绪，可在任意线程调用
     bool is_connected() const { return _status == CONNECTED; }
 
     // 设置获取连接时回调对象
@@ -1475,6 +2311,76 @@ public:
     // 设置关闭连接回调对象
     void set_anyevent_callback(const close_cb_t &cb) { _anyev_cb = cb; }
 
+    // 设置发送缓冲区高低水位线，high为0表示不启用
+    void set_water_mark(const size_t &high, const size_t &low)
+    {
+        _high_water_mark = high;
+        _low_water_mark = low < high ? low : high / 2;
+    }
+    // 设置越过高水位回调
+    void set_high_water_mark_callback(const water_mark_cb_t &cb) { _high_water_cb = cb; }
+    // 设置回落到低水位回调
+    void set_low_water_mark_callback(const water_mark_cb_t &cb) { _low_water_cb = cb; }
+    // 设置高水位之上时是否停止读取对端数据
+    void set_pause_read_on_high_water(const bool &on) { _pause_read_on_high_water = on; }
+    // 设置服务器级别的发送缓冲区内存预算
+    void set_outbuffer_budget(outbuffer_budget *budget) { _budget = budget; }
+    // 发送缓冲区中待发送数据量，可在任意线程调用
+    size_t outbuffer_size() const { return _outbuffer_size.load(std::memory_order_relaxed); }
+    // 设置接收缓冲区上限及达到上限后的处理策略，0表示不限制
+    void set_max_inbuffer_size(const size_t &size, const inbuffer_overflow_policy &policy = OVERFLOW_PAUSE)
+    {
+        _max_inbuffer_size = size;
+        _overflow_policy = policy;
+    }
+
+    // 获取连接统计快照，可在任意线程调用；连接未关闭时附带TCP_INFO
+    void get_stats(conn_stats_t *st)
+    {
+        uint64_t now = metrics_clock::now_ns();
+        uint64_t last = _last_active_ns.load(std::memory_order_relaxed);
+        st->_conn_id = _conn_id;
+        st->_fd = _sockfd;
+        st->_loop_id = _loop->get_metrics()->loop_id();
+        st->_bytes_in = _stat_bytes_in.load(std::memory_order_relaxed);
+        st->_bytes_out = _stat_bytes_out.load(std::memory_order_relaxed);
+        st->_reads = _stat_reads.load(std::memory_order_relaxed);
+        st->_writes = _stat_writes.load(std::memory_order_relaxed);
+        st->_messages = _stat_messages.load(std::memory_order_relaxed);
+        st->_write_armed = _stat_write_armed.load(std::memory_order_relaxed);
+        st->_age_sec = (now - _created_ns) / 1e9;
+        st->_idle_sec = now > last ? (now - last) / 1e9 : 0;
+        st->_inbuffer_size = _inbuffer_size.load(std::memory_order_relaxed);
+        st->_outbuffer_size = _outbuffer_size.load(std::memory_order_relaxed);
+
+        std::unique_lock<std::mutex> lock(_sock_mutex);
+        if (_sock_closed)
+            return;
+
+        sockaddr_in peer;
+        socklen_t len = sizeof(peer);
+        if (0 == getpeername(_sockfd, (struct sockaddr *)&peer, &len))
+        {
+            char ip[INET_ADDRSTRLEN] = {0};
+            inet_ntop(AF_INET, &peer.sin_addr, ip, sizeof(ip));
+            st->_peer = std::string(ip) + ":" + std::to_string(ntohs(peer.sin_port));
+        }
+
+        struct tcp_info ti;
+        len = sizeof(ti);
+        if (0 == getsockopt(_sockfd, IPPROTO_TCP, TCP_INFO, &ti, &len))
+        {
+            st->_has_tcp_info = true;
+            st->_tcp_state = ti.tcpi_state;
+            st->_rtt_us = ti.tcpi_rtt;
+            st->_rttvar_us = ti.tcpi_rttvar;
+            st->_snd_cwnd = ti.tcpi_snd_cwnd;
+            st->_unacked = ti.tcpi_unacked;
+            st->_retransmits = ti.tcpi_retransmits;
+            st->_total_retrans = ti.tcpi_total_retrans;
+        }
+    }
+
     // 设置上下文---连接建立完成时进行回调
     void set_context(const any_t &context) { _context = context; }
 
@@ -1490,10 +2396,44 @@ public:
     // void send_peer(std::string &&data) { _loop->run_in_loop(std::bind(&connection::send_peer_in_loop, this, data)); }       // 尽量调用这个接口
     void send_peer(const std::string &&data) { _loop->run_in_loop(std::bind(&connection::send_peer_in_loop, this, data)); } // 尽量调用这个接口
 
+    // 直接访问发送缓冲区（只能在连接所属线程中调用），上层把数据直接序列化进去，省掉一次临时字符串和拷贝；
+    // 写完之后调用flush_outbuffer启动发送
+    buf_ptr outbuffer()
+    {
+        assert(_loop->is_in_loop());
+        return &_outbuffer;
+    }
+    void flush_outbuffer()
+    {
+        assert(_loop->is_in_loop());
+        if (_status == DISCONNECTED) // 连接已释放，数据无处可发，存储空间在本线程中还给内存池
+        {
+            _outbuffer.clear();
+            _outbuffer.release_storage();
+            return;
+        }
+        update_outbuffer_size();
+        if (_outbuffer.valid_data_size() > 0 && !_chan.is_write_monitored())
+            arm_write_event();
+    }
+
+    // 发送文件的[offset, offset+len)部分：用sendfile从文件直接发送，不读入内存，排在之前写入的数据之后
+    void send_file(const file_ptr &file, const uint64_t &offset, const uint64_t &len) { _loop->run_in_loop(std::bind(&connection::send_file_in_loop, this, file, offset, len)); }
+
     //  提供给组件使用者的关闭接口，实际并不一定关闭，需判断数据待处理
     void shutdown() { _loop->run_in_loop(std::bind(&connection::shutdown_in_loop, this)); }
+    // 暂停读取对端数据，数据留在内核缓冲区，由TCP的流量控制反压到对端
+    void pause_reading() { _loop->run_in_loop(std::bind(&connection::pause_reading_in_loop, shared_from_this())); }
+    // 恢复读取对端数据
+    void resume_reading() { _loop->run_in_loop(std::bind(&connection::resume_reading_in_loop, shared_from_this())); }
+    // 把接收缓冲区中还没处理的数据重新交给消息回调，用于上层暂停处理（例如等待流式响应结束）之后恢复
+    void redeliver_inbuffer() { _loop->run_in_loop(std::bind(&connection::redeliver_inbuffer_in_loop, shared_from_this())); }
+    // 立即关闭连接，丢弃发送缓冲区中的数据，可在任意线程调用
+    void force_close() { _loop->run_in_loop(std::bind(&connection::force_close_in_loop, shared_from_this())); }
     // 启动非活跃销毁，需传入超时时间，添加定时任务      主动刷新？
     void start_inactive_release(const uint32_t &sec) { _loop->run_in_loop(std::bind(&connection::start_inactive_release_in_loop, this, sec)); }
+    // 无活动sec秒后归还空缓冲区的存储空间，以降低大量空闲长连接的内存占用，0表示不启用
+    void start_idle_buffer_release(const uint32_t &sec) { _loop->run_in_loop(std::bind(&connection::start_idle_buffer_release_in_loop, this, sec)); }
     // 取消非活跃销毁
     void stop_inactive_release() { _loop->run_in_loop(std::bind(&connection::stop_inactive_release_in_loop, this)); }
     // 切换协议---重置上下文以及阶段性回调处理函数  -- 非线程安全
@@ -1512,6 +2452,8 @@ private:
     // std::unordered_map<int, conn_ptr> _conns; // fd conn_ptr
     std::unordered_map<uint64_t, conn_ptr> _conns; // conn_id connptr
     // uint64_t _id_to_distribute;
+    // 连接表只在主线程中增删，主线程读取不加锁；其他线程（查询连接统计）读取时加锁
+    std::mutex _mutex;
 
 public:
     // ~connection_manager() {}
@@ -1538,6 +2480,7 @@ public:
     {
         conn_ptr pc(new connection(conn_id, fd, loop));
 
+        std::unique_lock<std::mutex> lock(_mutex);
         _conns.insert(std::make_pair(conn_id, pc));
         return pc;
     }
@@ -1556,8 +2499,24 @@ public:
 
     void dele_conn(const uint64_t &conn_id)
     {
-        if (is_alive(conn_id))
-            _conns.erase(conn_id);
+        std::unique_lock<std::mutex> lock(_mutex);
+        _conns.erase(conn_id);
+    }
+
+    // 按id查找连接，不存在返回空，可在任意线程调用
+    conn_ptr find(const uint64_t &conn_id)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        auto it = _conns.find(conn_id);
+        return it == _conns.end() ? conn_ptr() : it->second;
+    }
+
+    // 拷贝出所有连接，可在任意线程调用
+    void collect(std::vector<conn_ptr> *out)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        for (auto &conn : _conns)
+            out->push_back(conn.second);
     }
 
     // 获取连接
@@ -1567,6 +2526,10 @@ public:
 
     // 已管理连接的数量
     size_t size() { return _conns.size(); }
+
+    // 迭代器
+    conn_iterator begin() { return _conns.begin(); }
+    conn_iterator end() { return _conns.end(); }
 };
 
 class loop_thread
@@ -1660,10 +2623,14 @@ public:
 
 class TcpServer
 {
+#define UPGRADE_FD_ENV "MUDUO_UPGRADE_FD" // 热升级时新进程从该环境变量得知与旧进程通信的Unix域套接字
+#define DEFAULT_DRAIN_TIMEOUT 30          // 热升级后旧进程等待已有连接处理完毕的最长时间（秒）
+
     using build_conn_cb_t = std::function<void(const conn_ptr &)>;
     using handle_message_cb_t = std::function<void(const conn_ptr &, buf_ptr)>;
     using destroy_conn_cb_t = std::function<void(const conn_ptr &)>;
     using anyevent_occur_cb_t = std::function<void(const conn_ptr &)>;
+    using water_mark_cb_t = std::function<void(const conn_ptr &, size_t)>;
 
 private:
     uint16_t _port;             // 端口
@@ -1677,24 +2644,240 @@ private:
 
     std::vector<std::pair<connection_manager, loop_ptr>> _conn_balance_in_loop; // 负载均衡模块
 
+    // 热升级
+    char *const *_upgrade_argv;                  // 新进程的启动参数
+    int _signalfd;                               // 触发热升级的信号
+    std::unique_ptr<channel> _signal_chan;       // _signalfd对应的事件
+    int _upgrade_fd;                             // 与新进程通信的Unix域套接字
+    std::unique_ptr<channel> _upgrade_chan;      // _upgrade_fd对应的事件，等待新进程接管完成的确认
+    bool _is_draining;                           // 监听套接字已交出，等待已有连接处理完毕
+    uint32_t _drain_timeout;                     // 等待已有连接处理完毕的最长时间
+    uint32_t _drain_elapsed;                     // 已经等待的时间
+
     build_conn_cb_t _build_conn;         // 获取连接，设置完各项参数之后调用
     handle_message_cb_t _handle_message; // 处理数据回调
     anyevent_occur_cb_t _anyevent_occur; // 任意事件发生时回调
     destroy_conn_cb_t _destroy_conn;     // 销毁连接前的回调
 
+    // 发送缓冲区背压
+    size_t _high_water_mark;        // 每个连接的高水位线，0表示不启用
+    size_t _low_water_mark;         // 每个连接的低水位线
+    bool _pause_read_on_high_water; // 高水位之上时停止读取对端数据
+    water_mark_cb_t _high_water_cb; // 越过高水位回调
+    water_mark_cb_t _low_water_cb;  // 回落到低水位回调
+    outbuffer_budget _budget;       // 所有连接发送缓冲区的内存预算
+
+    uint32_t _idle_buffer_release;             // 连接无活动多少秒后归还空缓冲区，0表示不启用
+    size_t _max_inbuffer_size;                 // 每个连接接收缓冲区上限，0表示不限制
+    inbuffer_overflow_policy _overflow_policy; // 接收缓冲区达到上限后的处理策略
+
 public:
     TcpServer(const uint16_t &port, const std::string &ip = "0.0.0.0")
-        : _port(port), _ip(ip), _id_to_distribute(0), _timeout(0), _is_inactive_release(false), _acceptor(&_main_loop, port, ip), _pool(&_main_loop)
+        : _port(port), _ip(ip), _id_to_distribute(0), _timeout(0), _is_inactive_release(false), _acceptor(&_main_loop, open_listener(port, ip)), _pool(&_main_loop),
+          _upgrade_argv(nullptr), _signalfd(-1), _upgrade_fd(-1), _is_draining(false), _drain_timeout(DEFAULT_DRAIN_TIMEOUT), _drain_elapsed(0),
+          _high_water_mark(0), _low_water_mark(0), _pause_read_on_high_water(false), _idle_buffer_release(0), _max_inbuffer_size(0), _overflow_policy(OVERFLOW_PAUSE)
     {
+        _budget._on_exceed = std::bind(&TcpServer::shed_connections, this);
         _acceptor.setaccept_callback(std::bind(&TcpServer::accept_connection, this, std::placeholders::_1));
         _acceptor.listen();
     }
     // ~TcpServer();
 
 private:
+    // 获取监听套接字：由旧进程热升级拉起时接管旧进程的监听套接字，否则新建
+    static int open_listener(const uint16_t &port, const std::string &ip)
+    {
+        int listenfd = -1;
+        const char *env = getenv(UPGRADE_FD_ENV);
+        if (env != nullptr)
+        {
+            int unixfd = atoi(env);
+            unsetenv(UPGRADE_FD_ENV);
+            listenfd = tcp_sock::recv_fd(unixfd);
+            if (-1 == listenfd)
+            {
+                LOG(FATAL, "[inherit listen socket failed][unix socket:%d]", unixfd);
+                exit(UPGRADE_INHERIT_ERR);
+            }
+            // 回复确认，旧进程收到后才停止获取新连接
+            char ack = 'A';
+            if (-1 == write(unixfd, &ack, 1))
+                LOG(ERROR, "[write upgrade ack failed][%d:%s]", errno, strerror(errno));
+            close(unixfd);
+            LOG(WARNING, "[listen socket inherited from old process][fd:%d]", listenfd);
+        }
+        else
+        {
+            tcp_sock sock(port, ip);
+            listenfd = sock.release_();
+        }
+
+        // 新旧进程短暂地同时监听同一个套接字，连接可能被对方取走，accept不能阻塞
+        tcp_sock::set_nonblock(listenfd);
+        return listenfd;
+    }
+
+    // 信号触发热升级
+    void handle_upgrade_signal()
+    {
+        struct signalfd_siginfo si;
+        if (-1 == read(_signalfd, &si, sizeof(si)))
+            return;
+
+        hot_upgrade_in_loop(_upgrade_argv);
+    }
+
+    // fork并exec新的可执行程序，把监听套接字通过Unix域套接字交给它
+    void hot_upgrade_in_loop(char *const *argv)
+    {
+        if (_is_draining || _upgrade_fd != -1 || argv == nullptr)
+        {
+            LOG(WARNING, "[hot upgrade is already in progress or not enabled]");
+            return;
+        }
+
+        int sv[2];
+        if (-1 == socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv))
+        {
+            LOG(ERROR, "[hot upgrade socketpair failed][%d:%s]", errno, strerror(errno));
+            return;
+        }
+
+        // fork之后子进程只能调用异步信号安全的函数，环境变量要提前准备好
+        char envbuf[64] = {0};
+        snprintf(envbuf, sizeof(envbuf), "%s=%d", UPGRADE_FD_ENV, sv[1]);
+        std::vector<char *> envp;
+        for (char **e = environ; *e != nullptr; ++e)
+            envp.push_back(*e);
+        envp.push_back(envbuf);
+        envp.push_back(nullptr);
+
+        struct rlimit rl;
+        int maxfd = (0 == getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur != RLIM_INFINITY) ? (int)rl.rlim_cur : 65536;
+
+        pid_t pid = fork();
+        if (-1 == pid)
+        {
+            LOG(ERROR, "[hot upgrade fork failed][%d:%s]", errno, strerror(errno));
+            close(sv[0]);
+            close(sv[1]);
+            return;
+        }
+        if (0 == pid)
+        {
+            // 子进程：只保留标准输入输出和通信用的套接字，其余的（连接、epoll、监听套接字）一律关闭
+            for (int fd = 3; fd < maxfd; ++fd)
+                if (fd != sv[1])
+                    close(fd);
+            fcntl(sv[1], F_SETFD, 0); // 取消CLOEXEC
+            sigset_t mask;
+            sigemptyset(&mask);
+            sigprocmask(SIG_SETMASK, &mask, nullptr);
+            execvpe(argv[0], argv, &envp[0]);
+            _exit(127);
+        }
+
+        close(sv[1]);
+        if (!tcp_sock::send_fd(sv[0], _acceptor.get_fd()))
+        {
+            close(sv[0]);
+            return;
+        }
+
+        // 等新进程确认接管之后，旧进程才停止获取新连接
+        _upgrade_fd = sv[0];
+        _upgrade_chan.reset(new channel(_upgrade_fd, &_main_loop));
+        _upgrade_chan->set_read_event_callbcak(std::bind(&TcpServer::handle_upgrade_ack, this));
+        _upgrade_chan->set_trace_tag("upgrade");
+        _upgrade_chan->monitor_read_event();
+        LOG(WARNING, "[hot upgrade started][new process pid:%d]", pid);
+    }
+
+    // 新进程确认接管（或者新进程启动失败，对端关闭）
+    void handle_upgrade_ack()
+    {
+        char ack = 0;
+        ssize_t n = read(_upgrade_fd, &ack, 1);
+        _upgrade_chan->cancel_monitor_all_event();
+        close(_upgrade_fd);
+        _upgrade_fd = -1;
+
+        if (n != 1)
+        {
+            LOG(ERROR, "[hot upgrade failed, new process exited before taking over, keep serving]");
+            return;
+        }
+
+        // 停止获取新连接，等待已有连接处理完毕后退出
+        _acceptor.stop();
+        _is_draining = true;
+        LOG(WARNING, "[listen socket handed over, draining %lu connections]", (unsigned long)conn_count());
+        check_drained();
+    }
+
+    // 所有连接处理完毕或等待超时，旧进程退出
+    void check_drained()
+    {
+        size_t n = conn_count();
+        if (n == 0 || _drain_elapsed >= _drain_timeout)
+        {
+            LOG(WARNING, "[old process exit after draining][remaining connections:%lu]", (unsigned long)n);
+            // 从属线程还在运行，exit执行的静态析构（日志、内存池、指标登记处）会和它们竞争，刷新日志后直接_exit
+            logger::instance().flush();
+            fflush(stdout);
+            _exit(0);
+        }
+        ++_drain_elapsed;
+        set_delayed_task_in_loop(1, std::bind(&TcpServer::check_drained, this));
+    }
+
+    // 发送缓冲区总量超出预算（由任意线程触发），交给主线程处理
+    void shed_connections() { _main_loop.push_in_loop(std::bind(&TcpServer::shed_connections_in_loop, this)); }
+
+    // 按待发送数据量从大到小强制关闭连接，直到回到预算以内
+    void shed_connections_in_loop()
+    {
+        int64_t total = _budget._total.load(std::memory_order_relaxed);
+        std::vector<std::pair<size_t, conn_ptr>> heavy;
+        for (auto &conn_and_loop : _conn_balance_in_loop)
+            for (auto &conn : conn_and_loop.first)
+                if (conn.second->outbuffer_size() > 0)
+                    heavy.push_back(std::make_pair(conn.second->outbuffer_size(), conn.second));
+
+        std::sort(heavy.begin(), heavy.end(), [](const std::pair<size_t, conn_ptr> &a, const std::pair<size_t, conn_ptr> &b)
+                  { return a.first > b.first; });
+
+        size_t closed = 0;
+        for (auto &h : heavy)
+        {
+            if (total <= (int64_t)_budget._limit)
+                break;
+            LOG(WARNING, "[output memory budget exceeded, close connection][conn id:%lu][pending bytes:%lu]", (unsigned long)h.second->get_id(), (unsigned long)h.first);
+            h.second->force_close();
+            total -= (int64_t)h.first;
+            ++closed;
+        }
+        LOG(WARNING, "[output memory budget exceeded][limit:%lu][closed:%lu]", (unsigned long)_budget._limit, (unsigned long)closed);
+
+        // 被关闭的连接在各自线程中异步释放，1秒内不再重复处理
+        set_delayed_task_in_loop(1, [this]()
+                                 { _budget._shed_pending = false; });
+    }
+
+    // 所有连接的数量，在主线程中调用
+    size_t conn_count()
+    {
+        size_t n = 0;
+        for (auto &conn_and_loop : _conn_balance_in_loop)
+            n += conn_and_loop.first.size();
+        return n;
+    }
+
     // 获取新连接
     void accept_connection(const int fd)
     {
+        ALLOC_SCOPE(ALLOC_CONNECTION);
+        ALLOC_COUNT_CONNECTION();
         // LOG(DEBUG, "[accept new connection][fd:%d]", fd);
 
         auto &conn_and_loop = _conn_balance_in_loop[which_loop()];
@@ -1711,9 +2894,20 @@ private:
 
         pc->set_conn_manager_close_callback(std::bind(&TcpServer::remove_connection, this, &(conn_and_loop.first), std::placeholders::_1));
 
+        pc->set_water_mark(_high_water_mark, _low_water_mark);
+        pc->set_pause_read_on_high_water(_pause_read_on_high_water);
+        if (_high_water_cb)
+            pc->set_high_water_mark_callback(_high_water_cb);
+        if (_low_water_cb)
+            pc->set_low_water_mark_callback(_low_water_cb);
+        pc->set_outbuffer_budget(&_budget);
+        pc->set_max_inbuffer_size(_max_inbuffer_size, _overflow_policy);
+
         pc->establish_connn();
         if (_is_inactive_release)
             pc->start_inactive_release(_timeout);
+        if (_idle_buffer_release > 0)
+            pc->start_idle_buffer_release(_idle_buffer_release);
     }
 
     // 移除连接 这里不同的loop操作的都是属于自己的那一个connection_manager
@@ -1738,7 +2932,94 @@ private:
 
     uint64_t id_distributor() { return _id_to_distribute++; }
 
+    std::vector<loop_metrics *> own_metrics()
+    {
+        std::vector<loop_metrics *> loops(1, _main_loop.get_metrics());
+        for (auto it = _pool.begin(); it != _pool.end(); ++it)
+            loops.push_back((*it)->get_metrics());
+        return loops;
+    }
+
 public:
+    // 所有eventloop缓冲区内存池的统计信息之和
+    buffer_pool::stats_t buffer_pool_stats()
+    {
+        buffer_pool::stats_t st = _main_loop.get_buffer_pool()->get_stats();
+        for (auto it = _pool.begin(); it != _pool.end(); ++it)
+            st += (*it)->get_buffer_pool()->get_stats();
+        return st;
+    }
+
+    // 本服务器所有eventloop运行指标之和，per_loop不为空时带出每个eventloop各自的指标
+    // （指标登记处是进程全局的，这里只取本服务器自己的loop，同一进程中的其他服务器不计入）
+    metrics_snapshot metrics(std::vector<metrics_snapshot> *per_loop = nullptr)
+    {
+        std::vector<loop_metrics *> loops = own_metrics();
+        return metrics_registry::instance().snapshot(per_loop, &loops);
+    }
+    // 本服务器eventloop的Prometheus文本格式指标
+    std::string prometheus_text()
+    {
+        std::vector<loop_metrics *> loops = own_metrics();
+        return metrics_registry::instance().prometheus_text(&loops);
+    }
+
+    // 启用卡顿检测（毫秒，0表示不启用）：单个回调/任务超过slow_callback_ms记录下来，
+    // 一轮循环超过stall_ms没有结束由看门狗线程打印该loop正在执行的回调
+    void enable_stall_detector(const uint32_t &stall_ms, const uint32_t &slow_callback_ms) { loop_watchdog::instance().configure(stall_ms, slow_callback_ms); }
+    // 所有eventloop最近的慢回调记录
+    std::vector<slow_callback_t> slow_callbacks() { return loop_watchdog::instance().slow_callbacks(); }
+
+    // 按连接id查询连接统计，连接不存在返回false，可在任意线程调用
+    bool conn_stats(const uint64_t &conn_id, conn_stats_t *st)
+    {
+        for (auto &conn_and_loop : _conn_balance_in_loop)
+        {
+            conn_ptr pc = conn_and_loop.first.find(conn_id);
+            if (pc)
+            {
+                pc->get_stats(st);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // 某个eventloop（loop_id与运行指标中的loop编号一致，-1表示所有）上每个连接的统计，可在任意线程调用，
+    // 只读取各连接的统计计数，不需要投递任务到对应的eventloop
+    std::vector<conn_stats_t> conn_stats(const int &loop_id = -1)
+    {
+        std::vector<conn_ptr> conns;
+        for (auto &conn_and_loop : _conn_balance_in_loop)
+            if (loop_id < 0 || conn_and_loop.second->get_metrics()->loop_id() == loop_id)
+                conn_and_loop.first.collect(&conns);
+
+        std::vector<conn_stats_t> stats(conns.size());
+        for (size_t i = 0; i < conns.size(); ++i)
+            conns[i]->get_stats(&stats[i]);
+        return stats;
+    }
+
+    // 按key从大到小排列的前n个连接
+    std::vector<conn_stats_t> top_conns(const size_t &n, const conn_stats_key &key = CONN_BY_BYTES)
+    {
+        std::vector<conn_stats_t> stats = conn_stats();
+        size_t top = std::min(n, stats.size());
+        std::partial_sort(stats.begin(), stats.begin() + top, stats.end(), [key](const conn_stats_t &a, const conn_stats_t &b)
+                          { return a.key_value(key) > b.key_value(key); });
+        stats.resize(top);
+        return stats;
+    }
+
+    // 最重的n个连接，表格形式的文本
+    std::string top_conns_report(const size_t &n, const conn_stats_key &key = CONN_BY_BYTES) { return conn_stats_t::format(top_conns(n, key)); }
+
+    // 按子系统的内存分配统计（需要以 -DALLOC_PROFILE 编译，否则全为0）
+    std::string alloc_report() { return alloc_profile::instance().report(); }
+
+    // 主线程的eventloop，用于监控组件使用者自己的描述符
+    loop_ptr get_main_loop() { return &_main_loop; }
+
     // 设置从属线程数量
     void set_thread_num(const int &thread_num)
     {
@@ -1767,6 +3048,28 @@ public:
     // 设置关闭连接回调
     void set_destroy_conn_callback(const destroy_conn_cb_t &cb) { _destroy_conn = cb; }
 
+    // 设置每个连接发送缓冲区的高低水位线及其回调，high为0表示不启用
+    void set_water_mark(const size_t &high, const size_t &low, const water_mark_cb_t &high_cb = water_mark_cb_t(), const water_mark_cb_t &low_cb = water_mark_cb_t())
+    {
+        _high_water_mark = high;
+        _low_water_mark = low;
+        _high_water_cb = high_cb;
+        _low_water_cb = low_cb;
+    }
+    // 设置高水位之上时是否停止读取对端数据
+    void set_pause_read_on_high_water(const bool &on) { _pause_read_on_high_water = on; }
+    // 设置所有连接发送缓冲区的内存预算，超出后关闭待发送数据最多的连接，0表示不限制
+    void set_output_memory_budget(const size_t &bytes) { _budget._limit = bytes; }
+    // 设置每个连接接收缓冲区上限及达到上限后的处理策略，0表示不限制
+    void set_max_inbuffer_size(const size_t &size, const inbuffer_overflow_policy &policy = OVERFLOW_PAUSE)
+    {
+        _max_inbuffer_size = size;
+        _overflow_policy = policy;
+    }
+
+    // 设置连接无活动多少秒后归还空缓冲区的存储空间，0表示不启用
+    void set_idle_buffer_release(const uint32_t &sec) { _idle_buffer_release = sec; }
+
     // 设置非活跃连接销毁
     void set_inactive_release(const uint32_t &sec)
     {
@@ -1777,6 +3080,35 @@ public:
     // 设置定时任务
     void set_delayed_task(const uint32_t sec, const timefunc_t &task) { _main_loop.run_in_loop(std::bind(&TcpServer::set_delayed_task_in_loop, this, sec, task)); }
 
+    // 启用热升级：收到signo信号时以argv重新拉起新进程并交出监听套接字
+    // 需在set_thread_num之前调用，让从属线程继承屏蔽该信号的信号掩码，信号只由signalfd处理
+    void enable_hot_upgrade(char *const argv[], const int &signo = SIGUSR2)
+    {
+        _upgrade_argv = argv;
+
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigaddset(&mask, signo);
+        pthread_sigmask(SIG_BLOCK, &mask, nullptr);
+
+        _signalfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+        if (-1 == _signalfd)
+        {
+            LOG(FATAL, "[signalfd create failed][%d:%s]", errno, strerror(errno));
+            exit(SIGNALFD_CREATE_ERR);
+        }
+        _signal_chan.reset(new channel(_signalfd, &_main_loop));
+        _signal_chan->set_read_event_callbcak(std::bind(&TcpServer::handle_upgrade_signal, this));
+        _signal_chan->set_trace_tag("signal");
+        _signal_chan->monitor_read_event();
+    }
+
+    // 主动触发热升级
+    void hot_upgrade(char *const argv[]) { _main_loop.run_in_loop(std::bind(&TcpServer::hot_upgrade_in_loop, this, argv)); }
+
+    // 设置热升级后等待已有连接处理完毕的最长时间
+    void set_drain_timeout(const uint32_t &sec) { _drain_timeout = sec; }
+
     // 启动服务器
     void start() { _main_loop.start(); }
 };
@@ -1800,9 +3132,12 @@ bool channel::update_events() { return _loop->update_events(this); }
 // bool channel::remove_events() { return _loop->remove_events(shared_from_this()); }
 bool channel::remove_events() { return _loop->remove_events(this); }
 
+loop_tracer *channel::tracer() const { return _loop->get_tracer(); }
+
 void timewheel::timeout()
 {
     uint64_t times = read_timer();
+    _loop->get_metrics()->add(M_TIMER_FIRES, times);
     for (uint64_t i = 0; i < times; ++i)
         tick_tock();
     // _loop->run_in_loop(std::bind(&timewheel::tick_tock, this));
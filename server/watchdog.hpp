@@ -0,0 +1,240 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+
+#include <cstdio>
+#include <cstdint>
+#include <ctime>
+
+#include "log.hpp"
+#include "metrics.hpp"
+
+// eventloop卡顿检测：每个eventloop一个loop_tracer，记录当前在执行哪个回调、从什么时候开始，
+// 超过阈值的回调记录下来；看门狗线程周期性检查各个loop，一轮循环迟迟没有结束就把它正在执行的回调打印出来
+
+#define SLOW_CALLBACK_KEEP 128 // 每个loop保留最近的慢回调记录数量
+
+// 一次慢回调
+struct slow_callback_t
+{
+    int _loop_id;          // 所属eventloop
+    const char *_tag;      // 回调所属对象：conn/acceptor/timer/eventfd/task...
+    const char *_kind;     // 回调类型：read/write/error/close/any/task
+    int _fd;               // 描述符，任务为-1
+    uint64_t _id;          // 连接id，非连接为0
+    uint64_t _duration_ns; // 耗时
+    time_t _when;          // 发生时间
+};
+
+class loop_tracer
+{
+private:
+    int _loop_id;
+
+    // 当前活动，只由所属线程写，看门狗线程读
+    std::atomic<uint64_t> _iter_begin_ns; // 本轮循环开始处理事件的时间，0表示阻塞在epoll_wait中
+    std::atomic<uint64_t> _cb_begin_ns;   // 当前回调开始的时间，0表示没有在执行回调
+    std::atomic<const char *> _cb_tag;
+    std::atomic<const char *> _cb_kind;
+    std::atomic<int> _cb_fd;
+    std::atomic<uint64_t> _cb_id;
+
+    uint64_t _reported_iter; // 已经报告过卡顿的那一轮循环的开始时间，只由看门狗线程访问
+
+    std::mutex _mutex; // 保护_slow
+    std::deque<slow_callback_t> _slow;
+
+public:
+    loop_tracer(const int &loop_id);
+    ~loop_tracer();
+
+    loop_tracer(const loop_tracer &) = delete;
+    loop_tracer &operator=(const loop_tracer &) = delete;
+
+    // 慢回调阈值和卡顿阈值（纳秒），全局设置，0表示不启用
+    static std::atomic<uint64_t> &slow_threshold()
+    {
+        static std::atomic<uint64_t> s_ns(0);
+        return s_ns;
+    }
+    static std::atomic<uint64_t> &stall_threshold()
+    {
+        static std::atomic<uint64_t> s_ns(0);
+        return s_ns;
+    }
+    // 两者都没启用时不取时间，只多一次原子读
+    static bool enabled() { return slow_threshold().load(std::memory_order_relaxed) != 0 || stall_threshold().load(std::memory_order_relaxed) != 0; }
+
+    int loop_id() const { return _loop_id; }
+
+    // 一轮循环从epoll_wait返回到任务执行完毕
+    void iteration_begin(const uint64_t &now) { _iter_begin_ns.store(enabled() ? now : 0, std::memory_order_relaxed); }
+    void iteration_end() { _iter_begin_ns.store(0, std::memory_order_relaxed); }
+
+    // 开始执行一个回调，返回开始时间（未启用返回0）
+    uint64_t callback_begin(const char *tag, const char *kind, const int &fd, const uint64_t &id)
+    {
+        if (!enabled())
+            return 0;
+        _cb_tag.store(tag, std::memory_order_relaxed);
+        _cb_kind.store(kind, std::memory_order_relaxed);
+        _cb_fd.store(fd, std::memory_order_relaxed);
+        _cb_id.store(id, std::memory_order_relaxed);
+        uint64_t now = metrics_clock::now_ns();
+        _cb_begin_ns.store(now, std::memory_order_release);
+        return now;
+    }
+
+    // 回调执行完毕，超过阈值的记录下来
+    void callback_end(const uint64_t &begin, const char *tag, const char *kind, const int &fd, const uint64_t &id)
+    {
+        if (begin == 0)
+            return;
+        _cb_begin_ns.store(0, std::memory_order_relaxed);
+        uint64_t threshold = slow_threshold().load(std::memory_order_relaxed);
+        uint64_t cost = metrics_clock::now_ns() - begin;
+        if (threshold == 0 || cost < threshold)
+            return;
+
+        LOG(WARNING, "[slow callback][loop:%d][%s %s][fd:%d][id:%lu][%.3fms]", _loop_id, tag, kind, fd, (unsigned long)id, cost / 1e6);
+        slow_callback_t rec = {_loop_id, tag, kind, fd, id, cost, time(nullptr)};
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (_slow.size() >= SLOW_CALLBACK_KEEP)
+            _slow.pop_front();
+        _slow.push_back(rec);
+    }
+
+    // 最近的慢回调记录
+    void slow_callbacks(std::vector<slow_callback_t> *out)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        out->insert(out->end(), _slow.begin(), _slow.end());
+    }
+
+    // 看门狗线程调用：本轮循环超过stall_ns还没结束就打印当前正在执行的回调，每轮只报告一次
+    void check_stall(const uint64_t &now, const uint64_t &stall_ns)
+    {
+        uint64_t iter = _iter_begin_ns.load(std::memory_order_relaxed);
+        if (iter == 0 || iter == _reported_iter || now < iter || now - iter < stall_ns)
+            return;
+        _reported_iter = iter;
+
+        uint64_t cb = _cb_begin_ns.load(std::memory_order_acquire);
+        if (cb == 0)
+        {
+            LOG(ERROR, "[eventloop stalled][loop:%d][iteration running %.3fms][not inside a traced callback]", _loop_id, (now - iter) / 1e6);
+            return;
+        }
+        LOG(ERROR, "[eventloop stalled][loop:%d][iteration running %.3fms][running %s %s][fd:%d][id:%lu][for %.3fms]",
+            _loop_id, (now - iter) / 1e6, _cb_tag.load(std::memory_order_relaxed), _cb_kind.load(std::memory_order_relaxed),
+            _cb_fd.load(std::memory_order_relaxed), (unsigned long)_cb_id.load(std::memory_order_relaxed), now > cb ? (now - cb) / 1e6 : 0.0);
+    }
+};
+
+// 回调执行期间的跟踪，离开作用域时结束（回调中对象可能已被释放，这里只保存值）
+class trace_scope
+{
+private:
+    loop_tracer *_tracer;
+    const char *_tag;
+    const char *_kind;
+    int _fd;
+    uint64_t _id;
+    uint64_t _begin;
+
+public:
+    trace_scope(loop_tracer *tracer, const char *tag, const char *kind, const int &fd, const uint64_t &id)
+        : _tracer(tracer), _tag(tag), _kind(kind), _fd(fd), _id(id), _begin(tracer->callback_begin(tag, kind, fd, id)) {}
+    ~trace_scope() { _tracer->callback_end(_begin, _tag, _kind, _fd, _id); }
+};
+
+// 看门狗：独立线程，每隔卡顿阈值的四分之一检查一次所有eventloop
+// 对象故意不析构，进程退出时线程随之结束
+class loop_watchdog
+{
+private:
+    std::mutex _mutex; // 保护_tracers
+    std::vector<loop_tracer *> _tracers;
+    std::atomic<bool> _running;
+
+    loop_watchdog() : _running(false) {}
+
+    void watch_entry()
+    {
+        sigset_t all; // 和日志线程一样不处理信号
+        sigfillset(&all);
+        pthread_sigmask(SIG_BLOCK, &all, nullptr);
+        while (true)
+        {
+            uint64_t stall_ns = loop_tracer::stall_threshold().load(std::memory_order_relaxed);
+            if (stall_ns == 0)
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                continue;
+            }
+            std::this_thread::sleep_for(std::chrono::nanoseconds(std::max<uint64_t>(stall_ns / 4, 1000000)));
+
+            uint64_t now = metrics_clock::now_ns();
+            std::unique_lock<std::mutex> lock(_mutex);
+            for (loop_tracer *t : _tracers)
+                t->check_stall(now, stall_ns);
+        }
+    }
+
+public:
+    static loop_watchdog &instance()
+    {
+        static loop_watchdog *s_watchdog = new loop_watchdog;
+        return *s_watchdog;
+    }
+
+    void add(loop_tracer *t)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _tracers.push_back(t);
+    }
+
+    void remove(loop_tracer *t)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        auto it = std::find(_tracers.begin(), _tracers.end(), t);
+        if (it != _tracers.end())
+            _tracers.erase(it);
+    }
+
+    // 设置阈值（毫秒，0表示不启用），需要卡顿检测时启动看门狗线程
+    void configure(const uint32_t &stall_ms, const uint32_t &slow_callback_ms)
+    {
+        loop_tracer::stall_threshold().store((uint64_t)stall_ms * 1000000, std::memory_order_relaxed);
+        loop_tracer::slow_threshold().store((uint64_t)slow_callback_ms * 1000000, std::memory_order_relaxed);
+        if (stall_ms > 0 && !_running.exchange(true))
+            std::thread(&loop_watchdog::watch_entry, this).detach();
+    }
+
+    // 所有eventloop最近的慢回调记录，按时间排序
+    std::vector<slow_callback_t> slow_callbacks()
+    {
+        std::vector<slow_callback_t> out;
+        std::unique_lock<std::mutex> lock(_mutex);
+        for (loop_tracer *t : _tracers)
+            t->slow_callbacks(&out);
+        std::stable_sort(out.begin(), out.end(), [](const slow_callback_t &a, const slow_callback_t &b)
+                         { return a._when < b._when; });
+        return out;
+    }
+};
+
+loop_tracer::loop_tracer(const int &loop_id) : _loop_id(loop_id), _iter_begin_ns(0), _cb_begin_ns(0), _cb_tag(""), _cb_kind(""), _cb_fd(-1), _cb_id(0), _reported_iter(0)
+{
+    loop_watchdog::instance().add(this);
+}
+
+loop_tracer::~loop_tracer() { loop_watchdog::instance().remove(this); }
@@ -0,0 +1,145 @@
+// HTTP/2提前回复错误之后的正文：同一次写入多个DATA帧，流上只能有一个响应，路由处理函数不能再被调用
+// 先启动http/server（监听8080），然后运行 ./h2_early_error [wwwroot目录]
+// 给出wwwroot目录时，额外测试正文消费者失败（把1234.txt.part建成目录，让fopen失败）的情况
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+using namespace std;
+
+struct Frame
+{
+    uint8_t _type;
+    uint8_t _flags;
+    uint32_t _id;
+    string _payload;
+};
+
+string MakeFrame(uint8_t type, uint8_t flags, uint32_t id, const string &payload)
+{
+    string f;
+    f += (char)(payload.size() >> 16);
+    f += (char)(payload.size() >> 8);
+    f += (char)payload.size();
+    f += (char)type;
+    f += (char)flags;
+    f += (char)(id >> 24);
+    f += (char)(id >> 16);
+    f += (char)(id >> 8);
+    f += (char)id;
+    return f + payload;
+}
+
+// 不索引的字面值字段，名字和值都短于127字节
+string Literal(const string &name, const string &value)
+{
+    return string(1, '\0') + (char)name.size() + name + (char)value.size() + value;
+}
+
+string Request(const string &method, const string &path, size_t length)
+{
+    string block = Literal(":method", method) + "\x86" + Literal(":path", path) + Literal(":authority", "x");
+    if (length > 0)
+        block += Literal("content-length", to_string(length));
+    return block;
+}
+
+int Connect()
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(8080);
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    if (connect(fd, (sockaddr *)&addr, sizeof(addr)) == -1)
+        return -1;
+    timeval tv = {1, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    string hello = string("PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n") + MakeFrame(0x4, 0, 0, "");
+    write(fd, hello.data(), hello.size());
+    return fd;
+}
+
+// 读到超时或者连接关闭为止
+vector<Frame> ReadFrames(int fd)
+{
+    string buf;
+    char tmp[65536];
+    ssize_t n;
+    while ((n = read(fd, tmp, sizeof(tmp))) > 0)
+        buf.append(tmp, n);
+    vector<Frame> frames;
+    size_t pos = 0;
+    while (buf.size() - pos >= 9)
+    {
+        const uint8_t *h = (const uint8_t *)buf.data() + pos;
+        size_t len = (size_t)h[0] << 16 | (size_t)h[1] << 8 | h[2];
+        if (buf.size() - pos < 9 + len)
+            break;
+        Frame f = {h[3], h[4], ((uint32_t)h[5] << 24 | (uint32_t)h[6] << 16 | (uint32_t)h[7] << 8 | h[8]) & 0x7FFFFFFF, buf.substr(pos + 9, len)};
+        frames.push_back(f);
+        pos += 9 + len;
+    }
+    return frames;
+}
+
+// 请求头部之后，一次写入三个DATA帧（最后一个带END_STREAM），再在流3上发一个正常请求
+// 流1只能有一个HEADERS帧，状态码是status（静态表中的索引），错误页的正文发完（DATA带END_STREAM），流3正常得到200
+bool Check(const string &name, const string &method, const string &path, int status_index)
+{
+    int fd = Connect();
+    if (fd == -1)
+    {
+        cout << name << ": connect failed\n";
+        return false;
+    }
+    string chunk(13000, 'a');
+    string out = MakeFrame(0x1, 0x4, 1, Request(method, path, chunk.size() * 3));
+    out += MakeFrame(0x0, 0, 1, chunk) + MakeFrame(0x0, 0, 1, chunk) + MakeFrame(0x0, 0x1, 1, chunk);
+    out += MakeFrame(0x1, 0x5, 3, Request("GET", "/hello", 0));
+    write(fd, out.data(), out.size());
+    vector<Frame> frames = ReadFrames(fd);
+    close(fd);
+
+    int headers1 = 0, headers3 = 0;
+    bool status_ok = false, body_done = false, hello_ok = false;
+    for (auto &f : frames)
+    {
+        if (f._type == 0x1 && f._id == 1)
+        {
+            ++headers1;
+            status_ok = !f._payload.empty() && (uint8_t)f._payload[0] == (0x80 | status_index);
+        }
+        if (f._type == 0x0 && f._id == 1 && (f._flags & 0x1))
+            body_done = true;
+        if (f._type == 0x1 && f._id == 3)
+            hello_ok = ++headers3 == 1 && !f._payload.empty() && (uint8_t)f._payload[0] == (0x80 | 8); // :status 200
+        if (f._type == 0x7)
+            cout << name << ": unexpected GOAWAY\n";
+    }
+    bool ok = headers1 == 1 && status_ok && body_done && hello_ok;
+    cout << name << ": " << (ok ? "ok" : "FAILED") << " (stream 1 HEADERS: " << headers1 << ", stream 3 HEADERS: " << headers3 << ")\n";
+    return ok;
+}
+
+int main(int argc, char *argv[])
+{
+    bool ok = Check("bad query (400)", "POST", "/login?bad", 12);
+    if (argc > 1)
+    {
+        string part = string(argv[1]) + "/1234.txt.part";
+        mkdir(part.c_str(), 0755);
+        ok = Check("consumer failure (500)", "PUT", "/1234.txt", 14) && ok;
+        rmdir(part.c_str());
+    }
+    return ok ? 0 : 1;
+}